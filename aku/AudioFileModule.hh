@@ -21,6 +21,7 @@ public:
   virtual void set_fname(const char *fname);
   virtual void set_file(FILE *fp, bool stream=false);
   virtual void discard_file(void);
+  virtual void set_raw_audio(bool raw_audio) { m_raw_audio = raw_audio; }
   virtual bool eof(int frame);
   virtual int sample_rate(void) { return m_sample_rate; }
   virtual float frame_rate(void) { return m_frame_rate; }
@@ -47,6 +48,7 @@ private:
 
   int m_endian; // RAW-file endianess: 0=default, 1=little, 2=big
   bool m_raw; // File mode enforced to RAW
+  bool m_raw_audio; // RAW enforced by the caller for the current file
 
   /** Should we copy border frames when negative or after-eof frames
    * are requested?  Otherwise, we assume that AudioReader gives zero
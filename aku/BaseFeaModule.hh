@@ -13,6 +13,11 @@ public:
   virtual void set_file(FILE *fp, bool stream=false) = 0;
   virtual void discard_file(void) = 0;
 
+  // If true, the next file is read as raw samples even if the
+  // configuration does not say so. Ignored by modules that do not read
+  // audio.
+  virtual void set_raw_audio(bool raw_audio) { }
+
   // Note: eof() may return false for a frame that is past the real EOF
   // if at() for that frame has not yet been called.
   virtual bool eof(int frame) = 0;
@@ -6,6 +6,7 @@
 #include <math.h>
 
 #include "Distributions.hh"
+#include "Parallel.hh"
 #include "str.hh"
 
 #include "blaspp.h"
@@ -94,6 +95,59 @@ FullStatisticsAccumulator::accumulate_from_dump(std::istream &is)
 }
 
 
+void
+FullStatisticsAccumulator::accumulate_from(const GaussianAccumulator &other)
+{
+  const FullStatisticsAccumulator *o =
+    dynamic_cast< const FullStatisticsAccumulator* >(&other);
+  if (o == NULL)
+    throw std::string("FullStatisticsAccumulator::accumulate_from: accumulator types differ");
+  if (!o->accumulated())
+    return;
+
+  m_feacount += o->m_feacount;
+  m_gamma += o->m_gamma;
+  m_aux_gamma += o->m_aux_gamma;
+  m_accumulated = true;
+  Blas_Add_Mult(m_mean, 1, o->m_mean);
+  for (int i=0; i<dim(); i++)
+    for (int j=0; j<=i; j++)
+      m_second_moment(i,j) += o->m_second_moment(i,j);
+}
+
+
+void
+FullStatisticsAccumulator::pack_statistics(double *data) const
+{
+  *data++ = m_feacount;
+  *data++ = m_gamma;
+  *data++ = m_aux_gamma;
+  for (int i=0; i<dim(); i++)
+    *data++ = m_mean(i);
+  for (int i=0; i<dim(); i++)
+    for (int j=0; j<=i; j++)
+      *data++ = m_second_moment(i,j);
+}
+
+
+void
+FullStatisticsAccumulator::accumulate_packed(const double *data)
+{
+  if (data[0] < 0)
+    throw std::string("Invalid packed statistics");
+  m_feacount += (int)data[0];
+  m_gamma += data[1];
+  m_aux_gamma += data[2];
+  m_accumulated = true;
+  data += 3;
+  for (int i=0; i<dim(); i++)
+    m_mean(i) += *data++;
+  for (int i=0; i<dim(); i++)
+    for (int j=0; j<=i; j++)
+      m_second_moment(i,j) += *data++;
+}
+
+
 void
 FullStatisticsAccumulator::get_accumulated_second_moment(Matrix &second_moment) const
 {
@@ -206,6 +260,56 @@ DiagonalStatisticsAccumulator::accumulate_from_dump(std::istream &is)
 }
 
 
+void
+DiagonalStatisticsAccumulator::accumulate_from(const GaussianAccumulator &other)
+{
+  const DiagonalStatisticsAccumulator *o =
+    dynamic_cast< const DiagonalStatisticsAccumulator* >(&other);
+  if (o == NULL)
+    throw std::string("DiagonalStatisticsAccumulator::accumulate_from: accumulator types differ");
+  if (!o->accumulated())
+    return;
+
+  m_feacount += o->m_feacount;
+  m_gamma += o->m_gamma;
+  m_aux_gamma += o->m_aux_gamma;
+  m_accumulated = true;
+  Blas_Add_Mult(m_mean, 1, o->m_mean);
+  Blas_Add_Mult(m_second_moment, 1, o->m_second_moment);
+}
+
+
+void
+DiagonalStatisticsAccumulator::pack_statistics(double *data) const
+{
+  *data++ = m_feacount;
+  *data++ = m_gamma;
+  *data++ = m_aux_gamma;
+  for (int i=0; i<dim(); i++)
+    *data++ = m_mean(i);
+  for (int i=0; i<dim(); i++)
+    *data++ = m_second_moment(i);
+}
+
+
+void
+DiagonalStatisticsAccumulator::accumulate_packed(const double *data)
+{
+  if (data[0] < 0)
+    throw std::string("Invalid packed statistics");
+  m_feacount += (int)data[0];
+  m_gamma += data[1];
+  m_aux_gamma += data[2];
+  m_accumulated = true;
+  data += 3;
+  for (int i=0; i<dim(); i++)
+    m_mean(i) += data[i];
+  data += dim();
+  for (int i=0; i<dim(); i++)
+    m_second_moment(i) += data[i];
+}
+
+
 void
 DiagonalStatisticsAccumulator::get_covariance_estimate(Matrix &covariance_estimate) const
 {
@@ -333,6 +437,84 @@ Gaussian::accumulate_from_dump(std::istream &is, StatisticsMode mode)
 }
 
 
+void
+Gaussian::accumulate_from(const PDF &other)
+{
+  const Gaussian *o = dynamic_cast< const Gaussian* >(&other);
+  if (o == NULL)
+    throw std::string("Gaussian::accumulate_from: the other PDF is not a Gaussian");
+
+  for (int i = 0; i < (int)o->m_accums.size(); i++)
+  {
+    if (o->m_accums[i] == NULL || !o->m_accums[i]->accumulated())
+      continue;
+    if (i >= (int)m_accums.size() || m_accums[i] == NULL)
+      throw str::fmt(128, "Gaussian::accumulate_from: Invalid accumulator position %i", i);
+    m_accums[i]->accumulate_from(*o->m_accums[i]);
+  }
+}
+
+
+int
+Gaussian::packed_statistics_size() const
+{
+  int size = 1;
+  for (int i = 0; i < (int)m_accums.size(); i++)
+  {
+    if (m_accums[i] != NULL && m_accums[i]->accumulated())
+      size += 2 + m_accums[i]->packed_size();
+  }
+  return size;
+}
+
+
+void
+Gaussian::pack_statistics(double *data) const
+{
+  double *count = data++;
+  *count = 0;
+  for (int i = 0; i < (int)m_accums.size(); i++)
+  {
+    if (m_accums[i] != NULL && m_accums[i]->accumulated()) {
+      *count += 1;
+      *data++ = i;
+      *data++ = m_accums[i]->packed_size();
+      m_accums[i]->pack_statistics(data);
+      data += m_accums[i]->packed_size();
+    }
+  }
+}
+
+
+void
+Gaussian::accumulate_packed(const double *data, int size, StatisticsMode mode)
+{
+  const double *end = data + size;
+  if (size < 1)
+    throw std::string("Gaussian::accumulate_packed: Invalid statistics");
+
+  if (m_accums.size() == 0)
+    start_accumulating(mode);
+
+  int count = (int)*data++;
+  for (int c = 0; c < count; c++) {
+    if (end - data < 2)
+      throw std::string("Gaussian::accumulate_packed: Invalid statistics");
+    int accum_pos = (int)data[0];
+    int accum_size = (int)data[1];
+    data += 2;
+    if (accum_pos < 0 || accum_pos >= (int)m_accums.size() ||
+        m_accums[accum_pos] == NULL)
+      throw str::fmt(128, "Gaussian::accumulate_packed: Invalid accumulator position %i", accum_pos);
+    if (accum_size != m_accums[accum_pos]->packed_size() ||
+        end - data < accum_size)
+      throw std::string("Gaussian::accumulate_packed: The accumulator types differ");
+    m_accums[accum_pos]->accumulate_packed(data);
+    data += accum_size;
+  }
+}
+
+
 void
 Gaussian::stop_accumulating()
 {
@@ -2086,6 +2268,17 @@ Mixture::compute_likelihood(const Vector &f) const
 }
 
 
+double
+Mixture::compute_block_likelihood(const Matrix &pool_likelihoods,
+                                  int frame) const
+{
+  double l = 0;
+  for (unsigned int i=0; i< m_pointers.size(); i++)
+    l += m_weights[i]*pool_likelihoods(frame, m_pointers[i]);
+  return l;
+}
+
+
 double
 Mixture::compute_log_likelihood(const Vector &f) const
 {
@@ -2245,6 +2438,88 @@ Mixture::accumulate_from_dump(std::istream &is, StatisticsMode mode)
 }
 
 
+void
+Mixture::accumulate_from(const PDF &other)
+{
+  const Mixture *o = dynamic_cast< const Mixture* >(&other);
+  if (o == NULL || o->size() != size())
+    throw std::string("Mixture::accumulate_from: the mixtures differ");
+
+  for (int a = 0; a < (int)o->m_accums.size(); a++)
+  {
+    if (o->m_accums[a] == NULL || !o->m_accums[a]->accumulated)
+      continue;
+    if (a >= (int)m_accums.size() || m_accums[a] == NULL)
+      throw str::fmt(128, "Mixture::accumulate_from: Invalid accumulator position %i", a);
+
+    for (int i = 0; i < size(); i++)
+      m_accums[a]->gamma[i] += o->m_accums[a]->gamma[i];
+    m_accums[a]->aux_gamma += o->m_accums[a]->aux_gamma;
+    m_accums[a]->mixture_ll += o->m_accums[a]->mixture_ll;
+    m_accums[a]->accumulated = true;
+  }
+}
+
+
+int
+Mixture::packed_statistics_size() const
+{
+  int size = 1;
+  for (int a = 0; a < (int)m_accums.size(); a++)
+  {
+    if (m_accums[a] != NULL && m_accums[a]->accumulated)
+      size += 4 + this->size();
+  }
+  return size;
+}
+
+
+void
+Mixture::pack_statistics(double *data) const
+{
+  double *count = data++;
+  *count = 0;
+  for (int a = 0; a < (int)m_accums.size(); a++)
+  {
+    if (m_accums[a] != NULL && m_accums[a]->accumulated) {
+      *count += 1;
+      *data++ = a;
+      *data++ = size();
+      for (int i = 0; i < size(); i++)
+        *data++ = m_accums[a]->gamma[i];
+      *data++ = m_accums[a]->aux_gamma;
+      *data++ = m_accums[a]->mixture_ll;
+    }
+  }
+}
+
+
+void
+Mixture::accumulate_packed(const double *data, int size, StatisticsMode mode)
+{
+  if (size < 1)
+    throw std::string("Mixture::accumulate_packed: Invalid statistics");
+
+  if (m_accums.size() == 0)
+    start_accumulating(mode);
+
+  int count = (int)*data++;
+  if (size != 1 + count * (4 + this->size()))
+    throw std::string("Mixture::accumulate_packed: The mixtures differ");
+  for (int c = 0; c < count; c++) {
+    int a = (int)data[0];
+    data += 2;
+    if (a < 0 || a >= (int)m_accums.size() || m_accums[a] == NULL)
+      throw str::fmt(128, "Mixture::accumulate_packed: Invalid accumulator position %i", a);
+    for (int i = 0; i < this->size(); i++)
+      m_accums[a]->gamma[i] += *data++;
+    m_accums[a]->aux_gamma += *data++;
+    m_accums[a]->mixture_ll += *data++;
+    m_accums[a]->accumulated = true;
+  }
+}
+
+
 void
 Mixture::stop_accumulating()
 {
@@ -2574,6 +2849,8 @@ PDFPool::reset()
   m_evaluate_min_gaussians = 1;
   m_cluster_centers.clear();
   m_ismooth_prev_prior = false;
+  m_use_packed_gaussians = true;
+  m_packed_gaussians_valid = false;
 }
 
 
@@ -2592,6 +2869,7 @@ PDFPool::set_pdf(int pdfindex, PDF *pdf)
     m_likelihoods.resize(m_pool.size());
   }
   m_pool[pdfindex]=pdf;
+  m_packed_gaussians_valid = false;
 }
 
 
@@ -2601,6 +2879,7 @@ PDFPool::add_pdf(PDF *pdf)
   int index = (int)m_pool.size();
   m_pool.push_back(pdf);
   m_likelihoods.resize(m_pool.size());
+  m_packed_gaussians_valid = false;
   return index;
 }
 
@@ -2611,6 +2890,7 @@ PDFPool::delete_pdf(int index)
   m_pool.erase(m_pool.begin()+index);
   reset_cache();
   m_likelihoods.resize(m_pool.size());
+  m_packed_gaussians_valid = false;
 }
 
 
@@ -2661,20 +2941,36 @@ PDFPool::precompute_likelihoods(const Vector &f)
 
   // Clustering not in use
   if (!use_clustering()) {
-    Vector exponential_feature_vector((int)(dim()*(dim()+3)/2));
-    for (int i=0; i<dim(); i++)
-      exponential_feature_vector(i) = f(i);
-    Matrix tmat(dim(), dim()); tmat=0;
-    Blas_R1_Update(tmat, f, f, 1.0);
-    Vector tvec;
-    LinearAlgebra::map_m2v(tmat, tvec);
-    for (int i=0; i<tvec.size(); i++)
-      exponential_feature_vector(dim()+i) = tvec(i);
+    int num_unpacked = size();
+    if (m_use_packed_gaussians) {
+      if (!m_packed_gaussians_valid)
+        pack_gaussians();
+
+      // Score all diagonal Gaussians in one pass
+      m_packed_feature.resize(dim());
+      for (int i=0; i<dim(); i++)
+        m_packed_feature[i] = f(i);
+      m_packed_gaussians.compute_log_likelihoods(&m_packed_feature[0], &m_packed_log_likelihoods[0]);
+      for (unsigned int k=0; k<m_packed_pdfs.size(); k++) {
+        m_likelihoods[m_packed_pdfs[k]] = exp(m_packed_log_likelihoods[k]);
+        m_valid_likelihoods.push_back(m_packed_pdfs[k]);
+      }
+      num_unpacked = m_unpacked_pdfs.size();
+    }
     
-    for (int i=0; i<size(); i++) {
+    // The exponential feature is built only if full covariance Gaussians
+    // are left to be scored
+    bool exponential_feature_valid = false;
+    for (int j=0; j<num_unpacked; j++) {
+      int i = m_use_packed_gaussians ? m_unpacked_pdfs[j] : j;
       FullCovarianceGaussian *fcgaussian = dynamic_cast< FullCovarianceGaussian* > (m_pool[i]);
-      if (fcgaussian != NULL)
-        m_likelihoods[i] = fcgaussian->compute_likelihood_exponential(exponential_feature_vector);
+      if (fcgaussian != NULL) {
+        if (!exponential_feature_valid) {
+          compute_exponential_feature(f, m_exponential_feature);
+          exponential_feature_valid = true;
+        }
+        m_likelihoods[i] = fcgaussian->compute_likelihood_exponential(m_exponential_feature);
+      }
       else
         m_likelihoods[i] = m_pool[i]->compute_likelihood(f);
       m_valid_likelihoods.push_back(i);
@@ -2682,43 +2978,248 @@ PDFPool::precompute_likelihoods(const Vector &f)
   }
 
   // Gaussian clustering in use
-  else { 
-    // Push the clusters to a priority queue
-    ClusterLikelihoods cluster_likelihoods;
-    double likelihood;
-    for (int i=0; i<number_of_clusters(); i++) {
-      likelihood = m_cluster_centers[i]->compute_likelihood(f);
-      cluster_likelihoods.push(ClusterLikelihoodPair(i, likelihood));
+  else {
+    compute_clustered_likelihoods(f, m_likelihoods);
+    for (int i=0; i<number_of_clusters(); i++)
+      for (unsigned int j=0; j<m_cluster_to_gaussians[i].size(); j++)
+        m_valid_likelihoods.push_back(m_cluster_to_gaussians[i][j]);
+  }
+}
+
+
+void
+PDFPool::compute_clustered_likelihoods(const Vector &f,
+                                       std::vector<double> &likelihoods) const
+{
+  likelihoods.resize(size());
+
+  // Push the clusters to a priority queue
+  ClusterLikelihoods cluster_likelihoods;
+  double likelihood;
+  for (int i=0; i<number_of_clusters(); i++) {
+    likelihood = m_cluster_centers[i]->compute_likelihood(f);
+    cluster_likelihoods.push(ClusterLikelihoodPair(i, likelihood));
+  }
+
+  // Precompute Gaussians as long as needed
+  int total_clusters_evaluated=0, total_gaussians_evaluated=0, cluster_pos, gauss_pos;
+  ClusterLikelihoodPair current_cluster;
+  while((total_clusters_evaluated < evaluate_min_clusters()) || (total_gaussians_evaluated < evaluate_min_gaussians())) {
+    current_cluster = cluster_likelihoods.top();
+    cluster_pos = current_cluster.first;
+    for (unsigned int j=0; j<m_cluster_to_gaussians[cluster_pos].size(); j++) {
+      gauss_pos = m_cluster_to_gaussians[cluster_pos][j];
+      likelihoods[gauss_pos] = m_pool[gauss_pos]->compute_likelihood(f);
+    }
+    total_clusters_evaluated++;
+    total_gaussians_evaluated += m_cluster_to_gaussians[cluster_pos].size();
+    cluster_likelihoods.pop();
+  }
+
+  // For the rest, use the cluster center likelihood
+  while(!cluster_likelihoods.empty()) {
+    current_cluster = cluster_likelihoods.top();
+    cluster_pos = current_cluster.first;
+    for (unsigned int j=0; j<m_cluster_to_gaussians[cluster_pos].size(); j++) {
+      gauss_pos = m_cluster_to_gaussians[cluster_pos][j];
+      likelihoods[gauss_pos] = current_cluster.second;
     }
+    cluster_likelihoods.pop();
+  }
+}
 
-    // Precompute Gaussians as long as needed
-    int total_clusters_evaluated=0, total_gaussians_evaluated=0, cluster_pos, gauss_pos;
-    ClusterLikelihoodPair current_cluster;
-    while((total_clusters_evaluated < evaluate_min_clusters()) || (total_gaussians_evaluated < evaluate_min_gaussians())) {
-      current_cluster = cluster_likelihoods.top();
-      cluster_pos = current_cluster.first;
-      for (unsigned int j=0; j<m_cluster_to_gaussians[cluster_pos].size(); j++) {
-        gauss_pos = m_cluster_to_gaussians[cluster_pos][j];
-        m_likelihoods[gauss_pos] = m_pool[gauss_pos]->compute_likelihood(f);
-        m_valid_likelihoods.push_back(gauss_pos);
-      }
-      total_clusters_evaluated++;
-      total_gaussians_evaluated += m_cluster_to_gaussians[cluster_pos].size();
-      cluster_likelihoods.pop();
+
+void
+PDFPool::precompute_likelihoods(const Matrix &features)
+{
+  reset_cache();
+
+#ifdef USE_SUBSPACE_COV
+  if (!m_precision_subspaces.empty() || !m_exponential_subspaces.empty()) {
+    // Subspaces cache the projected feature, one frame at a time
+    Vector f(dim());
+    m_batch_likelihoods.resize(features.rows(), size());
+    for (int t=0; t<features.rows(); t++) {
+      for (int i=0; i<dim(); i++)
+        f(i) = features(t, i);
+      precompute_likelihoods(f);
+      for (int i=0; i<size(); i++)
+        m_batch_likelihoods(t, i) = m_likelihoods[i];
     }
+    reset_cache();
+    return;
+  }
+#endif
+
+  prepare_likelihoods();
+  compute_likelihoods(features, m_batch_likelihoods, m_batch_buffers);
+}
+
+
+void
+PDFPool::prepare_likelihoods()
+{
+  if (!m_use_packed_gaussians)
+    return;
+  if (!m_packed_gaussians_valid)
+    pack_gaussians();
+  if (m_batch_weights.cols() != (int)m_packed_pdfs.size())
+    pack_batch_weights();
+}
 
-    // For the rest, use the cluster center likelihood
-    while(!cluster_likelihoods.empty()) {
-      current_cluster = cluster_likelihoods.top();
-      cluster_pos = current_cluster.first;
-      for (unsigned int j=0; j<m_cluster_to_gaussians[cluster_pos].size(); j++) {
-        gauss_pos = m_cluster_to_gaussians[cluster_pos][j];
-        m_likelihoods[gauss_pos] = current_cluster.second;
-        m_valid_likelihoods.push_back(gauss_pos);
+
+// Resizes a matrix only if the size changes, so that the memory is reused
+static void
+resize_matrix(Matrix &m, int rows, int cols)
+{
+  if (m.rows() != rows || m.cols() != cols)
+    m.resize(rows, cols);
+}
+
+
+void
+PDFPool::compute_likelihoods(const Matrix &features, Matrix &likelihoods,
+                             LikelihoodBuffers &buffers) const
+{
+#ifdef USE_SUBSPACE_COV
+  if (!m_precision_subspaces.empty() || !m_exponential_subspaces.empty())
+    throw std::string("PDFPool::compute_likelihoods(): subspace Gaussians are not supported");
+#endif
+  if (m_use_packed_gaussians && !m_packed_gaussians_valid)
+    throw std::string("PDFPool::compute_likelihoods(): prepare_likelihoods() has not been called");
+
+  int frames = features.rows();
+  Vector &f = buffers.feature;
+  if (f.size() != dim())
+    f.resize(dim());
+  resize_matrix(likelihoods, frames, size());
+
+  if (use_clustering()) {
+    std::vector<double> &frame_likelihoods = buffers.frame_likelihoods;
+    for (int t=0; t<frames; t++) {
+      for (int i=0; i<dim(); i++)
+        f(i) = features(t, i);
+      compute_clustered_likelihoods(f, frame_likelihoods);
+      for (int i=0; i<size(); i++)
+        likelihoods(t, i) = frame_likelihoods[i];
+    }
+    return;
+  }
+
+  // Diagonal Gaussians with one matrix product
+  if (m_use_packed_gaussians && !m_packed_pdfs.empty()) {
+    Matrix &extended_features = buffers.extended_features;
+    Matrix &scores = buffers.scores;
+    resize_matrix(extended_features, frames, 2*dim());
+    resize_matrix(scores, frames, (int)m_packed_pdfs.size());
+    for (int t=0; t<frames; t++) {
+      for (int i=0; i<dim(); i++) {
+        extended_features(t, i) = features(t, i);
+        extended_features(t, dim()+i) = features(t, i) * features(t, i);
       }
-      cluster_likelihoods.pop();
     }
-    
+    Blas_Mat_Mat_Mult(extended_features, m_batch_weights, scores, 1.0, 0.0);
+    for (unsigned int k=0; k<m_packed_pdfs.size(); k++)
+      for (int t=0; t<frames; t++)
+        likelihoods(t, m_packed_pdfs[k]) = exp(scores(t, k) + m_batch_bias(k));
+  }
+
+  // The rest one frame at a time
+  int num_unpacked = m_use_packed_gaussians ? m_unpacked_pdfs.size() : size();
+  if (num_unpacked > 0) {
+    for (int t=0; t<frames; t++) {
+      for (int i=0; i<dim(); i++)
+        f(i) = features(t, i);
+      bool exponential_feature_valid = false;
+      for (int j=0; j<num_unpacked; j++) {
+        int i = m_use_packed_gaussians ? m_unpacked_pdfs[j] : j;
+        FullCovarianceGaussian *fcgaussian = dynamic_cast< FullCovarianceGaussian* > (m_pool[i]);
+        if (fcgaussian != NULL) {
+          if (!exponential_feature_valid) {
+            compute_exponential_feature(f, buffers.exponential_feature);
+            exponential_feature_valid = true;
+          }
+          likelihoods(t, i) = fcgaussian->compute_likelihood_exponential(buffers.exponential_feature);
+        }
+        else
+          likelihoods(t, i) = m_pool[i]->compute_likelihood(f);
+      }
+    }
+  }
+}
+
+
+void
+PDFPool::set_batch_frame(int frame)
+{
+  assert(frame >= 0 && frame < num_batch_frames());
+  reset_cache();
+  for (int i=0; i<size(); i++) {
+    m_likelihoods[i] = m_batch_likelihoods(frame, i);
+    m_valid_likelihoods.push_back(i);
+  }
+}
+
+
+void
+PDFPool::compute_exponential_feature(const Vector &f,
+                                     Vector &exponential_feature) const
+{
+  exponential_feature.resize((int)(dim()*(dim()+3)/2));
+  for (int i=0; i<dim(); i++)
+    exponential_feature(i) = f(i);
+  Matrix tmat(dim(), dim()); tmat=0;
+  Blas_R1_Update(tmat, f, f, 1.0);
+  Vector tvec;
+  LinearAlgebra::map_m2v(tmat, tvec);
+  for (int i=0; i<tvec.size(); i++)
+    exponential_feature(dim()+i) = tvec(i);
+}
+
+
+void
+PDFPool::pack_gaussians()
+{
+  m_packed_pdfs.clear();
+  m_unpacked_pdfs.clear();
+  for (int i=0; i<size(); i++) {
+    if (dynamic_cast< DiagonalGaussian* > (m_pool[i]) != NULL)
+      m_packed_pdfs.push_back(i);
+    else
+      m_unpacked_pdfs.push_back(i);
+  }
+
+  m_packed_gaussians.resize(dim(), m_packed_pdfs.size());
+  for (unsigned int k=0; k<m_packed_pdfs.size(); k++) {
+    DiagonalGaussian *gaussian = dynamic_cast< DiagonalGaussian* > (m_pool[m_packed_pdfs[k]]);
+    assert(gaussian->dim() == dim());
+    m_packed_gaussians.set_gaussian(k, gaussian->m_mean.addr(),
+                                    gaussian->m_precision.addr(),
+                                    gaussian->m_constant);
+  }
+  m_packed_log_likelihoods.resize(m_packed_pdfs.size() + 1);
+  m_batch_weights.resize(0, 0);
+  m_packed_gaussians_valid = true;
+}
+
+
+void
+PDFPool::pack_batch_weights()
+{
+  int num_packed = (int)m_packed_pdfs.size();
+  m_batch_weights.resize(2*dim(), num_packed);
+  m_batch_bias.resize(num_packed);
+  for (int k=0; k<num_packed; k++) {
+    DiagonalGaussian *gaussian = dynamic_cast< DiagonalGaussian* > (m_pool[m_packed_pdfs[k]]);
+    double bias = gaussian->m_constant;
+    for (int i=0; i<dim(); i++) {
+      double mean = gaussian->m_mean(i);
+      double precision = gaussian->m_precision(i);
+      m_batch_weights(i, k) = mean * precision;
+      m_batch_weights(dim()+i, k) = -0.5 * precision;
+      bias -= 0.5 * mean * mean * precision;
+    }
+    m_batch_bias(k) = bias;
   }
 }
 
@@ -2758,9 +3259,14 @@ PDFPool::set_hcl_optimization(HCL_LineSearch_MT_d *ls,
 #endif
 
 void
-PDFPool::estimate_parameters(PDF::EstimationMode mode)
+PDFPool::estimate_parameters(PDF::EstimationMode mode, int num_threads)
 {
-  for (int i=0; i<size(); i++)
+  m_packed_gaussians_valid = false;
+#ifdef USE_SUBSPACE_COV
+  // The subspace Gaussians share the optimization objects
+  num_threads = 1;
+#endif
+  run_parallel(size(), num_threads, [&](int i, int)
   {
 #ifdef USE_SUBSPACE_COV
     PrecisionConstrainedGaussian *pctemp = dynamic_cast< PrecisionConstrainedGaussian* > (m_pool[i]);
@@ -2804,7 +3310,7 @@ PDFPool::estimate_parameters(PDF::EstimationMode mode)
       std::cout << "Warning: Gaussian number " << i
                 << ": " << errstr << std::endl;
     }
-  }
+  });
 }
 
 
@@ -2826,6 +3332,7 @@ PDFPool::read_gk(const std::string &filename)
   m_valid_likelihoods.clear();
   for (int i=0; i<pdfs; i++)
     m_likelihoods[i] = -1;
+  m_packed_gaussians_valid = false;
   
   // New implementation
   if (type_str == "variable") {
@@ -2983,6 +3490,7 @@ PDFPool::read_bgk(const std::string &filename)
   m_valid_likelihoods.clear();
   for (int i=0; i<pdfs; i++)
     m_likelihoods[i] = -1;
+  m_packed_gaussians_valid = false;
 
   // New implementation
   for (int i=0; i<pdfs; i++) {
@@ -3069,6 +3577,7 @@ PDFPool::split_gaussian(int index, int *new_index)
   if (!gaussian->accumulated(PDF::ML_BUF))
     throw std::string("PDFPool::split_gaussian: ML statistics are required");
   
+  m_packed_gaussians_valid = false;
   Gaussian *new_gaussian = gaussian->copy_gaussian();
   gaussian->split(*new_gaussian);
   *new_index = add_pdf(new_gaussian);
@@ -5,6 +5,7 @@
 
 #include "FeatureBuffer.hh"
 #include "LinearAlgebra.hh"
+#include "PackedGaussians.hh"
 #ifdef USE_SUBSPACE_COV
 # include "Subspaces.hh"
 #endif
@@ -52,6 +53,15 @@ public:
   virtual void dump_statistics(std::ostream &os) const = 0;
   /* Accumulates from a file dump */
   virtual void accumulate_from_dump(std::istream &is, StatisticsMode mode) = 0;
+  /* Adds the statistics accumulated in another instance of the same pdf */
+  virtual void accumulate_from(const PDF &other) = 0;
+  /* Number of doubles written by pack_statistics() */
+  virtual int packed_statistics_size() const = 0;
+  /* Writes the accumulated statistics to an array of doubles */
+  virtual void pack_statistics(double *data) const = 0;
+  /* Accumulates from an array written by pack_statistics() */
+  virtual void accumulate_packed(const double *data, int size,
+                                 StatisticsMode mode) = 0;
   /* Stops training and clears the accumulators */
   virtual void stop_accumulating() = 0;
   /* Tells if this pdf has been accumulated */
@@ -158,8 +168,79 @@ public:
   ///
   void precompute_likelihoods(const Vector &f);
 
-  /// Estimates parameters of the pdfs in the pool
-  void estimate_parameters(PDF::EstimationMode mode);
+  /// \brief Computes likelihoods for all distributions for a block of frames.
+  ///
+  /// The diagonal Gaussians are scored for the whole block with one matrix
+  /// product \f$[x, x^2] [\mu \Lambda; -\Lambda/2]\f$, so their parameters
+  /// are read from memory only once per block. Other distributions, and
+  /// pools using Gaussian clustering, are computed one frame at a time.
+  /// The results are stored in a frames x pdfs cache, from which
+  /// set_batch_frame() loads the likelihoods of one frame.
+  ///
+  /// \param features the feature vectors, one frame per row
+  ///
+  void precompute_likelihoods(const Matrix &features);
+
+  /// Number of frames given to the last precompute_likelihoods(const Matrix&)
+  int num_batch_frames() const { return m_batch_likelihoods.rows(); }
+
+  /** Loads the likelihoods of one frame of the precomputed block to the
+   * cache used by compute_likelihood().
+   * \param frame the row index in the block
+   */
+  void set_batch_frame(int frame);
+
+  /// Likelihoods of the last block given to precompute_likelihoods(const Matrix&)
+  const Matrix &batch_likelihoods() const { return m_batch_likelihoods; }
+
+  /// Work space of compute_likelihoods(), reused between calls
+  struct LikelihoodBuffers {
+    Vector feature;
+    Vector exponential_feature;
+    Matrix extended_features;
+    Matrix scores;
+    std::vector<double> frame_likelihoods;
+  };
+
+  /// \brief Builds the data needed by compute_likelihoods().
+  ///
+  /// Must be called after the pool has been modified and before the pool
+  /// is shared between threads.
+  void prepare_likelihoods();
+
+  /// \brief Computes likelihoods for all distributions for a block of
+  /// frames without using the cache of the pool.
+  ///
+  /// Only reads the pool, so several threads may call this concurrently
+  /// as long as nobody modifies the pool. Subspace Gaussians are not
+  /// supported.
+  ///
+  /// \param features the feature vectors, one frame per row
+  /// \param likelihoods the result, frames x pdfs
+  /// \param buffers work space, one for each thread
+  ///
+  void compute_likelihoods(const Matrix &features, Matrix &likelihoods,
+                           LikelihoodBuffers &buffers) const;
+
+  /// \brief Enables or disables the packed diagonal Gaussian scoring in
+  /// precompute_likelihoods(). Enabled by default.
+  ///
+  /// The packed copy stores the parameters in single precision, so the
+  /// likelihoods may differ slightly from PDF::compute_likelihood().
+  void set_use_packed_gaussians(bool use) { m_use_packed_gaussians = use; }
+
+  /// \brief Marks the packed copy of the diagonal Gaussians outdated.
+  ///
+  /// Must be called if the parameters of the Gaussians are changed through
+  /// the pointers returned by get_pdf(). Changes made through the pool
+  /// itself invalidate the copy automatically.
+  void invalidate_packed_gaussians() { m_packed_gaussians_valid = false; }
+
+  /// \brief Estimates parameters of the pdfs in the pool
+  ///
+  /// The pdfs are estimated independently, so they can be divided
+  /// between several threads without changing the result.
+  void estimate_parameters(PDF::EstimationMode mode, int num_threads = 1);
 
 
   /********************************************************************/
@@ -230,10 +311,10 @@ public:
   /* Methods for Gaussian clustering                                  */
   /********************************************************************/
 
-  bool use_clustering() { return m_use_clustering; }
-  int number_of_clusters() { return m_number_of_clusters; }
-  int evaluate_min_clusters() { return m_evaluate_min_clusters; }
-  int evaluate_min_gaussians() { return m_evaluate_min_gaussians; }
+  bool use_clustering() const { return m_use_clustering; }
+  int number_of_clusters() const { return m_number_of_clusters; }
+  int evaluate_min_clusters() const { return m_evaluate_min_clusters; }
+  int evaluate_min_gaussians() const { return m_evaluate_min_gaussians; }
 
   void set_use_clustering(bool use) { m_use_clustering = use; }
   void set_number_of_clusters(int n) { m_number_of_clusters = n; }
@@ -257,12 +338,37 @@ public:
   std::vector<std::vector<int> > &get_cluster_to_gaussians() { return m_cluster_to_gaussians; }
   
 private:
+  /// Builds the packed copy of the diagonal Gaussians in the pool
+  void pack_gaussians();
+  /// Builds the matrix and bias used for scoring blocks of frames
+  void pack_batch_weights();
+  /// Computes the [f, vec(f f')] feature for full covariance Gaussians
+  void compute_exponential_feature(const Vector &f, Vector &exponential_feature) const;
+  /// Computes the likelihoods of one frame using the Gaussian clustering
+  void compute_clustered_likelihoods(const Vector &f, std::vector<double> &likelihoods) const;
+
   // Standard things
   std::vector<PDF*> m_pool;
   std::vector<double> m_likelihoods;
   std::vector<int> m_valid_likelihoods;
   int m_dim;
 
+  // Packed diagonal Gaussians for fast likelihood computation
+  bool m_use_packed_gaussians;
+  bool m_packed_gaussians_valid;
+  PackedDiagonalGaussians m_packed_gaussians;
+  std::vector<int> m_packed_pdfs; //!< Pool indices of the packed Gaussians
+  std::vector<int> m_unpacked_pdfs; //!< Pool indices of the other pdfs
+  std::vector<double> m_packed_log_likelihoods;
+  std::vector<double> m_packed_feature; //!< The frame being scored
+  Vector m_exponential_feature; //!< Built only for full covariances
+
+  // Block scoring
+  Matrix m_batch_weights; //!< Rows [mean.*precision; -precision/2]
+  Vector m_batch_bias; //!< Constants minus mean'*precision*mean/2
+  Matrix m_batch_likelihoods; //!< Likelihoods of the block, frames x pdfs
+  LikelihoodBuffers m_batch_buffers;
+
   // Estimation constants
   double m_minvar;
   double m_covsmooth;
@@ -322,6 +428,12 @@ public:
   virtual void accumulate_aux_gamma(double gamma) { m_aux_gamma += gamma; }
   virtual void dump_statistics(std::ostream &os) const = 0;
   virtual void accumulate_from_dump(std::istream &is) = 0;
+  virtual void accumulate_from(const GaussianAccumulator &other) = 0;
+  /* Packed statistics: feacount, gamma, aux_gamma, mean, second moment */
+  int packed_size() const { return 3 + m_dim + second_moment_size(); }
+  virtual int second_moment_size() const = 0;
+  virtual void pack_statistics(double *data) const = 0;
+  virtual void accumulate_packed(const double *data) = 0;
   virtual bool full_stats_accumulated() const = 0;
   virtual void reset() = 0;
 protected:
@@ -349,6 +461,10 @@ public:
   virtual void accumulate(int feacount, double gamma, const Vector &f);
   virtual void dump_statistics(std::ostream &os) const;
   virtual void accumulate_from_dump(std::istream &is);
+  virtual void accumulate_from(const GaussianAccumulator &other);
+  virtual int second_moment_size() const { return m_dim * (m_dim + 1) / 2; }
+  virtual void pack_statistics(double *data) const;
+  virtual void accumulate_packed(const double *data);
   virtual bool full_stats_accumulated() const { return accumulated(); }
   virtual void reset();
 private:
@@ -371,6 +487,10 @@ public:
   virtual void accumulate(int feacount, double gamma, const Vector &f);
   virtual void dump_statistics(std::ostream &os) const;
   virtual void accumulate_from_dump(std::istream &is);
+  virtual void accumulate_from(const GaussianAccumulator &other);
+  virtual int second_moment_size() const { return m_dim; }
+  virtual void pack_statistics(double *data) const;
+  virtual void accumulate_packed(const double *data);
   virtual bool full_stats_accumulated() const { return false; }
   virtual void reset();
 private:
@@ -433,6 +553,14 @@ public:
   virtual void dump_statistics(std::ostream &os) const;
   /* Accumulates from dump */
   virtual void accumulate_from_dump(std::istream &is, StatisticsMode mode);
+  /* Adds the statistics of another Gaussian */
+  virtual void accumulate_from(const PDF &other);
+  /* Packed statistics: the number of accumulators, then accum_pos, size
+     and the packed accumulator for each */
+  virtual int packed_statistics_size() const;
+  virtual void pack_statistics(double *data) const;
+  virtual void accumulate_packed(const double *data, int size,
+                                 StatisticsMode mode);
   /* Stops training and clears the accumulators */
   virtual void stop_accumulating();
   /* Tells if this Gaussian has been accumulated */
@@ -616,6 +744,8 @@ private:
   Vector m_precision;
 
   bool m_full_stats;
+
+  friend class PDFPool;
 };
 
 
@@ -866,6 +996,11 @@ public:
 			  int accum_pos = 0);
   virtual void dump_statistics(std::ostream &os) const;
   virtual void accumulate_from_dump(std::istream &is, StatisticsMode mode);
+  virtual void accumulate_from(const PDF &other);
+  virtual int packed_statistics_size() const;
+  virtual void pack_statistics(double *data) const;
+  virtual void accumulate_packed(const double *data, int size,
+                                 StatisticsMode mode);
   virtual void stop_accumulating();
   virtual bool accumulated(int accum_pos = 0) const;
   virtual void estimate_parameters(EstimationMode mode);
@@ -875,6 +1010,13 @@ public:
   virtual void read(std::istream &is);
   virtual void draw_sample(Vector &sample);
 
+  /** Computes the likelihood from precomputed pool likelihoods
+   * \param pool_likelihoods pool likelihoods for a block of frames, see
+   *                         \ref PDFPool::compute_likelihoods()
+   * \param frame row of the block
+   */
+  double compute_block_likelihood(const Matrix &pool_likelihoods, int frame) const;
+
 private:
 
   class MixtureAccumulator {
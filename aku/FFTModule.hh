@@ -24,6 +24,8 @@ private:
   virtual void get_module_config(ModuleConfig &config);
   virtual void set_module_config(const ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
+  void compute_frame(const double *source, double *target);
 
   int m_magnitude; //!< If nonzero, compute magnitude spectrum instead of power
   int m_log; //!< If nonzero, take logarithms of the output
@@ -83,11 +83,47 @@ public:
 
   const Vector* get_vector() const { return m_ptr; }
 
+  /** Direct access to the contiguous values without bounds checking,
+   * for the inner loops of the feature modules. */
+  const double *data() const { return m_ptr->addr(); }
+  double *data() { return m_ptr->addr(); }
+
 private:
   const Vector *m_ptr; //!< Pointer to the feature vector values
   int m_dim; //!< The dimension of the vector
 };
 
+/** Feature vectors of consecutive frames stored row by row in one
+ * contiguous array. Used for generating features a block at a time. */
+class FeatureFrameBlock {
+public:
+  FeatureFrameBlock() : m_num_frames(0), m_dim(0) { }
+
+  /** Set the size of the block.  The values are not initialized. */
+  void resize(int num_frames, int dim)
+  {
+    m_num_frames = num_frames;
+    m_dim = dim;
+    m_data.resize((size_t)num_frames * dim);
+  }
+
+  /** The number of frames in the block. */
+  int num_frames() const { return m_num_frames; }
+
+  /** The dimension of the feature vectors. */
+  int dim() const { return m_dim; }
+
+  /** The values of the frame with index \c frame in the block. */
+  const double *row(int frame) const { return &m_data[(size_t)frame * m_dim]; }
+  double *row(int frame) { return &m_data[(size_t)frame * m_dim]; }
+
+private:
+  int m_num_frames;
+  int m_dim;
+  std::vector<double> m_data;
+};
+
+
 /** A class for storing feature vectors in a circular buffer. */
 class FeatureBuffer {
 public:
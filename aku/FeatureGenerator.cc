@@ -28,7 +28,7 @@ FeatureGenerator::~FeatureGenerator()
 }
 
 void
-FeatureGenerator::open(const std::string &filename)
+FeatureGenerator::open(const std::string &filename, bool raw_audio)
 {
 /* Old implementation 7.4.2010 varjokal
   if (m_file != NULL)
@@ -48,6 +48,7 @@ FeatureGenerator::open(const std::string &filename)
     m_modules[i]->reset();
 
   assert( m_base_module != NULL );
+  m_base_module->set_raw_audio(raw_audio);
   m_base_module->set_fname(filename.c_str());
 }
 
@@ -62,6 +63,8 @@ FeatureGenerator::open_fd(const int fd, bool raw_audio)
     throw std::string("could not open fd ") + ": " +
       strerror(errno);
   }
+  assert( m_base_module != NULL );
+  m_base_module->set_raw_audio(raw_audio);
   open(file, false, false);
 }
 
@@ -272,6 +275,28 @@ FeatureGenerator::generate(int frame)
   return temp;
 }
 
+int
+FeatureGenerator::generate_block(int start, int count, Matrix &features)
+{
+  assert( m_last_module != NULL );
+  m_last_module->generate_block(start, count, m_block);
+
+  int dim = m_last_module->dim();
+  features.resize(count, dim);
+  for (int t = 0; t < count; t++)
+  {
+    const double *row = m_block.row(t);
+    for (int i = 0; i < dim; i++)
+      features(t, i) = row[i];
+  }
+
+  int frames = 0;
+  while (frames < count && !m_base_module->eof(start + frames))
+    frames++;
+  m_eof_on_last_frame = (frames < count);
+  return frames;
+}
+
 int
 FeatureGenerator::last_frame()
 {
@@ -28,10 +28,11 @@ public:
   /** Open an audio file closing the possible previously opened file.
    *
    * \param filename = The name of the audio file.  
+   * \param raw_audio = If true, the file is assumed to contain raw
    * samples.  Otherwise, automatic file format is used.
    * \exception string If cannot open file.
    */
-  void open(const std::string &filename);
+  void open(const std::string &filename, bool raw_audio = false);
   void open_fd(const int fd, bool raw_audio);
 
   /** Open an audio file closing the possible previously opened file.
@@ -70,6 +71,17 @@ public:
    **/
   const FeatureVec generate(int frame);
 
+  /** Generates the features of \c count frames starting from \c
+   * start into the rows of \c features.  The modules that support it
+   * process the whole block at once, which is faster than calling
+   * generate() for each frame.  Intended for reading files from start
+   * to end, not for streams that should be decoded frame by frame.
+   *
+   * \return The number of frames before the end of file.  The rest of
+   * the rows are undefined.
+   */
+  int generate_block(int start, int count, Matrix &features);
+
   /** Returns the last frame that does not generate eof */
   int last_frame();
 
@@ -120,6 +132,9 @@ private:
 
   /** Was end of file reached on the frame requested from generate(). */
   bool m_eof_on_last_frame;
+
+  /** Work space for generate_block(). */
+  FeatureFrameBlock m_block;
 };
 
 }
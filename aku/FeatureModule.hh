@@ -112,6 +112,13 @@ public:
   /** Access features computed by the module. */
   const FeatureVec at(int frame);
 
+  /** Compute the features of \c count frames starting from \c start
+   * into \c block.  Modules that compute each frame from a fixed
+   * neighbourhood of source frames process the whole block at once from
+   * a block of their source.  Other modules fall back to at() frame by
+   * frame.  The frames are not stored in the module buffer. */
+  void generate_block(int start, int count, FeatureFrameBlock &block);
+
   /** The dimension of the feature. \note Valid only after the module
    * has been configured with set_config(). */
   int dim(void) { return m_dim; }
@@ -131,6 +138,12 @@ private:
   virtual void reset_module() { }
   
   virtual void generate(int frame) = 0;
+
+  /** Virtual method for computing a block of frames, which has been
+   * resized already.  Returns false if the module does not support
+   * blocks. */
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block)
+  { return false; }
   
 protected:
   std::string m_name; //!< The name of the module given by FeatureGenerator
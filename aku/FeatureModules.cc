@@ -159,6 +159,22 @@ FeatureModule::at(int frame)
 
 
 // The default implementation allows only one source, overload if necessary.
+void
+FeatureModule::generate_block(int start, int count, FeatureFrameBlock &block)
+{
+  block.resize(count, m_dim);
+  if (generate_module_block(start, block))
+    return;
+
+  for (int t = 0; t < count; t++)
+  {
+    const double *source = at(start + t).data();
+    double *target = block.row(t);
+    for (int i = 0; i < m_dim; i++)
+      target[i] = source[i];
+  }
+}
+
 void
 FeatureModule::add_source(FeatureModule *source)
 {
@@ -229,6 +245,7 @@ AudioFileModule::AudioFileModule(FeatureGenerator *fea_gen) :
   m_eof_frame(INT_MAX),
   m_endian(0),
   m_raw(false),
+  m_raw_audio(false),
   m_copy_borders(true),
   m_last_feature_frame(INT_MIN)
 {
@@ -244,7 +261,7 @@ AudioFileModule::~AudioFileModule()
 void
 AudioFileModule::set_fname(const char *fname)
 {
-  m_reader.enforce_raw(m_raw);
+  m_reader.enforce_raw(m_raw || m_raw_audio);
   if (m_endian == 1)
     m_reader.set_little_endian(true);
   else if (m_endian == 2)
@@ -267,7 +284,7 @@ AudioFileModule::set_fname(const char *fname)
 void
 AudioFileModule::set_file(FILE *fp, bool stream)
 {
-  m_reader.enforce_raw(m_raw);
+  m_reader.enforce_raw(m_raw || m_raw_audio);
   if (m_endian == 1)
     m_reader.set_little_endian(true);
   else if (m_endian == 2)
@@ -519,16 +536,31 @@ FFTModule::set_module_config(const ModuleConfig &config)
 
 void
 FFTModule::generate(int frame)
+{
+  compute_frame(m_sources.back()->at(frame).data(), m_buffer[frame].data());
+}
+
+bool
+FFTModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  FeatureFrameBlock source;
+  m_sources.back()->generate_block(start, block.num_frames(), source);
+  for (int t = 0; t < block.num_frames(); t++)
+    compute_frame(source.row(t), block.row(t));
+  return true;
+}
+
+void
+FFTModule::compute_frame(const double *source, double *target)
 {
   int t;
-  
-  const FeatureVec source_fea = m_sources.back()->at(frame);
-  FeatureVec target = m_buffer[frame];
+  const float *window = &m_hamming_window[0];
+  int source_dim = m_sources.back()->dim();
 
 #ifdef KISS_FFT
   // Apply Hamming window
-  for (t = 0; t < source_fea.dim(); t++)
-    m_kiss_fft_datain[t] = m_hamming_window[t] * source_fea[t];
+  for (t = 0; t < source_dim; t++)
+    m_kiss_fft_datain[t] = window[t] * source[t];
   kiss_fftr(m_coeffs, m_kiss_fft_datain, m_kiss_fft_dataout);
   for (t = 0; t < m_dim; t++)
   {
@@ -538,29 +570,29 @@ FFTModule::generate(int frame)
   
 #else // FFTW
   // Apply Hamming window
-  for (t = 0; t < source_fea.dim(); t++)
-  {
-    m_fftw_datain[t] = m_hamming_window[t] * source_fea[t];
-  }
+  double *datain = &m_fftw_datain[0];
+  for (t = 0; t < source_dim; t++)
+    datain[t] = window[t] * source[t];
   
   fftw_execute(m_coeffs);
 
-  // NOTE: fftw returns the imaginary parts in funny order
-  for (t = 0; t < source_fea.dim() / 2; t++)
-  {
-    target[t] = m_fftw_dataout[t] * m_fftw_dataout[t] + 
-      m_fftw_dataout[source_fea.dim()-t] * m_fftw_dataout[source_fea.dim()-t];
-  }
+  // NOTE: fftw returns the imaginary parts in funny order. The extra zero
+  // at the end of the output is the imaginary part of the zero frequency.
+  const double *real = &m_fftw_dataout[0];
+  const double *imag = &m_fftw_dataout[source_dim];
+  for (t = 0; t < source_dim / 2; t++)
+    target[t] = real[t] * real[t] + imag[-t] * imag[-t];
 
   // The highest frequency component has zero imaginary part
-  target[t] = m_fftw_dataout[t] * m_fftw_dataout[t];
+  target[t] = real[t] * real[t];
 #endif
 
-  for (t = 0; t < m_dim; t++) {
-    if (m_magnitude)
+  if (m_magnitude) {
+    for (t = 0; t < m_dim; t++)
       target[t] = sqrtf(target[t]);
-
-    if (m_log)
+  }
+  if (m_log) {
+    for (t = 0; t < m_dim; t++)
       target[t] = logf(target[t]);
   }
 }
@@ -791,60 +823,82 @@ void
 MelModule::create_mel_bins(void)
 {
   int edges = m_dim + 2;
+  int source_dim = m_sources.back()->dim();
   float rate = m_fea_gen->sample_rate();
   float mel_step = 2595 * log10f(1.0 + rate / 1400.0) / edges;
 
   m_bin_edges.resize(edges);
   for (int i = 0; i < edges; i++) {
     m_bin_edges[i] = 1400.0 * (pow(10, (i+1) * mel_step / 2595) - 1)*
-      (m_sources.back()->dim()-1) / rate;
+      (source_dim-1) / rate;
+  }
+
+  // Compute the triangular filters once.
+  m_first_source.resize(m_dim);
+  m_weight_offset.resize(m_dim + 1);
+  m_weights.clear();
+  std::vector<float> weights;
+  for (int b = 0; b < m_dim; b++)
+  {
+    float beg = m_bin_edges[b] - 1;
+    float mid = m_bin_edges[b+1];
+    float end = m_bin_edges[b+2];
+    int t = (int)std::max(ceilf(beg), 0.0f);
+    float sum = 0;
+
+    m_first_source[b] = t;
+    weights.clear();
+    for (; t < mid; t++)
+      weights.push_back((t - beg)/(mid - beg));
+    for (; t < end; t++)
+      weights.push_back((end - t)/(end - mid));
+    if (t > source_dim)
+      throw std::string("MelModule: filterbank exceeds the source dimension");
+
+    for (int i = 0; i < (int)weights.size(); i++)
+      sum += weights[i];
+    m_weight_offset[b] = m_weights.size();
+    for (int i = 0; i < (int)weights.size(); i++)
+      m_weights.push_back(weights[i] / sum);
   }
+  m_weight_offset[m_dim] = m_weights.size();
 }
 
 
 void
 MelModule::generate(int frame)
 {
-  int t;
-  float beg, end, val, scale, sum;
-  const FeatureVec data = m_sources.back()->at(frame);
-  
+  compute_frame(m_sources.back()->at(frame).data(), m_buffer[frame].data());
+}
+
+
+bool
+MelModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  FeatureFrameBlock source;
+  m_sources.back()->generate_block(start, block.num_frames(), source);
+  for (int t = 0; t < block.num_frames(); t++)
+    compute_frame(source.row(t), block.row(t));
+  return true;
+}
+
+
+void
+MelModule::compute_frame(const double *data, double *target)
+{
   for (int b = 0; b < m_dim; b++)
   {
-    val = 0;
-    sum = 0;
-    beg = m_bin_edges[b] - 1;
-    end = m_bin_edges[b+1];
-    
-    t = (int)std::max(ceilf(beg), 0.0f);
-    
-    while (t < end)
-    {
-      scale = (t - beg)/(end - beg);
-      val += scale * data[t];
-      sum += scale;
-      t++;
-    }
-    beg = end;
-    end = m_bin_edges[b+2];
-    
-    while (t < end)
-    {
-      scale = (end - t)/(end - beg);
-      val += scale * data[t];
-      sum += scale;
-      t++;
-    }
-    
+    const double *src = data + m_first_source[b];
+    const float *weight = &m_weights[0] + m_weight_offset[b];
+    int count = m_weight_offset[b+1] - m_weight_offset[b];
+    double val = 0;
+    for (int i = 0; i < count; i++)
+      val += weight[i] * src[i];
       
     if (m_root)
-    {
-      m_buffer[frame][b] = pow((double)(val/sum), 0.1);
-    }
+      target[b] = pow(val, 0.1);
     else
-    {
-      m_buffer[frame][b] = logf(val/sum + 1);
-    }
+      target[b] = logf(val + 1);
   }
 }
 
@@ -873,15 +927,30 @@ PowerModule::set_module_config(const ModuleConfig &config)
 
 void
 PowerModule::generate(int frame)
+{
+  compute_frame(m_sources.back()->at(frame).data(), m_buffer[frame].data());
+}
+
+bool
+PowerModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  FeatureFrameBlock source;
+  m_sources.back()->generate_block(start, block.num_frames(), source);
+  for (int t = 0; t < block.num_frames(); t++)
+    compute_frame(source.row(t), block.row(t));
+  return true;
+}
+
+void
+PowerModule::compute_frame(const double *src, double *target)
 {
   float power = 0;
   int src_dim = m_sources.back()->dim();
-  const FeatureVec src = m_sources.back()->at(frame);
   
   for (int i = 0; i < src_dim; i++)
     power += src[i];
   
-  m_buffer[frame][0] = log(power + 1e-10);
+  target[0] = log(power + 1e-10);
 }
 
 
@@ -909,15 +978,30 @@ MelPowerModule::set_module_config(const ModuleConfig &config)
 
 void
 MelPowerModule::generate(int frame)
+{
+  compute_frame(m_sources.back()->at(frame).data(), m_buffer[frame].data());
+}
+
+bool
+MelPowerModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  FeatureFrameBlock source;
+  m_sources.back()->generate_block(start, block.num_frames(), source);
+  for (int t = 0; t < block.num_frames(); t++)
+    compute_frame(source.row(t), block.row(t));
+  return true;
+}
+
+void
+MelPowerModule::compute_frame(const double *src, double *target)
 {
   float power = 0;
   int src_dim = m_sources.back()->dim();
-  const FeatureVec src = m_sources.back()->at(frame);
 
   for (int i = 0; i < src_dim; i++)
     power += exp(src[i]);
 
-  m_buffer[frame][0] = log(power + 1e-10);
+  target[0] = log(power + 1e-10);
 }
 
 
@@ -950,31 +1034,49 @@ DCTModule::set_module_config(const ModuleConfig &config)
   if (m_dim < 1)
     throw std::string("DCTModule: Dimension must be > 0");
   config.get("zeroth", m_zeroth_comp);
+
+  // Compute the cosine table once. The zeroth component is the sum of the
+  // source values.
+  int src_dim = m_sources.back()->dim();
+  int bias = m_zeroth_comp ? 1 : 0;
+  m_dct.resize(m_dim * src_dim);
+  for (int b = 0; b < src_dim; b++)
+  {
+    if (m_zeroth_comp)
+      m_dct[b] = 1;
+    for (int i = 0; i < m_dim-bias; i++)
+      m_dct[(i+bias)*src_dim + b] = cosf((i+1) * (b+0.5) * M_PI / src_dim);
+  }
 }
 
 void
 DCTModule::generate(int frame)
 {
-  const FeatureVec source_fea = m_sources.back()->at(frame);
-  FeatureVec target_fea = m_buffer[frame];
+  compute_frame(m_sources.back()->at(frame).data(), m_buffer[frame].data());
+}
+
+bool
+DCTModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  FeatureFrameBlock source;
+  m_sources.back()->generate_block(start, block.num_frames(), source);
+  for (int t = 0; t < block.num_frames(); t++)
+    compute_frame(source.row(t), block.row(t));
+  return true;
+}
+
+void
+DCTModule::compute_frame(const double *source, double *target)
+{
   int src_dim = m_sources.back()->dim();
-  int i = 0;
-  int bias=0;
+  const float *dct = &m_dct[0];
 
-  if (m_zeroth_comp)
+  for (int i = 0; i < m_dim; i++, dct += src_dim)
   {
-    target_fea[0] = 0.0;
+    double sum = 0.0;
     for (int b = 0; b < src_dim; b++)
-      target_fea[0] += source_fea[b];
-    //i++;
-    bias=1;
-  }
-  
-  for (; i < m_dim-bias; i++)
-  {
-    target_fea[i+bias] = 0.0;
-    for (int b = 0; b < src_dim; b++)
-      target_fea[i+bias] += source_fea[b] * cosf((i+1) * (b+0.5) * M_PI / src_dim);
+      sum += source[b] * dct[b];
+    target[i] = sum;
   }
 }
 
@@ -1036,6 +1138,37 @@ DeltaModule::generate(int frame)
     target_fea[i] /= m_delta_norm;
 }
 
+bool
+DeltaModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  // The source block has m_delta_width extra frames on both sides.
+  FeatureFrameBlock source;
+  int frames = block.num_frames();
+  m_sources.back()->generate_block(start - m_delta_width,
+                                   frames + 2 * m_delta_width, source);
+
+  for (int t = 0; t < frames; t++)
+  {
+    double *target = block.row(t);
+    int i, k;
+
+    for (i = 0; i < m_dim; i++)
+      target[i] = 0;
+
+    for (k = 1; k <= m_delta_width; k++)
+    {
+      const double *left = source.row(t + m_delta_width - k);
+      const double *right = source.row(t + m_delta_width + k);
+      for (i = 0; i < m_dim; i++)
+        target[i] += k * (right[i] - left[i]);
+    }
+
+    for (i = 0; i < m_dim; i++)
+      target[i] /= m_delta_norm;
+  }
+  return true;
+}
+
 
 //////////////////////////////////////////////////////////////////
 // NormalizationModule
@@ -1135,10 +1268,24 @@ NormalizationModule::set_normalization(const std::vector<float> &mean,
 void
 NormalizationModule::generate(int frame)
 {
-  const FeatureVec source_fea = m_sources.back()->at(frame);
-  FeatureVec target_fea = m_buffer[frame];
+  compute_frame(m_sources.back()->at(frame).data(), m_buffer[frame].data());
+}
+
+bool
+NormalizationModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  FeatureFrameBlock source;
+  m_sources.back()->generate_block(start, block.num_frames(), source);
+  for (int t = 0; t < block.num_frames(); t++)
+    compute_frame(source.row(t), block.row(t));
+  return true;
+}
+
+void
+NormalizationModule::compute_frame(const double *source, double *target)
+{
   for (int i = 0; i < m_dim; i++)
-    target_fea[i] = (source_fea[i] - m_mean[i]) * m_scale[i];
+    target[i] = (source[i] - m_mean[i]) * m_scale[i];
 }
 
 
@@ -1243,28 +1390,44 @@ LinTransformModule::check_transform_parameters(void)
 void
 LinTransformModule::generate(int frame)
 {
-  int index;
-  const FeatureVec source_fea = m_sources.back()->at(frame);
-  FeatureVec target_fea = m_buffer[frame];
+  compute_frame(m_sources.back()->at(frame).data(), m_buffer[frame].data());
+}
+
 
+bool
+LinTransformModule::generate_module_block(int start, FeatureFrameBlock &block)
+{
+  FeatureFrameBlock source;
+  m_sources.back()->generate_block(start, block.num_frames(), source);
+  for (int t = 0; t < block.num_frames(); t++)
+    compute_frame(source.row(t), block.row(t));
+  return true;
+}
+
+
+void
+LinTransformModule::compute_frame(const double *source, double *target)
+{
   if (m_matrix_defined)
   {
-    for (int i = index = 0; i < m_dim; i++)
+    const float *row = &m_transform[0];
+    for (int i = 0; i < m_dim; i++, row += m_src_dim)
     {
-      target_fea[i] = 0;
-      for (int j = 0; j < m_src_dim; j++, index++)
-        target_fea[i] += m_transform[index]*source_fea[j];
+      double sum = 0;
+      for (int j = 0; j < m_src_dim; j++)
+        sum += row[j]*source[j];
+      target[i] = sum;
     }
   }
   else
   {
     for (int i = 0; i < m_dim; i++)
-      target_fea[i] = source_fea[i];
+      target[i] = source[i];
   }
   if (m_bias_defined)
   {
     for (int i = 0; i < m_dim; i++)
-      target_fea[i] += m_bias[i];
+      target[i] += m_bias[i];
   }
 }
 
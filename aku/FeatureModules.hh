@@ -65,6 +65,8 @@ private:
   virtual void get_module_config(ModuleConfig &config);
   virtual void set_module_config(const ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
+  void compute_frame(const double *source, double *target);
 
   void create_mel_bins(void);
 
@@ -74,6 +76,14 @@ private:
   int m_bins;
   int m_root; //!< If nonzero, take 10th root of the output instead of logarithm
   std::vector<float> m_bin_edges;
+
+  // The filterbank as a sparse matrix. Filter b has weights
+  // m_weights[m_weight_offset[b] ... m_weight_offset[b+1]-1] for the source
+  // values starting from m_first_source[b]. The weights of a filter sum to
+  // one.
+  std::vector<int> m_first_source;
+  std::vector<int> m_weight_offset;
+  std::vector<float> m_weights;
 };
 
 
@@ -85,6 +95,8 @@ private:
   virtual void get_module_config(ModuleConfig &config);
   virtual void set_module_config(const ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
+  void compute_frame(const double *source, double *target);
 };
 
 
@@ -96,6 +108,8 @@ private:
   virtual void get_module_config(ModuleConfig &config);
   virtual void set_module_config(const ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
+  void compute_frame(const double *source, double *target);
 };
 
 
@@ -107,8 +121,11 @@ private:
   virtual void get_module_config(ModuleConfig &config);
   virtual void set_module_config(const ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
+  void compute_frame(const double *source, double *target);
 private:
   int m_zeroth_comp; //!< If nonzero, output includes zeroth component
+  std::vector<float> m_dct; //!< The transform, one row per output dimension
 };
 
 
@@ -120,6 +137,7 @@ private:
   virtual void get_module_config(ModuleConfig &config);
   virtual void set_module_config(const ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
 private:
   int m_delta_width;
   float m_delta_norm;
@@ -138,6 +156,8 @@ private:
   virtual void set_parameters(const ModuleConfig &config);
   virtual void get_parameters(ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
+  void compute_frame(const double *source, double *target);
 private:
   std::vector<float> m_mean;
   std::vector<float> m_scale;
@@ -158,6 +178,8 @@ private:
   virtual void get_module_config(ModuleConfig &config);
   virtual void set_module_config(const ModuleConfig &config);
   virtual void generate(int frame);
+  virtual bool generate_module_block(int start, FeatureFrameBlock &block);
+  void compute_frame(const double *source, double *target);
   void check_transform_parameters(void);
 private:
   std::vector<float> m_transform;
@@ -27,6 +27,7 @@ HmmNetBaumWelch::HmmNetBaumWelch(FeatureGenerator &fea_gen, HmmSet &model)
   m_eof_flag = false;
   m_collect_transitions = false;
   m_acoustic_scale = 1;
+  m_fast_scoring = false;
 
   m_features_generated = false;
   m_bw_scores_computed = false;
@@ -829,6 +830,8 @@ HmmNetBaumWelch::fill_backward_probabilities(void)
   }
   
   clear_bw_scores();
+  if (m_fast_scoring)
+    prepare_fast_scoring();
   if (m_last_frame > 0)
     cur_frame = m_last_frame - 1;
   else
@@ -837,7 +840,8 @@ HmmNetBaumWelch::fill_backward_probabilities(void)
   // Create a token to the final node
   active_tokens.push_back(
     BackwardToken(m_final_node_id, loglikelihoods.one()));
-  node_token_map.insert(NodeTokenMap::value_type(m_final_node_id, 0));
+  node_token_map.resize(m_nodes.size());
+  node_token_map.insert(m_final_node_id, 0);
 
   // Propagate the epsilon arcs leading to the final node
   backward_propagate_epsilon_arcs(active_tokens, node_token_map, cur_frame);
@@ -862,7 +866,7 @@ HmmNetBaumWelch::fill_backward_probabilities(void)
           continue;
     
         int next_node_id = m_arcs[arc_id].source;
-        double arc_score = get_arc_score(arc_id, get_feature(cur_frame));
+        double arc_score = get_frame_arc_score(arc_id, cur_frame);
         double backward_score =
           loglikelihoods.times(active_tokens[i].score, arc_score);
 
@@ -929,7 +933,7 @@ HmmNetBaumWelch::fill_backward_probabilities(void)
 
         if (m_segmentation_mode == MODE_BAUM_WELCH)
         {
-          new_node_score = loglikelihoods.plus(new_node_score,
+          new_node_score = log_plus(new_node_score,
                                                (*it2).second.score);
           // Set the backward score
           m_arcs[(*it2).second.arc_id].bw_scores.set_new_score(
@@ -975,7 +979,7 @@ HmmNetBaumWelch::fill_backward_probabilities(void)
              tr_it != parent_transition_map.end(); ++tr_it)
         {
           if (new_node_score > loglikelihoods.zero())
-            new_node_score = loglikelihoods.plus(new_node_score,
+            new_node_score = log_plus(new_node_score,
                                                  (*tr_it).second.score);
           else
             new_node_score = (*tr_it).second.score;
@@ -992,8 +996,7 @@ HmmNetBaumWelch::fill_backward_probabilities(void)
       }
 
       // Create a token to the target node
-      node_token_map.insert(
-        NodeTokenMap::value_type((*it).first, active_tokens.size()));
+      node_token_map.insert((*it).first, active_tokens.size());
       active_tokens.push_back(BackwardToken((*it).first, new_node_score));
 
       it = it2;
@@ -1005,10 +1008,10 @@ HmmNetBaumWelch::fill_backward_probabilities(void)
   }
 
   // Set the total lattice scores
-  NodeTokenMap::iterator it = node_token_map.find(m_initial_node_id);
-  if (it == node_token_map.end())
+  int initial_token = node_token_map.find(m_initial_node_id);
+  if (initial_token < 0)
     return false; // Did not reach the initial node
-  m_total_score = active_tokens[(*it).second].score;
+  m_total_score = active_tokens[initial_token].score;
 
   if (m_total_score <= loglikelihoods.zero())
     return false; // Initial node was not reached
@@ -1045,11 +1048,10 @@ HmmNetBaumWelch::backward_propagate_epsilon_arcs(
       m_arcs[arc_id].bw_scores.set_new_score(cur_frame, backward_score);
 
       // Find out whether the next network node has already been activated
-      NodeTokenMap::iterator node_token = node_token_map.find(next_node_id);
-      if (node_token != node_token_map.end())
+      int token_id = node_token_map.find(next_node_id);
+      if (token_id >= 0)
       {
         // Update the existing token
-        int token_id = (*node_token).second;
         assert( active_tokens[token_id].node_id == next_node_id );
         if (m_segmentation_mode == MODE_VITERBI)
         {
@@ -1059,15 +1061,14 @@ HmmNetBaumWelch::backward_propagate_epsilon_arcs(
         else
         {
           active_tokens[token_id].score =
-            loglikelihoods.plus(active_tokens[token_id].score,
+            log_plus(active_tokens[token_id].score,
                                 backward_score);
         }
       }
       else
       {
         // Create a new token
-        node_token_map.insert(
-          NodeTokenMap::value_type(next_node_id, active_tokens.size()));
+        node_token_map.insert(next_node_id, active_tokens.size());
         active_tokens.push_back(BackwardToken(next_node_id, backward_score));
       }
     }
@@ -1083,6 +1084,8 @@ HmmNetBaumWelch::create_segmented_lattice(void)
     if (!fill_backward_probabilities())
       return NULL;
   }
+  if (m_fast_scoring)
+    prepare_fast_scoring();
   
   SegmentedLattice *sl = new SegmentedLattice;
   sl->frame_lattice = true;
@@ -1096,6 +1099,8 @@ HmmNetBaumWelch::create_segmented_lattice(void)
   // propagating the tokens.
   vector< ForwardToken> active_tokens[2];
   NodeTokenMap node_token_map[2];
+  node_token_map[0].resize(m_nodes.size());
+  node_token_map[1].resize(m_nodes.size());
 
   // One pending arc represents a traversal through a non-epsilon arc
   // from a certain source node. One pending arc may get connected to
@@ -1112,9 +1117,8 @@ HmmNetBaumWelch::create_segmented_lattice(void)
   sl->nodes.push_back(SegmentedNode(cur_frame));
   active_tokens[tbuf].push_back(ForwardToken(m_initial_node_id,
                                              loglikelihoods.one()));
-  node_token_map[tbuf].insert(
-    NodeTokenMap::value_type(m_initial_node_id,
-                             active_tokens[tbuf].size()-1));
+  node_token_map[tbuf].insert(m_initial_node_id,
+                              active_tokens[tbuf].size()-1);
   // Initial segmented node
   active_tokens[tbuf].back().source_seg_node = 0;
   
@@ -1164,7 +1168,7 @@ HmmNetBaumWelch::create_segmented_lattice(void)
         if (arc_total_score < m_total_score - m_forward_beam)
           continue;
 
-        double arc_score = get_arc_score(arc_id, get_feature(cur_frame));
+        double arc_score = get_frame_arc_score(arc_id, cur_frame);
         double forward_score = loglikelihoods.times(
           active_tokens[sbuf][i].score, arc_score);
         assert( forward_score > loglikelihoods.zero() );
@@ -1191,26 +1195,24 @@ HmmNetBaumWelch::create_segmented_lattice(void)
 
         // Find out whether the next network node has already been
         // activated during this frame.
-        NodeTokenMap::iterator node_token =
-          node_token_map[sbuf].find(next_node_id);
+        int node_token = node_token_map[sbuf].find(next_node_id);
         
-        if (node_token != node_token_map[sbuf].end())
+        if (node_token >= 0)
         {
           // Update the existing token
-          assert( active_tokens[sbuf][(*node_token).second].node_id
+          assert( active_tokens[sbuf][node_token].node_id
                   == next_node_id );
-          new_token_index = (*node_token).second;
+          new_token_index = node_token;
           active_tokens[sbuf][new_token_index].score =
-            loglikelihoods.plus(active_tokens[sbuf][new_token_index].score,
+            log_plus(active_tokens[sbuf][new_token_index].score,
                                 forward_score);
         }
         else // Create a new token
         {
           active_tokens[sbuf].push_back(
             ForwardToken(next_node_id, forward_score));
-          node_token_map[sbuf].insert(
-            NodeTokenMap::value_type(next_node_id,
-                                     (int)active_tokens[sbuf].size()-1));
+          node_token_map[sbuf].insert(next_node_id,
+                                      (int)active_tokens[sbuf].size()-1);
           new_token_index = active_tokens[sbuf].size() - 1;
           // source_seg_node is needed for the initial segmented node!
           active_tokens[sbuf][new_token_index].source_seg_node =
@@ -1275,7 +1277,7 @@ HmmNetBaumWelch::create_segmented_lattice(void)
         // Although not really required for MODE_VITERBI, put the updated
         // token to appropriate location in the map
         node_token_map[sbuf].clear();
-        node_token_map[sbuf].insert(NodeTokenMap::value_type(next_node_id, i));
+        node_token_map[sbuf].insert(next_node_id, i);
         // Only one token in MODE_VITERBI, but reiterate in case there
         // are several epsilon arcs in sequence.
         i--;
@@ -1355,7 +1357,7 @@ HmmNetBaumWelch::create_segmented_lattice(void)
 
         }
 
-        double arc_score = get_arc_score(arc_id, get_feature(cur_frame));
+        double arc_score = get_frame_arc_score(arc_id, cur_frame);
         double arc_acoustic_score = arc_score;
         if (m_use_static_scores)
            arc_acoustic_score -= m_arcs[arc_id].static_score;
@@ -1407,7 +1409,7 @@ HmmNetBaumWelch::create_segmented_lattice(void)
     if (total_score <= loglikelihoods.zero())
       total_score = active_tokens[tbuf][i].score;
     else
-      total_score = loglikelihoods.plus(total_score,
+      total_score = log_plus(total_score,
                                         active_tokens[tbuf][i].score);
   }
   if (num_end_arcs == 0)
@@ -1425,22 +1427,20 @@ HmmNetBaumWelch::create_or_update_token(
   int node_id, double forward_score)
 {
   // Find out whether the next network node has an active token
-  NodeTokenMap::iterator node_token = node_token_map.find(node_id);
-  int token_index = -1;
-  if (node_token != node_token_map.end())
+  int token_index = node_token_map.find(node_id);
+  if (token_index >= 0)
   {
     // Update the existing tokens
-    token_index = (*node_token).second;
     assert( token_vector[token_index].node_id == node_id );
     token_vector[token_index].score =
-      loglikelihoods.plus(token_vector[token_index].score, forward_score);
+      log_plus(token_vector[token_index].score, forward_score);
   }
   else
   {
     // Create a new token
     token_index = token_vector.size();
     token_vector.push_back(ForwardToken(node_id, forward_score));
-    node_token_map.insert(NodeTokenMap::value_type(node_id, token_index));
+    node_token_map.insert(node_id, token_index);
   }
   return token_vector[token_index];
 }
@@ -1942,6 +1942,56 @@ HmmNetBaumWelch::get_arc_score(int arc_id, const FeatureVec &fea_vec)
 }
 
 
+void
+HmmNetBaumWelch::prepare_fast_scoring(void)
+{
+  m_pdf_log_likelihoods.resize(m_model.num_emission_pdfs());
+  m_pdf_log_likelihood_frames.assign(m_model.num_emission_pdfs(), -1);
+  m_arc_pdfs.resize(m_arcs.size());
+  m_arc_log_transitions.resize(m_arcs.size());
+  for (int i = 0; i < (int)m_arcs.size(); i++)
+  {
+    m_arc_pdfs[i] = -1;
+    m_arc_log_transitions[i] = 0;
+    if (m_arcs[i].epsilon())
+      continue;
+    HmmTransition &tr = m_model.transition(m_arcs[i].transition_index);
+    m_arc_pdfs[i] = m_model.state(tr.source_index).emission_pdf;
+    if (m_use_transition_probabilities)
+      m_arc_log_transitions[i] = (tr.prob > 0 ? log(tr.prob) : -HUGE_VAL);
+  }
+}
+
+
+double
+HmmNetBaumWelch::get_fast_arc_score(int arc_id, int frame)
+{
+  static const double log_tiny = log(util::tiny_for_log);
+  double score = loglikelihoods.one();
+  
+  if (m_use_static_scores)
+    score = m_arcs[arc_id].static_score;
+
+  int pdf = m_arc_pdfs[arc_id];
+  if (pdf < 0)
+    return score;
+
+  // The PDF likelihoods are computed once per frame, regardless of the
+  // number of arcs and transitions sharing the PDF
+  if (m_pdf_log_likelihood_frames[pdf] != frame)
+  {
+    m_pdf_log_likelihoods[pdf] =
+      log(m_model.pdf_likelihood(pdf, get_feature(frame)));
+    m_pdf_log_likelihood_frames[pdf] = frame;
+  }
+  double log_likelihood =
+    m_pdf_log_likelihoods[pdf] + m_arc_log_transitions[arc_id];
+  if (log_likelihood <= log_tiny)
+    return loglikelihoods.zero();
+  return loglikelihoods.times(score, m_acoustic_scale*log_likelihood);
+}
+
+
 
 
 struct ESLPendingArc {
@@ -2283,8 +2333,8 @@ HmmNetBaumWelch::clear_bw_scores(void)
 void
 HmmNetBaumWelch::FrameScores::set_score(int frame, double score)
 {
-  if (!frame_blocks.empty() && frame_blocks.back().start == frame)
-    score_table[num_scores-1] = score;
+  if (!scores.empty() && frame == last_frame - (int)scores.size() + 1)
+    scores.back() = score;
   else
     set_new_score(frame, score);
 }
@@ -2292,59 +2342,21 @@ HmmNetBaumWelch::FrameScores::set_score(int frame, double score)
 void
 HmmNetBaumWelch::FrameScores::set_new_score(int frame, double score)
 {
-  if (num_scores == score_table_size)
-  {
-    // Increase the size of the score table
-    int new_size = max(score_table_size*2, score_table_size+4);
-    double *new_table = new double[new_size];
-    if (score_table_size > 0)
-    {
-      memcpy(new_table, score_table, score_table_size*sizeof(double));
-      delete [] score_table;
-    }
-    score_table = new_table;
-    score_table_size = new_size;
-  }
-  if (!frame_blocks.empty() && frame_blocks.back().start == frame+1)
-  {
-    // Add to previous block
-    frame_blocks.back().start--;
-    score_table[num_scores++] = score;
-  }
-  else
-  {
-    // Create a new block
-    FrameBlock b(frame, frame, num_scores);
-    frame_blocks.push_back(b);
-    score_table[num_scores++] = score;
-  }
-}
-
-double
-HmmNetBaumWelch::FrameScores::get_score(int frame)
-{
-  for (int i = 0; i < (int)frame_blocks.size() && frame <= frame_blocks[i].end;
-       i++)
-  {
-    if (frame >= frame_blocks[i].start && frame <= frame_blocks[i].end)
-    {
-      // Found the block
-      return score_table[frame_blocks[i].buf_start +
-                         frame_blocks[i].end-frame];
-    }
-  }
-  // There is no score for this frame
-  return HmmNetBaumWelch::loglikelihoods.zero();
+  if (scores.empty())
+    last_frame = frame;
+  int i = last_frame - frame;
+  if (i < (int)scores.size())
+    return; // Keep the score that was set first
+  // Frames without a score in between get the zero score
+  scores.resize(i, HmmNetBaumWelch::loglikelihoods.zero());
+  scores.push_back(score);
 }
 
 void
 HmmNetBaumWelch::FrameScores::clear(void)
 {
-  if (score_table_size > 0)
-    delete [] score_table;
-  score_table_size = 0;
-  num_scores = 0;
-  frame_blocks.clear();
+  std::vector<double>().swap(scores);
+  last_frame = -1;
 }
 
 }
@@ -120,29 +120,27 @@ public:
   };
 
 
-  /// Class for storing backward phase scores
+  /** Class for storing backward phase scores. The scores are kept in a
+   * dense array from the last frame set down to the first one, as the
+   * backward phase sets them in decreasing frame order.
+   */
   class FrameScores {
   public:
     void set_score(int frame, double score);
     void set_new_score(int frame, double score);
-    double get_score(int frame);
+    double get_score(int frame) const
+    {
+      int i = last_frame - frame;
+      if (i < 0 || i >= (int)scores.size())
+        return HmmNetBaumWelch::loglikelihoods.zero();
+      return scores[i];
+    }
     void clear(void); //!< Frees the allocated memory
-    FrameScores() : score_table(NULL), num_scores(0), score_table_size(0) { }
-    
+    FrameScores() : last_frame(-1) { }
+
   private:
-    struct FrameBlock {
-      int start;
-      int end;
-
-      /// Start index to log_prob_table. Probabilities are in reverse order.
-      int buf_start;
-      
-      FrameBlock(int s, int e, int b) : start(s), end(e), buf_start(b) { }
-    };
-    std::vector<FrameBlock> frame_blocks; //!< Blocks are in reverse order
-    double *score_table;
-    int num_scores;
-    int score_table_size;
+    int last_frame;
+    std::vector<double> scores; //!< Scores in reverse frame order
   };
 
 
@@ -429,7 +427,28 @@ private:
     ForwardToken(int net_node_, double score_) : node_id(net_node_), score(score_) { source_seg_node = -1; }
   };
 
-  typedef std::map< int, int > NodeTokenMap;
+  /** Dense map from network node ids to token indices */
+  class NodeTokenMap {
+  public:
+    void resize(int num_nodes) { token_index.assign(num_nodes, -1); }
+    /// Returns the token index of the node, or -1
+    int find(int node_id) const { return token_index[node_id]; }
+    void insert(int node_id, int index)
+    {
+      if (token_index[node_id] < 0)
+        nodes.push_back(node_id);
+      token_index[node_id] = index;
+    }
+    void clear(void)
+    {
+      for (int i = 0; i < (int)nodes.size(); i++)
+        token_index[nodes[i]] = -1;
+      nodes.clear();
+    }
+  private:
+    std::vector<int> token_index;
+    std::vector<int> nodes; //!< Nodes with a token
+  };
 
   // Internal type for storing log scores and custom path scores
   struct ScorePair {
@@ -480,6 +499,13 @@ public:
   /// Set the use of transition_probabilities
   void set_use_transition_probabilities(bool use) { m_use_transition_probabilities = use; }
 
+  /** Set the fast scoring mode for the forward and backward passes.
+   * The log sums use \ref util::fast_logadd() and the acoustic scores
+   * are computed from logarithms of the PDF likelihoods cached for each
+   * frame. The scores differ from the exact ones by less than 1e-5.
+   */
+  void set_fast_scoring(bool fast) { m_fast_scoring = fast; }
+
   /** Runs forward-backward algorithm and creates a segmented lattice
       representation. Note that due to pruning, the arc total scores
       may not be exact before calling
@@ -557,6 +583,25 @@ private:
   /** Returns the arc score */
   double get_arc_score(int arc_id, const FeatureVec &fea_vec);
 
+  /** Returns the arc score for the current frame of the forward and
+   * backward passes, see \ref set_fast_scoring() */
+  double get_frame_arc_score(int arc_id, int frame)
+  {
+    if (!m_fast_scoring)
+      return get_arc_score(arc_id, get_feature(frame));
+    return get_fast_arc_score(arc_id, frame);
+  }
+  double get_fast_arc_score(int arc_id, int frame);
+
+  /** Precomputes the frame independent parts of the fast arc scores */
+  void prepare_fast_scoring(void);
+
+  /// Log sum in the forward and backward passes
+  double log_plus(double a, double b)
+  {
+    return m_fast_scoring ? util::fast_logadd(a, b) : util::logadd(a, b);
+  }
+
   /** Either creates or updates a token (if a token already exists) */
   ForwardToken& create_or_update_token(
     std::vector< ForwardToken > &token_vector, NodeTokenMap &node_token_map,
@@ -616,6 +661,18 @@ private:
   /// Scaling value for acoustic log likelihoods
   double m_acoustic_scale;
 
+  /// Use the approximate scores, see \ref set_fast_scoring()
+  bool m_fast_scoring;
+
+  /// For fast scoring: the log PDF likelihoods and the frames they are for
+  std::vector<double> m_pdf_log_likelihoods;
+  std::vector<int> m_pdf_log_likelihood_frames;
+
+  /// For fast scoring: the emission PDF and log transition probability
+  /// of each arc
+  std::vector<int> m_arc_pdfs;
+  std::vector<double> m_arc_log_transitions;
+
   /** Maximum score or sum of path scores, depending on the segmentation mode.
    * Computed in the backward phase.
    */
@@ -3,11 +3,14 @@
 #include <fstream>
 #include <math.h>
 #include <algorithm>
+#include <cstring>
 
 #include "HmmSet.hh"
 #include "FeatureModules.hh"
 #include "util.hh"
 #include "str.hh"
+#include "StatisticsFile.hh"
+#include "Parallel.hh"
 
 
 
@@ -43,6 +46,7 @@ Hmm::get_center_phone()
 HmmSet::HmmSet()
 {
   m_statistics_mode = 0;
+  m_pool_batch_valid = false;
 }
 
 HmmSet::~HmmSet()
@@ -60,6 +64,8 @@ HmmSet::HmmSet(const HmmSet &hmm_set)
 HmmSet::HmmSet(int dimension)
 {
   m_pool.set_dim(dimension);
+  m_statistics_mode = 0;
+  m_pool_batch_valid = false;
 }
 
 
@@ -77,6 +83,7 @@ HmmSet::copy(const HmmSet &hmm_set)
   m_valid_pdf_likelihoods.clear();
   m_hmms = hmm_set.m_hmms;
   m_statistics_mode = hmm_set.m_statistics_mode;
+  m_pool_batch_valid = false;
 }
 
 
@@ -501,6 +508,80 @@ HmmSet::precompute_likelihoods(const FeatureVec &f)
 }
 
 
+void
+HmmSet::precompute_likelihoods(const Matrix &features)
+{
+  reset_cache();
+  if (m_pdf_likelihood_batch.rows() != features.rows() ||
+      m_pdf_likelihood_batch.cols() != num_emission_pdfs())
+    m_pdf_likelihood_batch.resize(features.rows(), num_emission_pdfs());
+
+  if (!m_reset_cache_objects.empty()) {
+    // Model transformations cache the transformed feature vector, so the
+    // frames must be computed one at a time
+    Vector f(dim());
+    for (int t = 0; t < features.rows(); t++) {
+      for (int i = 0; i < dim(); i++)
+        f(i) = features(t, i);
+      precompute_likelihoods(FeatureVec(&f, dim()));
+      for (int i = 0; i < num_emission_pdfs(); i++)
+        m_pdf_likelihood_batch(t, i) = m_pdf_likelihoods[i];
+    }
+    reset_cache();
+    m_pool_batch_valid = false;
+    return;
+  }
+
+  m_pool.precompute_likelihoods(features);
+  compute_pdf_likelihoods(m_pool.batch_likelihoods(), m_pdf_likelihood_batch);
+  m_pool_batch_valid = true;
+}
+
+
+void
+HmmSet::set_batch_frame(int frame)
+{
+  assert(frame >= 0 && frame < m_pdf_likelihood_batch.rows());
+  reset_cache();
+  if (m_pool_batch_valid)
+    m_pool.set_batch_frame(frame);
+  for (int i = 0; i < num_emission_pdfs(); i++) {
+    m_pdf_likelihoods[i] = m_pdf_likelihood_batch(frame, i);
+    m_valid_pdf_likelihoods.push_back(i);
+  }
+}
+
+
+void
+HmmSet::compute_likelihoods(const Matrix &features, Matrix &pool_likelihoods,
+                            Matrix &pdf_likelihoods,
+                            PDFPool::LikelihoodBuffers &buffers) const
+{
+  if (!m_reset_cache_objects.empty())
+    throw std::string("HmmSet::compute_likelihoods(): model transformations are not supported");
+  m_pool.compute_likelihoods(features, pool_likelihoods, buffers);
+  compute_pdf_likelihoods(pool_likelihoods, pdf_likelihoods);
+}
+
+
+void
+HmmSet::compute_pdf_likelihoods(const Matrix &pool_likelihoods,
+                                Matrix &pdf_likelihoods) const
+{
+  if (pdf_likelihoods.rows() != pool_likelihoods.rows() ||
+      pdf_likelihoods.cols() != num_emission_pdfs())
+    pdf_likelihoods.resize(pool_likelihoods.rows(), num_emission_pdfs());
+  for (int t = 0; t < pool_likelihoods.rows(); t++) {
+    for (int i = 0; i < num_emission_pdfs(); i++) {
+      double likelihood = m_emission_pdfs[i]->compute_block_likelihood(pool_likelihoods, t);
+      if (likelihood < util::tiny_for_log)
+        likelihood = util::tiny_for_log;
+      pdf_likelihoods(t, i) = likelihood;
+    }
+  }
+}
+
+
 void
 HmmSet::start_accumulating(PDF::StatisticsMode mode)
 {
@@ -548,6 +629,9 @@ HmmSet::dump_statistics(const std::string base) const
   dump_ph_statistics(base+".phs");
   dump_mc_statistics(base+".mcs");
   dump_gk_statistics(base+".gks");
+
+  // An old indexed dump would be read instead of these.
+  remove((base+".sts").c_str());
 }
 
 
@@ -628,6 +712,87 @@ HmmSet::dump_gk_statistics(const std::string filename) const
 }
 
 
+void
+HmmSet::dump_indexed_statistics(const std::string filename) const
+{
+  StatisticsFile::Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, StatisticsFile::magic, sizeof(header.magic));
+  header.byte_order = StatisticsFile::byte_order;
+  header.mode = m_statistics_mode;
+  header.dim = m_pool.dim();
+  header.num_gaussians = m_pool.size();
+  header.num_mixtures = num_emission_pdfs();
+  header.num_transitions = m_transition_accum.size();
+
+  // The PDFs without statistics take no space.
+  std::vector<int64_t> gaussian_index(header.num_gaussians + 1, 0);
+  for (int g = 0; g < header.num_gaussians; g++) {
+    int size = m_pool.get_pdf(g)->packed_statistics_size();
+    gaussian_index[g+1] = gaussian_index[g] + (size > 1 ? size : 0);
+  }
+  std::vector<int64_t> mixture_index(header.num_mixtures + 1, 0);
+  mixture_index[0] = gaussian_index.back();
+  for (int m = 0; m < header.num_mixtures; m++) {
+    int size = m_emission_pdfs[m]->packed_statistics_size();
+    mixture_index[m+1] = mixture_index[m] + (size > 1 ? size : 0);
+  }
+  std::vector<double> transitions(2 * header.num_transitions);
+  for (int t = 0; t < header.num_transitions; t++) {
+    transitions[2*t] = m_accumulated[t] ? 1 : 0;
+    transitions[2*t+1] = m_transition_accum[t].prob;
+  }
+
+  header.gaussian_index_offset = sizeof(header);
+  header.mixture_index_offset = header.gaussian_index_offset +
+    gaussian_index.size() * sizeof(int64_t);
+  header.transition_offset = header.mixture_index_offset +
+    mixture_index.size() * sizeof(int64_t);
+  header.data_offset = header.transition_offset +
+    transitions.size() * sizeof(double);
+  header.file_size = header.data_offset +
+    mixture_index.back() * sizeof(double);
+
+  FILE *file = fopen(filename.c_str(), "wb");
+  if (file == NULL) {
+    fprintf(stderr, "HmmSet::dump_indexed_statistics(): could not open %s\n", filename.c_str());
+    throw OpenError();
+  }
+  bool ok = (fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(&gaussian_index[0], sizeof(int64_t),
+                    gaussian_index.size(), file) == gaussian_index.size() &&
+             fwrite(&mixture_index[0], sizeof(int64_t),
+                    mixture_index.size(), file) == mixture_index.size() &&
+             (transitions.empty() ||
+              fwrite(&transitions[0], sizeof(double),
+                     transitions.size(), file) == transitions.size()));
+
+  std::vector<double> buffer;
+  for (int i = 0; ok && i < header.num_gaussians + header.num_mixtures; i++)
+  {
+    const PDF *pdf;
+    size_t size;
+    if (i < header.num_gaussians) {
+      pdf = m_pool.get_pdf(i);
+      size = gaussian_index[i+1] - gaussian_index[i];
+    }
+    else {
+      pdf = m_emission_pdfs[i - header.num_gaussians];
+      size = mixture_index[i - header.num_gaussians + 1] -
+        mixture_index[i - header.num_gaussians];
+    }
+    if (size == 0)
+      continue;
+    buffer.resize(size);
+    pdf->pack_statistics(&buffer[0]);
+    ok = (fwrite(&buffer[0], sizeof(double), size, file) == size);
+  }
+
+  if (fclose(file) != 0 || !ok)
+    throw WriteError();
+}
+
+
 void
 HmmSet::prepare_smoothing_gamma(int source, int target)
 {
@@ -645,12 +810,122 @@ HmmSet::prepare_smoothing_gamma(int source, int target)
 void
 HmmSet::accumulate_from_dump(const std::string base)
 {
+  if (StatisticsFile::is_statistics_file(base+".sts")) {
+    StatisticsFile file(base+".sts");
+    accumulate_from(file);
+    return;
+  }
   accumulate_ph_from_dump(base+".phs");
   accumulate_mc_from_dump(base+".mcs");
   accumulate_gk_from_dump(base+".gks");
 }
 
 
+void
+HmmSet::accumulate_from(const HmmSet &other)
+{
+  if (other.num_emission_pdfs() != num_emission_pdfs() ||
+      other.m_pool.size() != m_pool.size() ||
+      other.m_transition_accum.size() > m_transition_accum.size())
+    throw std::string("HmmSet::accumulate_from: the models differ");
+
+  for (unsigned int t=0; t<other.m_transition_accum.size(); t++) {
+    if (other.m_accumulated[t])
+      accumulate_transition(t, other.m_transition_accum[t].prob);
+  }
+
+  for (int i = 0; i < num_emission_pdfs(); i++)
+    m_emission_pdfs[i]->accumulate_from(*other.m_emission_pdfs[i]);
+
+  for (int g = 0; g < m_pool.size(); g++)
+    m_pool.get_pdf(g)->accumulate_from(*other.m_pool.get_pdf(g));
+}
+
+
+void
+HmmSet::accumulate_from(const StatisticsFile &file)
+{
+  prepare_accumulating_from(file);
+  accumulate_ph_from(file);
+  accumulate_mc_from(file, 0, num_emission_pdfs());
+  accumulate_gk_from(file, 0, m_pool.size());
+}
+
+
+void
+HmmSet::prepare_accumulating_from(const StatisticsFile &file)
+{
+  const StatisticsFile::Header &header = file.header();
+  if (header.num_gaussians != m_pool.size() ||
+      header.num_mixtures != num_emission_pdfs())
+    throw str::fmt(512, "HmmSet::prepare_accumulating_from: the number of PDFs in: %s is wrong\n", file.filename().c_str());
+  if (header.dim != m_pool.dim())
+    throw str::fmt(512, "HmmSet::prepare_accumulating_from: the dimensionality of mixture base distributions in: %s is wrong\n", file.filename().c_str());
+
+  // The packed statistics of the PDFs depend on the mode, so statistics
+  // of different modes cannot be summed.
+  if (header.mode <= 0 || header.mode > (PDF_ML_STATS | PDF_ML_FULL_STATS |
+                                         PDF_MMI_STATS | PDF_MPE_NUM_STATS |
+                                         PDF_MPE_DEN_STATS))
+    throw str::fmt(512, "HmmSet::prepare_accumulating_from: invalid statistics mode in %s\n", file.filename().c_str());
+  if (m_statistics_mode == 0)
+    m_statistics_mode = header.mode;
+  else if (header.mode != m_statistics_mode)
+    throw str::fmt(512, "HmmSet::prepare_accumulating_from: the statistics mode %i in: %s doesn't match the earlier accumulations (%i)\n", header.mode, file.filename().c_str(), m_statistics_mode);
+
+  if (header.num_transitions > 0) {
+    if (m_transition_accum.size() == 0)
+      init_transition_accumulators();
+    if ((int)m_transition_accum.size() != header.num_transitions)
+      throw str::fmt(512, "HmmSet::prepare_accumulating_from: the number of transitions in: %s doesn't match the earlier accumulations\n", file.filename().c_str());
+  }
+
+  // Start the accumulators here, as the mixtures start the accumulators of
+  // their base distributions.
+  for (int i = 0; i < num_emission_pdfs(); i++)
+    if (!m_emission_pdfs[i]->is_accumulating())
+      m_emission_pdfs[i]->start_accumulating(m_statistics_mode);
+  for (int g = 0; g < m_pool.size(); g++)
+    if (!m_pool.get_pdf(g)->is_accumulating())
+      m_pool.get_pdf(g)->start_accumulating(m_statistics_mode);
+}
+
+
+void
+HmmSet::accumulate_gk_from(const StatisticsFile &file, int first, int last)
+{
+  int size;
+  for (int g = first; g < last; g++) {
+    const double *data = file.gaussian(g, size);
+    if (data != NULL)
+      m_pool.get_pdf(g)->accumulate_packed(data, size, m_statistics_mode);
+  }
+}
+
+
+void
+HmmSet::accumulate_mc_from(const StatisticsFile &file, int first, int last)
+{
+  int size;
+  for (int m = first; m < last; m++) {
+    const double *data = file.mixture(m, size);
+    if (data != NULL)
+      m_emission_pdfs[m]->accumulate_packed(data, size, m_statistics_mode);
+  }
+}
+
+
+void
+HmmSet::accumulate_ph_from(const StatisticsFile &file)
+{
+  const double *transitions = file.transitions();
+  for (int t = 0; t < file.header().num_transitions; t++) {
+    if (transitions[2*t] != 0)
+      accumulate_transition(t, transitions[2*t+1]);
+  }
+}
+
+
 void
 HmmSet::accumulate_ph_from_dump(const std::string filename)
 {
@@ -816,23 +1091,40 @@ HmmSet::estimate_transition_parameters()
 
 
 void
-HmmSet::estimate_parameters(PDF::EstimationMode mode, bool pool, bool mixture)
+HmmSet::estimate_parameters(PDF::EstimationMode mode, bool pool, bool mixture,
+                            int num_threads)
 {
   if (pool)
-    m_pool.estimate_parameters(mode);
+    m_pool.estimate_parameters(mode, num_threads);
 
-  if (mixture) {  
+  if (mixture) {
+    // Group the states by the emission pdf, so that a pdf shared by
+    // several states is estimated in one thread as many times as before.
+    std::vector<int> pdf_job(num_emission_pdfs(), -1);
+    std::vector< std::vector<int> > job_states;
     for (int s = 0; s < num_states(); s++) {
       if (m_state_update[s])
       {
-        try {
-          m_emission_pdfs[state(s).emission_pdf]->estimate_parameters(mode);
-        } catch (std::string errstr) {
-          std::cout << "Warning: emission pdf for state " << s
-                    << ": " <<  errstr << std::endl;
+        int &job = pdf_job[state(s).emission_pdf];
+        if (job < 0) {
+          job = (int)job_states.size();
+          job_states.push_back(std::vector<int>());
         }
+        job_states[job].push_back(s);
       }
     }
+
+    run_parallel((int)job_states.size(), num_threads, [&](int job, int) {
+        for (int i = 0; i < (int)job_states[job].size(); i++) {
+          int s = job_states[job][i];
+          try {
+            m_emission_pdfs[state(s).emission_pdf]->estimate_parameters(mode);
+          } catch (std::string errstr) {
+            std::cout << "Warning: emission pdf for state " << s
+                      << ": " <<  errstr << std::endl;
+          }
+        }
+      });
   }
 }
 
@@ -1029,6 +1321,7 @@ HmmSet::estimate_mllt(FeatureGenerator &fea_gen, const std::string &mllt_name)
               m_pool.get_covsmooth());
     gaussian->set_covariance(new_covariance);
   }
+  m_pool.invalidate_packed_gaussians();
   
   // Set transformation
   Blas_Mat_Mat_Mult(A, Aold, temp_m, 1.0, 0.0);
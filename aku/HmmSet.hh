@@ -16,6 +16,8 @@
 
 namespace aku {
 
+class StatisticsFile;
+
 //
 // HmmState
 //
@@ -182,7 +184,7 @@ public:
    * \param state state index
    * \return the emission pdf index of the state
    */
-  inline int emission_pdf_index(int state);
+  inline int emission_pdf_index(int state) const;
   
   /** Adds a new transition to the HmmSet
    * \param source index of the source state
@@ -320,6 +322,37 @@ public:
    */
   void precompute_likelihoods(const FeatureVec &f);
 
+  /** Compute all PDF likelihoods for a block of frames. The results are
+   * kept in a frames x PDFs cache, see \ref set_batch_frame() and
+   * \ref PDFPool::precompute_likelihoods(const Matrix&)
+   * \param features the features, one frame per row
+   */
+  void precompute_likelihoods(const Matrix &features);
+
+  /** Loads the likelihoods of one frame of the block given to
+   * \ref precompute_likelihoods(const Matrix&) to the likelihood cache.
+   * \param frame the row index in the block
+   */
+  void set_batch_frame(int frame);
+
+  /** Prepares the model for \ref compute_likelihoods(). Must be called
+   * after the model has been modified and before it is shared between
+   * threads.
+   */
+  void prepare_likelihoods() { m_pool.prepare_likelihoods(); }
+
+  /** Computes the PDF likelihoods for a block of frames without using the
+   * caches of the HmmSet. The model is only read, so several threads can
+   * share one HmmSet. Model transformations are not supported.
+   * \param features the features, one frame per row
+   * \param pool_likelihoods work space for the base distribution likelihoods
+   * \param pdf_likelihoods the result, frames x emission PDFs
+   * \param buffers work space of the pool, one for each thread
+   */
+  void compute_likelihoods(const Matrix &features, Matrix &pool_likelihoods,
+                           Matrix &pdf_likelihoods,
+                           PDFPool::LikelihoodBuffers &buffers) const;
+
   /** Prepares the HmmSet for parameter training. 
    * Should be called before \ref accumulate()
    */
@@ -367,8 +400,15 @@ public:
    */
   void dump_gk_statistics(const std::string filename) const;
 
+  /** Dumps all the accumulated statistics to one file in the indexed
+   * binary format, see StatisticsFile. Keeps the full precision.
+   * \param filename name of the dump file, preferably base+".sts"
+   */
+  void dump_indexed_statistics(const std::string filename) const;
+
   /** Accumulates the statistics from a dump file
-   * \param base basename for the temporary files (base+gks/phs/mcs)
+   * \param base basename for the temporary files (base+gks/phs/mcs), or
+   * base+sts if it exists
    */
   void accumulate_from_dump(const std::string base);
 
@@ -387,6 +427,35 @@ public:
    */
   void accumulate_gk_from_dump(const std::string filename);
 
+  /** Adds the statistics accumulated in another HmmSet with the same
+   * model structure, e.g. by another thread.  Unlike the dumps, keeps
+   * the full precision of the statistics.
+   * \param other a model that has been read from the same files
+   */
+  void accumulate_from(const HmmSet &other);
+
+  /** Accumulates all the statistics of an indexed statistics file */
+  void accumulate_from(const StatisticsFile &file);
+
+  /** Checks that an indexed statistics file matches the model and the
+   * statistics mode of the earlier accumulations, and prepares the
+   * accumulators for it.  Must be called before the range
+   * functions below, which may then be called from several threads for
+   * disjoint ranges.
+   */
+  void prepare_accumulating_from(const StatisticsFile &file);
+
+  /** Accumulates the Gaussians first ... last-1 of the pool from an
+   * indexed statistics file */
+  void accumulate_gk_from(const StatisticsFile &file, int first, int last);
+
+  /** Accumulates the emission PDFs first ... last-1 from an indexed
+   * statistics file */
+  void accumulate_mc_from(const StatisticsFile &file, int first, int last);
+
+  /** Accumulates the transitions from an indexed statistics file */
+  void accumulate_ph_from(const StatisticsFile &file);
+
   /** Stops parameter training.
    */
   void stop_accumulating();
@@ -395,9 +464,11 @@ public:
    * \param mode estimation mode
    * \param pool estimate pool parameters
    * \param mixture estimate mixture parameters
+   * \param num_threads number of threads dividing the PDFs, does not
+   *   affect the result
    */
   void estimate_parameters(PDF::EstimationMode mode, bool pool=true,
-                           bool mixture=true);
+                           bool mixture=true, int num_threads=1);
 
   /** Estimates/updates the MLLT transform and Gaussian parameters
    * according to the current accumulators
@@ -505,6 +576,13 @@ private:
    */
   int get_state_with_pdf(int pdf_index);
 
+  /** Computes the mixture likelihoods from base distribution likelihoods
+   * \param pool_likelihoods base distribution likelihoods, frames x pool PDFs
+   * \param pdf_likelihoods the result, frames x emission PDFs
+   */
+  void compute_pdf_likelihoods(const Matrix &pool_likelihoods,
+                               Matrix &pdf_likelihoods) const;
+
 public:
   
   // Exceptions
@@ -552,6 +630,12 @@ private:
   /// List of the PDFs with valid likelihoods in the cache
   std::vector<int> m_valid_pdf_likelihoods;
 
+  /// PDF likelihoods for a block of frames, frames x PDFs
+  Matrix m_pdf_likelihood_batch;
+
+  /// Does the pool hold the likelihoods of the same block
+  bool m_pool_batch_valid;
+
   std::vector<Hmm> m_hmms;
 
   /// For accumulating transition probabilities
@@ -642,7 +726,7 @@ HmmSet::state(int state)
 
 
 int
-HmmSet::emission_pdf_index(int state)
+HmmSet::emission_pdf_index(int state) const
 {
   return m_states[state].emission_pdf;
 }
@@ -0,0 +1,200 @@
+#include <cassert>
+#include <stdint.h>
+
+#include "PackedGaussians.hh"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PACKED_GAUSSIANS_X86
+# include <immintrin.h>
+#endif
+
+
+namespace aku {
+
+namespace {
+
+// Computes sum_d (f_d - m_d)^2 p_d for each packed Gaussian. All the
+// arrays are aligned and padded to a multiple of ALIGNMENT floats.
+typedef void (*ScoreKernel)(const float *f, const float *means,
+                            const float *precisions, int stride,
+                            int num_gaussians, float *scores);
+
+
+void
+score_scalar(const float *f, const float *means, const float *precisions,
+             int stride, int num_gaussians, float *scores)
+{
+  for (int k = 0; k < num_gaussians; k++) {
+    const float *m = means + (long)k * stride;
+    const float *p = precisions + (long)k * stride;
+    float sum = 0;
+    for (int d = 0; d < stride; d++) {
+      float diff = f[d] - m[d];
+      sum += diff * diff * p[d];
+    }
+    scores[k] = sum;
+  }
+}
+
+
+#ifdef PACKED_GAUSSIANS_X86
+
+__attribute__((target("avx2,fma"))) void
+score_avx2(const float *f, const float *means, const float *precisions,
+           int stride, int num_gaussians, float *scores)
+{
+  for (int k = 0; k < num_gaussians; k++) {
+    const float *m = means + (long)k * stride;
+    const float *p = precisions + (long)k * stride;
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    for (int d = 0; d < stride; d += 16) {
+      __m256 diff0 = _mm256_sub_ps(_mm256_load_ps(f + d), _mm256_load_ps(m + d));
+      __m256 diff1 = _mm256_sub_ps(_mm256_load_ps(f + d + 8),
+                                   _mm256_load_ps(m + d + 8));
+      sum0 = _mm256_fmadd_ps(_mm256_mul_ps(diff0, diff0),
+                             _mm256_load_ps(p + d), sum0);
+      sum1 = _mm256_fmadd_ps(_mm256_mul_ps(diff1, diff1),
+                             _mm256_load_ps(p + d + 8), sum1);
+    }
+    sum0 = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0),
+                             _mm256_extractf128_ps(sum0, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    scores[k] = _mm_cvtss_f32(half);
+  }
+}
+
+
+__attribute__((target("avx512f"))) void
+score_avx512(const float *f, const float *means, const float *precisions,
+             int stride, int num_gaussians, float *scores)
+{
+  for (int k = 0; k < num_gaussians; k++) {
+    const float *m = means + (long)k * stride;
+    const float *p = precisions + (long)k * stride;
+    __m512 sum = _mm512_setzero_ps();
+    for (int d = 0; d < stride; d += 16) {
+      __m512 diff = _mm512_sub_ps(_mm512_load_ps(f + d), _mm512_load_ps(m + d));
+      sum = _mm512_fmadd_ps(_mm512_mul_ps(diff, diff),
+                            _mm512_load_ps(p + d), sum);
+    }
+    scores[k] = _mm512_reduce_add_ps(sum);
+  }
+}
+
+#endif
+
+
+struct Kernel {
+  ScoreKernel score;
+  const char *name;
+};
+
+
+Kernel
+detect_kernel()
+{
+  Kernel kernel;
+  kernel.score = score_scalar;
+  kernel.name = "scalar";
+#ifdef PACKED_GAUSSIANS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    kernel.score = score_avx512;
+    kernel.name = "avx512";
+  }
+  else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    kernel.score = score_avx2;
+    kernel.name = "avx2";
+  }
+#endif
+  return kernel;
+}
+
+
+const Kernel&
+selected_kernel()
+{
+  static const Kernel kernel = detect_kernel();
+  return kernel;
+}
+
+}
+
+
+PackedDiagonalGaussians::PackedDiagonalGaussians()
+{
+  resize(0, 0);
+}
+
+
+float*
+PackedDiagonalGaussians::aligned(const std::vector<float> &buffer)
+{
+  uintptr_t address = (uintptr_t)&buffer[0];
+  uintptr_t mask = ALIGNMENT * sizeof(float) - 1;
+  return (float*)((address + mask) & ~mask);
+}
+
+
+void
+PackedDiagonalGaussians::resize(int dim, int num_gaussians)
+{
+  m_dim = dim;
+  m_stride = (dim + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  if (m_stride == 0)
+    m_stride = ALIGNMENT;
+
+  // Zero padding makes the extra dimensions contribute nothing
+  long size = (long)num_gaussians * m_stride + ALIGNMENT;
+  m_means.assign(size, 0);
+  m_precisions.assign(size, 0);
+  m_constants.assign(num_gaussians, 0);
+}
+
+
+void
+PackedDiagonalGaussians::set_gaussian(int index, const double *mean,
+                                      const double *precision, double constant)
+{
+  assert(index >= 0 && index < size());
+  float *m = aligned(m_means) + (long)index * m_stride;
+  float *p = aligned(m_precisions) + (long)index * m_stride;
+  for (int d = 0; d < m_dim; d++) {
+    m[d] = mean[d];
+    p[d] = precision[d];
+  }
+  m_constants[index] = constant;
+}
+
+
+void
+PackedDiagonalGaussians::compute_log_likelihoods(const double *f,
+                                                 double *log_likelihoods) const
+{
+  if (m_constants.empty())
+    return;
+
+  std::vector<float> feature_buffer(m_stride + ALIGNMENT, 0);
+  float *feature = aligned(feature_buffer);
+  for (int d = 0; d < m_dim; d++)
+    feature[d] = f[d];
+
+  std::vector<float> scores(m_constants.size());
+  selected_kernel().score(feature, aligned(m_means), aligned(m_precisions),
+                          m_stride, size(), &scores[0]);
+
+  for (int k = 0; k < size(); k++)
+    log_likelihoods[k] = m_constants[k] - 0.5 * scores[k];
+}
+
+
+const char*
+PackedDiagonalGaussians::kernel_name()
+{
+  return selected_kernel().name;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef PACKEDGAUSSIANS_HH
+#define PACKEDGAUSSIANS_HH
+
+#include <vector>
+
+
+namespace aku {
+
+/** A packed, structure-of-arrays copy of diagonal covariance Gaussians
+ * for scoring a whole set of Gaussians against a feature vector in one
+ * pass.
+ *
+ * The means and precisions are stored as single precision floats in
+ * contiguous arrays, one row per Gaussian. The rows are padded with zeros
+ * to a multiple of \ref ALIGNMENT floats and aligned to a cache line, so
+ * that the SIMD kernels never need a scalar tail loop. The normalization
+ * constants are kept in double precision.
+ *
+ * The kernel is selected at run time: AVX-512 or AVX2/FMA on x86 CPUs
+ * supporting them, a portable scalar loop otherwise.
+ */
+class PackedDiagonalGaussians {
+public:
+
+  /// Number of floats the rows are padded and aligned to (one cache line)
+  enum { ALIGNMENT = 16 };
+
+  PackedDiagonalGaussians();
+
+  /** Allocate space for Gaussians. Invalidates the existing contents.
+   * \param dim Feature dimension
+   * \param num_gaussians Number of Gaussians to be packed
+   */
+  void resize(int dim, int num_gaussians);
+
+  /// Remove all Gaussians
+  void clear() { resize(0, 0); }
+
+  /// Feature dimension
+  int dim() const { return m_dim; }
+
+  /// Number of packed Gaussians
+  int size() const { return (int)m_constants.size(); }
+
+  /** Set the parameters of a packed Gaussian.
+   * \param index Position of the Gaussian in the packed arrays
+   * \param mean Mean vector of \ref dim() values
+   * \param precision Diagonal of the precision matrix
+   * \param constant Log normalization constant
+   */
+  void set_gaussian(int index, const double *mean, const double *precision,
+                    double constant);
+
+  /** Compute log likelihoods of all the packed Gaussians.
+   * \param f Feature vector of \ref dim() values
+   * \param log_likelihoods Output array of \ref size() values
+   */
+  void compute_log_likelihoods(const double *f, double *log_likelihoods) const;
+
+  /// Name of the kernel used on this CPU, for diagnostics
+  static const char *kernel_name();
+
+private:
+  /// Aligned start of the rows within a buffer
+  static float *aligned(const std::vector<float> &buffer);
+
+  int m_dim;
+  int m_stride; //!< Padded row length in floats
+
+  std::vector<float> m_means; //!< Storage for the mean rows
+  std::vector<float> m_precisions; //!< Storage for the precision rows
+  std::vector<double> m_constants;
+};
+
+}
+
+#endif /* PACKEDGAUSSIANS_HH */
@@ -0,0 +1,72 @@
+#ifndef PARALLEL_HH
+#define PARALLEL_HH
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace aku {
+
+/** Runs jobs 0 ... num_jobs-1 in a pool of worker threads.
+ *
+ * The jobs are handed out one at a time in increasing order to whichever
+ * thread is free. The job is called as job(job_index, thread_index), where
+ * thread_index is in 0 ... num_threads-1, so that the caller can give each
+ * thread its own work space. With one thread the jobs are run in the
+ * calling thread.
+ *
+ * If a job throws, no new jobs are started and the first exception is
+ * rethrown in the calling thread after all the workers have finished.
+ *
+ * \param num_jobs Number of jobs
+ * \param num_threads Number of worker threads
+ * \param job Function object called for each job
+ */
+template <typename Job>
+void run_parallel(int num_jobs, int num_threads, Job job)
+{
+  if (num_threads > num_jobs)
+    num_threads = num_jobs;
+  if (num_threads <= 1) {
+    for (int i = 0; i < num_jobs; i++)
+      job(i, 0);
+    return;
+  }
+
+  std::atomic<int> next_job(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_lock;
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; t++) {
+    workers.push_back(std::thread([&, t]() {
+      while (!failed) {
+        int i = next_job++;
+        if (i >= num_jobs)
+          break;
+        try {
+          job(i, t);
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(error_lock);
+          if (!failed)
+            error = std::current_exception();
+          failed = true;
+        }
+      }
+    }));
+  }
+  for (int t = 0; t < num_threads; t++)
+    workers[t].join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+}
+
+#endif /* PARALLEL_HH */
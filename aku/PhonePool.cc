@@ -2,12 +2,18 @@
 
 #include "PhonePool.hh"
 #include "LinearAlgebra.hh"
+#include "Parallel.hh"
 #include "str.hh"
 #include "util.hh"
 
 
 namespace aku {
 
+// The splits are evaluated in parallel only if the number of candidate
+// splits times the context phones of the cluster is at least this.
+// Otherwise starting the threads costs more than the evaluation.
+static const int min_parallel_split_work = 1024;
+
 int safe_tolower(int c)
 {
   if (c == '')
@@ -320,7 +326,8 @@ PhonePool::PhonePool(void) :
   m_min_split_ll_gain(0),
   m_max_merge_ll_loss(0),
   m_dim(0),
-  m_info(0)
+  m_info(0),
+  m_num_threads(1)
 {
 }
 
@@ -467,87 +474,119 @@ PhonePool::finish_statistics(void)
 void
 PhonePool::decision_tree_cluster_context_phones(int max_context_index)
 {
-  int context_start, context_end;
   int total_clusters = 0;
 
+  // One tree for each phone state
+  std::vector<std::pair<Phone*, int> > trees;
   for (PhoneMap::iterator it = m_phones.begin(); it != m_phones.end(); it++)
-  {
     for (int s = 0; s < (*it).second->num_states(); s++)
-    {
-      if (m_info > 0)
-        fprintf(stderr, "Processing phone %s, state %i\n",
-                (*it).second->label().c_str(), s);
+      trees.push_back(std::make_pair((*it).second, s));
 
-      std::vector<ContextPhoneCluster*> clusters;
-      clusters.push_back((*it).second->get_initial_clustered_state(s));
+  // Build the largest trees first, so that they do not finish last
+  std::vector<int> tree_order;
+  for (int i = 0; i < (int)trees.size(); i++)
+    tree_order.push_back(i);
+  if (m_num_threads > 1)
+  {
+    std::stable_sort(tree_order.begin(), tree_order.end(),
+                     [&](int a, int b) {
+                       return (trees[a].first->num_context_phones(trees[a].second) >
+                               trees[b].first->num_context_phones(trees[b].second));
+                     });
+  }
 
-      // Determine the context range
-      if (max_context_index > 0)
-      {
-        context_start = -std::min((*it).second->max_left_contexts(),
-                                  max_context_index);
-        context_end = std::min((*it).second->max_right_contexts(),
-                               max_context_index);
-      }
-      else
-      {
-        context_start = -(*it).second->max_left_contexts();
-        context_end = (*it).second->max_right_contexts();
-      }
-      if (m_info > 1)
-        fprintf(stderr, "Checking context indices %i through %i\n",
-                context_start, context_end);
+  std::vector< std::vector<ContextPhoneCluster*> > tree_clusters(trees.size());
+  std::atomic<int> remaining_trees((int)trees.size());
+  run_parallel((int)trees.size(), m_num_threads, [&](int job, int thread) {
+      int t = tree_order[job];
+      cluster_state(trees[t].first, trees[t].second, max_context_index,
+                    remaining_trees, tree_clusters[t]);
+      remaining_trees--;
+    });
+
+  // Save the results in the original order
+  for (int t = 0; t < (int)trees.size(); t++)
+  {
+    for (int c = 0; c < (int)tree_clusters[t].size(); c++)
+      trees[t].first->add_final_cluster(trees[t].second, tree_clusters[t][c]);
+    if (m_info > 0)
+      fprintf(stderr, "Phone %s, state %i: %i clusters generated\n",
+              trees[t].first->label().c_str(), trees[t].second,
+              (int)tree_clusters[t].size());
+    total_clusters += (int)tree_clusters[t].size();
+  }
+  if (m_info > 0)
+    fprintf(stderr, "Total: %i clusters generated\n", total_clusters);
+}
 
-      // Split the clusters until no more clusters can be split
-      for (int c = 0; c < (int)clusters.size(); c++)
-      {
-        // Find the best rule to split the cluster
-        ContextPhoneCluster *new_cluster;
-        int num_rules = 0;
-        if (clusters[c]->num_applied_rule_sets() > 0)
-          num_rules = (int)clusters[c]->applied_rules(0).size();
-        apply_best_splitting_rule(clusters[c], context_start, context_end,
-                                  &new_cluster);
-        if (new_cluster != NULL)
-        {
-          assert( (int)clusters[c]->applied_rules(0).size() == num_rules+1 );
-          assert( (int)new_cluster->applied_rules(0).size() == num_rules+1 );
-          // The cluster was split, add the new cluster to the vector
-          clusters.push_back(new_cluster);
-          c--; // Reconsider the split cluster for splitting again
-        }
-      }
 
-      // Save the result
-      for (int c = 0; c < (int)clusters.size(); c++)
-        (*it).second->add_final_cluster(s, clusters[c]);
-      if (m_info > 0)
-        fprintf(stderr, "%i clusters generated\n", (int)clusters.size());
-      total_clusters += (int)clusters.size();
+void
+PhonePool::cluster_state(Phone *phone, int state, int max_context_index,
+                         const std::atomic<int> &remaining_trees,
+                         std::vector<ContextPhoneCluster*> &clusters)
+{
+  int context_start, context_end;
+
+  if (m_info > 0)
+    fprintf(stderr, "Processing phone %s, state %i\n",
+            phone->label().c_str(), state);
+
+  clusters.push_back(phone->get_initial_clustered_state(state));
+
+  // Determine the context range
+  if (max_context_index > 0)
+  {
+    context_start = -std::min(phone->max_left_contexts(), max_context_index);
+    context_end = std::min(phone->max_right_contexts(), max_context_index);
+  }
+  else
+  {
+    context_start = -phone->max_left_contexts();
+    context_end = phone->max_right_contexts();
+  }
+  if (m_info > 1)
+    fprintf(stderr, "Checking context indices %i through %i\n",
+            context_start, context_end);
+
+  // Split the clusters until no more clusters can be split
+  for (int c = 0; c < (int)clusters.size(); c++)
+  {
+    // The threads without a tree of their own evaluate the rules
+    int num_threads = m_num_threads /
+      std::max(1, std::min((int)remaining_trees, m_num_threads));
+
+    // Find the best rule to split the cluster
+    ContextPhoneCluster *new_cluster;
+    int num_rules = 0;
+    if (clusters[c]->num_applied_rule_sets() > 0)
+      num_rules = (int)clusters[c]->applied_rules(0).size();
+    apply_best_splitting_rule(clusters[c], context_start, context_end,
+                              num_threads, &new_cluster);
+    if (new_cluster != NULL)
+    {
+      assert( (int)clusters[c]->applied_rules(0).size() == num_rules+1 );
+      assert( (int)new_cluster->applied_rules(0).size() == num_rules+1 );
+      // The cluster was split, add the new cluster to the vector
+      clusters.push_back(new_cluster);
+      c--; // Reconsider the split cluster for splitting again
     }
   }
-  if (m_info > 0)
-    fprintf(stderr, "Total: %i clusters generated\n", total_clusters);
 }
 
 
 void
 PhonePool::apply_best_splitting_rule(
   ContextPhoneCluster *cl, int min_context_index, int max_context_index,
-  ContextPhoneCluster **new_cl)
+  int num_threads, ContextPhoneCluster **new_cl)
 {
   double c1, c2; // Temporary cluster occupancy counts
   bool cur_first_answer;
   std::vector< ContextPhoneSet > applied_sets;
+  std::vector< AppliedDecisionRule > applied_rules;
   int num_new_context_phones;
-
-  // Initialize the best applied rule to invalid values (context 0)
-  AppliedDecisionRule best_applied_rule(&(m_rules[0]), 0, false);
-  ContextPhoneCluster best_cl1(m_dim), best_cl2(m_dim);
-  double best_ll_gain = -1;
   int s;
 
-  // Iterate through rules
+  // Find the distinct splits that satisfy the occupancy limit
   for (int r = 0; r < (int)m_rules.size(); r++)
   {
     for (int i=min_context_index; i <= max_context_index; i++)
@@ -562,7 +601,6 @@ PhonePool::apply_best_splitting_rule(
       if (c1 < m_min_occupancy || c2 < m_min_occupancy)
         continue;
 
-      ContextPhoneCluster cl1(*cl), cl2(*cl);
       ContextPhoneSet new_context_phones;
 
       // Use the smaller set to check whether we have a new set of phones
@@ -583,28 +621,48 @@ PhonePool::apply_best_splitting_rule(
       if (s < (int)applied_sets.size()) // Found the same set
         continue;
 
-      cl1.fill_cluster(new_context_phones);
-      cl2.remove_from_cluster(cl1);
-
       applied_sets.push_back(new_context_phones);
-
-      double gain = compute_log_likelihood_gain(*cl, cl1, cl2);
-      if (gain > best_ll_gain && gain > m_min_split_ll_gain)
-      {
-        best_cl1 = cl1;
-        best_cl2 = cl2;
-        best_applied_rule = AppliedDecisionRule(&(m_rules[r]), i,
-                                                cur_first_answer);
-        best_ll_gain = gain;
-      }
+      applied_rules.push_back(AppliedDecisionRule(&(m_rules[r]), i,
+                                                  cur_first_answer));
 
       if (m_rules[r].rule_type != DecisionRule::CONTEXT)
         break; // Context index has no meaning, no need to iterate
     }
   }
-  if (best_applied_rule.context != 0)
+
+  // Compute the likelihood gains of the splits, in parallel if there is
+  // enough work
+  if ((double)applied_sets.size() * cl->num_context_phones() <
+      min_parallel_split_work)
+    num_threads = 1;
+  std::vector<double> gains(applied_sets.size());
+  run_parallel((int)applied_sets.size(), num_threads, [&](int k, int thread) {
+      ContextPhoneCluster cl1(*cl), cl2(*cl);
+      cl1.fill_cluster(applied_sets[k]);
+      cl2.remove_from_cluster(cl1);
+      gains[k] = compute_log_likelihood_gain(*cl, cl1, cl2);
+    });
+
+  // Choose the first of the best splits, as the serial search did
+  int best = -1;
+  double best_ll_gain = -1;
+  for (int k = 0; k < (int)gains.size(); k++)
+  {
+    if (gains[k] > best_ll_gain && gains[k] > m_min_split_ll_gain)
+    {
+      best = k;
+      best_ll_gain = gains[k];
+    }
+  }
+
+  if (best >= 0)
   {
     // Found an applicable rule
+    AppliedDecisionRule best_applied_rule = applied_rules[best];
+    ContextPhoneCluster best_cl1(*cl), best_cl2(*cl);
+    best_cl1.fill_cluster(applied_sets[best]);
+    best_cl2.remove_from_cluster(best_cl1);
+
     *cl = best_cl1;
     *new_cl = new ContextPhoneCluster(m_dim);
     **new_cl = best_cl2;
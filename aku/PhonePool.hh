@@ -1,6 +1,7 @@
 #ifndef PHONEPOOL_HH
 #define PHONEPOOL_HH
 
+#include <atomic>
 #include <set>
 #include <map>
 #include <vector>
@@ -139,6 +140,7 @@ private:
     int finish_statistics(void);
 
     int num_states(void) { return (int)m_cp_states.size(); }
+    int num_context_phones(int state) { return (int)m_cp_states[state].size(); }
     int max_left_contexts(void) { return m_max_left_contexts; }
     int max_right_contexts(void) { return m_max_right_contexts; }
 
@@ -263,6 +265,16 @@ public:
    */
   void set_info(int info) { m_info = info; }
 
+  /** Sets the number of threads used in decision tree clustering.
+   * The trees of different phone states are built in parallel, largest
+   * first, and the threads that are left over at the end evaluate the
+   * splitting rules of the remaining trees, if the clusters are large
+   * enough to be worth it. The result does not depend on
+   * the number of threads.
+   * \param num_threads Number of threads (default 1)
+   */
+  void set_num_threads(int num_threads) { m_num_threads = num_threads; }
+
   /** Loads the rule set for the decision tree
    * \param fp Pointer to FILE object
    */
@@ -315,8 +327,12 @@ public:
   inline void add_context(const std::string &context);
   
 private:
+  void cluster_state(Phone *phone, int state, int max_context_index,
+                     const std::atomic<int> &remaining_trees,
+                     std::vector<ContextPhoneCluster*> &clusters);
   void apply_best_splitting_rule(ContextPhoneCluster *cl,
                                  int min_context_index, int max_context_index,
+                                 int num_threads,
                                  ContextPhoneCluster **new_cl);
   double compute_log_likelihood_gain(ContextPhoneCluster &parent,
                                      ContextPhoneCluster &child1,
@@ -340,6 +356,7 @@ private:
 
   int m_dim; //!< Feature dimension
   int m_info; //!< Verbosity
+  int m_num_threads; //!< Threads in decision tree clustering
 
   std::vector< DecisionRule > m_rules;
 };
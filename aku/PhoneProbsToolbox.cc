@@ -12,10 +12,12 @@
 #endif
 
 #include <fcntl.h>
+#include <algorithm>
 
 #include "endian.hh"
 #include "io.hh"
 #include "str.hh"
+#include "Parallel.hh"
 
 #define BYTE unsigned char
 
@@ -26,7 +28,7 @@
 
 namespace aku {
 
-void PPToolbox::write_int(FILE *fp, unsigned int i)
+void PPToolbox::write_int(FILE *fp, unsigned int i) const
 {
   BYTE buf[4];
 
@@ -41,6 +43,7 @@ void PPToolbox::write_int(FILE *fp, unsigned int i)
 
 void PPToolbox::read_configuration(const std::string &cfgname) {
   gen.load_configuration(io::Stream(cfgname));
+  config_name = cfgname;
 }
 
 void PPToolbox::read_models(const std::string &base) {
@@ -52,14 +55,94 @@ void PPToolbox::set_clustering(const std::string &clfile_name, double eval_minc,
   model.set_clustering_min_evals(eval_minc, eval_ming);
 }
 
+void PPToolbox::write_probs(FeatureGenerator &generator, FILE *ofp,
+                            const int lnabytes) const {
+  BYTE buffer[4];
+  assert( sizeof(BYTE) == 1 );
+
+  // Write header
+  write_int(ofp, model.num_states());
+  fputc(lnabytes, ofp);
+
+  // Write the probabilities, scoring a block of frames at a time. Only
+  // local buffers are used, so that threads can share the model.
+  Matrix block(frame_block, generator.dim());
+  Matrix pool_likelihoods, pdf_likelihoods;
+  PDFPool::LikelihoodBuffers likelihood_buffers;
+  std::vector<float> obs_log_probs(model.num_states());
+  for (int f = 0; true; f += frame_block)
+    {
+      int block_frames = 0;
+      while (block_frames < frame_block)
+	{
+	  const FeatureVec block_vec = generator.generate(f + block_frames);
+	  if (generator.eof())
+	    break;
+	  for (int i = 0; i < generator.dim(); i++)
+	    block(block_frames, i) = block_vec[i];
+	  block_frames++;
+	}
+      if (block_frames == 0)
+	break;
+
+      if (block_frames < frame_block)
+	model.compute_likelihoods(
+	  block(LaIndex(0, block_frames-1), LaIndex(0, generator.dim()-1)),
+	  pool_likelihoods, pdf_likelihoods, likelihood_buffers);
+      else
+	model.compute_likelihoods(block, pool_likelihoods, pdf_likelihoods,
+				  likelihood_buffers);
+
+      for (int b = 0; b < block_frames; b++)
+	{
+	  double log_normalizer=0;
+	  for (int i = 0; i < model.num_states(); i++) {
+	    obs_log_probs[i] = pdf_likelihoods(b, model.emission_pdf_index(i));
+	    log_normalizer += obs_log_probs[i];
+	  }
+	  if (log_normalizer == 0)
+	    log_normalizer = 1;
+	  for (int i = 0; i < (int)obs_log_probs.size(); i++)
+	    obs_log_probs[i] = util::safe_log(obs_log_probs[i] / log_normalizer);
+
+	  for (int i = 0; i < model.num_states(); i++)
+	    {
+	      if (lnabytes == 4)
+		{
+		  BYTE *p = (BYTE*)&obs_log_probs[i];
+		  for (int j = 0; j < 4; j++)
+		    buffer[j] = p[j];
+		  if (endian::big)
+		    endian::convert(buffer, 4);
+		}
+	      else if (lnabytes == 2)
+		{
+		  if (obs_log_probs[i] < -36.008)
+		    {
+		      buffer[0] = 255;
+		      buffer[1] = 255;
+		    }
+		  else
+		    {
+		      int temp = (int)(-1820.0 * obs_log_probs[i] + .5);
+		      buffer[0] = (BYTE)((temp>>8)&255);
+		      buffer[1] = (BYTE)(temp&255);
+		    }
+		}
+	      if ((int)fwrite(buffer, sizeof(BYTE), lnabytes, ofp) < lnabytes)
+		throw std::string("Write error");
+	    }
+	}
+      if (block_frames < frame_block)
+	break;
+    }
+  fflush(ofp);
+}
+
 void PPToolbox::generate_to_fd(const int in_fd, const int out_fd, const bool raw_flag) {    
   const int lnabytes=2;
   //io::Stream ofp;
   FILE *ofp;
-  const int start_frame=0;
-
-  BYTE buffer[4];
-  assert( sizeof(BYTE) == 1 );
 
   if (model.dim() != gen.dim())
     {
@@ -76,59 +159,8 @@ void PPToolbox::generate_to_fd(const int in_fd, const int out_fd, const bool raw
      throw std::string("could not open fd ") + ": " +
       strerror(errno);
   }
-  // Write header
-  write_int(ofp, model.num_states());
-  fputc(lnabytes, ofp);
-
-  // Write the probabilities
-  for (int f = start_frame; true ; f++)
-    {
-      const FeatureVec fea_vec = gen.generate(f);
-      if (gen.eof())
-	break;
-
-      model.reset_cache();
-      model.precompute_likelihoods(fea_vec);
-      obs_log_probs.resize(model.num_states());
-      double log_normalizer=0;
-      for (int i = 0; i < model.num_states(); i++) {
-	obs_log_probs[i] = model.state_likelihood(i, fea_vec);
-	log_normalizer += obs_log_probs[i];
-      }
-      if (log_normalizer == 0)
-	log_normalizer = 1;
-      for (int i = 0; i < (int)obs_log_probs.size(); i++)
-	obs_log_probs[i] = util::safe_log(obs_log_probs[i] / log_normalizer);
-      
-
-      for (int i = 0; i < model.num_states(); i++)
-        {
-          if (lnabytes == 4)
-	    {
-	      BYTE *p = (BYTE*)&obs_log_probs[i];
-	      for (int j = 0; j < 4; j++)
-		buffer[j] = p[j];
-	      if (endian::big)
-		endian::convert(buffer, 4);
-	    }
-          else if (lnabytes == 2)
-	    {
-	      if (obs_log_probs[i] < -36.008)
-		{
-		  buffer[0] = 255;
-		  buffer[1] = 255;
-		}
-	      else
-		{
-		  int temp = (int)(-1820.0 * obs_log_probs[i] + .5);
-		  buffer[0] = (BYTE)((temp>>8)&255);
-		  buffer[1] = (BYTE)(temp&255);
-		}
-	    }
-          if ((int)fwrite(buffer, sizeof(BYTE), lnabytes, ofp) < lnabytes)
-            throw std::string("Write error");
-        }
-    }
+  model.prepare_likelihoods();
+  write_probs(gen, ofp, lnabytes);
 }
 
 
@@ -136,10 +168,6 @@ void PPToolbox::generate_from_file_to_fd(const std::string &input_name, const in
   const int lnabytes=2;
   //io::Stream ofp;
   FILE *ofp;
-  const int start_frame=0;
-
-  BYTE buffer[4];
-  assert( sizeof(BYTE) == 1 );
 
   if (model.dim() != gen.dim())
     {
@@ -149,62 +177,11 @@ void PPToolbox::generate_from_file_to_fd(const std::string &input_name, const in
     }
   
   // Open files
-  gen.open(input_name);
+  gen.open(input_name, raw_flag);
   ofp=fdopen(out_fd, "wb");
 
-  // Write header
-  write_int(ofp, model.num_states());
-  fputc(lnabytes, ofp);
-
-  // Write the probabilities
-  for (int f = start_frame; true ; f++)
-    {
-      const FeatureVec fea_vec = gen.generate(f);
-      if (gen.eof())
-	break;
-
-      model.reset_cache();
-      model.precompute_likelihoods(fea_vec);
-      obs_log_probs.resize(model.num_states());
-      double log_normalizer=0;
-      for (int i = 0; i < model.num_states(); i++) {
-	obs_log_probs[i] = model.state_likelihood(i, fea_vec);
-	log_normalizer += obs_log_probs[i];
-      }
-      if (log_normalizer == 0)
-	log_normalizer = 1;
-      for (int i = 0; i < (int)obs_log_probs.size(); i++)
-	obs_log_probs[i] = util::safe_log(obs_log_probs[i] / log_normalizer);
-      
-
-      for (int i = 0; i < model.num_states(); i++)
-        {
-          if (lnabytes == 4)
-	    {
-	      BYTE *p = (BYTE*)&obs_log_probs[i];
-	      for (int j = 0; j < 4; j++)
-		buffer[j] = p[j];
-	      if (endian::big)
-		endian::convert(buffer, 4);
-	    }
-          else if (lnabytes == 2)
-	    {
-	      if (obs_log_probs[i] < -36.008)
-		{
-		  buffer[0] = 255;
-		  buffer[1] = 255;
-		}
-	      else
-		{
-		  int temp = (int)(-1820.0 * obs_log_probs[i] + .5);
-		  buffer[0] = (BYTE)((temp>>8)&255);
-		  buffer[1] = (BYTE)(temp&255);
-		}
-	    }
-          if ((int)fwrite(buffer, sizeof(BYTE), lnabytes, ofp) < lnabytes)
-            throw std::string("Write error");
-        }
-    }
+  model.prepare_likelihoods();
+  write_probs(gen, ofp, lnabytes);
 }
 
 
@@ -221,4 +198,61 @@ void PPToolbox::generate(const std::string &input_name, const std::string &outpu
   close(out);
 };
 
+
+void PPToolbox::generate_parallel(const std::vector<std::string> &input_names,
+                                  const std::vector<std::string> &output_names,
+                                  const bool raw_flag,
+                                  const int num_threads) {
+  const int lnabytes=2;
+
+  if (input_names.size() != output_names.size())
+    throw std::string("PPToolbox::generate_parallel(): different number of input and output files");
+  if (config_name.empty())
+    throw std::string("PPToolbox::generate_parallel(): feature configuration has not been read");
+  if (model.dim() != gen.dim())
+    {
+      throw str::fmt(256,
+                     "Gaussian dimension is %d but feature dimension is %d.",
+                     model.dim(), gen.dim());
+    }
+
+  // The model is shared, each thread has its own feature generator
+  model.prepare_likelihoods();
+  int threads = std::min(num_threads, (int)input_names.size());
+  std::vector<FeatureGenerator*> generators(std::max(threads, 1));
+  for (unsigned int t = 0; t < generators.size(); t++) {
+    generators[t] = new FeatureGenerator();
+    generators[t]->load_configuration(io::Stream(config_name));
+  }
+
+  try {
+    run_parallel(input_names.size(), threads, [&](int i, int t) {
+	FeatureGenerator &generator = *generators[t];
+	generator.open(input_names[i], raw_flag);
+	FILE *ofp = fopen(output_names[i].c_str(), "wb");
+	if (ofp == NULL)
+	  throw std::string("could not open ") + output_names[i] + ": " +
+	    strerror(errno);
+	try {
+	  write_probs(generator, ofp, lnabytes);
+	}
+	catch (...) {
+	  fclose(ofp);
+	  generator.close();
+	  throw;
+	}
+	generator.close();
+	if (fclose(ofp) != 0)
+	  throw std::string("Write error");
+      });
+  }
+  catch (...) {
+    for (unsigned int t = 0; t < generators.size(); t++)
+      delete generators[t];
+    throw;
+  }
+  for (unsigned int t = 0; t < generators.size(); t++)
+    delete generators[t];
+}
+
 }
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <cstring>
+#include <vector>
 #include "conf.hh"
 #include "FeatureGenerator.hh"
 #include "HmmSet.hh"
@@ -12,20 +13,37 @@ namespace aku {
 
 class PPToolbox {
 public:
+  PPToolbox() : frame_block(16) { }
   void read_models(const std::string &base);
   void read_configuration(const std::string &cfgname);
   void set_clustering(const std::string &clfile_name, double eval_minc, double eval_ming);
   void generate_to_fd(const int in, const int out, const bool raw_flag);
   void generate_from_file_to_fd(const std::string &input_name, const int out, const bool raw_flag);
   void generate(const std::string &input_name, const std::string &output_name, const bool raw_flag);
+  /** Generates LNA files for several input files using a pool of threads.
+   * The threads share the model, but each has its own feature generator.
+   * \param input_names audio files
+   * \param output_names LNA files, one for each audio file
+   * \param raw_flag if true, the audio files contain raw samples
+   * \param num_threads number of worker threads
+   */
+  void generate_parallel(const std::vector<std::string> &input_names,
+                         const std::vector<std::string> &output_names,
+                         const bool raw_flag,
+                         const int num_threads);
+  /// Number of frames whose likelihoods are computed at once
+  void set_frame_block(int frames) { frame_block = frames > 0 ? frames : 1; }
   //set_lnabytes(int x);
 private:
   conf::Config config;
   aku::FeatureGenerator gen;
   aku::HmmSet model;
-  std::vector<float> obs_log_probs;
+  std::string config_name;
+  int frame_block;
 
-  void write_int(FILE *fp, unsigned int i);
+  void write_int(FILE *fp, unsigned int i) const;
+  void write_probs(FeatureGenerator &generator, FILE *ofp,
+                   const int lnabytes) const;
 };
 
 }
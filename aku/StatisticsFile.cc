@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <cstring>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "StatisticsFile.hh"
+#include "str.hh"
+
+
+namespace aku {
+
+const char StatisticsFile::magic[8] = { 'A', 'K', 'U', 'S', 'T', 'S', '1', '\n' };
+
+
+bool
+StatisticsFile::is_statistics_file(const std::string &filename)
+{
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == NULL)
+    return false;
+  char buf[sizeof(magic)];
+  bool ok = (fread(buf, sizeof(buf), 1, file) == 1 &&
+             memcmp(buf, magic, sizeof(magic)) == 0);
+  fclose(file);
+  return ok;
+}
+
+
+StatisticsFile::StatisticsFile(const std::string &filename)
+  : m_filename(filename),
+    m_map_data(NULL),
+    m_map_size(0)
+{
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == NULL)
+    throw str::fmt(512, "StatisticsFile: could not open %s", filename.c_str());
+
+  Header header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, magic, sizeof(magic)) != 0)
+  {
+    fclose(file);
+    throw str::fmt(512, "StatisticsFile: %s is not an indexed statistics file",
+                   filename.c_str());
+  }
+  if (header.byte_order != byte_order) {
+    fclose(file);
+    throw str::fmt(512, "StatisticsFile: %s was written on a machine with different byte order", filename.c_str());
+  }
+
+  const char *base = NULL;
+#ifndef _WIN32
+  struct stat st;
+  int fd = fileno(file);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size >= header.file_size && header.file_size > 0)
+  {
+    void *data = mmap(NULL, header.file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      m_map_data = data;
+      m_map_size = header.file_size;
+      base = (const char*)data;
+    }
+  }
+#endif
+  if (base == NULL && header.file_size >= (int64_t)sizeof(header)) {
+    m_buffer.resize((header.file_size + sizeof(double) - 1) / sizeof(double));
+    char *buf = (char*)&m_buffer[0];
+    memcpy(buf, &header, sizeof(header));
+    size_t rest = header.file_size - sizeof(header);
+    if (rest == 0 || fread(buf + sizeof(header), rest, 1, file) == 1)
+      base = buf;
+  }
+  fclose(file);
+  if (base == NULL)
+    throw str::fmt(512, "StatisticsFile: could not read %s", filename.c_str());
+
+  m_header = (const Header*)base;
+  m_gaussian_index = (const int64_t*)(base + header.gaussian_index_offset);
+  m_mixture_index = (const int64_t*)(base + header.mixture_index_offset);
+  m_transitions = (const double*)(base + header.transition_offset);
+  m_data = (const double*)(base + header.data_offset);
+
+  // Check that the tables and the statistics are inside the file.
+  bool ok = (header.num_gaussians >= 0 && header.num_mixtures >= 0 &&
+             header.num_transitions >= 0);
+  const int64_t *tables[2] = { m_gaussian_index, m_mixture_index };
+  int64_t table_offsets[2] = { header.gaussian_index_offset,
+                               header.mixture_index_offset };
+  int table_sizes[2] = { header.num_gaussians, header.num_mixtures };
+  int64_t num_data = (header.file_size - header.data_offset) / (int64_t)sizeof(double);
+  for (int t = 0; ok && t < 2; t++) {
+    ok = (table_offsets[t] % sizeof(int64_t) == 0 &&
+          table_offsets[t] >= (int64_t)sizeof(header) &&
+          table_offsets[t] + (table_sizes[t] + 1) * (int64_t)sizeof(int64_t)
+          <= header.file_size);
+    for (int i = 0; ok && i < table_sizes[t]; i++)
+      ok = (tables[t][i] >= 0 && tables[t][i] <= tables[t][i + 1] &&
+            tables[t][i + 1] <= num_data);
+  }
+  ok = ok && (header.transition_offset % sizeof(double) == 0 &&
+              header.transition_offset + 2 * header.num_transitions *
+              (int64_t)sizeof(double) <= header.file_size &&
+              header.data_offset % sizeof(double) == 0 &&
+              header.data_offset <= header.file_size);
+  if (!ok) {
+    unmap();
+    throw str::fmt(512, "StatisticsFile: %s is corrupted", filename.c_str());
+  }
+}
+
+
+StatisticsFile::~StatisticsFile()
+{
+  unmap();
+}
+
+
+void
+StatisticsFile::unmap()
+{
+#ifndef _WIN32
+  if (m_map_data != NULL)
+    munmap(m_map_data, m_map_size);
+#endif
+  m_map_data = NULL;
+}
+
+}
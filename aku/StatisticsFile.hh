@@ -0,0 +1,91 @@
+#ifndef STATISTICSFILE_HH
+#define STATISTICSFILE_HH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+namespace aku {
+
+/** Read-only view of a statistics dump in the indexed binary format
+ * (.sts), written by HmmSet::dump_indexed_statistics().
+ *
+ * The file starts with a \ref Header, followed by offset tables for the
+ * Gaussians and the mixtures and the statistics as 8-byte aligned arrays
+ * of doubles. The statistics of each PDF are in the format of
+ * PDF::pack_statistics(), and can be located without reading the rest of
+ * the file. The file is memory-mapped when possible, so opening even a
+ * large dump is cheap and several threads can read it at the same time.
+ */
+class StatisticsFile {
+public:
+
+  struct Header {
+    char magic[8];
+    int32_t byte_order;
+    int32_t mode; // PDF::StatisticsMode
+    int32_t dim;
+    int32_t num_gaussians;
+    int32_t num_mixtures;
+    int32_t num_transitions;
+    int64_t gaussian_index_offset; // int64_t[num_gaussians + 1]
+    int64_t mixture_index_offset; // int64_t[num_mixtures + 1]
+    int64_t transition_offset; // double[2 * num_transitions]
+    int64_t data_offset; // The PDF index offsets count doubles from here
+    int64_t file_size;
+  };
+
+  static const char magic[8];
+  static const int32_t byte_order = 0x01020304;
+
+  /// Tells if \a filename exists and starts with the magic string
+  static bool is_statistics_file(const std::string &filename);
+
+  /// Opens the file or throws a string describing the error
+  StatisticsFile(const std::string &filename);
+  ~StatisticsFile();
+
+  const std::string &filename() const { return m_filename; }
+  const Header &header() const { return *m_header; }
+
+  /** The packed statistics of a Gaussian in the pool.
+   * \param size Set to the number of doubles
+   * \return NULL if there are no statistics
+   */
+  const double *gaussian(int g, int &size) const
+  { return pdf(m_gaussian_index, g, size); }
+
+  /// The packed statistics of an emission PDF, see gaussian()
+  const double *mixture(int m, int &size) const
+  { return pdf(m_mixture_index, m, size); }
+
+  /// Pairs of (accumulated, occupancy) for each transition
+  const double *transitions() const { return m_transitions; }
+
+private:
+  StatisticsFile(const StatisticsFile&);
+  StatisticsFile &operator=(const StatisticsFile&);
+
+  void unmap();
+  const double *pdf(const int64_t *index, int i, int &size) const
+  {
+    size = (int)(index[i + 1] - index[i]);
+    return size > 0 ? m_data + index[i] : NULL;
+  }
+
+  std::string m_filename;
+  void *m_map_data;
+  size_t m_map_size;
+  std::vector<double> m_buffer; // If the file could not be mapped
+
+  const Header *m_header;
+  const int64_t *m_gaussian_index;
+  const int64_t *m_mixture_index;
+  const double *m_transitions;
+  const double *m_data;
+};
+
+}
+
+#endif // STATISTICSFILE_HH
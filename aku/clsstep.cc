@@ -3,11 +3,13 @@
 #include <iostream>
 #include <stdlib.h>
 #include <algorithm>
+#include <mutex>
 
 #include "io.hh"
 #include "str.hh"
 #include "conf.hh"
 #include "HmmSet.hh"
+#include "Parallel.hh"
 
 using namespace aku;
 using namespace std;
@@ -17,6 +19,7 @@ string out_model_name;
 string state_file;
 
 int info;
+int num_threads = 1;
 
 conf::Config config;
 HmmSet model;
@@ -33,11 +36,19 @@ double cov_criterion_kld_ratio = 0;
 bool criterion_relative_ratio = false;
 double criterion_value = 0;
 
-double mixture_max_objective_function = 0;
+// Objective counters of the updates. Each thread collects its own
+// counters, which are summed after the update.
+struct UpdateCounters {
+  double mixture_max_objective_function;
 
-int global_num_below_kld = 0;
-double global_sum_objective = 0;
-int global_num_negative_objective = 0;
+  UpdateCounters() : mixture_max_objective_function(0) { }
+  void add(const UpdateCounters &c)
+  {
+    mixture_max_objective_function += c.mixture_max_objective_function;
+  }
+};
+
+UpdateCounters global_counters;
 
 
 double mpe_smooth = 800;
@@ -47,14 +58,88 @@ vector<double> gaussian_weights; // Mixture weights for each Gaussian
 bool weighted_gaussian_kld_ratios = false;
 
 
-bool global_debug_flag = false;
-bool global_debug_flag2 = false;
+thread_local bool global_debug_flag = false;
+thread_local bool global_debug_flag2 = false;
+
+// Diagnostics of the updates. With several threads each block of
+// parallel_update writes to its own file, which is copied to stderr in
+// block order so that the output is in PDF order.
+thread_local FILE *update_log = stderr;
 
 
 typedef enum {MODE_MMI, MODE_MPE} OPTIMIZATION_MODE;
 OPTIMIZATION_MODE opt_mode = MODE_MMI;
 
 
+// Number of PDFs in one block of parallel_update. The blocks do not
+// depend on the number of threads, so neither does the updated model.
+const int update_block_size = 256;
+
+
+void copy_update_log(FILE *log)
+{
+  char buf[4096];
+  size_t n;
+  rewind(log);
+  while ((n = fread(buf, 1, sizeof(buf), log)) > 0)
+    fwrite(buf, 1, n, stderr);
+  fclose(log);
+}
+
+
+// Updates the PDFs 0 ... num_pdfs-1 by calling
+// update(first, last, counters) for blocks of update_block_size PDFs,
+// and adds the counters of the blocks to global_counters in block
+// order. The lambda averages that start the searches begin again in
+// each block.
+template <typename Update>
+void parallel_update(int num_pdfs, Update update)
+{
+  int num_blocks = (num_pdfs + update_block_size - 1) / update_block_size;
+  vector<UpdateCounters> counters(num_blocks);
+  vector<FILE*> logs(num_blocks, (FILE*)NULL);
+  int next_log = 0;
+  mutex log_lock;
+
+  try {
+    run_parallel(num_blocks, num_threads, [&](int b, int) {
+        FILE *log = stderr;
+        if (num_threads > 1)
+        {
+          log = tmpfile();
+          if (log == NULL)
+            throw string("Could not create a temporary file for the update log");
+        }
+        update_log = log;
+        global_debug_flag = false;
+        global_debug_flag2 = false;
+        int first = b * update_block_size;
+        update(first, min(num_pdfs, first + update_block_size), counters[b]);
+        if (log == stderr)
+          return;
+
+        // Copy the logs of the finished blocks that are next in order
+        lock_guard<mutex> lock(log_lock);
+        logs[b] = log;
+        while (next_log < num_blocks && logs[next_log] != NULL)
+        {
+          copy_update_log(logs[next_log]);
+          logs[next_log++] = NULL;
+        }
+      });
+  }
+  catch (...) {
+    for (int b = 0; b < num_blocks; b++)
+      if (logs[b] != NULL)
+        fclose(logs[b]);
+    throw;
+  }
+
+  for (int b = 0; b < num_blocks; b++)
+    global_counters.add(counters[b]);
+}
+
+
 class FuncEval {
 public:
   virtual double evaluate_function(double p) const = 0;
@@ -162,7 +247,7 @@ double bin_search_param_value_acc(double lower_bound, double low_value,
   {
     if (global_debug_flag2)
     {
-      fprintf(stderr, "SUM: [%g, %g, %g] -> [%g, %g, %g]\n", lower_bound, new_param,
+      fprintf(update_log, "SUM: [%g, %g, %g] -> [%g, %g, %g]\n", lower_bound, new_param,
               upper_bound, low_value, new_value, up_value);
 
       // global_debug_flag = true;
@@ -268,7 +353,7 @@ double search_lambda(double initial_value, double limit,
     while (constraint < limit && cur_value > 0)
     {
       if (global_debug_flag)
-        fprintf(stderr, "  lambda = %g, C = %g\n", cur_value, constraint);
+        fprintf(update_log, "  lambda = %g, C = %g\n", cur_value, constraint);
       up_value = constraint;
       up_bound = cur_value;
       cur_value /= 2.0;
@@ -289,7 +374,7 @@ double search_lambda(double initial_value, double limit,
     while (constraint > limit)
     {
       if (global_debug_flag)
-        fprintf(stderr, "  lambda = %g, C = %g\n", cur_value, constraint);
+        fprintf(update_log, "  lambda = %g, C = %g\n", cur_value, constraint);
       low_value = constraint;
       low_bound = cur_value;
       if (cur_value > 0)
@@ -304,7 +389,7 @@ double search_lambda(double initial_value, double limit,
     up_bound = cur_value;
   }
   if (global_debug_flag)
-    fprintf(stderr, "  binary search [%g, %g], values [%g, %g]\n",
+    fprintf(update_log, "  binary search [%g, %g], values [%g, %g]\n",
             low_bound, up_bound, low_value, up_value);
   return bin_search_max_param_value_acc(low_bound, low_value,
                                         up_bound, up_value,
@@ -366,7 +451,7 @@ bool CriticalMixtureWeightSolver::solve_weight(double &weight) const
   if (lambda == 0)
   {
     if (global_debug_flag)
-      fprintf(stderr, "CriticalMixtureWeightSolver::solve_weight: lambda == 0, c = %g\n", c);
+      fprintf(update_log, "CriticalMixtureWeightSolver::solve_weight: lambda == 0, c = %g\n", c);
     // Normal CLS equation:
     // weight = min(max(cur_gamma/c, min_weight), 1.0);
 
@@ -462,7 +547,7 @@ bool CriticalMixtureWeightSolver::solve_weight(double &weight) const
     double upper_f = evaluate_function(1.0);
     if (lower_f < upper_f)
     {
-      fprintf(stderr, "  Warning: lower_f = %g, upper_f = %g, weight0 = %g, gamma = %g, abs_gamma = %g, lambda = %g, c = %g\n", lower_f, upper_f, weight0, cur_gamma, abs_gamma, lambda, c);
+      fprintf(update_log, "  Warning: lower_f = %g, upper_f = %g, weight0 = %g, gamma = %g, abs_gamma = %g, lambda = %g, c = %g\n", lower_f, upper_f, weight0, cur_gamma, abs_gamma, lambda, c);
       abort();
     }
     if (lower_f < 0)
@@ -478,16 +563,16 @@ bool CriticalMixtureWeightSolver::solve_weight(double &weight) const
     else
     {
       if (global_debug_flag)
-        fprintf(stderr, "CriticalMixtureWeightSolver: bin search [%g, %g] -> [%g, %g]\n",
+        fprintf(update_log, "CriticalMixtureWeightSolver: bin search [%g, %g] -> [%g, %g]\n",
                 min_weight, 1.0, lower_f, upper_f);
       weight = bin_search_max_param(min_weight, lower_f,
                                     1.0, upper_f, 0, search_acc, *this);
       if (global_debug_flag)
-        fprintf(stderr, "CriticalMixtureWeightSolver::solve_weight: weight = %g\n", weight);
+        fprintf(update_log, "CriticalMixtureWeightSolver::solve_weight: weight = %g\n", weight);
     }
     weight = min(max(weight, min_weight), 1.0);
     if (global_debug_flag)
-      fprintf(stderr, "CriticalMixtureWeightSolver::solve_weight: Final weight = %g\n", weight);
+      fprintf(update_log, "CriticalMixtureWeightSolver::solve_weight: Final weight = %g\n", weight);
     return true;
   }
 }
@@ -513,16 +598,16 @@ double MixtureKLDConstraint::evaluate_function(double p) const
   Vector new_weights;
   double kld = 0;
   if (global_debug_flag)
-    fprintf(stderr, "MixtureKLDConstraint::evaluate_function(%g)\n", p);
+    fprintf(update_log, "MixtureKLDConstraint::evaluate_function(%g)\n", p);
   if (!solve_weights(p, new_weights)) // Failed?
   {
     if (!eval_kld)
     {
       if (!global_debug_flag)
       {
-        fprintf(stderr, "Warning: Weight solving failed when optimizing criterion/KLD ratio!\n");
-        fprintf(stderr, "Function: MixtureKLDConstraint::evaluate_function(%g)\n", p);
-        fprintf(stderr, "******** This is potentially dangerous, enabling debug mode *******\n");
+        fprintf(update_log, "Warning: Weight solving failed when optimizing criterion/KLD ratio!\n");
+        fprintf(update_log, "Function: MixtureKLDConstraint::evaluate_function(%g)\n", p);
+        fprintf(update_log, "******** This is potentially dangerous, enabling debug mode *******\n");
         global_debug_flag = true;
       }
     }
@@ -619,13 +704,13 @@ CriticalMixtureSolver::solve_new_weights(double lambda, double sum_constraint,
     if (!w.solve_weight(new_weights(i)))
     {
       if (global_debug_flag)
-        fprintf(stderr, "CriticalMixtureSolver::solve_new_weights: Estimating weight %i failed\n", i);
+        fprintf(update_log, "CriticalMixtureSolver::solve_new_weights: Estimating weight %i failed\n", i);
       return false; // Failed because of too small a lambda
     }
     if (new_weights(i) == 0) // Invalid weight, invalid sum_constraint
     {
       if (global_debug_flag)
-        fprintf(stderr, "CriticalMixtureSolver::solve_new_weights: Weight %i is zero, failed\n", i);
+        fprintf(update_log, "CriticalMixtureSolver::solve_new_weights: Weight %i is zero, failed\n", i);
       norm = 0;
       return true;
     }
@@ -675,7 +760,7 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
   {
     if (local_debug_flag)
     {
-      fprintf(stderr, "CriticalMixtureSolver::solve_weights: Initial estimation failed\n");
+      fprintf(update_log, "CriticalMixtureSolver::solve_weights: Initial estimation failed\n");
       global_debug_flag = local_debug_flag;
     }
 
@@ -685,7 +770,7 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
   SumEval f(lambda, this);
 
   if (local_debug_flag && lambda == 0)
-    fprintf(stderr, "  init = %g, norm = %g\n", lower_bound, norm0);
+    fprintf(update_log, "  init = %g, norm = %g\n", lower_bound, norm0);
 
   if (norm0 != 1)
   {
@@ -698,7 +783,7 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
     for (init = 1; init < 1e20; init *= 2.0)
     {
       if (local_debug_flag)
-        fprintf(stderr, "  SUM iteration, init = %g (pos = %d, neg = %d)\n",
+        fprintf(update_log, "  SUM iteration, init = %g (pos = %d, neg = %d)\n",
                 init, (positive?1:0), (negative?1:0));
       double cur_c;
       norm = 0;
@@ -714,7 +799,7 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
           return false;
         }
         if (local_debug_flag && lambda == 0)
-          fprintf(stderr, "    neg: norm = %g\n", norm);
+          fprintf(update_log, "    neg: norm = %g\n", norm);
         if (norm0 == 0)
         {
           if (norm > 0)
@@ -783,7 +868,7 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
           return false;
         }
         if (local_debug_flag && lambda == 0)
-          fprintf(stderr, "    pos: norm = %g\n", norm);
+          fprintf(update_log, "    pos: norm = %g\n", norm);
         if (norm == 0)
         {
           // We may find an upper limit of sum constraint
@@ -835,14 +920,14 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
   }
 
   if (local_debug_flag)
-    fprintf(stderr, "  Sum constraint search [%g, %g], values [%g, %g]\n",
+    fprintf(update_log, "  Sum constraint search [%g, %g], values [%g, %g]\n",
             lower_bound, upper_bound, lower_value, upper_value);
   global_debug_flag2 = local_debug_flag;
   cur_sum_constraint = bin_search_param_value_acc(
     lower_bound, lower_value, upper_bound, upper_value, 1, 1e-3,
     1e-12*(upper_bound-lower_bound), f);
   if (local_debug_flag)
-    fprintf(stderr, "  Optimum: %g\n", cur_sum_constraint);
+    fprintf(update_log, "  Optimum: %g\n", cur_sum_constraint);
 
   global_debug_flag2 = false;
 
@@ -852,7 +937,7 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
   if (!solve_new_weights(lambda, cur_sum_constraint, new_weights, norm))
   {
     if (global_debug_flag)
-      fprintf(stderr, "CriticalMixtureSolver::solve_weights: Final estimation failed\n");
+      fprintf(update_log, "CriticalMixtureSolver::solve_weights: Final estimation failed\n");
     return false;
   }
 
@@ -875,7 +960,7 @@ bool CriticalMixtureSolver::solve_weights(double lambda,
   if (fabs(1-norm) > 0.01)
   {
     if (global_debug_flag)
-      fprintf(stderr, "  Bad weight normalization, norm %g\n", norm);
+      fprintf(update_log, "  Bad weight normalization, norm %g\n", norm);
     return false; // FIXME: Shouldn't fail on final weight estimation call!
   }
   
@@ -994,7 +1079,7 @@ bool LinearMixtureSolver::solve_weights(double lambda,
   
   // Normalize weights
   if (fabs(1-norm) > 0.01)
-    fprintf(stderr, "Warning: Normalization deviates from 1: %g\n", norm);
+    fprintf(update_log, "Warning: Normalization deviates from 1: %g\n", norm);
   for (int i = 0; i < new_weights.size(); i++)
     new_weights(i) = new_weights(i) / norm;
 
@@ -1604,14 +1689,14 @@ void original_cls_mixture_step(void)
       search_dir = new_weights;
       Blas_Add_Mult(search_dir, -1, orig_weights);
       if (info > 0)
-        fprintf(stderr, "Mixture %i, MAX update\n", i);
+        fprintf(update_log, "Mixture %i, MAX update\n", i);
     }
     else if (neg && !pos) // Critical point is a minimum
     {
       search_dir = orig_weights;
       Blas_Add_Mult(search_dir, -1, new_weights);
       if (info > 0)
-        fprintf(stderr, "Mixture %i, MIN update\n", i);
+        fprintf(update_log, "Mixture %i, MIN update\n", i);
     }
     else
     {
@@ -1634,7 +1719,7 @@ void original_cls_mixture_step(void)
         search_dir(j) = search_dir(j) - projection*normal_c;
 
       if (info > 0)
-        fprintf(stderr, "Mixture %i, gradient update\n", i);
+        fprintf(update_log, "Mixture %i, gradient update\n", i);
     }
 
     // Compute step size for approximative KLD constraint
@@ -1673,21 +1758,21 @@ void original_cls_mixture_step(void)
         if (step_size < 0)
         {
           if (info > 0)
-            fprintf(stderr, "Warning: Negative step size (%g), truncating\n",
+            fprintf(update_log, "Warning: Negative step size (%g), truncating\n",
                     step_size);
           step_size = 0;
         }
         new_weights = orig_weights;
         Blas_Add_Mult(new_weights, step_size, search_dir);
         if (info > 0)
-          fprintf(stderr, "  Rescaling, %g -> %g\n",
+          fprintf(update_log, "  Rescaling, %g -> %g\n",
                   original_step_size, step_size);
       }
       
       norm = Blas_Norm1(new_weights);
 
       if (fabs(norm - 1.0) > 0.01 && info > 0)
-        fprintf(stderr, "Warning: Bad normalization for mixture %i (%g)\n",
+        fprintf(update_log, "Warning: Bad normalization for mixture %i (%g)\n",
                 i, norm);
       
       // Set the new mixture parameters
@@ -1700,12 +1785,12 @@ void original_cls_mixture_step(void)
       for (int i = 0; i < orig_weights.size(); i++)
         kld += new_weights(i)*log(new_weights(i)/orig_weights(i));
       if (info > 0)
-        fprintf(stderr, "  KLD: %.4f (step size %g)\n", kld, step_size);
+        fprintf(update_log, "  KLD: %.4f (step size %g)\n", kld, step_size);
     }
     else
     {
       if (info > 0)
-        fprintf(stderr, "Warning: No update for mixture %i\n", i);
+        fprintf(update_log, "Warning: No update for mixture %i\n", i);
     }
   }
 }
@@ -1784,7 +1869,7 @@ void original_cls_mean_cov_step(void)
           mean_search_dir(j) = scale * mean_search_dir(j);
       }
       if (info > 0)
-        fprintf(stderr, "Mean %i, gradient update, scale %g\n", i, scale);
+        fprintf(update_log, "Mean %i, gradient update, scale %g\n", i, scale);
     }
     else
     {
@@ -1809,9 +1894,9 @@ void original_cls_mean_cov_step(void)
         scale = 1;
 
       if (sign > 0)
-        fprintf(stderr, "Mean %i, MAX update, scale %g\n", i, scale);
+        fprintf(update_log, "Mean %i, MAX update, scale %g\n", i, scale);
       else
-        fprintf(stderr, "Mean %i, MIN update, scale %g\n", i, scale);
+        fprintf(update_log, "Mean %i, MIN update, scale %g\n", i, scale);
     }
 
     // Update the mean
@@ -1824,7 +1909,7 @@ void original_cls_mean_cov_step(void)
     for (int j = 0; j < pool->dim(); j++)
       kld += gaussian_mean_parameter_kld(target_mean(j) - mean(j), cov(j))*2;
     if (info > 0)
-      fprintf(stderr, "  KLD: %.4f\n", kld);
+      fprintf(update_log, "  KLD: %.4f\n", kld);
 
     //////////////////////
     // Covariance update
@@ -1850,7 +1935,7 @@ void original_cls_mean_cov_step(void)
     if (pos)
     {
       if (info > 0 && d_gamma < 0)
-        fprintf(stderr, "NOTE: Cov %i, incorrect precondition (MAX update, O(1) = %g\n", i, d_gamma);
+        fprintf(update_log, "NOTE: Cov %i, incorrect precondition (MAX update, O(1) = %g\n", i, d_gamma);
 
       for (int j = 0; j < dim; j++)
         cov_search_dir(j) = target_cov(j) - cov(j);
@@ -1865,7 +1950,7 @@ void original_cls_mean_cov_step(void)
         scale = cov_kld_limit; // Just for printing the scale
       
       if (info > 0)
-        fprintf(stderr, "Cov %i, MAX update, scale %g\n", i,
+        fprintf(update_log, "Cov %i, MAX update, scale %g\n", i,
                 sqrt(cov_kld_limit/scale));
     }
     else
@@ -1893,7 +1978,7 @@ void original_cls_mean_cov_step(void)
         Blas_Scale(sqrt(cov_kld_limit/scale), cov_search_dir);
 
       if (info > 0)
-        fprintf(stderr, "Cov %i, gradient update, scale %g\n", i,
+        fprintf(update_log, "Cov %i, gradient update, scale %g\n", i,
                 sqrt(cov_kld_limit/scale));
     }
     
@@ -1907,7 +1992,7 @@ void original_cls_mean_cov_step(void)
     for (int j = 0; j < pool->dim(); j++)
       kld += target_cov(j)/exp(cov(j))+cov(j)-util::safe_log(target_cov(j));
     if (info > 0)
-      fprintf(stderr, "  KLD: %.4f\n", kld);
+      fprintf(update_log, "  KLD: %.4f\n", kld);
   }
 }
 
@@ -1985,7 +2070,7 @@ void soft_max_mixture_cls_step(void)
         search_dir(j) = val;
       }
       if (info > 0)
-        fprintf(stderr, "Gradient update for mixture %i\n", i);
+        fprintf(update_log, "Gradient update for mixture %i\n", i);
     }
 
     // Update parameters, ensure KLD restriction
@@ -2059,8 +2144,8 @@ void soft_max_mixture_cls_step(void)
     {
       if (info > 0)
       {
-        fprintf(stderr, "Warning: Invalid search direction, no update for mixture %i\n", i);
-        fprintf(stderr, "init_step = %g, kld = %g\n", init_step, kld);
+        fprintf(update_log, "Warning: Invalid search direction, no update for mixture %i\n", i);
+        fprintf(update_log, "init_step = %g, kld = %g\n", init_step, kld);
       }
     }
   }
@@ -2127,7 +2212,7 @@ void combined_mean_covariance_cls_update(void)
       for (int j = 0; j < dim; j++)
         mean_search_dir(j) = step*mean_search_dir(j);
       if (info > 0)
-        fprintf(stderr, "Gradient update for mean %i\n", i);
+        fprintf(update_log, "Gradient update for mean %i\n", i);
     }
     else
     {
@@ -2196,12 +2281,12 @@ void combined_mean_covariance_cls_update(void)
       {
         // No covariance update
         if (info > 0)
-          fprintf(stderr, "Warning: No covariance update for Gaussian %i\n", i);
+          fprintf(update_log, "Warning: No covariance update for Gaussian %i\n", i);
         for (int j = 0; j < dim; j++)
           cov_search_dir(j) = 0;
       }
       if (info > 0)
-        fprintf(stderr, "Gradient update for covariance %i\n", i);
+        fprintf(update_log, "Gradient update for covariance %i\n", i);
     }
 
     // KLD limit the whole Gaussian
@@ -2286,7 +2371,7 @@ void separate_mean_covariance_cls_update(void)
           mean_search_dir(j) = scale * mean_search_dir(j);
       }
       if (info > 0)
-        fprintf(stderr, "Gradient update for mean %i, scale %g\n", i, scale);
+        fprintf(update_log, "Gradient update for mean %i, scale %g\n", i, scale);
 
 //      printf("G\n");
     }
@@ -2330,7 +2415,7 @@ void separate_mean_covariance_cls_update(void)
       if (info > 0)
       {
         GaussianMeanKLD g(&cov, &mean_search_dir, dim);        
-        fprintf(stderr, "Mean %i, KLD %.4f\n", i,
+        fprintf(update_log, "Mean %i, KLD %.4f\n", i,
                 g.evaluate_function(1));
       }
     }
@@ -2425,14 +2510,14 @@ void separate_mean_covariance_cls_update(void)
           step /= 2;
           kld = gc.evaluate_function(step);
           if (info > 0)
-            fprintf(stderr, "Covariance %i: gradient fallback to step %.4g, KLD %.4g\n", i, step, kld);
+            fprintf(update_log, "Covariance %i: gradient fallback to step %.4g, KLD %.4g\n", i, step, kld);
         }
       }
       else
       {
         step = 0;
         if (info > 0)
-          fprintf(stderr, "Warning: No covariance update for Gaussian %i\n", i);
+          fprintf(update_log, "Warning: No covariance update for Gaussian %i\n", i);
       }
     }
 
@@ -2447,18 +2532,18 @@ void separate_mean_covariance_cls_update(void)
           if (mpe_gamma > 0)
           {
             if (info > 0)
-              fprintf(stderr, "Covariance %i: Critical point update, step %.4g, KLD %.4g\n", i, step, gc.evaluate_function(step));
+              fprintf(update_log, "Covariance %i: Critical point update, step %.4g, KLD %.4g\n", i, step, gc.evaluate_function(step));
           }
           else
           {
             if (info > 0)
-              fprintf(stderr, "Covariance %i: Minimum point update, step %.4g, KLD %.4g\n", i, step, gc.evaluate_function(step));
+              fprintf(update_log, "Covariance %i: Minimum point update, step %.4g, KLD %.4g\n", i, step, gc.evaluate_function(step));
           }
         }
         else
         {
           if (info > 0)
-            fprintf(stderr, "Covariance %i: Gradient update, step %.4g, KLD %.4g\n", i, step, gc.evaluate_function(step));
+            fprintf(update_log, "Covariance %i: Gradient update, step %.4g, KLD %.4g\n", i, step, gc.evaluate_function(step));
         }
 
 //         if (pos)
@@ -2476,7 +2561,7 @@ void separate_mean_covariance_cls_update(void)
         if (pos)
         {
           if (info > 0)
-            fprintf(stderr, "Covariance %i: Critical point update, step 1, KLD %.4g\n", i, kld);
+            fprintf(update_log, "Covariance %i: Critical point update, step 1, KLD %.4g\n", i, kld);
         }
 
 //        printf("C\n");
@@ -2492,19 +2577,16 @@ void separate_mean_covariance_cls_update(void)
 }
 
 
-void kld_constrained_mixture_update(void)
+void kld_constrained_mixture_update_block(int first, int last,
+                                          UpdateCounters &counters)
 {
   double avg_mixture_max_lambda = 1;
   int num_mixture_max_update = 0;
   double avg_mixture_linear_lambda = 1;
   int num_mixture_linear_update = 0;
 
-  // Initialize Gaussian weights
-  gaussian_weights.clear();
-  gaussian_weights.resize(model.get_pool()->size(), 0);
-  
-  // Go through all the mixtures and update their components
-  for (int i = 0; i < model.num_emission_pdfs(); i++)
+  // Go through the mixtures and update their components
+  for (int i = first; i < last; i++)
   {
     Mixture *m = model.get_emission_pdf(i);
     Vector orig_weights;
@@ -2519,7 +2601,7 @@ void kld_constrained_mixture_update(void)
     weight_abs_gamma.resize(m->size());
     bool mixture_max_update = true;
 
-    fprintf(stderr, "Mixture %i\n", i);
+    fprintf(update_log, "Mixture %i\n", i);
 
     for (int j = 0; j < m->size(); j++)
     {
@@ -2541,7 +2623,6 @@ void kld_constrained_mixture_update(void)
           g->get_accumulated_aux_gamma(PDF::MMI_BUF);
       else if (opt_mode == MODE_MPE)
         weight_abs_gamma(j) = g->get_accumulated_aux_gamma(PDF::MPE_NUM_BUF);
-      gaussian_weights[m->get_base_pdf_index(j)] += orig_weights(j);
     }
 
     double mix_ratio = mixture_criterion_kld_ratio;
@@ -2555,11 +2636,11 @@ void kld_constrained_mixture_update(void)
     }
 
     mix_ratio *= m->size();
-    fprintf(stderr, "  Mixture: Ratio: %g\n", mix_ratio);
+    fprintf(update_log, "  Mixture: Ratio: %g\n", mix_ratio);
 
     if (mixture_max_update)
     {
-      fprintf(stderr, "Critical point update\n");
+      fprintf(update_log, "Critical point update\n");
 
       // Try critical point update
       CriticalMixtureSolver mixture_solver(orig_weights, weight_gamma,
@@ -2574,7 +2655,7 @@ void kld_constrained_mixture_update(void)
       }
       if (!mixture_solver.solve_weights(lambda, new_weights))
         mixture_max_update = false;
-      fprintf(stderr, "  Final lambda = %g\n", lambda);
+      fprintf(update_log, "  Final lambda = %g\n", lambda);
 
       // Check the normalization constraint
       double norm = 0;
@@ -2584,11 +2665,11 @@ void kld_constrained_mixture_update(void)
         mixture_max_update = false;
       
       double final_kld = mixture_solver.evaluate_function(lambda);
-      fprintf(stderr, "  init_k = %g\n", final_kld);
+      fprintf(update_log, "  init_k = %g\n", final_kld);
       // Check the KLD
       if (final_kld > weight_kld_limit)
       {
-        fprintf(stderr, "Warning: Final mixture weight evaluation failed\n");
+        fprintf(update_log, "Warning: Final mixture weight evaluation failed\n");
         mixture_max_update = false;
       }
 
@@ -2596,7 +2677,7 @@ void kld_constrained_mixture_update(void)
       double d = mixture_solver.evaluate_objective_function(new_weights) - mixture_solver.evaluate_objective_function(orig_weights);
       if (d < 0)
       {
-        fprintf(stderr, "Warning: Decreasing objective function %g -> %g (%g)\n", mixture_solver.evaluate_objective_function(orig_weights), mixture_solver.evaluate_objective_function(new_weights), d);
+        fprintf(update_log, "Warning: Decreasing objective function %g -> %g (%g)\n", mixture_solver.evaluate_objective_function(orig_weights), mixture_solver.evaluate_objective_function(new_weights), d);
         // for (int j = 0; j < m->size(); j++)
         //   fprintf(stderr, "  %g -> %g (A: %g, G: %g, T: %g)\n", orig_weights(j), new_weights(j), weight_abs_gamma(j), weight_gamma(j),
         //           orig_weights(j)*(weight_abs_gamma(j)+weight_gamma(j))/
@@ -2607,7 +2688,7 @@ void kld_constrained_mixture_update(void)
       
       if (mixture_max_update)
       {
-        mixture_max_objective_function += d;
+        counters.mixture_max_objective_function += d;
         avg_mixture_max_lambda = (avg_mixture_max_lambda*num_mixture_max_update+
                                   lambda) / (num_mixture_max_update + 1);
         num_mixture_max_update++;
@@ -2620,11 +2701,11 @@ void kld_constrained_mixture_update(void)
             double old_lambda = lambda;
             lambda = search_lambda(lambda, 0, mixture_solver);
             assert( lambda >= old_lambda );
-            fprintf(stderr, "  Mixture: Increasing lambda %g -> %g\n",
+            fprintf(update_log, "  Mixture: Increasing lambda %g -> %g\n",
                     old_lambda, lambda);
             if (!mixture_solver.solve_weights(lambda, new_weights))
             {
-              fprintf(stderr, "Warning: Mixture weight evaluation failed after KLD ratio\n");
+              fprintf(update_log, "Warning: Mixture weight evaluation failed after KLD ratio\n");
               mixture_max_update = false;
             }
             else
@@ -2637,20 +2718,20 @@ void kld_constrained_mixture_update(void)
           global_debug_flag = false;
         }
         if (mixture_max_update)
-          fprintf(stderr, "Mixture KLD %.6f\n", final_kld);
+          fprintf(update_log, "Mixture KLD %.6f\n", final_kld);
       }
     }
 
     // EBW: Skip update if EBW equations do not produce valid a update
     if (!mixture_max_update)
     {
-      fprintf(stderr, "Warning: No update\n");
+      fprintf(update_log, "Warning: No update\n");
       continue;
     }
     
     if (!mixture_max_update)
     {
-      fprintf(stderr, "Linear update\n");
+      fprintf(update_log, "Linear update\n");
       LinearMixtureSolver mixture_solver(orig_weights, weight_gradient,
                                          mix_ratio);
       double lambda = 0;
@@ -2674,15 +2755,15 @@ void kld_constrained_mixture_update(void)
           double old_lambda = lambda;
           lambda = search_lambda(lambda, 0, mixture_solver);
           assert( lambda >= old_lambda );
-          fprintf(stderr, "  Mixture: Increasing lambda %g -> %g\n",
+          fprintf(update_log, "  Mixture: Increasing lambda %g -> %g\n",
                   old_lambda, lambda);
           mixture_solver.solve_weights(lambda, new_weights);
         }
       }
       
-      fprintf(stderr, "  Final lambda = %g\n", lambda);
+      fprintf(update_log, "  Final lambda = %g\n", lambda);
       mixture_solver.set_kld_evaluation(true);
-      fprintf(stderr, "Mixture KLD %.6f\n", mixture_solver.evaluate_function(lambda));
+      fprintf(update_log, "Mixture KLD %.6f\n", mixture_solver.evaluate_function(lambda));
     }
 
     // Set the new mixture parameters
@@ -2692,7 +2773,26 @@ void kld_constrained_mixture_update(void)
 }
 
 
-void kld_constrained_mean_covariance_update(void)
+void kld_constrained_mixture_update(void)
+{
+  // Initialize Gaussian weights
+  gaussian_weights.clear();
+  gaussian_weights.resize(model.get_pool()->size(), 0);
+  for (int i = 0; i < model.num_emission_pdfs(); i++)
+  {
+    Mixture *m = model.get_emission_pdf(i);
+    for (int j = 0; j < m->size(); j++)
+      gaussian_weights[m->get_base_pdf_index(j)] +=
+        m->get_mixture_coefficient(j);
+  }
+
+  parallel_update(model.num_emission_pdfs(),
+                  kld_constrained_mixture_update_block);
+}
+
+
+void kld_constrained_mean_covariance_update_block(int first, int last,
+                                                  UpdateCounters &counters)
 {
   PDFPool *pool = model.get_pool();
   int dim = pool->dim();
@@ -2706,8 +2806,8 @@ void kld_constrained_mean_covariance_update(void)
   // Assuming diagonal covariance!
   double param_ratio = (double)pool->dim()/(pool->size()*(pool->dim()*2+1.0));
 
-  // Update means and covariances (diagonal) of all Gaussians
-  for (int i = 0; i < pool->size(); i++)
+  // Update means and covariances (diagonal) of the Gaussians
+  for (int i = first; i < last; i++)
   {
     Gaussian *pdf = dynamic_cast< Gaussian* >(pool->get_pdf(i));
     if (pdf == NULL)
@@ -2761,13 +2861,13 @@ void kld_constrained_mean_covariance_update(void)
     {
       gaussian_weight = gaussian_weights[i];
       if (gaussian_weight <= 0)
-        fprintf(stderr, "Warning: Invalid Gaussian weight %g\n", gaussian_weight);
+        fprintf(update_log, "Warning: Invalid Gaussian weight %g\n", gaussian_weight);
     }
 
 
     if (d_gamma == 0)
     {
-      fprintf(stderr,"Warning: Skipping Gaussian %i update, gamma = 0\n", i);
+      fprintf(update_log,"Warning: Skipping Gaussian %i update, gamma = 0\n", i);
       continue;
     }
 
@@ -2794,7 +2894,7 @@ void kld_constrained_mean_covariance_update(void)
 
     double min_mean_lambda = max(-d_gamma, 0.0);
     if (info > 0)
-      fprintf(stderr, "Mean %i, minimum lambda limit: > %g\n", i,
+      fprintf(update_log, "Mean %i, minimum lambda limit: > %g\n", i,
               min_mean_lambda);
 
     CriticalMeanSolver mean_solver(mean, cov, d_gamma, d_m1);
@@ -2823,7 +2923,7 @@ void kld_constrained_mean_covariance_update(void)
       if (weighted_gaussian_kld_ratios)
         mean_ratio *= gaussian_weight;
       if (mean_ratio != mean_criterion_kld_ratio)
-        fprintf(stderr, "  Mean: Ratio: %g\n", mean_ratio);
+        fprintf(update_log, "  Mean: Ratio: %g\n", mean_ratio);
         
       MeanSolver ratio_mean_solver(mean, cov, d_gamma, abs_gamma, d_m1,
                                    mean_ratio);
@@ -2833,14 +2933,14 @@ void kld_constrained_mean_covariance_update(void)
         double old_lambda = lambda;
         lambda = search_lambda(lambda, 0, ratio_mean_solver);
         assert( lambda >= old_lambda );
-        fprintf(stderr, "  Mean: Increasing lambda %g -> %g\n", old_lambda, lambda);
+        fprintf(update_log, "  Mean: Increasing lambda %g -> %g\n", old_lambda, lambda);
         ratio_mean_solver.solve_mean(lambda, target_mean);
       }
       else
-        fprintf(stderr, "  Lambda = %g\n", lambda);
+        fprintf(update_log, "  Lambda = %g\n", lambda);
     }
     else
-      fprintf(stderr, "  Lambda = %g\n", lambda);
+      fprintf(update_log, "  Lambda = %g\n", lambda);
     
     pdf->set_mean(target_mean);
 
@@ -2851,14 +2951,14 @@ void kld_constrained_mean_covariance_update(void)
       for (int j = 0; j < dim; j++)
         mean_search_dir(j) = target_mean(j) - mean(j);
       GaussianMeanKLD g(&cov, &mean_search_dir, dim);        
-      fprintf(stderr, "Mean KLD %.6f\n", g.evaluate_function(1));
+      fprintf(update_log, "Mean KLD %.6f\n", g.evaluate_function(1));
     }
 
     /////////////////////
     // Covariance update
     /////////////////////
 
-    fprintf(stderr, "Cov %i\n", i);
+    fprintf(update_log, "Cov %i\n", i);
     bool max_cov_update = true;
 
     // This check is too strict, but the effect seems to be small
@@ -2883,7 +2983,7 @@ void kld_constrained_mean_covariance_update(void)
     if (weighted_gaussian_kld_ratios)
       cov_ratio *= gaussian_weight;
     if (cov_ratio != cov_criterion_kld_ratio)  
-      fprintf(stderr, "  Cov: Ratio: %g\n", cov_ratio);
+      fprintf(update_log, "  Cov: Ratio: %g\n", cov_ratio);
 
     double cur_cov_kld_limit = cov_kld_limit;
     
@@ -2922,11 +3022,11 @@ void kld_constrained_mean_covariance_update(void)
             min_lambda = lim2;
         }
       }
-      fprintf(stderr, "  Minimum lambda: %g\n", min_lambda);
+      fprintf(update_log, "  Minimum lambda: %g\n", min_lambda);
 
       // Try critical point update
       double max_kld = cov_solver.evaluate_function(min_lambda);
-      fprintf(stderr, "  Maximum KLD: %g\n", max_kld);
+      fprintf(update_log, "  Maximum KLD: %g\n", max_kld);
 
       lambda = min_lambda;
       if (max_kld > cur_cov_kld_limit)
@@ -2965,14 +3065,14 @@ void kld_constrained_mean_covariance_update(void)
     {
       cov_solver.set_solver(CovSolver::LINEAR);
       if (info > 0)
-        fprintf(stderr, "Cov %i, gradient update\n", i);
+        fprintf(update_log, "Cov %i, gradient update\n", i);
       lambda = search_lambda(avg_cov_linear_lambda, cur_cov_kld_limit, cov_solver);
       avg_cov_linear_lambda =
         (avg_cov_linear_lambda*num_cov_linear_update + lambda) /
         (num_cov_linear_update + 1);
       num_cov_linear_update++;
       cov_solver.solve_cov(lambda, target_cov);
-      fprintf(stderr, "  Final lambda = %g\n", lambda);
+      fprintf(update_log, "  Final lambda = %g\n", lambda);
     }
 
     if (cov_ratio > 0)
@@ -2983,7 +3083,7 @@ void kld_constrained_mean_covariance_update(void)
         double old_lambda = lambda;
         lambda = search_lambda(lambda, 0, cov_solver);
         assert( lambda >= old_lambda );
-        fprintf(stderr, "  Cov: Increasing lambda %g -> %g\n",
+        fprintf(update_log, "  Cov: Increasing lambda %g -> %g\n",
                 old_lambda, lambda);
         cov_solver.solve_cov(lambda, target_cov);
       }
@@ -3004,15 +3104,22 @@ void kld_constrained_mean_covariance_update(void)
       }
 
       GaussianCovKLD gc(&lcov, &cov_search_dir, dim, min_var);
-      fprintf(stderr, "Cov KLD %.6f\n", gc.evaluate_function(1));
+      fprintf(update_log, "Cov KLD %.6f\n", gc.evaluate_function(1));
     }
   }
 }
 
 
-void ebw_mixture_update(void)
+void kld_constrained_mean_covariance_update(void)
 {
-  for (int i = 0; i < model.num_emission_pdfs(); i++)
+  parallel_update(model.get_pool()->size(),
+                  kld_constrained_mean_covariance_update_block);
+}
+
+
+void ebw_mixture_update_block(int first, int last, UpdateCounters &counters)
+{
+  for (int i = first; i < last; i++)
   {
     Mixture *m = model.get_emission_pdf(i);
     vector<double> num_gamma;
@@ -3089,7 +3196,7 @@ void ebw_mixture_update(void)
         
         if (sol1 <= 0 || sol1 >= 1.0 || (sol2 > 0 && sol2 < 1.0))
         {
-          fprintf(stderr, "Warning: Mixture size %i, iter %i, sol1 = %g, sol2 = %g, old = %g\n", m->size(), iter, sol1, sol2, old_weights[w]);
+          fprintf(update_log, "Warning: Mixture size %i, iter %i, sol1 = %g, sol2 = %g, old = %g\n", m->size(), iter, sol1, sol2, old_weights[w]);
         }
 
         // Heuristics: If outside permitted region, move halfway
@@ -3120,7 +3227,7 @@ void ebw_mixture_update(void)
       diff = fabs(oldfval-currfval);
       if (iter > 1 && oldfval > currfval)
       {
-        fprintf(stderr, "Warning: Mixture size %i, iter %i, reduced function value, %g\n", m->size(), iter, currfval - oldfval);
+        fprintf(update_log, "Warning: Mixture size %i, iter %i, reduced function value, %g\n", m->size(), iter, currfval - oldfval);
       }
     }
     for (int j = 0; j < (int)m->size(); j++)
@@ -3129,6 +3236,12 @@ void ebw_mixture_update(void)
 }
 
 
+void ebw_mixture_update(void)
+{
+  parallel_update(model.num_emission_pdfs(), ebw_mixture_update_block);
+}
+
+
 void cls_step(bool kldcs) //const string &in_grad_file, const string &out_grad_file)
 {
   if (!kldcs)
@@ -3178,11 +3291,15 @@ main(int argc, char *argv[])
       ('\0', "weighted-ratio", "", "", "Gaussian KLD ratios weighted by mixture weights")
       ('s', "savesum=FILE", "arg", "", "save summary information")
       ('\0', "no-write", "", "", "Don't write anything")
+      ('T', "threads=INT", "arg", "1", "number of threads in the update (default 1)")
       ('i', "info=INT", "arg", "0", "info level")
       ;
     config.default_parse(argc, argv);
 
     info = config["info"].get_int();
+    num_threads = config["threads"].get_int();
+    if (num_threads < 1)
+      throw string("Invalid number of threads");
     out_model_name = config["out"].get_str();
 
     string mode_str = config["mode"].get_str();
@@ -3340,10 +3457,7 @@ main(int argc, char *argv[])
     }
 
     // Print statistics
-   printf("Sum of mixture MAX objective functions: %g\n", mixture_max_objective_function);
-    printf("\nSum of objective functions: %g\n", global_sum_objective);
-    printf("%i mixtures below KLD limit\n", global_num_below_kld);
-    printf("%i negative objective functions\n", global_num_negative_objective);
+   printf("Sum of mixture MAX objective functions: %g\n", global_counters.mixture_max_objective_function);
   }
   
   catch (exception &e) {
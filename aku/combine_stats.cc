@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <iostream>
@@ -6,6 +7,8 @@
 #include "str.hh"
 #include "conf.hh"
 #include "HmmSet.hh"
+#include "StatisticsFile.hh"
+#include "Parallel.hh"
 
 using namespace aku;
 
@@ -28,6 +31,8 @@ main(int argc, char *argv[])
       ('p', "ph=FILE", "arg", "", "HMM definitions")
       ('L', "list=LISTNAME", "arg must", "", "File with one statistics file per line")
       ('o', "out=BASENAME", "arg must", "", "Base filename for output statistics")
+      ('I', "indexed", "", "", "Write the output in the indexed binary format (.sts)")
+      ('T', "threads=INT", "arg", "1", "Number of threads for summing indexed statistics files")
       ;
     config.default_parse(argc, argv);
 
@@ -56,11 +61,24 @@ main(int argc, char *argv[])
       exit(1);
     }
 
-    // Accumulate statistics
+    int num_threads = config["threads"].get_int();
+    if (num_threads < 1)
+      throw std::string("Invalid number of threads");
+
+    // Accumulate statistics. The indexed files are only mapped here and
+    // summed below.
+    std::vector<StatisticsFile*> indexed_files;
     while (filelist >> stat_file && stat_file != " ") {
-      model.accumulate_gk_from_dump(stat_file+".gks");
-      model.accumulate_mc_from_dump(stat_file+".mcs");
-      model.accumulate_ph_from_dump(stat_file+".phs");
+      if (StatisticsFile::is_statistics_file(stat_file+".sts")) {
+        indexed_files.push_back(new StatisticsFile(stat_file+".sts"));
+        model.prepare_accumulating_from(*indexed_files.back());
+        model.accumulate_ph_from(*indexed_files.back());
+      }
+      else {
+        model.accumulate_gk_from_dump(stat_file+".gks");
+        model.accumulate_mc_from_dump(stat_file+".mcs");
+        model.accumulate_ph_from_dump(stat_file+".phs");
+      }
       std::string lls_file_name = stat_file+".lls";
       std::ifstream lls_file(lls_file_name.c_str());
       while (lls_file.good())
@@ -83,8 +101,39 @@ main(int argc, char *argv[])
       lls_file.close();
     }
 
+    // Sum the indexed files in parallel, each thread taking a range of
+    // Gaussians or mixtures at a time. The files are summed in the order
+    // of the list, so the result does not depend on the number of threads.
+    if (indexed_files.size() > 0) {
+      int num_gaussians = model.get_pool()->size();
+      int num_mixtures = model.num_emission_pdfs();
+      int gaussian_jobs = std::min(num_gaussians, 8 * num_threads);
+      int mixture_jobs = std::min(num_mixtures, 8 * num_threads);
+      run_parallel(gaussian_jobs + mixture_jobs, num_threads,
+                   [&](int job, int thread) {
+        bool gaussians = (job < gaussian_jobs);
+        int num_pdfs = gaussians ? num_gaussians : num_mixtures;
+        int num_jobs = gaussians ? gaussian_jobs : mixture_jobs;
+        if (!gaussians)
+          job -= gaussian_jobs;
+        int first = (int)((long)num_pdfs * job / num_jobs);
+        int last = (int)((long)num_pdfs * (job + 1) / num_jobs);
+        for (size_t f = 0; f < indexed_files.size(); f++) {
+          if (gaussians)
+            model.accumulate_gk_from(*indexed_files[f], first, last);
+          else
+            model.accumulate_mc_from(*indexed_files[f], first, last);
+        }
+      });
+      for (size_t f = 0; f < indexed_files.size(); f++)
+        delete indexed_files[f];
+    }
+
     std::string out_file = config["out"].get_str();
-    model.dump_statistics(out_file);
+    if (config["indexed"].specified)
+      model.dump_indexed_statistics(out_file+".sts");
+    else
+      model.dump_statistics(out_file);
     if (sum_statistics.size() > 0)
     {
       std::string lls_file_name = out_file+".lls";
@@ -7,6 +7,7 @@
 #include "str.hh"
 #include "conf.hh"
 #include "HmmSet.hh"
+#include "StatisticsFile.hh"
 #include "FeatureGenerator.hh"
 #include "Recipe.hh"
 
@@ -124,6 +125,7 @@ main(int argc, char *argv[])
       ('o', "out=BASENAME", "arg must", "", "base filename for output models")
       ('t', "transitions", "", "", "estimate also state transitions")
       ('i', "info=INT", "arg", "0", "info level")
+      ('T', "threads=INT", "arg", "1", "number of threads in parameter estimation (default 1)")
       ('\0', "mllt=MODULE", "arg", "", "update maximum likelihood linear transform")
       ('\0', "ml", "", "", "maximum likelihood estimation")
       ('\0', "mmi", "", "", "maximum mutual information estimation")
@@ -158,6 +160,8 @@ main(int argc, char *argv[])
     transtat = config["transitions"].specified;    
     info = config["info"].get_int();
     out_file = config["out"].get_str();
+    if (config["threads"].get_int() < 1)
+      throw std::string("Invalid number of threads");
 
     int count = 0;
     if (config["ml"].specified) {
@@ -283,12 +287,31 @@ main(int argc, char *argv[])
       exit(1);
     }
 
+    // The statistics the estimation needs
+    PDF::StatisticsMode required_statistics = PDF_ML_STATS | PDF_ML_FULL_STATS;
+    if (mode == PDF::MMI_EST)
+      required_statistics = PDF_MMI_STATS;
+    else if (mode == PDF::MPE_EST || mode == PDF::MPE_MMI_PRIOR_EST)
+      required_statistics = PDF_MPE_NUM_STATS;
+
     // Accumulate statistics
     while (filelist >> stat_file && stat_file != " ") {
-      model.accumulate_gk_from_dump(stat_file+".gks");
-      model.accumulate_mc_from_dump(stat_file+".mcs");
-      if (transtat)
-        model.accumulate_ph_from_dump(stat_file+".phs");
+      if (StatisticsFile::is_statistics_file(stat_file+".sts")) {
+        StatisticsFile file(stat_file+".sts");
+        if (!(file.header().mode & required_statistics))
+          throw str::fmt(512, "%s does not contain the statistics for the estimation mode\n", file.filename().c_str());
+        model.prepare_accumulating_from(file);
+        model.accumulate_gk_from(file, 0, model.get_pool()->size());
+        model.accumulate_mc_from(file, 0, model.num_emission_pdfs());
+        if (transtat)
+          model.accumulate_ph_from(file);
+      }
+      else {
+        model.accumulate_gk_from_dump(stat_file+".gks");
+        model.accumulate_mc_from_dump(stat_file+".mcs");
+        if (transtat)
+          model.accumulate_ph_from_dump(stat_file+".phs");
+      }
       std::string lls_file_name = stat_file+".lls";
       std::ifstream lls_file(lls_file_name.c_str());
       while (lls_file.good())
@@ -371,7 +394,8 @@ main(int argc, char *argv[])
       if (config["mllt"].specified)
         model.estimate_mllt(fea_gen, config["mllt"].get_str());
       else
-        model.estimate_parameters(mode, true, !config["no-mixture-update"].specified);
+        model.estimate_parameters(mode, true, !config["no-mixture-update"].specified,
+                                  config["threads"].get_int());
       
       // Delete Gaussians
       if (config["delete"].specified)
@@ -1,10 +1,12 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include "Distributions.hh"
 #include "conf.hh"
 #include "LinearAlgebra.hh"
 #include "HmmSet.hh"
 #include "RegClassTree.hh"
+#include "Parallel.hh"
 
 using namespace aku;
 
@@ -17,6 +19,7 @@ bool diagonal = true;
 int num_iterations;
 int dim;
 int info;
+int num_threads = 1;
 
 int num_clusters;
 
@@ -28,8 +31,26 @@ struct GaussianInfo {
   double ldet; // Logarithmic determinant (used only if diagonal in use)
   
   bool valid;
+  int count; // Number of Gaussians in a cluster
 
-  GaussianInfo() : g(NULL), valid(false) { }
+  GaussianInfo() : g(NULL), valid(false), count(0) { }
+};
+
+// A candidate merge of clusters first < second. The candidate is stale if
+// either cluster has changed since the distance was computed.
+struct MergeCandidate {
+  double distance;
+  int first, second;
+  int first_version, second_version;
+
+  // Orders the heap so that the smallest distance is on top
+  bool operator<(const MergeCandidate &c) const {
+    if (distance != c.distance)
+      return distance > c.distance;
+    if (first != c.first)
+      return first > c.first;
+    return second > c.second;
+  }
 };
 
 class GaussianClustering {
@@ -44,13 +65,17 @@ std::vector<int> cluster_map;
 
 
 
-  GaussianClustering(std::vector<int> &gaussian_ids) : m_gaussian_ids(gaussian_ids) { }
+  GaussianClustering(std::vector<int> &gaussian_ids) : m_gaussian_ids(gaussian_ids), m_merge_heap_valid(false) { }
 
   void set_num_clusters(int n_clusters) { num_clusters = n_clusters; clusters.resize(n_clusters); }
-  void make_initial_clusters(void);
+  void make_initial_clusters(const std::vector<int> &perm);
   void collect_gaussians(PDFPool *pool);
 
-  merge_option_type get_best_merge_option() const;
+  // Computes the distances of all the cluster pairs into the merge heap.
+  // The heap is rebuilt automatically when needed, but can be built in
+  // advance with several threads.
+  void build_merge_heap(int threads);
+  merge_option_type get_best_merge_option();
 
   void merge(std::pair<int,int> p);
 
@@ -58,8 +83,14 @@ std::vector<int> cluster_map;
 
 private:
   void compute_cluster_statistics(void);
+  void push_merge_candidate(int c1, int c2);
   double kl_divergence(int gauss_index, int cluster_index) const;
   double kl_divergence(const GaussianInfo &g1, const GaussianInfo &g2) const;
+
+  std::vector< std::vector<int> > m_members; // Gaussians in each cluster
+  std::vector<int> m_versions; // Incremented when a cluster changes
+  std::vector<MergeCandidate> m_merge_heap;
+  bool m_merge_heap_valid;
 };
 
 std::vector<GaussianClustering> cluster_groups;
@@ -72,37 +103,129 @@ struct CompPair {
     };
 
 
-merge_option_type GaussianClustering::get_best_merge_option() const {
-  std::pair<int,int> best_merge_option (0,0);
-  double smallest_distance = 1e100;
-
-  for(unsigned int i = 0; i < clusters.size(); ++i) {
-    if(!clusters[i].valid) continue;
-    for(unsigned int j = i+1; j < clusters.size(); ++j) {
-      if(!clusters[j].valid) continue;
+void GaussianClustering::push_merge_candidate(int c1, int c2) {
+  MergeCandidate c;
+  c.first = std::min(c1, c2);
+  c.second = std::max(c1, c2);
+  c.distance = kl_divergence(clusters[c.first], clusters[c.second]);
+  c.first_version = m_versions[c.first];
+  c.second_version = m_versions[c.second];
+  m_merge_heap.push_back(c);
+  std::push_heap(m_merge_heap.begin(), m_merge_heap.end());
+}
 
-      double dist = kl_divergence(clusters[i], clusters[j]);
-      if(dist < smallest_distance) {
-        smallest_distance = dist;
-        best_merge_option.first = i;
-        best_merge_option.second = j;
+void GaussianClustering::build_merge_heap(int threads) {
+  std::vector<int> valid_clusters;
+  for(unsigned int i = 0; i < clusters.size(); ++i)
+    if(clusters[i].valid) valid_clusters.push_back(i);
+
+  std::vector< std::vector<MergeCandidate> > rows(valid_clusters.size());
+  run_parallel((int)valid_clusters.size(), threads, [&](int r, int) {
+      for(unsigned int s = r+1; s < valid_clusters.size(); ++s) {
+        MergeCandidate c;
+        c.first = valid_clusters[r];
+        c.second = valid_clusters[s];
+        c.distance = kl_divergence(clusters[c.first], clusters[c.second]);
+        c.first_version = m_versions[c.first];
+        c.second_version = m_versions[c.second];
+        rows[r].push_back(c);
       }
-    }
+    });
+
+  m_merge_heap.clear();
+  for(unsigned int r = 0; r < rows.size(); ++r) {
+    m_merge_heap.insert(m_merge_heap.end(), rows[r].begin(), rows[r].end());
+    std::vector<MergeCandidate>().swap(rows[r]);
   }
+  std::make_heap(m_merge_heap.begin(), m_merge_heap.end());
+  m_merge_heap_valid = true;
+}
 
-  merge_option_type merge;
-  merge.first = best_merge_option;
-  merge.second = smallest_distance;
+merge_option_type GaussianClustering::get_best_merge_option() {
+  if(!m_merge_heap_valid)
+    build_merge_heap(1);
+
+  // Drop the candidates whose clusters have been merged since
+  while(!m_merge_heap.empty()) {
+    const MergeCandidate &c = m_merge_heap.front();
+    if(clusters[c.first].valid && clusters[c.second].valid &&
+       c.first_version == m_versions[c.first] &&
+       c.second_version == m_versions[c.second])
+      break;
+    std::pop_heap(m_merge_heap.begin(), m_merge_heap.end());
+    m_merge_heap.pop_back();
+  }
+
+  merge_option_type merge(std::pair<int,int>(0,0), 1e100);
+  if(!m_merge_heap.empty()) {
+    merge.first.first = m_merge_heap.front().first;
+    merge.first.second = m_merge_heap.front().second;
+    merge.second = m_merge_heap.front().distance;
+  }
   return merge;
 }
 
+// Merges cluster p.second to p.first. Only the statistics of p.first are
+// updated, and the distances from it are pushed to the merge heap.
 void GaussianClustering::merge(std::pair<int,int> p) {
-  clusters[p.second].valid = false;
-  for(unsigned int g = 0; g < cluster_map.size(); ++g)
-    if(cluster_map[g] == p.second) cluster_map[g] = p.first;
-
-  compute_cluster_statistics();
-
+  if(p.first == p.second) return;
+  GaussianInfo &c1 = clusters[p.first];
+  GaussianInfo &c2 = clusters[p.second];
+
+  if(c2.count > 0) {
+    if(c1.count == 0) {
+      c1.mean = c2.mean;
+      c1.cov = c2.cov;
+      c1.ldet = c2.ldet;
+      std::swap(c1.g, c2.g);
+    }
+    else if (diagonal) {
+      double w1 = c1.count / (double)(c1.count + c2.count);
+      double w2 = c2.count / (double)(c1.count + c2.count);
+      Blas_Scale(w1, c1.mean);
+      Blas_Add_Mult(c1.mean, w2, c2.mean);
+      Blas_Scale(w1, c1.cov);
+      Blas_Add_Mult(c1.cov, w2, c2.cov);
+      double t = 0;
+      for (int j = 0; j < dim; j++)
+        t += log(c1.cov(j));
+      c1.ldet = t;
+    }
+    else {
+      std::vector<double> weights(2);
+      std::vector<const Gaussian*> temp_gauss(2);
+      weights[0] = c1.count;
+      weights[1] = c2.count;
+      temp_gauss[0] = c1.g;
+      temp_gauss[1] = c2.g;
+      Gaussian *g = new FullCovarianceGaussian(dim);
+      g->merge(weights, temp_gauss, false);
+      delete c1.g;
+      c1.g = g;
+    }
+    c1.valid = true;
+  }
+  if(c2.g != NULL) {
+    delete c2.g;
+    c2.g = NULL;
+  }
+  c2.valid = false;
+
+  std::vector<int> &members = m_members[p.second];
+  for(unsigned int i = 0; i < members.size(); ++i)
+    cluster_map[members[i]] = p.first;
+  m_members[p.first].insert(m_members[p.first].end(), members.begin(), members.end());
+  std::vector<int>().swap(members);
+  c1.count += c2.count;
+  c2.count = 0;
+
+  ++m_versions[p.first];
+  ++m_versions[p.second];
+  if(m_merge_heap_valid && c1.valid) {
+    for(unsigned int i = 0; i < clusters.size(); ++i)
+      if((int)i != p.first && clusters[i].valid)
+        push_merge_candidate(p.first, i);
+  }
 }
 
 void GaussianClustering::collect_gaussians(PDFPool *pool)
@@ -181,6 +304,16 @@ void fill_random_permutation(int num, std::vector<int> &p)
 
 void GaussianClustering::compute_cluster_statistics(void)
 {
+  // All clusters may change, so the merge heap is rebuilt when needed
+  m_merge_heap_valid = false;
+  m_merge_heap.clear();
+  m_versions.assign(num_clusters, 0);
+  m_members.assign(num_clusters, std::vector<int>());
+  for (int i = 0; i < (int)gaussians.size(); i++)
+    m_members[cluster_map[i]].push_back(i);
+  for (int i = 0; i < num_clusters; i++)
+    clusters[i].count = (int)m_members[i].size();
+
   if (diagonal)
   {
     std::vector<int> gauss_count;
@@ -259,12 +392,10 @@ void GaussianClustering::compute_cluster_statistics(void)
 }
 
 
-void GaussianClustering::make_initial_clusters(void)
+void GaussianClustering::make_initial_clusters(const std::vector<int> &perm)
 {
   cluster_map.resize((int)gaussians.size());
   // Start with random Gaussians as centers
-  std::vector<int> perm;
-  fill_random_permutation((int)gaussians.size(), perm);
   for (int i = 0; i < num_clusters; i++)
     clusters[i].mean = gaussians[perm[i]].mean;
 
@@ -365,11 +496,15 @@ main(int argc, char *argv[])
       ('t', "iterations=INT", "arg", "4", "number of iterations (default 4)")
       ('R', "regtree=FILE", "arg", "", "regression tree file, if given, the clustering will group gaussians from the same treenode together")
       ('b', "base=BASENAME", "arg", "", "base filename for model files, only necessary if regtree is given")
+      ('T', "threads=INT", "arg", "1", "number of threads (default 1)")
       ('i', "info=INT", "arg", "0", "info level")
       ;
     config.default_parse(argc, argv);
 
     info = config["info"].get_int();
+    num_threads = config["threads"].get_int();
+    if (num_threads < 1)
+      throw std::string("Invalid number of threads");
 
     PDFPool *pool = new PDFPool;
     pool->read_gk(config["gk"].get_str());
@@ -436,10 +571,21 @@ main(int argc, char *argv[])
       diagonal = false;
     std::cerr << "make initial clusters" << std::endl;
 
-    for(unsigned int i = 0; i < cluster_groups.size(); ++i) {
-      cluster_groups[i].collect_gaussians(pool);
-      cluster_groups[i].make_initial_clusters();
-    }
+    // The random initial centers are drawn in the group order, so that the
+    // result does not depend on the number of threads.
+    std::vector< std::vector<int> > permutations(cluster_groups.size());
+    for(unsigned int i = 0; i < cluster_groups.size(); ++i)
+      fill_random_permutation((int)cluster_groups[i].m_gaussian_ids.size(),
+                              permutations[i]);
+
+    std::cerr << "start clustering" << std::endl;
+    run_parallel((int)cluster_groups.size(), num_threads, [&](int i, int) {
+        cluster_groups[i].collect_gaussians(pool);
+        cluster_groups[i].make_initial_clusters(permutations[i]);
+        cluster_groups[i].refine_clustering(4);
+        if (cluster_groups.size() > 1)
+          cluster_groups[i].build_merge_heap(1);
+      });
 
     if (diagonal)
     {
@@ -449,12 +595,8 @@ main(int argc, char *argv[])
     }
 
     int num_total_clusters = 0;
-
-    std::cerr << "start clustering" << std::endl;
-    for(unsigned int i = 0; i < cluster_groups.size(); ++i) {
-      cluster_groups[i].refine_clustering(4);
+    for(unsigned int i = 0; i < cluster_groups.size(); ++i)
       num_total_clusters += cluster_groups[i].clusters.size();
-    }
 
     if(cluster_groups.size() > 1) {
       int num_merges = 0;
@@ -497,6 +639,7 @@ main(int argc, char *argv[])
         if(group_num_merges[queue_item.second.first] > (num_clusters / num_iterations / (int)group_num_merges.size())) {
           group_num_merges[queue_item.second.first] = 0;
           cluster_groups[queue_item.second.first].refine_clustering(2);
+          cluster_groups[queue_item.second.first].build_merge_heap(num_threads);
         }
       }
 
@@ -1,5 +1,6 @@
 #include <climits>
 #include <iostream>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,7 @@
 #include "HmmSet.hh"
 #include "SpeakerConfig.hh"
 #include "endian.hh"
+#include "Parallel.hh"
 
 using namespace aku;
 
@@ -27,7 +29,18 @@ conf::Config config;
 FeatureGenerator gen;
 HmmSet model;
 SpeakerConfig speaker_conf(gen, &model);
-std::vector<float> obs_log_probs;
+int lnabytes;
+int frame_block;
+bool no_normalization;
+
+// An utterance to be processed by the worker threads
+struct Job {
+  int recipe_index;
+  std::string audio_path;
+  std::string out_file;
+  int start_frame;
+  int end_frame;
+};
 
 void write_int(FILE *fp, unsigned int i)
 {
@@ -42,17 +55,130 @@ void write_int(FILE *fp, unsigned int i)
     throw std::string("Write error");
 }
 
+// Writes the LNA file for one utterance. If shared_model is true, the
+// model is only accessed through the const interface, so that several
+// threads may call this at once with their own feature generators.
+// Otherwise the per-frame model caches are used, which is required when
+// the model has speaker adaptation.
+void write_lna(FeatureGenerator &generator, const std::string &audio_path,
+               const std::string &out_file, int start_frame, int end_frame,
+               bool shared_model)
+{
+  io::Stream ofp;
+  BYTE buffer[4];
+  std::vector<float> obs_log_probs(model.num_states());
+
+  // Open files
+  generator.open(audio_path);
+  ofp.open(out_file, "w");
+
+  // Write header
+  write_int(ofp, model.num_states());
+  fputc(lnabytes, ofp);
+
+  // Write the probabilities, scoring a block of frames at a time
+  Matrix block(frame_block, generator.dim());
+  Matrix pool_likelihoods, pdf_likelihoods;
+  PDFPool::LikelihoodBuffers likelihood_buffers;
+  Vector frame(generator.dim());
+  const FeatureVec fea_vec(&frame, generator.dim());
+  for (int f = start_frame; f < end_frame; f += frame_block)
+  {
+    int block_frames = generator.generate_block(
+      f, std::min(frame_block, end_frame - f), block);
+    if (block_frames == 0)
+      break;
+
+    if (shared_model)
+    {
+      if (block_frames < frame_block)
+        model.compute_likelihoods(
+          block(LaIndex(0, block_frames-1), LaIndex(0, generator.dim()-1)),
+          pool_likelihoods, pdf_likelihoods, likelihood_buffers);
+      else
+        model.compute_likelihoods(block, pool_likelihoods, pdf_likelihoods,
+                                  likelihood_buffers);
+    }
+    else
+    {
+      if (block_frames < frame_block)
+        model.precompute_likelihoods(
+          block(LaIndex(0, block_frames-1), LaIndex(0, generator.dim()-1)));
+      else
+        model.precompute_likelihoods(block);
+    }
+
+    for (int b = 0; b < block_frames; b++)
+    {
+      double log_normalizer=0;
+      if (shared_model)
+      {
+        for (int i = 0; i < model.num_states(); i++) {
+          obs_log_probs[i] = pdf_likelihoods(b, model.emission_pdf_index(i));
+          log_normalizer += obs_log_probs[i];
+        }
+      }
+      else
+      {
+        for (int i = 0; i < generator.dim(); i++)
+          frame(i) = block(b, i);
+        model.set_batch_frame(b);
+        for (int i = 0; i < model.num_states(); i++) {
+          obs_log_probs[i] = model.state_likelihood(i, fea_vec);
+          log_normalizer += obs_log_probs[i];
+        }
+      }
+      if (no_normalization || log_normalizer == 0)
+        log_normalizer = 1;
+      for (int i = 0; i < (int)obs_log_probs.size(); i++)
+        obs_log_probs[i] = util::safe_log(obs_log_probs[i] / log_normalizer);
+
+      for (int i = 0; i < model.num_states(); i++)
+      {
+        if (lnabytes == 4)
+        {
+          BYTE *p = (BYTE*)&obs_log_probs[i];
+          for (int j = 0; j < 4; j++)
+            buffer[j] = p[j];
+          if (endian::big)
+            endian::convert(buffer, 4);
+        }
+        else if (lnabytes == 2)
+        {
+          if (obs_log_probs[i] < -36.008)
+          {
+            buffer[0] = 255;
+            buffer[1] = 255;
+          }
+          else
+          {
+            int temp = (int)(-1820.0 * obs_log_probs[i] + .5);
+            buffer[0] = (BYTE)((temp>>8)&255);
+            buffer[1] = (BYTE)(temp&255);
+          }
+        }
+        if ((int)fwrite(buffer, sizeof(BYTE), lnabytes, ofp) < lnabytes)
+          throw std::string("Write error");
+      }
+    }
+    if (block_frames < frame_block)
+      break;
+  }
+
+  generator.close();
+  ofp.close();
+}
+
 int
 main(int argc, char *argv[])
 {
-  int lnabytes;
   int info;
+  int num_threads;
   std::string out_dir = "";
   std::string out_file = "";
   int start_frame, end_frame;
   bool no_overwrite;
-  io::Stream ofp;
-  BYTE buffer[4];
+  std::vector<Job> jobs;
 
   assert( sizeof(BYTE) == 1 );
   
@@ -77,6 +203,8 @@ main(int argc, char *argv[])
       ('N', "no-normalization", "", "", "do not normalize the likelihoods")
       ('B', "batch=INT", "arg", "0", "number of batch processes with the same recipe")
       ('I', "bindex=INT", "arg", "0", "batch process index")
+      ('\0', "frame-block=INT", "arg", "16", "number of frames to score at once")
+      ('\0', "threads=INT", "arg", "1", "number of utterances to process in parallel, not with --speakers")
       ('i', "info=INT", "arg", "0", "info level")
       ;
     config.default_parse(argc, argv);
@@ -90,6 +218,18 @@ main(int argc, char *argv[])
 
     no_overwrite = config["no-overwrite"].specified;
 
+    frame_block = config["frame-block"].get_int();
+    if (frame_block < 1)
+      throw std::string("Invalid frame block size");
+
+    no_normalization = config["no-normalization"].specified;
+
+    num_threads = config["threads"].get_int();
+    if (num_threads < 1)
+      throw std::string("Invalid number of threads");
+    if (num_threads > 1 && config["speakers"].specified)
+      throw std::string("--threads can not be used with --speakers");
+
     if (config["speakers"].specified)
       speaker_conf.read_speaker_file(io::Stream(config["speakers"].get_str()));
 
@@ -145,7 +285,8 @@ main(int argc, char *argv[])
     for (int recipe_index = 0; recipe_index < (int)recipe.infos.size(); 
 	 recipe_index++)
     {
-      if (info > 0)
+      // With several threads the progress is printed when the job starts
+      if (info > 0 && num_threads == 1)
       {
         printf("Processing file %d/%d\n", recipe_index+1,
                (int)recipe.infos.size());
@@ -174,7 +315,7 @@ main(int argc, char *argv[])
           file.erase(pos);
         out_file = out_dir + file + ".lna";
       }
-      if (info > 0)
+      if (info > 0 && num_threads == 1)
         printf("Output: %s\n", out_file.c_str());
 
       if (no_overwrite)
@@ -200,70 +341,61 @@ main(int argc, char *argv[])
                           gen.frame_rate());
       end_frame = (int)(recipe.infos[recipe_index].end_time *
                         gen.frame_rate());
-      if ((info > 0 && start_frame != 0) || end_frame != 0)
+      if (num_threads == 1 &&
+          ((info > 0 && start_frame != 0) || end_frame != 0))
         printf("Generating frames %d - %d\n", start_frame, end_frame);
       if (end_frame == 0)
         end_frame = INT_MAX;
 
-      // Open files
-      gen.open(recipe.infos[recipe_index].audio_path);
-      ofp.open(out_file, "w");
-
-      // Write header
-      write_int(ofp, model.num_states());
-      fputc(lnabytes, ofp);
-
-      // Write the probabilities
-      for (int f = start_frame; f < end_frame; f++)
+      if (num_threads > 1)
       {
-        const FeatureVec fea_vec = gen.generate(f);
-        if (gen.eof())
-          break;
-
-	model.reset_cache();
-	model.precompute_likelihoods(fea_vec);
-	obs_log_probs.resize(model.num_states());
-	double log_normalizer=0;
-        for (int i = 0; i < model.num_states(); i++) {
-          obs_log_probs[i] = model.state_likelihood(i, fea_vec);
-          log_normalizer += obs_log_probs[i];
-        }
-        if (config["no-normalization"].specified || log_normalizer == 0)
-          log_normalizer = 1;
-	for (int i = 0; i < (int)obs_log_probs.size(); i++)
-	  obs_log_probs[i] = util::safe_log(obs_log_probs[i] / log_normalizer);
+        jobs.push_back(Job());
+        jobs.back().recipe_index = recipe_index;
+        jobs.back().audio_path = recipe.infos[recipe_index].audio_path;
+        jobs.back().out_file = out_file;
+        jobs.back().start_frame = start_frame;
+        jobs.back().end_frame = end_frame;
+      }
+      else
+        write_lna(gen, recipe.infos[recipe_index].audio_path, out_file,
+                  start_frame, end_frame, false);
+    }
 
-        for (int i = 0; i < model.num_states(); i++)
-        {
-          if (lnabytes == 4)
-          {
-            BYTE *p = (BYTE*)&obs_log_probs[i];
-            for (int j = 0; j < 4; j++)
-              buffer[j] = p[j];
-            if (endian::big)
-              endian::convert(buffer, 4);
-          }
-          else if (lnabytes == 2)
+    if (!jobs.empty())
+    {
+      // The threads share the model, but each needs its own feature
+      // generator
+      model.prepare_likelihoods();
+      std::vector<FeatureGenerator*> generators(num_threads);
+      for (int t = 0; t < num_threads; t++)
+      {
+        generators[t] = new FeatureGenerator();
+        generators[t]->load_configuration(
+          io::Stream(config["config"].get_str()));
+      }
+      int num_files = recipe.infos.size();
+      std::mutex print_lock;
+      run_parallel(jobs.size(), num_threads, [&](int j, int t) {
           {
-            if (obs_log_probs[i] < -36.008)
-            {
-              buffer[0] = 255;
-              buffer[1] = 255;
-            }
-            else
+            std::lock_guard<std::mutex> lock(print_lock);
+            if (info > 0)
             {
-              int temp = (int)(-1820.0 * obs_log_probs[i] + .5);
-              buffer[0] = (BYTE)((temp>>8)&255);
-              buffer[1] = (BYTE)(temp&255);
+              printf("Processing file %d/%d\n", jobs[j].recipe_index+1,
+                     num_files);
+              printf("Input: %s\n", jobs[j].audio_path.c_str());
+              printf("Output: %s\n", jobs[j].out_file.c_str());
             }
+            if ((info > 0 && jobs[j].start_frame != 0) ||
+                jobs[j].end_frame != INT_MAX)
+              printf("Generating frames %d - %d\n", jobs[j].start_frame,
+                     jobs[j].end_frame != INT_MAX ? jobs[j].end_frame : 0);
+            fflush(stdout);
           }
-          if ((int)fwrite(buffer, sizeof(BYTE), lnabytes, ofp) < lnabytes)
-            throw std::string("Write error");
-        }
-      }
-
-      gen.close();
-      ofp.close();
+          write_lna(*generators[t], jobs[j].audio_path, jobs[j].out_file,
+                    jobs[j].start_frame, jobs[j].end_frame, true);
+        });
+      for (int t = 0; t < num_threads; t++)
+        delete generators[t];
     }
   }
   catch (std::exception &e) {
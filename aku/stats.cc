@@ -15,6 +15,7 @@
 #include "SpeakerConfig.hh"
 #include "util.hh"
 #include "SegErrorEvaluator.hh"
+#include "Parallel.hh"
 
 using namespace aku;
 
@@ -24,11 +25,6 @@ int info;
 int accum_pos;
 bool transtat = false;
 float start_time, end_time;
-double total_num_log_likelihood = 0;
-double total_den_log_likelihood = 0;
-double total_mpe_score = 0;
-double total_mpe_num_score = 0;
-int num_frames = 0;
 
 bool print_alignments = false;
 
@@ -45,17 +41,46 @@ bool compute_mpe_numerator_score = true;
 
 double numerator_score_mult = 1.0;
 
+int hmmnet_seg_mode = 0;
+int hmmnet_num_seg_mode = 0;
+PDF::StatisticsMode stats_mode = 0;
+bool only_ml = true;
+bool precomputed_num_lattices = false;
+bool precomputed_den_lattices = false;
+bool no_train = false;
+
 conf::Config config;
 Recipe recipe;
-HmmSet model;
-HmmSet *num_seg_model = NULL;
-FeatureGenerator fea_gen;
-SpeakerConfig speaker_config(fea_gen, &model);
+std::string gkfile, mcfile, phfile;
 
+// Configured in main() and copied to the workers
 SegErrorEvaluator error_evaluator;
 SegErrorEvaluator::ErrorMode errmode;
 
 
+// The models, statistics and feature generator of one worker thread.
+// Each worker reads its own copy of the model, and the statistics are
+// summed to the first worker at the end.
+struct Worker {
+  Worker() : num_seg_model(NULL), speaker_config(fea_gen, &model),
+             total_num_log_likelihood(0), total_den_log_likelihood(0),
+             total_mpe_score(0), total_mpe_num_score(0), num_frames(0) { }
+  ~Worker() { delete num_seg_model; }
+
+  HmmSet model;
+  HmmSet *num_seg_model;
+  FeatureGenerator fea_gen;
+  SpeakerConfig speaker_config;
+  SegErrorEvaluator error_evaluator;
+
+  double total_num_log_likelihood;
+  double total_den_log_likelihood;
+  double total_mpe_score;
+  double total_mpe_num_score;
+  int num_frames;
+};
+
+
 void print_alignment_line(FILE *f, float fr, int start, int end,
                           const std::string &label)
 {
@@ -70,9 +95,13 @@ void print_alignment_line(FILE *f, float fr, int start, int end,
 }
 
 
-void simple_train(HmmSet &model, Segmentator &segmentator,
+void simple_train(Worker &worker, Segmentator &segmentator,
                   bool accumulate, FILE *alignment_out, bool hmmnets)
 {
+  HmmSet &model = worker.model;
+  FeatureGenerator &fea_gen = worker.fea_gen;
+  double &total_num_log_likelihood = worker.total_num_log_likelihood;
+  int &num_frames = worker.num_frames;
   int cur_start_frame = -1;
   std::string cur_label = "";
 
@@ -222,10 +251,11 @@ create_segmented_lattice(HmmNetBaumWelch &seg, float fw_beam, float bw_beam,
 
 
 void
-collect_lattice_stats(HmmSet &model, HmmNetBaumWelch &seg,
+collect_lattice_stats(Worker &worker, HmmNetBaumWelch &seg,
                       HmmNetBaumWelch::SegmentedLattice *lattice,
                       PDF::StatisticsMode mode, bool count_frames)
 {
+  HmmSet &model = worker.model;
   std::set<int> active_nodes;
 
   if (!lattice->frame_lattice)
@@ -240,7 +270,7 @@ collect_lattice_stats(HmmSet &model, HmmNetBaumWelch &seg,
 
     // FIXME: Frames are not counted with --no-train and DT
     if (count_frames)
-      num_frames++;
+      worker.num_frames++;
 
     int frame = -1;
     model.reset_cache();
@@ -306,17 +336,282 @@ collect_lattice_stats(HmmSet &model, HmmNetBaumWelch &seg,
   }
 }
 
+// Reads the models and the configurations for a worker
+void init_worker(Worker &worker)
+{
+  worker.fea_gen.load_configuration(io::Stream(config["config"].get_str()));
+
+  HmmSet &model = worker.model;
+  if (config["base"].specified)
+    model.read_all(config["base"].get_str());
+  else {
+    model.read_gk(gkfile);
+    model.read_mc(mcfile);
+    model.read_ph(phfile);
+  }
+
+  if (config["nseggk"].specified || config["nsegmc"].specified)
+  {
+    HmmSet *num_seg_model = worker.num_seg_model = new HmmSet;
+    if (config["nseggk"].specified)
+      num_seg_model->read_gk(config["nseggk"].get_str());
+    else
+      num_seg_model->read_gk(gkfile);
+    if (config["nsegmc"].specified)
+      num_seg_model->read_mc(config["nsegmc"].get_str());
+    else
+      num_seg_model->read_mc(mcfile);
+    num_seg_model->read_ph(phfile);
+  }
+
+  // Check the dimension
+  if (model.dim() != worker.fea_gen.dim()) {
+    throw str::fmt(128,
+                   "gaussian dimension is %d but feature dimension is %d",
+                   model.dim(), worker.fea_gen.dim());
+  }
+
+  // Load speaker configurations
+  if (config["speakers"].specified) {
+    worker.speaker_config.read_speaker_file(
+      io::Stream(config["speakers"].get_str()));
+  }
+
+  worker.error_evaluator = error_evaluator;
+  worker.error_evaluator.set_model(&model);
+
+  if (!no_train)
+    model.start_accumulating(stats_mode);
+}
+
+
+// Collects the statistics of recipe line f
+void process_file(Worker &worker, int f)
+{
+  HmmSet &model = worker.model;
+  HmmSet *num_seg_model = worker.num_seg_model;
+  FeatureGenerator &fea_gen = worker.fea_gen;
+  SpeakerConfig &speaker_config = worker.speaker_config;
+  SegErrorEvaluator &error_evaluator = worker.error_evaluator;
+  double &total_num_log_likelihood = worker.total_num_log_likelihood;
+  double &total_den_log_likelihood = worker.total_den_log_likelihood;
+  double &total_mpe_score = worker.total_mpe_score;
+  double &total_mpe_num_score = worker.total_mpe_num_score;
+
+  // Print file name, start and end times to stderr
+  if (info > 0) {
+    fprintf(stderr, "Processing file: %s",
+            recipe.infos[f].audio_path.c_str());
+    if (recipe.infos[f].start_time || recipe.infos[f].end_time)
+      fprintf(stderr, " (%.2f-%.2f)", recipe.infos[f].start_time,
+              recipe.infos[f].end_time);
+    fprintf(stderr, "\n");
+  }
+
+  if (config["speakers"].specified) {
+    speaker_config.set_speaker(recipe.infos[f].speaker_id);
+    if (config["uttadap"].specified &&
+        recipe.infos[f].utterance_id.size() > 0)
+      speaker_config.set_utterance(recipe.infos[f].utterance_id);
+  }
+
+  FILE *alignment_out = NULL;
+  if (print_alignments)
+  {
+    if ((alignment_out = fopen(recipe.infos[f].alignment_path.c_str(),
+                               "w")) == NULL)
+      fprintf(stderr, "Could not open alignment file %s\n",
+              recipe.infos[f].alignment_path.c_str());
+  }
+
+  if (!config["hmmnet"].specified)
+  {
+    assert( only_ml );
+    PhnReader* phnreader = 
+      recipe.infos[f].init_phn_files(&model, false, false,
+                                     config["ophn"].specified, &fea_gen,
+                                     NULL);
+    phnreader->set_collect_transition_probs(transtat);
+    simple_train(worker, *phnreader, !no_train, alignment_out, false);
+    delete phnreader;
+  }
+  else
+  {
+    // Open files and configure
+    HmmNetBaumWelch* num_seg = recipe.infos[f].init_hmmnet_files(
+      (num_seg_model == NULL ? &model : num_seg_model),
+      false, &fea_gen, NULL);
+    num_seg->set_fast_scoring(config["fast-bw"].specified);
+
+    if (only_ml)
+    {
+      num_seg->set_collect_transition_probs(transtat);
+      num_seg->set_mode(hmmnet_num_seg_mode);
+      num_seg->set_pruning_thresholds(config["fw-beam"].get_float(),
+                                      config["bw-beam"].get_float());
+      num_seg->set_acoustic_scaling(config["ac-scale"].get_float());
+      // FIXME: SegmentedLattice loading not implemented
+      simple_train(worker, *num_seg, !no_train, alignment_out, true);
+    }
+    else
+    {
+      // Discriminative training
+
+      HmmNetBaumWelch* den_seg  = NULL;
+      HmmNetBaumWelch::SegmentedLattice *den_lattice = NULL;
+      HmmNetBaumWelch::SegmentedLattice *num_lattice = NULL;
+
+      if (precomputed_num_lattices)
+      {
+        // FIXME: hmmnet_path reused
+        std::string sl_file = recipe.infos[f].hmmnet_path + ".sl";
+        num_lattice = num_seg->load_segmented_lattice(sl_file);
+        num_seg->set_acoustic_scaling(config["ac-scale"].get_float());
+        num_seg->generate_features();
+        num_seg->rescore_segmented_lattice(num_lattice);
+      }
+      else
+      {
+        num_lattice = create_segmented_lattice(
+          *num_seg, config["fw-beam"].get_float(),
+          config["bw-beam"].get_float(), config["ac-scale"].get_float(),
+          hmmnet_num_seg_mode);
+      }
+      
+      bool skip = false;
+      if (num_lattice == NULL)
+      {
+        skip = true;
+        fprintf(stderr, "Failed to segment the numerator lattice, skipping\n");
+      }
+      if (!skip)
+      {
+        fea_gen.close(); // init_hmmnet_files opens the file for fea_gen
+        den_seg = recipe.infos[f].init_hmmnet_files(
+          &model, true, &fea_gen, NULL);
+        den_seg->set_fast_scoring(config["fast-bw"].specified);
+        den_seg->set_collect_transition_probs(transtat);
+        if (precomputed_den_lattices)
+        {
+          // FIXME: den_hmmnet_path reused
+          std::string sl_file = recipe.infos[f].den_hmmnet_path + ".sl";
+          den_lattice = den_seg->load_segmented_lattice(sl_file);
+          den_seg->set_acoustic_scaling(config["ac-scale"].get_float());
+          den_seg->generate_features();
+          den_seg->rescore_segmented_lattice(den_lattice);
+        }
+        else
+        {
+          den_lattice = create_segmented_lattice(
+            *den_seg, config["fw-beam"].get_float(),
+            config["bw-beam"].get_float(), config["ac-scale"].get_float(),
+            hmmnet_seg_mode);
+        }
+        if (den_lattice == NULL)
+        {
+          skip = true;
+          fprintf(stderr, "Failed to segment denominator lattice, skipping\n");
+        }
+      }
+      if (!skip)
+      {
+        assert( num_seg->computes_total_log_likelihood() &&
+                den_seg->computes_total_log_likelihood() );
+
+        // FIXME: We don't compute the number of frames here. Should
+        // it be saved anyway and be compared to the frames of
+        // denominator statistics?
+        if ((stats_mode&PDF_ML_STATS) && !no_train)
+          collect_lattice_stats(worker, *num_seg, num_lattice,
+                                PDF_ML_STATS, false);
+        total_num_log_likelihood += numerator_score_mult*num_lattice->total_score;
+          
+        if (mpe)
+        {
+          if (errmode == SegErrorEvaluator::MWE ||
+              errmode == SegErrorEvaluator::MPE ||
+              errmode == SegErrorEvaluator::MPE_SNFE)
+          {
+            // Need a higher hierarchy lattice for the error evaluation
+            int level = 0;
+            if (errmode == SegErrorEvaluator::MWE)
+              level = 3; // FIXME? Only works for word-based lattices
+            else if (errmode == SegErrorEvaluator::MPE ||
+                     errmode == SegErrorEvaluator::MPE_SNFE)
+              level = 2;
+            HmmNetBaumWelch::SegmentedLattice *num_lat_logical =
+              num_seg->extract_segmented_lattice(num_lattice, level);
+            HmmNetBaumWelch::SegmentedLattice *den_lat_logical =
+              den_seg->extract_segmented_lattice(den_lattice, level);
+            
+            error_evaluator.initialize_reference(num_lat_logical);
+            den_lat_logical->compute_custom_path_scores(&error_evaluator);
+            den_lat_logical->propagate_custom_scores_to_frame_segmented_lattice(den_lattice);
+
+            if (compute_mpe_numerator_score)
+            {
+              num_lat_logical->compute_custom_path_scores(&error_evaluator);
+              total_mpe_num_score += num_lat_logical->total_custom_score;
+            }
+            
+            delete den_lat_logical;
+            delete num_lat_logical;
+          }
+          else
+          {
+            error_evaluator.initialize_reference(num_lattice);
+            den_lattice->compute_custom_path_scores(&error_evaluator);
+            if (compute_mpe_numerator_score)
+            {
+              num_lattice->compute_custom_path_scores(&error_evaluator);
+              total_mpe_num_score += num_lattice->total_custom_score;
+            }
+          }
+          if (info > 0)
+            fprintf(stderr, "Total custom score %f\n",
+                    den_lattice->total_custom_score);
+          total_mpe_score += den_lattice->total_custom_score;
+        }
+
+        if (config["savelat"].specified)
+        {
+          // FIXME: hmmnet_path and den_hmmnet_path reused
+          FILE *fp;
+          std::string sl = recipe.infos[f].hmmnet_path + ".sl";
+          if ((fp = fopen(sl.c_str(), "w")) == NULL)
+            throw std::string("Could not open file" + sl);
+          num_lattice->save_segmented_lattice(fp);
+          fclose(fp);
+          sl = recipe.infos[f].den_hmmnet_path + ".sl";
+          if ((fp = fopen(sl.c_str(), "w")) == NULL)
+            throw std::string("Could not open file" + sl);
+          den_lattice->save_segmented_lattice(fp);
+          fclose(fp);
+        }
+
+        if (!no_train)
+          collect_lattice_stats(worker, *den_seg, den_lattice,
+                                (stats_mode&(~PDF_ML_STATS)), true);
+        total_den_log_likelihood += den_lattice->total_score;
+      }
+      if (den_lattice != NULL)
+        delete den_lattice;
+      if (den_seg != NULL)
+        delete den_seg;
+      if (num_lattice != NULL)
+        delete num_lattice;
+    }
+    delete num_seg;
+  }
+
+  if (alignment_out != NULL)
+    fclose(alignment_out);
+  fea_gen.close();
+}
+
+
 int main(int argc, char *argv[])
 {
-  int hmmnet_seg_mode = 0;
-  int hmmnet_num_seg_mode = 0;
-  PDF::StatisticsMode stats_mode = 0;
-  bool only_ml = true;
-  bool precomputed_num_lattices = false;
-  bool precomputed_den_lattices = false;
-  bool no_train = false;
-  
-  std::string gkfile, mcfile, phfile;
   try {
     config("usage: stats [OPTION...]\n")
       ('h', "help", "", "", "display help")
@@ -335,6 +630,7 @@ int main(int argc, char *argv[])
       ('F', "fw-beam=FLOAT", "arg", "0", "Forward beam (for HMM networks)")
       ('W', "bw-beam=FLOAT", "arg", "0", "Backward beam (for HMM networks)")
       ('A', "ac-scale=FLOAT", "arg", "1", "Acoustic scaling (for HMM networks)")
+      ('\0', "fast-bw", "", "", "Use approximate but faster scoring in forward-backward (for HMM networks)")
       ('\0', "num-mult=FLOAT", "arg", "1", "Loglikelihood multiplier for the numerator")
       ('M', "segmode=MODE", "arg", "bw", "Segmentation mode: bw/vit/mpv")
       ('\0', "numseg=MODE", "arg", "", "Numerator segmentation mode")
@@ -353,15 +649,15 @@ int main(int argc, char *argv[])
       ('a', "alignment", "", "", "save output alignments (only with ML training)")
       ('B', "batch=INT", "arg", "0", "number of batch processes with the same recipe")
       ('I', "bindex=INT", "arg", "0", "batch process index")
+      ('T', "threads=INT", "arg", "1", "number of threads, each with its own copy of the model")
+      ('\0', "indexed", "", "", "write the statistics in the indexed binary format (.sts)")
       ('i', "info=INT", "arg", "0", "info level");
     config.default_parse(argc, argv);
 
     info = config["info"].get_int();
-    fea_gen.load_configuration(io::Stream(config["config"].get_str()));
 
-    // Initialize the model for accumulating statistics
+    // Model files for accumulating statistics
     if (config["base"].specified) {
-      model.read_all(config["base"].get_str());
       gkfile = config["base"].get_str() + ".gk";
       mcfile = config["base"].get_str() + ".mc";
       phfile = config["base"].get_str() + ".ph";
@@ -370,11 +666,8 @@ int main(int argc, char *argv[])
              config["ph"].specified)
     {
       gkfile = config["gk"].get_str();
-      model.read_gk(gkfile);
       mcfile = config["mc"].get_str();
-      model.read_mc(mcfile);
       phfile = config["ph"].get_str();
-      model.read_ph(phfile);
     }
     else {
       throw std::string(
@@ -382,21 +675,9 @@ int main(int argc, char *argv[])
     }
     out_file = config["out"].get_str();
 
-    if (config["nseggk"].specified || config["nsegmc"].specified)
-    {
-      if (!config["hmmnet"].specified)
-        throw std::string("Numerator segmentation requires --hmmnet");
-      num_seg_model = new HmmSet;
-      if (config["nseggk"].specified)
-        num_seg_model->read_gk(config["nseggk"].get_str());
-      else
-        num_seg_model->read_gk(gkfile);
-      if (config["nsegmc"].specified)
-        num_seg_model->read_mc(config["nsegmc"].get_str());
-      else
-        num_seg_model->read_mc(mcfile);
-      num_seg_model->read_ph(phfile);
-    }
+    if ((config["nseggk"].specified || config["nsegmc"].specified) &&
+        !config["hmmnet"].specified)
+      throw std::string("Numerator segmentation requires --hmmnet");
 
     if (config["batch"].specified^config["bindex"].specified)
       throw std::string("Must give both --batch and --bindex");
@@ -404,19 +685,6 @@ int main(int argc, char *argv[])
     // Check for state transition statistics
     transtat = config["transitions"].specified;
 
-    // Check the dimension
-    if (model.dim() != fea_gen.dim()) {
-      throw str::fmt(128,
-                     "gaussian dimension is %d but feature dimension is %d",
-                     model.dim(), fea_gen.dim());
-    }
-
-    // Load speaker configurations
-    if (config["speakers"].specified) {
-      speaker_config.read_speaker_file(
-        io::Stream(config["speakers"].get_str()));
-    }
-
     // Read recipe file
     recipe.read(io::Stream(config["recipe"].get_str()),
                 config["batch"].get_int(), config["bindex"].get_int(),
@@ -444,7 +712,6 @@ int main(int argc, char *argv[])
       {
         stats_mode |= PDF_MPE_NUM_STATS|PDF_MPE_DEN_STATS;
       }
-      error_evaluator.set_model(&model);
     }
 
     if (stats_mode == 0)
@@ -540,219 +807,39 @@ int main(int argc, char *argv[])
     
     if (config["no-train"].specified || config["savelat"].specified)
       no_train = true;
-    if (!no_train)
-      model.start_accumulating(stats_mode);
-
-    // Process each recipe line
-    for (int f = 0; f < (int) recipe.infos.size(); f++) {
-      // Print file name, start and end times to stderr
-      if (info > 0) {
-        fprintf(stderr, "Processing file: %s",
-                recipe.infos[f].audio_path.c_str());
-        if (recipe.infos[f].start_time || recipe.infos[f].end_time)
-          fprintf(stderr, " (%.2f-%.2f)", recipe.infos[f].start_time,
-                  recipe.infos[f].end_time);
-        fprintf(stderr, "\n");
-      }
-
-      if (config["speakers"].specified) {
-        speaker_config.set_speaker(recipe.infos[f].speaker_id);
-        if (config["uttadap"].specified &&
-            recipe.infos[f].utterance_id.size() > 0)
-          speaker_config.set_utterance(recipe.infos[f].utterance_id);
-      }
-
-      FILE *alignment_out = NULL;
-      if (print_alignments)
-      {
-        if ((alignment_out = fopen(recipe.infos[f].alignment_path.c_str(),
-                                   "w")) == NULL)
-          fprintf(stderr, "Could not open alignment file %s\n",
-                  recipe.infos[f].alignment_path.c_str());
-      }
-
-      if (!config["hmmnet"].specified)
-      {
-        assert( only_ml );
-        PhnReader* phnreader = 
-          recipe.infos[f].init_phn_files(&model, false, false,
-                                         config["ophn"].specified, &fea_gen,
-                                         NULL);
-        phnreader->set_collect_transition_probs(transtat);
-        simple_train(model, *phnreader, !no_train, alignment_out, false);
-        delete phnreader;
-      }
-      else
-      {
-        // Open files and configure
-        HmmNetBaumWelch* num_seg = recipe.infos[f].init_hmmnet_files(
-          (num_seg_model == NULL ? &model : num_seg_model),
-          false, &fea_gen, NULL);
 
-        if (only_ml)
-        {
-          num_seg->set_collect_transition_probs(transtat);
-          num_seg->set_mode(hmmnet_num_seg_mode);
-          num_seg->set_pruning_thresholds(config["fw-beam"].get_float(),
-                                          config["bw-beam"].get_float());
-          num_seg->set_acoustic_scaling(config["ac-scale"].get_float());
-          // FIXME: SegmentedLattice loading not implemented
-          simple_train(model, *num_seg, !no_train, alignment_out, true);
-        }
-        else
-        {
-          // Discriminative training
-
-          HmmNetBaumWelch* den_seg  = NULL;
-          HmmNetBaumWelch::SegmentedLattice *den_lattice = NULL;
-          HmmNetBaumWelch::SegmentedLattice *num_lattice = NULL;
-
-          if (precomputed_num_lattices)
-          {
-            // FIXME: hmmnet_path reused
-            std::string sl_file = recipe.infos[f].hmmnet_path + ".sl";
-            num_lattice = num_seg->load_segmented_lattice(sl_file);
-            num_seg->set_acoustic_scaling(config["ac-scale"].get_float());
-            num_seg->generate_features();
-            num_seg->rescore_segmented_lattice(num_lattice);
-          }
-          else
-          {
-            num_lattice = create_segmented_lattice(
-              *num_seg, config["fw-beam"].get_float(),
-              config["bw-beam"].get_float(), config["ac-scale"].get_float(),
-              hmmnet_num_seg_mode);
-          }
-          
-          bool skip = false;
-          if (num_lattice == NULL)
-          {
-            skip = true;
-            fprintf(stderr, "Failed to segment the numerator lattice, skipping\n");
-          }
-          if (!skip)
-          {
-            fea_gen.close(); // init_hmmnet_files opens the file for fea_gen
-            den_seg = recipe.infos[f].init_hmmnet_files(
-              &model, true, &fea_gen, NULL);
-            den_seg->set_collect_transition_probs(transtat);
-            if (precomputed_den_lattices)
-            {
-              // FIXME: den_hmmnet_path reused
-              std::string sl_file = recipe.infos[f].den_hmmnet_path + ".sl";
-              den_lattice = den_seg->load_segmented_lattice(sl_file);
-              den_seg->set_acoustic_scaling(config["ac-scale"].get_float());
-              den_seg->generate_features();
-              den_seg->rescore_segmented_lattice(den_lattice);
-            }
-            else
-            {
-              den_lattice = create_segmented_lattice(
-                *den_seg, config["fw-beam"].get_float(),
-                config["bw-beam"].get_float(), config["ac-scale"].get_float(),
-                hmmnet_seg_mode);
-            }
-            if (den_lattice == NULL)
-            {
-              skip = true;
-              fprintf(stderr, "Failed to segment denominator lattice, skipping\n");
-            }
-          }
-          if (!skip)
-          {
-            assert( num_seg->computes_total_log_likelihood() &&
-                    den_seg->computes_total_log_likelihood() );
-
-            // FIXME: We don't compute the number of frames here. Should
-            // it be saved anyway and be compared to the frames of
-            // denominator statistics?
-            if ((stats_mode&PDF_ML_STATS) && !no_train)
-              collect_lattice_stats(model, *num_seg, num_lattice,
-                                    PDF_ML_STATS, false);
-            total_num_log_likelihood += numerator_score_mult*num_lattice->total_score;
-              
-            if (mpe)
-            {
-              if (errmode == SegErrorEvaluator::MWE ||
-                  errmode == SegErrorEvaluator::MPE ||
-                  errmode == SegErrorEvaluator::MPE_SNFE)
-              {
-                // Need a higher hierarchy lattice for the error evaluation
-                int level = 0;
-                if (errmode == SegErrorEvaluator::MWE)
-                  level = 3; // FIXME? Only works for word-based lattices
-                else if (errmode == SegErrorEvaluator::MPE ||
-                         errmode == SegErrorEvaluator::MPE_SNFE)
-                  level = 2;
-                HmmNetBaumWelch::SegmentedLattice *num_lat_logical =
-                  num_seg->extract_segmented_lattice(num_lattice, level);
-                HmmNetBaumWelch::SegmentedLattice *den_lat_logical =
-                  den_seg->extract_segmented_lattice(den_lattice, level);
-                
-                error_evaluator.initialize_reference(num_lat_logical);
-                den_lat_logical->compute_custom_path_scores(&error_evaluator);
-                den_lat_logical->propagate_custom_scores_to_frame_segmented_lattice(den_lattice);
-
-                if (compute_mpe_numerator_score)
-                {
-                  num_lat_logical->compute_custom_path_scores(&error_evaluator);
-                  total_mpe_num_score += num_lat_logical->total_custom_score;
-                }
-                
-                delete den_lat_logical;
-                delete num_lat_logical;
-              }
-              else
-              {
-                error_evaluator.initialize_reference(num_lattice);
-                den_lattice->compute_custom_path_scores(&error_evaluator);
-                if (compute_mpe_numerator_score)
-                {
-                  num_lattice->compute_custom_path_scores(&error_evaluator);
-                  total_mpe_num_score += num_lattice->total_custom_score;
-                }
-              }
-              if (info > 0)
-                fprintf(stderr, "Total custom score %f\n",
-                        den_lattice->total_custom_score);
-              total_mpe_score += den_lattice->total_custom_score;
-            }
-
-            if (config["savelat"].specified)
-            {
-              // FIXME: hmmnet_path and den_hmmnet_path reused
-              FILE *fp;
-              std::string sl = recipe.infos[f].hmmnet_path + ".sl";
-              if ((fp = fopen(sl.c_str(), "w")) == NULL)
-                throw std::string("Could not open file" + sl);
-              num_lattice->save_segmented_lattice(fp);
-              fclose(fp);
-              sl = recipe.infos[f].den_hmmnet_path + ".sl";
-              if ((fp = fopen(sl.c_str(), "w")) == NULL)
-                throw std::string("Could not open file" + sl);
-              den_lattice->save_segmented_lattice(fp);
-              fclose(fp);
-            }
-
-            if (!no_train)
-              collect_lattice_stats(model, *den_seg, den_lattice,
-                                    (stats_mode&(~PDF_ML_STATS)), true);
-            total_den_log_likelihood += den_lattice->total_score;
-          }
-          if (den_lattice != NULL)
-            delete den_lattice;
-          if (den_seg != NULL)
-            delete den_seg;
-          if (num_lattice != NULL)
-            delete num_lattice;
-        }
-        delete num_seg;
-      }
+    // Read the models for each thread
+    int num_threads = config["threads"].get_int();
+    if (num_threads < 1)
+      throw std::string("Invalid number of threads");
+    std::vector<Worker*> workers;
+    for (int t = 0; t < num_threads; t++) {
+      workers.push_back(new Worker);
+      init_worker(*workers.back());
+    }
 
-      if (alignment_out != NULL)
-        fclose(alignment_out);
-      fea_gen.close();
+    // Process each recipe line
+    run_parallel((int) recipe.infos.size(), num_threads,
+                 [&](int f, int t) { process_file(*workers[t], f); });
+
+    // Sum the statistics of the threads
+    Worker &result = *workers[0];
+    for (int t = 1; t < num_threads; t++) {
+      if (!no_train)
+        result.model.accumulate_from(workers[t]->model);
+      result.total_num_log_likelihood += workers[t]->total_num_log_likelihood;
+      result.total_den_log_likelihood += workers[t]->total_den_log_likelihood;
+      result.total_mpe_score += workers[t]->total_mpe_score;
+      result.total_mpe_num_score += workers[t]->total_mpe_num_score;
+      result.num_frames += workers[t]->num_frames;
+      delete workers[t];
     }
+    HmmSet &model = result.model;
+    double total_num_log_likelihood = result.total_num_log_likelihood;
+    double total_den_log_likelihood = result.total_den_log_likelihood;
+    double total_mpe_score = result.total_mpe_score;
+    double total_mpe_num_score = result.total_mpe_num_score;
+    int num_frames = result.num_frames;
 
     if (info > 0)
     {
@@ -769,7 +856,10 @@ int main(int argc, char *argv[])
     // Write statistics to file dump and clean up
     if (!no_train)
     {
-      model.dump_statistics(out_file);
+      if (config["indexed"].specified)
+        model.dump_indexed_statistics(out_file+".sts");
+      else
+        model.dump_statistics(out_file);
       model.stop_accumulating();
     }
 
@@ -797,8 +887,7 @@ int main(int argc, char *argv[])
         lls_file.close();
       }
     }
-    if (num_seg_model != NULL)
-      delete num_seg_model;
+    delete workers[0];
   }
 
   // Handle errors
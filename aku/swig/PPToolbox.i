@@ -1,6 +1,8 @@
 # -*- tab-width: 2 -*-
 
 %include exception.i
+%include "std_string.i"
+%include "std_vector.i"
 
 %module PPToolbox
 %{
@@ -56,12 +58,20 @@ using namespace aku;
 }
 #endif
 
+// Instantiate templates used
+%template(StringVector) std::vector<std::string>;
+
 class PPToolbox {
 public:
   void read_configuration(const std::string &cfgname);
   void read_models(const std::string &base);
   void generate_to_fd(const int in, const int out, const bool raw_flag);
   void generate(const std::string &input_name, const std::string &output_name, const bool raw_flag);
+  void generate_parallel(const std::vector<std::string> &input_names,
+                         const std::vector<std::string> &output_names,
+                         const bool raw_flag,
+                         const int num_threads);
+  void set_frame_block(int frames);
   void set_clustering(const std::string &clfile_name, double eval_minc, double eval_ming);
   //set_clustering() //FIXME: implement to speed up
 
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <iterator>
+#include "HmmSet.hh"
+#include "StatisticsFile.hh"
+#include "str.hh"
+
+using namespace aku;
+
+// Builds a random model of one-state HMMs, each with a mixture of its own
+// diagonal Gaussians. The same seed gives the same model.
+void
+build_model(HmmSet &model, int num_hmms, int num_components, int seed)
+{
+  srand48(seed);
+  const int dim = model.dim();
+  for (int h = 0; h < num_hmms; h++) {
+    Mixture *mixture = new Mixture(model.get_pool());
+    for (int c = 0; c < num_components; c++) {
+      DiagonalGaussian *gaussian = new DiagonalGaussian(dim);
+      Vector mean(dim), covariance(dim);
+      for (int i = 0; i < dim; i++) {
+        mean(i) = 4 * drand48() - 2;
+        covariance(i) = 0.5 + drand48();
+      }
+      gaussian->set_mean(mean);
+      gaussian->set_covariance(covariance);
+      mixture->add_component(model.add_pool_pdf(gaussian),
+                             1.0 / num_components);
+    }
+    int state = model.add_state(model.add_mixture_pdf(mixture));
+    model.add_transition(state, 0, 0.6);
+    model.add_transition(state, 1, 0.4);
+    Hmm &hmm = model.add_hmm(str::fmt(16, "h%d", h), 1);
+    hmm.state(0) = state;
+  }
+}
+
+// Accumulates ML and MMI statistics from random features
+void
+accumulate(HmmSet &model, int num_frames, int seed)
+{
+  srand48(seed);
+  Vector vec(model.dim());
+  FeatureVec feature(&vec, model.dim());
+  for (int f = 0; f < num_frames; f++) {
+    for (int i = 0; i < model.dim(); i++)
+      vec(i) = 4 * drand48() - 2;
+    int state = lrand48() % model.num_states();
+    int pdf = model.emission_pdf_index(state);
+    model.reset_cache();
+    model.accumulate_distribution(feature, pdf, 1.0, PDF::ML_BUF);
+    model.accumulate_distribution(feature, pdf, drand48(), PDF::MMI_BUF);
+    model.accumulate_transition(
+      model.state(state).transitions()[lrand48() % 2], 1.0);
+  }
+}
+
+std::string
+read_file(const std::string &filename)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in)
+    throw str::fmt(512, "could not open %s", filename.c_str());
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+int
+main(int argc, char *argv[])
+{
+  try {
+    if (argc != 2 && argc != 5) {
+      fprintf(stderr, "usage: statistics_test BASENAME "
+              "[HMMS COMPONENTS FRAMES]\n");
+      exit(1);
+    }
+    std::string base = argv[1];
+    int num_hmms = argc > 2 ? atoi(argv[2]) : 200;
+    int num_components = argc > 3 ? atoi(argv[3]) : 3;
+    int num_frames = argc > 4 ? atoi(argv[4]) : 20000;
+    const int dim = 4;
+
+    // Write the model and its statistics in both formats. The model and
+    // the legacy dumps are also used by other tests.
+    HmmSet model(dim);
+    build_model(model, num_hmms, num_components, 1);
+    model.start_accumulating(PDF_ML_STATS | PDF_MMI_STATS);
+    accumulate(model, num_frames, 2);
+    model.write_all(base);
+    model.dump_statistics(base);
+    model.dump_indexed_statistics(base + ".sts");
+    std::string reference = read_file(base + ".sts");
+
+    // Read the indexed statistics and write them again
+    {
+      HmmSet copy(dim);
+      build_model(copy, num_hmms, num_components, 1);
+      copy.accumulate_from_dump(base);
+      copy.dump_indexed_statistics(base + "_copy.sts");
+      if (read_file(base + "_copy.sts") != reference)
+        throw std::string("the statistics changed in reading and writing");
+    }
+
+    // Accumulate the PDFs in two ranges, as combine_stats does in threads
+    {
+      HmmSet copy(dim);
+      build_model(copy, num_hmms, num_components, 1);
+      StatisticsFile file(base + ".sts");
+      copy.prepare_accumulating_from(file);
+      int num_gaussians = copy.num_pool_pdfs();
+      int num_mixtures = copy.num_emission_pdfs();
+      copy.accumulate_gk_from(file, num_gaussians / 2, num_gaussians);
+      copy.accumulate_gk_from(file, 0, num_gaussians / 2);
+      copy.accumulate_mc_from(file, num_mixtures / 2, num_mixtures);
+      copy.accumulate_mc_from(file, 0, num_mixtures / 2);
+      copy.accumulate_ph_from(file);
+      copy.dump_indexed_statistics(base + "_copy.sts");
+      if (read_file(base + "_copy.sts") != reference)
+        throw std::string("the statistics accumulated in ranges differ");
+    }
+
+    // Statistics of a different mode must be rejected
+    {
+      HmmSet copy(dim);
+      build_model(copy, num_hmms, num_components, 1);
+      copy.start_accumulating(PDF_ML_STATS);
+      StatisticsFile file(base + ".sts");
+      bool rejected = false;
+      try {
+        copy.prepare_accumulating_from(file);
+      }
+      catch (std::string &str) {
+        rejected = true;
+      }
+      if (!rejected)
+        throw std::string("statistics of a different mode were accepted");
+    }
+
+    // A truncated file must be rejected
+    {
+      std::ofstream out((base + "_copy.sts").c_str(), std::ios::binary);
+      out.write(reference.data(), reference.size() - 8);
+      out.close();
+      bool rejected = false;
+      try {
+        StatisticsFile file(base + "_copy.sts");
+      }
+      catch (std::string &str) {
+        rejected = true;
+      }
+      if (!rejected)
+        throw std::string("a truncated statistics file was accepted");
+    }
+    remove((base + "_copy.sts").c_str());
+
+    printf("test successful\n");
+  }
+  catch (std::string &str) {
+    fprintf(stderr, "caught exception: %s\n", str.c_str());
+    abort();
+  }
+}
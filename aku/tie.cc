@@ -132,6 +132,7 @@ main(int argc, char *argv[])
       ('A', "ac-scale=FLOAT", "arg", "1", "Acoustic scaling (for HMM networks)")
       ('V', "vit", "", "", "Use Viterbi over HMM networks")
       ('S', "speakers=FILE", "arg", "", "speaker configuration file")
+      ('T', "threads=INT", "arg", "1", "number of threads in decision tree clustering")
       ('i', "info=INT", "arg", "0", "info level")
       ;
     config.default_parse(argc, argv);
@@ -162,6 +163,9 @@ main(int argc, char *argv[])
     // Initialize triphone tying
     phone_pool.set_dimension(fea_gen.dim());
     phone_pool.set_info(info);
+    if (config["threads"].get_int() < 1)
+      throw std::string("Invalid number of threads");
+    phone_pool.set_num_threads(config["threads"].get_int());
 
     if (config["hmmnet"].specified)
     {
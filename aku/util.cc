@@ -3,6 +3,17 @@
 
 namespace util {
 
+double logadd_table[LOGADD_TABLE_SCALE * LOGADD_TABLE_RANGE + 2];
+
+namespace {
+struct LogaddTableInit {
+  LogaddTableInit() {
+    for (int i = 0; i < LOGADD_TABLE_SCALE * LOGADD_TABLE_RANGE + 2; i++)
+      logadd_table[i] = log1p(exp(-(double)i / LOGADD_TABLE_SCALE));
+  }
+} logadd_table_init;
+}
+
 double bin_search_param_max_value(double lower_bound, double low_value,
                                   double upper_bound, double up_value,
                                   double max_value, double value_acc,
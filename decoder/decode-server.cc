@@ -0,0 +1,512 @@
+//
+// ----------------
+// decode-server.cc
+// ----------------
+//
+// A sample C++ program that serves several concurrent audio streams over a
+// local socket. The models are read once at startup and shared by all the
+// streams. Each connection gets its own feature extraction and search.
+//
+// The client sends raw audio in the format specified in the acoustic model
+// configuration, and shuts down its side of the connection for writing when
+// the audio ends. While the audio is coming in, the server writes a line
+//   PARTIAL: <words>
+// every time the best hypothesis changes. After the end of the audio it writes
+//   RESULT: <words>
+//   CONFIDENCE: <average acoustic likelihood per frame>
+//   STATS: frames=<n> audio=<s> decode=<s> rtf=<x> latency=<ms>
+// and closes the connection. "decode" is the time used for computing the
+// likelihoods and search. It does not include the feature generation, because
+// that waits for the client to send the audio. "rtf" is the ratio of "decode"
+// to the audio duration, and "latency" is the time from the end of the audio
+// to the final result.
+// Errors are reported with a line "ERROR: <message>".
+//
+// The number of decoders is fixed with --streams. A connection waits until a
+// decoder is free. The acoustic model and the lookahead language model (with
+// its cache of lookahead scores) are shared by all the decoders. The lexicon
+// and the language model have decoder-specific state, so every decoder reads
+// its own. Convert the language model with "arpa2bin --mmap" so that all the
+// decoders map the same pages of the file into memory.
+//
+// To build this program using GNU C++, first build AaltoASR, then enter the
+// build directory, and run the following command (on one line):
+//   g++ -std=c++0x -pthread ../decoder/decode-server.cc
+//       -I.. -Ivendor/lapackpp/include/lapackpp -I../decoder/src
+//       -Laku -Ldecoder/src -Ldecoder/src/fsalm -Ldecoder/src/misc -Lvendor/lapackpp/lib
+//       -Wl,-Bstatic -ldecoder -lfsalm -lmisc -laku -llapackpp
+//       -Wl,-Bdynamic -lfftw3 -lsndfile -llapack -lblas
+//       -o decode-server
+//
+// Example:
+//   decode-server -a am/speecon -d dict -l lm.bin -L lookahead.bin -s /tmp/asr
+//   (cat audio.raw; sleep 1) | socat - UNIX-CONNECT:/tmp/asr
+//
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <aku/AudioFileModule.hh>
+#include <aku/FeatureGenerator.hh>
+#include <aku/HmmSet.hh>
+#include <Toolbox.hh>
+#include <misc/conf.hh>
+
+
+using namespace std;
+using namespace aku;
+
+typedef vector<float> probabilities_type;
+typedef chrono::steady_clock Clock;
+
+
+static conf::Config config;
+
+// The feature configuration is read once and parsed for each stream.
+static string feature_configuration;
+
+// Shared by all the streams. Only the const member functions are used after
+// initialization.
+static HmmSet hmm_set;
+
+// FFTW plans are created and destroyed when a FeatureGenerator is configured
+// and destroyed. The FFTW planner is not thread-safe.
+static mutex feature_generator_mutex;
+
+
+// A fixed set of decoders. acquire() waits until a decoder is free.
+class DecoderPool
+{
+public:
+	void add(Toolbox * toolbox)
+	{
+		m_all.push_back(unique_ptr<Toolbox>(toolbox));
+		m_free.push_back(toolbox);
+	}
+
+	Toolbox & acquire()
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_released.wait(lock, [this]() { return !m_free.empty(); });
+		Toolbox * toolbox = m_free.back();
+		m_free.pop_back();
+		return *toolbox;
+	}
+
+	void release(Toolbox & toolbox)
+	{
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_free.push_back(&toolbox);
+		}
+		m_released.notify_one();
+	}
+
+private:
+	vector<unique_ptr<Toolbox> > m_all;
+	vector<Toolbox *> m_free;
+	mutex m_mutex;
+	condition_variable m_released;
+};
+
+static DecoderPool decoder_pool;
+
+
+static double seconds_since(const Clock::time_point & start)
+{
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+void initialize_acoustics()
+{
+	const string am_path = config["am"].get_str();
+	const string cfg_path = am_path + ".cfg";
+	FILE * config_stream = fopen(cfg_path.c_str(), "r");
+	if (config_stream == nullptr) {
+		perror("ERROR: Cannot open feature module configuration file for reading");
+		exit(1);
+	}
+	char buffer[4096];
+	size_t count;
+	while ((count = fread(buffer, 1, sizeof(buffer), config_stream)) > 0)
+		feature_configuration.append(buffer, count);
+	fclose(config_stream);
+
+	try {
+		hmm_set.read_mc(am_path + ".mc");  // mixture coefficients
+		hmm_set.read_ph(am_path + ".ph");  // HMM definition
+		hmm_set.read_gk(am_path + ".gk");  // mixture base functions
+
+		// Gaussian clustering (optional)
+		if (config["clustering"].specified) {
+			hmm_set.read_clustering(am_path + ".gcl");
+			hmm_set.set_clustering_min_evals(0, 0.15);
+		}
+
+		// The likelihoods are computed concurrently from now on.
+		hmm_set.prepare_likelihoods();
+	}
+	catch (string & message) {
+		cerr << "ERROR: Error loading acoustic model: " << message << endl;
+		exit(1);
+	}
+}
+
+
+// Reads the lexicon and the language models. The lookahead model of the first
+// decoder is shared by the others.
+Toolbox * create_decoder(Toolbox * first)
+{
+	const string am_path = config["am"].get_str();
+	string ph_path = am_path + ".ph";
+	string dur_path = am_path + ".dur";
+	Toolbox * toolbox = new Toolbox(ph_path.c_str(), dur_path.c_str());
+	const bool use_lookahead = config["lookahead"].specified;
+
+	try {
+		toolbox->set_optional_short_silence(true);
+		toolbox->set_cross_word_triphones(1);
+		toolbox->set_require_sentence_end(true);
+		toolbox->use_one_frame_acoustics();
+		toolbox->set_verbose(1);  // Don't print status messages to stdout.
+
+		toolbox->set_token_limit(config["token-limit"].get_int());
+		const float beam = config["beam"].get_float();
+		toolbox->set_global_beam(beam);
+		toolbox->set_word_end_beam(2 * beam / 3);
+		toolbox->set_duration_scale(3);
+		toolbox->set_transition_scale(1);
+		toolbox->set_lm_scale(config["lm-scale"].get_float());
+
+		if (config["morph"].specified) {
+			toolbox->set_silence_is_word(true);
+			toolbox->set_word_boundary("<w>");
+		}
+		else {
+			toolbox->set_silence_is_word(false);
+			toolbox->set_word_boundary("");
+		}
+
+		// set_lm_lookahead() has to be set before lex_read(), or
+		// lookahead will be disabled!
+		toolbox->set_lm_lookahead(use_lookahead ? 1 : 0);
+
+		toolbox->lex_read(config["dictionary"].get_str().c_str());
+		toolbox->set_sentence_boundary("<s>", "</s>");
+
+		int order = toolbox->ngram_read(config["lm"].get_str().c_str(), true, true);
+
+		if (use_lookahead) {
+			if (first == nullptr)
+				toolbox->read_lookahead_ngram(config["lookahead"].get_str().c_str(), true, true);
+			else
+				toolbox->share_lookahead_ngram(*first);
+			toolbox->prune_lm_lookahead_buffers(0, 4);
+		}
+		toolbox->set_prune_similar(order);
+
+		toolbox->set_generate_word_graph(false);
+	}
+	catch (TPNowayLexReader::UnknownHmm & e) {
+		cerr << "ERROR: The lexicon contains a triphone that does not exist in the acoustic model: " << e.phone() << endl;
+		exit(1);
+	}
+	catch (exception & e) {
+		cerr << "ERROR: Unable to initialize decoder: " << e.what() << endl;
+		exit(1);
+	}
+	return toolbox;
+}
+
+
+FeatureGenerator * create_feature_generator(FILE * audio_stream)
+{
+	lock_guard<mutex> lock(feature_generator_mutex);
+	unique_ptr<FeatureGenerator> feature_generator(new FeatureGenerator);
+
+	FILE * config_stream = fmemopen(const_cast<char *>(feature_configuration.data()),
+	                                feature_configuration.size(), "r");
+	if (config_stream == nullptr)
+		throw string("Cannot read feature module configuration");
+	try {
+		feature_generator->load_configuration(config_stream);
+	}
+	catch (...) {
+		fclose(config_stream);
+		throw;
+	}
+	fclose(config_stream);
+
+	// Force raw data in audio file module configuration.
+	AudioFileModule * afm = dynamic_cast<AudioFileModule *>(feature_generator->module("audiofile"));
+	if (afm == nullptr)
+		throw string("The feature configuration has no audiofile module");
+	ModuleConfig afm_config;
+	afm->get_config(afm_config);
+	afm_config.set("raw", 1);
+	afm->set_config(afm_config);
+
+	feature_generator->open(audio_stream, true, true);
+
+	return feature_generator.release();
+}
+
+
+void destroy_feature_generator(FeatureGenerator * feature_generator)
+{
+	lock_guard<mutex> lock(feature_generator_mutex);
+	delete feature_generator;
+}
+
+
+void get_likelihoods(const FeatureVec & features, Matrix & frame, Matrix & pool_likelihoods,
+                     Matrix & pdf_likelihoods, PDFPool::LikelihoodBuffers & buffers,
+                     probabilities_type & result)
+{
+	for (int i = 0; i < frame.cols(); ++i)
+		frame(0, i) = features[i];
+	hmm_set.compute_likelihoods(frame, pool_likelihoods, pdf_likelihoods, buffers);
+
+	result.clear();
+	result.reserve(hmm_set.num_states());
+	for (int i = 0; i < hmm_set.num_states(); ++i) {
+		double likelihood = pdf_likelihoods(0, hmm_set.emission_pdf_index(i));
+		result.push_back(static_cast<float>(log(likelihood)));
+	}
+}
+
+
+string best_path(Toolbox & toolbox)
+{
+	HistoryVector path;
+	toolbox.tp_search().get_path(path, true, NULL);
+
+	string result;
+	HistoryVector::const_reverse_iterator iter = path.rbegin();
+	for (; iter != path.rend(); ++iter) {
+		result += " ";
+		result += toolbox.word((*iter)->last().word_id());
+	}
+	return result;
+}
+
+
+// Decodes the audio from audio_stream and writes the results to
+// result_stream.
+void decode(Toolbox & toolbox, FILE * audio_stream, FILE * result_stream)
+{
+	const int partial_interval = config["partial-interval"].get_int();
+	FeatureGenerator * feature_generator = create_feature_generator(audio_stream);
+
+	try {
+		Matrix frame(1, feature_generator->dim());
+		Matrix pool_likelihoods, pdf_likelihoods;
+		PDFPool::LikelihoodBuffers likelihood_buffers;
+		probabilities_type likelihoods;
+		string partial;
+		int current_frame = 0;
+		double decode_seconds = 0;
+		Clock::time_point end_of_audio;
+
+		toolbox.reset(0);
+		while (true) {
+			likelihoods.clear();
+			const FeatureVec features = feature_generator->generate(current_frame);
+			Clock::time_point frame_start = Clock::now();
+			if (feature_generator->eof())
+				end_of_audio = frame_start;
+			else
+				get_likelihoods(features, frame, pool_likelihoods, pdf_likelihoods,
+				                likelihood_buffers, likelihoods);
+
+			// toolbox::run() will return false when likelihoods is empty.
+			toolbox.set_one_frame(current_frame, likelihoods);
+			if (!toolbox.run())
+				break;
+			++current_frame;
+
+			if (partial_interval > 0 && current_frame % partial_interval == 0) {
+				string path = best_path(toolbox);
+				if (path != partial) {
+					partial = path;
+					fprintf(result_stream, "PARTIAL:%s\n", partial.c_str());
+					fflush(result_stream);
+				}
+			}
+			decode_seconds += seconds_since(frame_start);
+		}
+
+		if (current_frame == 0)
+			throw string("No audio was read.");
+
+		const double audio_seconds = current_frame / feature_generator->frame_rate();
+		const float am_log_prob = toolbox.tp_search().get_am_log_prob(true);
+		fprintf(result_stream, "RESULT:%s\n", best_path(toolbox).c_str());
+		fprintf(result_stream, "CONFIDENCE: %g\n", exp(am_log_prob / current_frame));
+		fprintf(result_stream, "STATS: frames=%d audio=%.3f decode=%.3f rtf=%.3f latency=%.1f\n",
+		        current_frame, audio_seconds, decode_seconds, decode_seconds / audio_seconds,
+		        1000 * seconds_since(end_of_audio));
+		fflush(result_stream);
+	}
+	catch (...) {
+		destroy_feature_generator(feature_generator);
+		throw;
+	}
+	destroy_feature_generator(feature_generator);
+}
+
+
+void serve(int connection)
+{
+	// Separate streams for reading and writing the same socket.
+	FILE * audio_stream = fdopen(dup(connection), "r");
+	FILE * result_stream = fdopen(connection, "w");
+	if (audio_stream == nullptr || result_stream == nullptr) {
+		perror("ERROR: fdopen");
+		if (audio_stream != nullptr)
+			fclose(audio_stream);
+		if (result_stream != nullptr)
+			fclose(result_stream);
+		else
+			close(connection);
+		return;
+	}
+
+	Toolbox & toolbox = decoder_pool.acquire();
+	string error;
+	try {
+		decode(toolbox, audio_stream, result_stream);
+	}
+	catch (string & message) {
+		error = message;
+	}
+	catch (exception & e) {
+		error = e.what();
+	}
+	decoder_pool.release(toolbox);
+
+	if (!error.empty()) {
+		cerr << "ERROR: " << error << endl;
+		fprintf(result_stream, "ERROR: %s\n", error.c_str());
+	}
+	fclose(audio_stream);
+	fclose(result_stream);
+}
+
+
+int open_socket()
+{
+	int listener;
+	if (config["socket"].specified) {
+		const string & path = config["socket"].get_str();
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path)) {
+			cerr << "ERROR: Socket path is too long: " << path << endl;
+			exit(1);
+		}
+		strcpy(address.sun_path, path.c_str());
+		unlink(path.c_str());
+
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) {
+			perror("ERROR: Cannot bind to the socket");
+			exit(1);
+		}
+	}
+	else {
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(config["port"].get_int());
+
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		if (listener >= 0)
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) {
+			perror("ERROR: Cannot bind to the port");
+			exit(1);
+		}
+	}
+
+	if (listen(listener, 16) != 0) {
+		perror("ERROR: listen");
+		exit(1);
+	}
+	return listener;
+}
+
+
+int main(int argc, char * argv[])
+{
+	config("usage: decode-server [OPTION...]\n")
+		('h', "help", "", "", "display help")
+		('a', "am=BASENAME", "arg must", "", "acoustic model base name")
+		('d', "dictionary=FILE", "arg must", "", "pronunciation dictionary")
+		('l', "lm=FILE", "arg must", "", "binary language model")
+		('L', "lookahead=FILE", "arg", "", "binary lookahead language model")
+		('s', "socket=PATH", "arg", "", "listen on a Unix domain socket")
+		('p', "port=INT", "arg", "7000", "listen on a TCP port of the loopback interface")
+		('n', "streams=INT", "arg", "4", "number of streams decoded at the same time")
+		('i', "partial-interval=INT", "arg", "10", "frames between partial results, 0 to disable")
+		('b', "beam=FLOAT", "arg", "400", "global beam")
+		('t', "token-limit=INT", "arg", "50000", "maximum number of active tokens")
+		('S', "lm-scale=FLOAT", "arg", "30", "language model scale")
+		('c', "clustering", "", "", "use Gaussian clustering (BASENAME.gcl)")
+		('m', "morph", "", "", "the model uses morphs with <w> word boundaries")
+		;
+	config.default_parse(argc, argv);
+	if (config.arguments.size() != 0)
+		config.print_help(stderr, 1);
+
+	const int num_streams = config["streams"].get_int();
+	if (num_streams < 1) {
+		cerr << "ERROR: Invalid number of streams." << endl;
+		return 1;
+	}
+
+	initialize_acoustics();
+	Toolbox * first = nullptr;
+	for (int i = 0; i < num_streams; ++i) {
+		Toolbox * toolbox = create_decoder(first);
+		if (first == nullptr)
+			first = toolbox;
+		decoder_pool.add(toolbox);
+	}
+
+	// A client that disconnects early must not terminate the server.
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = open_socket();
+	cerr << "Ready for " << num_streams << " streams." << endl;
+	while (true) {
+		int connection = accept(listener, NULL, NULL);
+		if (connection < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ERROR: accept");
+			return 1;
+		}
+		thread(serve, connection).detach();
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+#ifndef BLOCKPOOL_HH
+#define BLOCKPOOL_HH
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <type_traits>
+
+/// \brief Pool allocator for small objects of one type.
+///
+/// Memory is reserved from the heap in blocks of \a block_size objects and
+/// never returned before the pool is destroyed. Released objects are kept in
+/// a free list and handed out again in LIFO order, so that recently used
+/// (cached) memory is reused first. A new block is handed out in address
+/// order.
+///
+/// The objects are not destroyed when they are released, so \a T has to be
+/// trivially destructible. allocate() returns storage that has to be
+/// initialized with placement new.
+///
+/// The free list is a plain vector of pointers, so it can be given directly
+/// to hist::unlink() and hist::Auto.
+///
+template <typename T>
+class BlockPool {
+public:
+  static_assert(std::is_trivially_destructible<T>::value,
+                "BlockPool objects are never destroyed");
+
+  BlockPool(int block_size = 1024);
+  ~BlockPool();
+
+  /// \brief Returns storage for one object.
+  inline void *allocate();
+
+  /// \brief Returns an object to the pool.
+  void release(T *object) { m_free_list.push_back(object); }
+
+  /// \brief The free list, for functions that release objects themselves.
+  std::vector<T *> *free_list() { return &m_free_list; }
+
+  /// \brief Number of objects that have been allocated and not released.
+  size_t num_used() const { return num_reserved() - m_free_list.size(); }
+
+  /// \brief Largest number of objects in use at the same time.
+  size_t peak_used() const { return m_peak_used; }
+
+  /// \brief Number of objects the reserved blocks can hold.
+  size_t num_reserved() const { return m_blocks.size() * m_block_size; }
+
+  /// \brief Forgets the peak usage, e.g. at the start of an utterance.
+  void reset_peak() { m_peak_used = num_used(); }
+
+private:
+  BlockPool(const BlockPool &);
+  BlockPool &operator=(const BlockPool &);
+
+  void reserve_block();
+
+  int m_block_size;
+  std::vector<T *> m_free_list;
+  std::vector<void *> m_blocks;
+  size_t m_peak_used;
+};
+
+template <typename T>
+BlockPool<T>::BlockPool(int block_size)
+  : m_block_size(block_size),
+    m_peak_used(0)
+{
+}
+
+template <typename T>
+BlockPool<T>::~BlockPool()
+{
+  for (size_t i = 0; i < m_blocks.size(); i++)
+    ::operator delete(m_blocks[i]);
+}
+
+template <typename T>
+void *
+BlockPool<T>::allocate()
+{
+  if (m_free_list.empty())
+    reserve_block();
+  T *object = m_free_list.back();
+  m_free_list.pop_back();
+
+  size_t used = num_used();
+  if (used > m_peak_used)
+    m_peak_used = used;
+  return object;
+}
+
+template <typename T>
+void
+BlockPool<T>::reserve_block()
+{
+  T *block = static_cast<T *>(::operator new(sizeof(T) * m_block_size));
+  m_blocks.push_back(block);
+
+  // Reverse order so that the block is handed out from the beginning.
+  m_free_list.reserve(num_reserved());
+  for (int i = m_block_size - 1; i >= 0; i--)
+    m_free_list.push_back(&block[i]);
+}
+
+#endif /* BLOCKPOOL_HH */
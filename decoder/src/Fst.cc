@@ -1,27 +1,111 @@
+
 #include "Fst.hh"
 #include "misc/str.hh"
 
+#include <climits>
 #include <cstdlib>
+#include <cstring>
+#include <map>
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #define strtof strtod
 
-Fst::Fst(): initial_node_idx(-1) {
+// The binary format. The arrays are aligned to 8 bytes.
+static const char binary_magic[] = "cis-fst-mmap1\n";
+static const int32_t binary_byte_order = 0x01020304;
+
+struct BinaryHeader {
+  char magic[16];
+  int32_t byte_order;
+  int32_t initial_node_idx;
+  int64_t num_nodes;
+  int64_t num_arcs;
+  int64_t num_symbols;
+  int64_t node_offset; // Node[num_nodes]
+  int64_t arc_offset; // Arc[num_arcs]
+  int64_t symbol_offset_offset; // int64_t[num_symbols + 1] from symbol_offset
+  int64_t symbol_offset; // Null-terminated symbols
+  int64_t file_size;
+};
+
+static int64_t
+binary_align(int64_t offset)
+{
+  return (offset + 7) / 8 * 8;
 }
 
-void Fst::read(std::string &fname) {
-  std::string line;
+// Writes the zeros that align the next array. Returns false on error.
+static bool
+write_binary_padding(FILE *ofh, int64_t length)
+{
+  static const char zeros[8] = {0};
+  return length == 0 || fwrite(zeros, length, 1, ofh) == 1;
+}
+
+Fst::Fst(): initial_node_idx(-1), m_map_data(nullptr), m_map_size(0) {
+}
+
+Fst::~Fst() {
+  unmap();
+}
 
-  FILE *ifh = fopen(fname.c_str(), "r");
+void Fst::unmap() {
+  if (m_map_data) {
+    // Do not leave the arrays pointing to the unmapped file
+    nodes.map(nullptr, 0);
+    arcs.map(nullptr, 0);
+  }
+#ifndef _MSC_VER
+  if (m_map_data) munmap(m_map_data, m_map_size);
+#endif
+  m_map_data = nullptr;
+  m_map_size = 0;
+}
+
+void Fst::read(std::string &fname) {
+  FILE *ifh = fopen(fname.c_str(), "rb");
   if (ifh==nullptr) {
     perror("Error");
     exit(-1); // FIXME: we should use exceptions
   }
 
+  char magic[sizeof(binary_magic)];
+  bool binary = fread(magic, sizeof(magic), 1, ifh) == 1 &&
+    memcmp(magic, binary_magic, sizeof(magic)) == 0;
+  rewind(ifh);
+  try {
+    if (binary) read_binary(ifh, fname);
+    else read_text(ifh);
+  } catch (...) {
+    fclose(ifh);
+    throw;
+  }
+  fclose(ifh);
+}
+
+void Fst::read_text(FILE *ifh) {
+  std::string line;
+
   str::read_line(line, ifh, true);
   if (line != "#FSTBasic MaxPlus") {
     fprintf(stderr, "Unknown header '%s'.\n", line.c_str());
     throw ReadError();
   }
+
+  // The arcs in the file order, and the node data
+  std::vector<Arc> file_arcs;
+  std::vector<Node> new_nodes;
+  Node empty_node;
+  empty_node.emission_pdf_idx = -1;
+  empty_node.first_arc = 0;
+  empty_node.num_arcs = 0;
+  empty_node.end_node = false;
+
   std::vector<std::string> fields;
+  std::map<std::string, int> symbol_ids;
+  symbols.clear();
   while (str::read_line(line, ifh, true)) {
     fields = str::split(line, " ", true);
     if (fields.size()<2) {
@@ -31,8 +115,8 @@ void Fst::read(std::string &fname) {
 
     // Resize nodes to the size of the first mentioned node
     auto first_node_idx = atoi(fields[1].c_str());
-    if (nodes.size() <= first_node_idx) {
-      nodes.resize(first_node_idx+1);
+    if (new_nodes.size() <= first_node_idx) {
+      new_nodes.resize(first_node_idx+1, empty_node);
     }
 
     if (fields[0]=="I") {
@@ -45,49 +129,54 @@ void Fst::read(std::string &fname) {
     }
 
     if (fields[0]=="F") {
-      nodes[first_node_idx].end_node = true;
+      new_nodes[first_node_idx].end_node = true;
       if (fields.size()>2) {
         fprintf(stderr, "Too many fields for F: '%s'.\n", line.c_str());
         throw ReadError();
       }
       continue;
     }
-    
+
     if (fields[0]=="T") {
       if (fields.size()<3 || fields.size()>6) {
         fprintf(stderr, "Weird number of fields for T: '%s'.\n", line.c_str());
         throw ReadError();
       }
-      
+
       auto second_node_idx = atoi(fields[2].c_str());
-      if (nodes.size() <= second_node_idx) {
-        nodes.resize(second_node_idx+1);
+      if (new_nodes.size() <= second_node_idx) {
+        new_nodes.resize(second_node_idx+1, empty_node);
       }
 
-      auto aidx=arcs.size();
-      arcs.resize(aidx+1);
-      Arc &a = arcs[aidx];
+      Arc a;
       a.source = first_node_idx;
       a.target = second_node_idx;
+      a.transition_logprob = 0.0f;
+      a.emit_symbol_id = -1;
 
       if (fields.size()>=5) {
         if (fields[4] != ",") {
-          a.emit_symbol = fields[4];
+          auto it = symbol_ids.insert(std::make_pair(fields[4], (int)symbols.size())).first;
+          if (it->second == (int)symbols.size()) {
+            symbols.push_back(fields[4]);
+          }
+          a.emit_symbol_id = it->second;
         }
       }
 
       if (fields.size()>=6) {
         a.transition_logprob = strtof(fields[5].c_str(), nullptr);
       }
-      nodes[first_node_idx].arcidxs.push_back(aidx);
+      file_arcs.push_back(a);
+      new_nodes[first_node_idx].num_arcs++;
 
       // Move emission pdf indices from arcs to nodes
       auto emission_pdf_idx = atoi(fields[3].c_str());
-      if (nodes[second_node_idx].emission_pdf_idx==-1) {
-        nodes[second_node_idx].emission_pdf_idx = emission_pdf_idx;
-      } else if (nodes[second_node_idx].emission_pdf_idx != emission_pdf_idx) {
+      if (new_nodes[second_node_idx].emission_pdf_idx==-1) {
+        new_nodes[second_node_idx].emission_pdf_idx = emission_pdf_idx;
+      } else if (new_nodes[second_node_idx].emission_pdf_idx != emission_pdf_idx) {
         fprintf(stderr, "Conflicting emission_pdf_indices for node %d: %d != %d.\n",
-                second_node_idx, nodes[second_node_idx].emission_pdf_idx, emission_pdf_idx);
+                second_node_idx, new_nodes[second_node_idx].emission_pdf_idx, emission_pdf_idx);
         throw ReadError();
       }
 
@@ -96,8 +185,173 @@ void Fst::read(std::string &fname) {
       fprintf(stderr, "Weird type indicator: '%s'.\n", fields[0].c_str());
       throw ReadError();
     }
-    
+
   }
-  fclose(ifh);
 
+  // Group the arcs by the source node, keeping the file order within a node
+  int first_arc = 0;
+  for (auto &n: new_nodes) {
+    n.first_arc = first_arc;
+    first_arc += n.num_arcs;
+  }
+  std::vector<Arc> new_arcs(file_arcs.size());
+  std::vector<int> next_arc(new_nodes.size());
+  for (int i=0; i<new_nodes.size(); ++i) next_arc[i] = new_nodes[i].first_arc;
+  for (const auto &a: file_arcs) {
+    new_arcs[next_arc[a.source]++] = a;
+  }
+
+  unmap();
+  nodes.assign(new_nodes);
+  arcs.assign(new_arcs);
+}
+
+void Fst::read_binary(FILE *ifh, const std::string &fname) {
+  BinaryHeader header;
+  if (fread(&header, sizeof(header), 1, ifh) != 1) {
+    fprintf(stderr, "Fst::read(): unexpected end of file in %s\n", fname.c_str());
+    throw ReadError();
+  }
+  if (header.byte_order != binary_byte_order) {
+    fprintf(stderr, "Fst::read(): %s was written on a machine with different byte order\n",
+            fname.c_str());
+    throw ReadError();
+  }
+  if (header.num_nodes < 0 || header.num_nodes > INT_MAX
+      || header.num_arcs < 0 || header.num_arcs > INT_MAX
+      || header.num_symbols < 0 || header.num_symbols > INT_MAX
+      || header.node_offset % 8 != 0 || header.arc_offset % 8 != 0
+      || header.symbol_offset_offset % 8 != 0
+      || header.node_offset + header.num_nodes * (int64_t)sizeof(Node) > header.file_size
+      || header.arc_offset + header.num_arcs * (int64_t)sizeof(Arc) > header.file_size
+      || header.symbol_offset_offset + (header.num_symbols + 1) * (int64_t)sizeof(int64_t)
+      > header.file_size
+      || header.symbol_offset > header.file_size
+      || header.initial_node_idx < 0 || header.initial_node_idx >= header.num_nodes)
+  {
+    fprintf(stderr, "Fst::read(): invalid header in %s\n", fname.c_str());
+    throw ReadError();
+  }
+
+  unmap();
+
+  // Map the file if possible. Otherwise read it to memory.
+  const char *base = nullptr;
+#ifndef _MSC_VER
+  struct stat st;
+  int fd = fileno(ifh);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= header.file_size) {
+    void *data = mmap(nullptr, header.file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      m_map_data = data;
+      m_map_size = header.file_size;
+      base = (const char*)data;
+    }
+  }
+#endif
+  std::vector<char> buffer;
+  if (base == nullptr) {
+    buffer.resize(header.file_size);
+    memcpy(&buffer[0], &header, sizeof(header));
+    if (fread(&buffer[sizeof(header)], header.file_size - sizeof(header), 1, ifh) != 1) {
+      fprintf(stderr, "Fst::read(): unexpected end of file in %s\n", fname.c_str());
+      throw ReadError();
+    }
+    base = &buffer[0];
+  }
+
+  // Check the arc ranges and the indices before the arrays are used
+  const Node *node_data = (const Node*)(base + header.node_offset);
+  const Arc *arc_data = (const Arc*)(base + header.arc_offset);
+  bool ok = true;
+  for (int64_t i=0; ok && i<header.num_nodes; ++i) {
+    const Node &n = node_data[i];
+    ok = n.first_arc >= 0 && n.num_arcs >= 0
+      && (int64_t)n.first_arc + n.num_arcs <= header.num_arcs;
+  }
+  for (int64_t i=0; ok && i<header.num_arcs; ++i) {
+    const Arc &a = arc_data[i];
+    ok = a.source >= 0 && a.source < header.num_nodes
+      && a.target >= 0 && a.target < header.num_nodes
+      && a.emit_symbol_id >= -1 && a.emit_symbol_id < header.num_symbols;
+  }
+  if (!ok) {
+    fprintf(stderr, "Fst::read(): invalid network in %s\n", fname.c_str());
+    unmap();
+    throw ReadError();
+  }
+
+  initial_node_idx = header.initial_node_idx;
+  if (m_map_data) {
+    nodes.map(node_data, header.num_nodes);
+    arcs.map(arc_data, header.num_arcs);
+  } else {
+    std::vector<Node> new_nodes(node_data, node_data + header.num_nodes);
+    std::vector<Arc> new_arcs(arc_data, arc_data + header.num_arcs);
+    nodes.assign(new_nodes);
+    arcs.assign(new_arcs);
+  }
+
+  const int64_t *symbol_offsets = (const int64_t*)(base + header.symbol_offset_offset);
+  const char *symbol_data = base + header.symbol_offset;
+  symbols.resize(header.num_symbols);
+  for (int i=0; i<header.num_symbols; ++i) {
+    if (symbol_offsets[i] < 0 || symbol_offsets[i+1] <= symbol_offsets[i] ||
+        header.symbol_offset + symbol_offsets[i+1] > header.file_size ||
+        symbol_data[symbol_offsets[i+1] - 1] != '\0') {
+      fprintf(stderr, "Fst::read(): invalid symbol table in %s\n", fname.c_str());
+      unmap();
+      throw ReadError();
+    }
+    symbols[i].assign(symbol_data + symbol_offsets[i]);
+  }
+}
+
+void Fst::write_binary(const std::string &fname) const {
+  BinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, binary_magic, sizeof(binary_magic));
+  header.byte_order = binary_byte_order;
+  header.initial_node_idx = initial_node_idx;
+  header.num_nodes = nodes.size();
+  header.num_arcs = arcs.size();
+  header.num_symbols = symbols.size();
+
+  std::vector<int64_t> symbol_offsets(symbols.size() + 1, 0);
+  for (int i=0; i<symbols.size(); ++i) {
+    symbol_offsets[i+1] = symbol_offsets[i] + symbols[i].size() + 1;
+  }
+
+  header.node_offset = binary_align(sizeof(header));
+  header.arc_offset = binary_align(header.node_offset + header.num_nodes * sizeof(Node));
+  header.symbol_offset_offset = binary_align(header.arc_offset + header.num_arcs * sizeof(Arc));
+  header.symbol_offset = header.symbol_offset_offset + symbol_offsets.size() * sizeof(int64_t);
+  header.file_size = header.symbol_offset + symbol_offsets.back();
+
+  FILE *ofh = fopen(fname.c_str(), "wb");
+  if (ofh==nullptr) {
+    perror("Error");
+    throw ReadError();
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, ofh) == 1;
+  ok = ok && write_binary_padding(ofh, header.node_offset - sizeof(header));
+  for (size_t i=0; ok && i<nodes.size(); ++i) {
+    ok = fwrite(&nodes[i], sizeof(Node), 1, ofh) == 1;
+  }
+  int64_t pos = header.node_offset + header.num_nodes * sizeof(Node);
+  ok = ok && write_binary_padding(ofh, header.arc_offset - pos);
+  for (size_t i=0; ok && i<arcs.size(); ++i) {
+    ok = fwrite(&arcs[i], sizeof(Arc), 1, ofh) == 1;
+  }
+  pos = header.arc_offset + header.num_arcs * sizeof(Arc);
+  ok = ok && write_binary_padding(ofh, header.symbol_offset_offset - pos);
+  ok = ok && fwrite(&symbol_offsets[0], sizeof(int64_t), symbol_offsets.size(), ofh)
+    == symbol_offsets.size();
+  for (size_t i=0; ok && i<symbols.size(); ++i) {
+    ok = fwrite(symbols[i].c_str(), symbols[i].size() + 1, 1, ofh) == 1;
+  }
+  if (fclose(ofh) != 0 || !ok) {
+    fprintf(stderr, "Fst::write_binary(): write error in %s\n", fname.c_str());
+    throw ReadError();
+  }
 }
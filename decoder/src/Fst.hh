@@ -1,11 +1,15 @@
 #ifndef FST_HH
 #define FST_HH
-/* 
-   Simple class to handle mitfst (http://people.csail.mit.edu/ilh/fst/) format networks. 
+/*
+   Simple class to handle mitfst (http://people.csail.mit.edu/ilh/fst/) format networks.
    AT&T fst toolkit and openfst have very similar formats, so this may work directly or
    with small adjustments with thosenetworks.
+
+   The network can also be compiled with fst2bin to a binary format, which is mapped
+   to memory when read.
 */
 
+#include <stdint.h>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -18,38 +22,80 @@ public:
   };
 
   struct Arc {
-    int source;
-    int target;
+    int32_t source;
+    int32_t target;
     float transition_logprob;
-    std::string emit_symbol;
+    int32_t emit_symbol_id; // Index to symbols, or -1 if no symbol
 
-    inline std::string str() {
+    inline std::string str() const {
       std::ostringstream os;
-      os << "Arc " << source << " -> " << target << " (" << transition_logprob << "): " << emit_symbol;
+      os << "Arc " << source << " -> " << target << " (" << transition_logprob << "): " << emit_symbol_id;
       return os.str();
     }
   };
-    
+
+  // The arcs leaving a node are arcs[first_arc] ... arcs[first_arc+num_arcs-1]
   struct Node {
-    Node() : emission_pdf_idx(-1), end_node(false) {}
-    int emission_pdf_idx;
-    std::vector<int> arcidxs;
-    bool end_node;
+    int32_t emission_pdf_idx;
+    int32_t first_arc;
+    int32_t num_arcs;
+    int32_t end_node;
 
-    inline std::string str() {
+    inline std::string str() const {
       std::ostringstream os;
-      os << "Node " << emission_pdf_idx << " (" << arcidxs.size() << ")";
+      os << "Node " << emission_pdf_idx << " (" << num_arcs << ")";
       return os.str();
     }
   };
 
+  // Read-only array that is either owned or points to the mapped file
+  template <typename T>
+  class Array {
+  public:
+    Array() : m_data(nullptr), m_size(0) {}
+    size_t size() const {return m_size;}
+    const T &operator[](size_t i) const {return m_data[i];}
+    void assign(std::vector<T> &v) {
+      m_owned.swap(v);
+      m_data = m_owned.empty()? nullptr: &m_owned[0];
+      m_size = m_owned.size();
+    }
+    void map(const T *data, size_t size) {
+      m_owned.clear(); m_data = data; m_size = size;
+    }
+  private:
+    std::vector<T> m_owned;
+    const T *m_data;
+    size_t m_size;
+  };
+
   Fst();
+  ~Fst();
+
+  // Reads the network in either the text or the binary format
   void read(std::string &);
   inline void read(const char *s) {std::string ss(s); read(ss);}
+
+  // Writes the network in the binary format
+  void write_binary(const std::string &fname) const;
+
+  const std::string &symbol(int id) const {return symbols[id];}
+
   int initial_node_idx;
-  std::vector<Node> nodes;
-  std::vector<Arc> arcs;
+  Array<Node> nodes;
+  Array<Arc> arcs; // Sorted by the source node
+  std::vector<std::string> symbols; // The distinct emit symbols
+
+private:
+  Fst(const Fst&);
+  Fst &operator=(const Fst&);
+
+  void read_text(FILE *ifh);
+  void read_binary(FILE *ifh, const std::string &fname);
+  void unmap();
+
+  void *m_map_data;
+  size_t m_map_size;
 };
 
 #endif
-
@@ -11,11 +11,11 @@ void FstConfidence::grammar_token_and_best_acu_confidence(float *gt_conf, float
   bool reject_same_prefix=false;
 
   float best_final_token_logprob;
-  std::vector<std::string> best_final_token_symbols;
-  for (const auto t: this->m_new_tokens) {
+  int best_final_token_history = -1;
+  for (const auto &t: this->m_new_tokens) {
     if (this->m_fst.nodes[t.node_idx].end_node) {
       best_final_token_logprob = t.logprob;
-      best_final_token_symbols = t.unemitted_words;
+      best_final_token_history = t.history;
       //fprintf(stderr, "Best %s\n", t.str().c_str());
       break;
     }
@@ -24,18 +24,19 @@ void FstConfidence::grammar_token_and_best_acu_confidence(float *gt_conf, float
   *ba_conf = 1.5f- 0.25f*(-best_final_token_logprob + m_best_acu_score)/m_cur_frame;
   //*ba_conf = m_best_acu_score/best_final_token_logprob;
 
-  if (best_final_token_symbols.size()==0) {
+  int best_final_token_length = history_length(best_final_token_history);
+  if (best_final_token_length==0) {
     fprintf(stderr, "Emptiness\n");
     *gt_conf = -9999999.9f;
     return;
   }
 
   float best_different_hypo_logprob=-9999999.9f;
-  for (const auto t:this->m_new_tokens) {
+  for (const auto &t:this->m_new_tokens) {
     //fprintf(stderr, "Tokening %s\n", t.str().c_str());
     if (check_only_final_nodes && this->m_fst.nodes[t.node_idx].end_node == false) continue;
 
-    if (t.unemitted_words.size() > best_final_token_symbols.size()) {
+    if (history_length(t.history) > best_final_token_length) {
       //fprintf(stderr, "size\n");
       best_different_hypo_logprob = t.logprob;
       break;
@@ -43,8 +44,10 @@ void FstConfidence::grammar_token_and_best_acu_confidence(float *gt_conf, float
 
     // Check for the same prefix
     if (reject_same_prefix) {
-      for (auto i=0; i<t.unemitted_words.size(); ++i) {
-        if (t.unemitted_words[i] != best_final_token_symbols[i]) {
+      const std::vector<std::string> words(token_words(t));
+      const std::vector<std::string> best_words(history_words(best_final_token_history));
+      for (auto i=0; i<words.size(); ++i) {
+        if (words[i] != best_words[i]) {
           best_different_hypo_logprob = t.logprob;
           //fprintf(stderr,"Diff hypo: ");
           //for (const auto w: t.unemitted_words) {
@@ -55,7 +58,8 @@ void FstConfidence::grammar_token_and_best_acu_confidence(float *gt_conf, float
         }
       }
     } else {
-      if (t.unemitted_words != best_final_token_symbols) {
+      // Equal histories have equal words
+      if (t.history != best_final_token_history) {
         best_different_hypo_logprob = t.logprob;
         goto out;
       }
@@ -13,17 +13,19 @@ H.fst: triphone to state numbers (expands to the number of states specified in t
 final.fst: The fst that the search uses
  */
 
+#include <stdint.h>
 #include "FstAcoustics.hh"
 #include "Fst.hh"
 
 typedef std::string bytestype;
 
 struct FstToken {
-  FstToken(): logprob(0.0f), node_idx(-1), state_dur(0) {};
+  FstToken(): logprob(0.0f), node_idx(-1), state_dur(0), history(-1), pending_symbol(-1) {};
   float logprob;
-  std::vector<std::string> unemitted_words;
   int node_idx;
   int state_dur;
+  int history; // The emitted words, index to the history trellis of the search
+  int pending_symbol; // Emitted in this frame, added to history if the token survives pruning
   
   std::string str() const;
 };
@@ -45,6 +47,11 @@ public:
   bytestype tokens_at_final_states();
   bytestype best_tokens(int n=10);
 
+  // The words emitted on the path of the token
+  std::vector<std::string> token_words(const T &t) const {return history_words(t.history);}
+  std::vector<std::string> history_words(int history) const;
+  int history_length(int history) const {return history<0? 0: m_histories[history].length;}
+
   void lna_open(const char *file, int size) {m_fst_acoustics->lna_open(file, size);}
   void lna_open_fd(const int fd, int size)  {m_fst_acoustics->lna_open_fd(fd, size);}
   void lna_close() {m_fst_acoustics->lna_close();}
@@ -66,6 +73,21 @@ protected:
   void propagate_tokens();
   std::vector<T> m_new_tokens;
 
+  // Word histories are stored as a trellis of back pointers. Each
+  // (previous history, symbol) pair is stored only once, so two tokens
+  // have emitted the same words if and only if their histories are equal.
+  struct History {
+    int symbol_id;
+    int prev;
+    int length;
+  };
+  size_t history_slot(int history, int symbol_id) const;
+  int find_history(int history, int symbol_id) const;
+  int extend_history(int history, int symbol_id);
+  void rehash_histories(size_t table_size);
+  std::vector<History> m_histories;
+  std::vector<int> m_history_table; // Open addressing index to m_histories, reused between utterances
+
   float m_duration_scale;
   float m_beam;
   int m_token_limit;
@@ -80,7 +102,11 @@ protected:
   std::vector<int> m_node_best_token;
 
 private:
-  float propagate_token(T &, float beam_prune_threshold=-999999999.0f);
+  float propagate_token(const T &, float beam_prune_threshold=-999999999.0f);
+  void recombine_tokens();
+  std::string token_str(const T &t) const;
+
+  std::vector<int> m_recombination_table; // Reused between the frames
 };
 
 typedef FstSearch_base<FstToken> FstSearch;
@@ -2,18 +2,86 @@
 #include "OneFrameAcoustics.hh"
 
 #include <algorithm>
-#include <set>
 
 inline std::string FstToken::str() const {
   std::ostringstream os;
-  os << "Token " << node_idx << " " << logprob << " dur " << state_dur << " '";
-  for (const auto s: unemitted_words) {
+  os << "Token " << node_idx << " " << logprob << " dur " << state_dur << " history " << history;
+  return os.str();
+}
+
+template <typename T>
+std::string FstSearch_base<T>::token_str(const T &t) const {
+  std::ostringstream os;
+  os << t.str() << " '";
+  for (const auto &s: token_words(t)) {
     os << " " << s;
   }
   os << " '";
   return os.str();
 }
 
+template <typename T>
+std::vector<std::string> FstSearch_base<T>::history_words(int history) const {
+  std::vector<std::string> words(history_length(history));
+  int i = words.size();
+  for (int h = history; h >= 0; h = m_histories[h].prev) {
+    words[--i] = m_fst.symbols[m_histories[h].symbol_id];
+  }
+  return words;
+}
+
+inline size_t fst_history_hash(int history, int symbol_id) {
+  uint64_t key = ((uint64_t)(uint32_t)(history+1) << 32) | (uint32_t)symbol_id;
+  return key * 0x9E3779B97F4A7C15ULL >> 32;
+}
+
+template <typename T>
+size_t FstSearch_base<T>::history_slot(int history, int symbol_id) const {
+  const size_t mask = m_history_table.size()-1;
+  size_t pos = fst_history_hash(history, symbol_id) & mask;
+  while (m_history_table[pos] != -1) {
+    const History &h = m_histories[m_history_table[pos]];
+    if (h.prev == history && h.symbol_id == symbol_id) break;
+    pos = (pos+1) & mask;
+  }
+  return pos;
+}
+
+template <typename T>
+int FstSearch_base<T>::find_history(int history, int symbol_id) const {
+  if (m_history_table.empty()) return -1;
+  return m_history_table[history_slot(history, symbol_id)];
+}
+
+template <typename T>
+int FstSearch_base<T>::extend_history(int history, int symbol_id) {
+  if (2*(m_histories.size()+1) > m_history_table.size()) {
+    rehash_histories(std::max((size_t)1024, 2*m_history_table.size()));
+  }
+
+  size_t pos = history_slot(history, symbol_id);
+  if (m_history_table[pos] != -1) return m_history_table[pos];
+
+  History h;
+  h.symbol_id = symbol_id;
+  h.prev = history;
+  h.length = history_length(history) + 1;
+  m_histories.push_back(h);
+  m_history_table[pos] = m_histories.size()-1;
+  return m_histories.size()-1;
+}
+
+template <typename T>
+void FstSearch_base<T>::rehash_histories(size_t table_size) {
+  m_history_table.assign(table_size, -1);
+  const size_t mask = table_size-1;
+  for (int i=0; i<m_histories.size(); ++i) {
+    size_t pos = fst_history_hash(m_histories[i].prev, m_histories[i].symbol_id) & mask;
+    while (m_history_table[pos] != -1) pos = (pos+1) & mask;
+    m_history_table[pos] = i;
+  }
+}
+
 // Constructor, if acoustics is created by the caller
 template <typename T>
 FstSearch_base<T>::FstSearch_base(const char * search_fst_fname, FstAcoustics *fst_acu):
@@ -46,7 +114,11 @@ void FstSearch_base<T>::init_search() {
   //if (verbose) fprintf(stderr, "Init search\n");
   m_new_tokens.resize(1);
   T &t=m_new_tokens[0];
+  t = T();
   t.node_idx = m_fst.initial_node_idx;
+  // Keep the capacity of the history buffers for the next utterance
+  m_histories.clear();
+  std::fill(m_history_table.begin(), m_history_table.end(), -1);
   if (m_one_token_per_node) std::fill(m_node_best_token.begin(), m_node_best_token.end(), -1);
 }
 
@@ -59,57 +131,81 @@ void FstSearch_base<T>::propagate_tokens() {
   m_new_tokens.clear();
 
   float best_logprob=-999999999.0f;
-  for (auto t: m_active_tokens) {
+  for (const auto &t: m_active_tokens) {
     float blp = propagate_token(t, best_logprob-m_beam);
     if (best_logprob<blp) {
       best_logprob = blp;
     }
   }
-  
-  // sort and prune
-  std::sort(m_new_tokens.begin(), m_new_tokens.end(),
-            [](T const & a, T const &b){return a.logprob > b.logprob;});
+  if (m_new_tokens.empty()) return;
 
   if (m_one_token_per_node) {
     std::fill(m_node_best_token.begin(), m_node_best_token.end(), -1);
-    /*fprintf(stderr, "Sorted\n");
-      int c=0;
-      for (auto t: m_new_tokens) {
-      fprintf(stderr, "  %d(%d): %s\n", ++c, m_frame, t.str().c_str());
-      }*/
-    if (m_new_tokens.size() > m_token_limit) {
-      m_new_tokens.resize(m_token_limit);
-    }
-    //fprintf(stderr, "size after token limit %ld\n", m_new_tokens.size());
   } else {
-    // For each active node, keep only one hypo with the same tokens
-    int num_accepted_tokens=0;
-    auto orig_tokens(std::move(m_new_tokens));
-    m_new_tokens.clear();
-    //std::map<int, std::unordered_set<std::vector<std::string > > > histmap; // no hash function for type
-    std::map<int, std::set<std::vector<std::string > > > histmap;
-    for (auto t: orig_tokens) {
-      //fprintf(stderr, "Is there already?");
-      auto &valset = histmap[t.node_idx];
-      if (valset.find(t.unemitted_words) !=valset.end() ) {
-        //fprintf(stderr, " Yes!\n");
-        continue;
-      }
-      //fprintf(stderr, " Nope!\n");
-      valset.insert(t.unemitted_words);
-      m_new_tokens.push_back(std::move(t));
-      if (num_accepted_tokens>= m_token_limit) break;
-      num_accepted_tokens++;
-    }
+    // For each active node, keep only one hypo with the same words
+    recombine_tokens();
   }
-  
-  int beam_prune_idx = 1;
+
+  // Beam pruning. The best token always survives.
   best_logprob = m_new_tokens[0].logprob;
-  while (beam_prune_idx < m_new_tokens.size() && m_new_tokens[beam_prune_idx].logprob > best_logprob-m_beam) {
-    beam_prune_idx++;
+  for (const auto &t: m_new_tokens) {
+    best_logprob = std::max(best_logprob, t.logprob);
+  }
+  auto end = std::remove_if(m_new_tokens.begin(), m_new_tokens.end(),
+                            [&](T const &t){return t.logprob <= best_logprob-m_beam;});
+  m_new_tokens.erase(end, m_new_tokens.end());
+
+  // Histogram pruning in linear time, then sort only the survivors
+  auto better = [](T const & a, T const &b){return a.logprob > b.logprob;};
+  if (m_new_tokens.size() > m_token_limit) {
+    std::nth_element(m_new_tokens.begin(), m_new_tokens.begin()+m_token_limit,
+                     m_new_tokens.end(), better);
+    m_new_tokens.resize(m_token_limit);
+  }
+  std::sort(m_new_tokens.begin(), m_new_tokens.end(), better);
+
+  // Store the words emitted in this frame only for the surviving tokens
+  for (auto &t: m_new_tokens) {
+    if (t.pending_symbol >= 0) {
+      t.history = extend_history(t.history, t.pending_symbol);
+      t.pending_symbol = -1;
+    }
+  }
+  //fprintf(stderr, "size after pruning %ld\n", m_new_tokens.size());
+}
+
+template <typename T>
+void FstSearch_base<T>::recombine_tokens() {
+  // Open addressing hash table from (node, history, pending symbol) to
+  // the kept token. Pending symbols only extend to new histories, so
+  // equal keys mean equal words.
+  size_t table_size = 16;
+  while (table_size < 2*m_new_tokens.size()) table_size *= 2;
+  m_recombination_table.assign(table_size, -1);
+
+  int num_kept = 0;
+  for (int i=0; i<m_new_tokens.size(); ++i) {
+    T &t = m_new_tokens[i];
+    uint64_t key = ((uint64_t)(uint32_t)t.node_idx << 32) | (uint32_t)fst_history_hash(t.history, t.pending_symbol);
+    size_t pos = (key * 0x9E3779B97F4A7C15ULL >> 32) & (table_size-1);
+    while (true) {
+      int j = m_recombination_table[pos];
+      if (j == -1) {
+        m_recombination_table[pos] = num_kept;
+        if (num_kept != i) m_new_tokens[num_kept] = std::move(t);
+        num_kept++;
+        break;
+      }
+      T &kept = m_new_tokens[j];
+      if (kept.node_idx == t.node_idx && kept.history == t.history &&
+          kept.pending_symbol == t.pending_symbol) {
+        if (t.logprob > kept.logprob) kept = std::move(t);
+        break;
+      }
+      pos = (pos+1) & (table_size-1);
+    }
   }
-  m_new_tokens.resize(beam_prune_idx);
-  //fprintf(stderr, "size after beam %ld\n", m_new_tokens.size());
+  m_new_tokens.resize(num_kept);
 }
 
 template <typename T>
@@ -127,9 +223,9 @@ template <typename T>
 bytestype FstSearch_base<T>::tokens_at_final_states() {
   std::ostringstream os;
   os << "Tokens at final nodes:" << std::endl;
-  for (const auto t: m_new_tokens) {
+  for (const auto &t: m_new_tokens) {
     if (m_fst.nodes[t.node_idx].end_node) {
-      os << "  " << t.str() << std::endl;
+      os << "  " << token_str(t) << std::endl;
     }
   }
   return os.str();
@@ -140,8 +236,8 @@ bytestype FstSearch_base<T>::best_tokens(int n) {
   std::ostringstream os;
   os << "Best tokens:" << std::endl;
   int c=0;
-  for (const auto t: m_new_tokens) {
-    os << "  " << t.str() << std::endl;
+  for (const auto &t: m_new_tokens) {
+    os << "  " << token_str(t) << std::endl;
     if (c++>n) break;
   }
   return os.str();
@@ -149,13 +245,13 @@ bytestype FstSearch_base<T>::best_tokens(int n) {
 
 template <typename T>
 bytestype FstSearch_base<T>::get_result_and_logprob(float &logprob) {
-  for (const auto t: m_new_tokens) {
+  for (const auto &t: m_new_tokens) {
     if (!m_fst.nodes[t.node_idx].end_node) {
       continue;
     }
     logprob = t.logprob;
     std::ostringstream os;
-    for (const auto w: t.unemitted_words) {
+    for (const auto &w: token_words(t)) {
       os << w << " ";
     }
     std::string retval(os.str()); // The best hypo at a final node
@@ -168,7 +264,7 @@ bytestype FstSearch_base<T>::get_result_and_logprob(float &logprob) {
 
 template <typename T>
 float FstSearch_base<T>::get_best_final_token_logprob() {
-  for (const auto t: m_new_tokens) {
+  for (const auto &t: m_new_tokens) {
     if (!m_fst.nodes[t.node_idx].end_node) continue;
     return t.logprob;
   }
@@ -176,24 +272,19 @@ float FstSearch_base<T>::get_best_final_token_logprob() {
 }
 
 template <typename T>
-float FstSearch_base<T>::propagate_token( T &t, float beam_prune_threshold) {
+float FstSearch_base<T>::propagate_token(const T &t, float beam_prune_threshold) {
   float best_logprob=-999999999.0f;
-  Fst::Node n = m_fst.nodes[t.node_idx];
+  const Fst::Node &n = m_fst.nodes[t.node_idx];
   //fprintf(stderr, "Propagate token at node %d\n", t.node_idx);
-  //fprintf(stderr, " num arcs %ld\n", n.arcidxs.size());
-  for (const auto arcidx: n.arcidxs) {
-    auto arc = m_fst.arcs[arcidx];
-    auto node = m_fst.nodes[arc.target];
+  //fprintf(stderr, " num arcs %d\n", n.num_arcs);
+  const int last_arc = n.first_arc + n.num_arcs;
+  for (int arcidx = n.first_arc; arcidx < last_arc; ++arcidx) {
+    const Fst::Arc &arc = m_fst.arcs[arcidx];
+    const Fst::Node &node = m_fst.nodes[arc.target];
     //fprintf(stderr, "%s\n", arc.str().c_str());
     //fprintf(stderr, "%s\n", node.str().c_str());
 
-    // Is this necessary, do objects have a default copy constructor?
     T updated_token(t);
-    
-    //Token updated_token;
-    //updated_token.logprob = t.logprob;
-    //updated_token.state_dur = t.state_dur;
-    //updated_token.unemitted_words = t.unemitted_words;
 
     updated_token.node_idx = arc.target;
 
@@ -216,9 +307,6 @@ float FstSearch_base<T>::propagate_token( T &t, float beam_prune_threshold) {
       //fprintf(stderr, "Increasing state dur %d\n", arc.source);
       updated_token.state_dur +=1;
     }
-    if (arc.emit_symbol.size()) {
-      updated_token.unemitted_words.push_back(arc.emit_symbol);
-    }
     //fprintf(stderr, "m_nbt size %ld, idx %d\n", m_node_best_token.size(), updated_token.node_idx);
     //fprintf(stderr, "%d\n", m_node_best_token[updated_token.node_idx]);
     int best_token_idx = m_one_token_per_node? m_node_best_token[updated_token.node_idx] : -1;
@@ -232,6 +320,13 @@ float FstSearch_base<T>::propagate_token( T &t, float beam_prune_threshold) {
       if (best_logprob < updated_token.logprob) {
         best_logprob = updated_token.logprob;
       }
+      if (arc.emit_symbol_id >= 0) {
+        // Use an existing history right away, so that recombination sees
+        // equal words as equal histories. New ones wait for pruning.
+        int history = find_history(updated_token.history, arc.emit_symbol_id);
+        if (history >= 0) updated_token.history = history;
+        else updated_token.pending_symbol = arc.emit_symbol_id;
+      }
       m_new_tokens.push_back(std::move(updated_token));
     }
   }
@@ -1,9 +1,11 @@
+#include <algorithm>
 #include "io.hh"
 #include "def.hh"
 #include "TreeGramArpaReader.hh"
 #include "InterTreeGram.hh"
+#include "QuantizedTreeGram.hh"
 
-InterTreeGram::InterTreeGram(const std::vector< std::string > lm_names, const std::vector<float> coeffs) {
+InterTreeGram::InterTreeGram(const std::vector< std::string > lm_names, const std::vector<float> coeffs, int quantization_bits) {
   if (lm_names.size() != coeffs.size()) {
     fprintf(stderr, "InterTreeGram::InterTreeGram: There must be as many interpolation coeffs as there are LMs. Exit.\n");
     exit(1);
@@ -56,22 +58,60 @@ InterTreeGram::InterTreeGram(const std::vector< std::string > lm_names, const st
     //TreeGramArpaReader tga2;
     //tga2.write(lm_out.file, lm);
     
-    m_models.push_back(lm);
     assert(lm->num_words() == real_num_words);
+    if (quantization_bits > 0) {
+      QuantizedTreeGram *qlm = new QuantizedTreeGram;
+      qlm->quantize(*lm, quantization_bits);
+      delete lm;
+      m_models.push_back(qlm);
+    }
+    else
+      m_models.push_back(lm);
 
-    if (lm->order()>m_order) {
-      m_order = lm->order();
+    if (m_models.back()->order()>m_order) {
+      m_order = m_models.back()->order();
     }
   }
+
+  set_cache_size(65536);
 }
 
 InterTreeGram::~InterTreeGram(void) {
-  for (std::vector<TreeGram *>::iterator j=m_models.begin();j!=m_models.end();++j) {
+  for (std::vector<NGram *>::iterator j=m_models.begin();j!=m_models.end();++j) {
     delete *j;
   }
 }
 
+void InterTreeGram::set_cache_size(int entries) {
+  int size = 0;
+  if (entries > 0) {
+    size = 1;
+    while (size < entries) size *= 2;
+  }
+  CacheEntry free_entry = { 0, 0.0f };
+  m_cache.assign(size, free_entry);
+  m_cache_words.assign((size_t)size * m_order, 0);
+}
+
 float InterTreeGram::log_prob(const Gram &gram) {
+  if (m_cache.empty() || gram.size() > m_order) return interpolate(gram);
+
+  size_t hash = gram.size();
+  for (Gram::const_iterator it = gram.begin(); it != gram.end(); ++it)
+    hash = (hash ^ *it) * 0x9e3779b97f4a7c15ULL;
+  size_t slot = (hash >> 16) & (m_cache.size() - 1);
+  CacheEntry &entry = m_cache[slot];
+  int *words = &m_cache_words[slot * m_order];
+  if (entry.size == gram.size() && std::equal(gram.begin(), gram.end(), words))
+    return entry.log_prob;
+
+  entry.size = gram.size();
+  entry.log_prob = interpolate(gram);
+  std::copy(gram.begin(), gram.end(), words);
+  return entry.log_prob;
+}
+
+float InterTreeGram::interpolate(const Gram &gram) {
   double prob=0.0;
   for (int i=0; i<m_models.size(); i++) {
     prob += m_coeffs[i] * pow(10, m_models[i]->log_prob(gram));
@@ -81,8 +121,10 @@ float InterTreeGram::log_prob(const Gram &gram) {
 
 void InterTreeGram::test_write(std::string fname, int idx) {
   io::Stream lm_out(fname, "w");
+  TreeGram *lm = dynamic_cast<TreeGram*>(m_models[idx]);
+  assert(lm != NULL); // Quantized models can not be written as ARPA
   TreeGramArpaReader tga;
-  tga.write(lm_out.file, m_models[idx]);
+  tga.write(lm_out.file, lm);
 }
 
 void InterTreeGram::fetch_bigram_list(int prev_word_id, 
@@ -109,3 +151,114 @@ void InterTreeGram::fetch_bigram_list(int prev_word_id,
     *it = safelogprob(*it);
   }
 }
+
+namespace {
+
+typedef std::vector<int> Words;
+
+// Index of the gram w[0] ... w[n-1] in the sorted list, or -1
+int find_gram(const std::vector<Words> &grams, const int *w, int n) {
+  std::vector<Words>::const_iterator it = std::lower_bound(
+    grams.begin(), grams.end(), w, [n](const Words &a, const int *b) {
+      return std::lexicographical_compare(a.begin(), a.end(), b, b + n); });
+  if (it == grams.end() || !std::equal(it->begin(), it->end(), w) || it->size() != n)
+    return -1;
+  return it - grams.begin();
+}
+
+// The probability of w[n-1] given w[0] ... w[n-2] in the back-off model
+float backoff_log_prob(const std::vector<std::vector<Words> > &grams,
+                       const std::vector<std::vector<float> > &log_probs,
+                       const std::vector<std::vector<float> > &back_offs,
+                       const int *w, int n) {
+  float back_off = 0.0f;
+  for (int first = 0; first < n; first++) {
+    int order = n - first;
+    int idx = find_gram(grams[order-1], w + first, order);
+    if (idx >= 0) return back_off + log_probs[order-1][idx];
+    if (order == 1) break;
+    idx = find_gram(grams[order-2], w + first, order - 1);
+    if (idx >= 0) back_off += back_offs[order-2][idx];
+  }
+  return back_off + MINLOGPROB;
+}
+
+}
+
+TreeGram *InterTreeGram::merge() {
+  std::vector<TreeGram *> models;
+  for (int i=0; i<m_models.size(); i++) {
+    TreeGram *lm = dynamic_cast<TreeGram*>(m_models[i]);
+    if (lm == NULL) {
+      fprintf(stderr, "InterTreeGram::merge: Quantized models can not be merged. Exit.\n");
+      exit(1);
+    }
+    models.push_back(lm);
+  }
+
+  // The union of the grams of each order in sorted order
+  std::vector<std::vector<Words> > grams(m_order);
+  for (int i=0; i<models.size(); i++) {
+    TreeGram::Iterator iter;
+    for (int order = 1; order <= models[i]->order(); order++) {
+      iter.reset(models[i]);
+      while (iter.next_order(order)) {
+        Words words(order);
+        for (int j = 1; j <= order; j++)
+          words[j-1] = iter.node(j).word;
+        grams[order-1].push_back(words);
+      }
+    }
+  }
+  for (int o=0; o<m_order; o++) {
+    std::sort(grams[o].begin(), grams[o].end());
+    grams[o].erase(std::unique(grams[o].begin(), grams[o].end()), grams[o].end());
+  }
+
+  // Interpolated probabilities
+  std::vector<std::vector<float> > log_probs(m_order), back_offs(m_order);
+  Gram gram;
+  for (int o=0; o<m_order; o++) {
+    log_probs[o].resize(grams[o].size());
+    back_offs[o].assign(grams[o].size(), 0.0f);
+    for (int k=0; k<grams[o].size(); k++) {
+      gram.assign(grams[o][k].begin(), grams[o][k].end());
+      log_probs[o][k] = interpolate(gram);
+    }
+  }
+
+  // The back-off weight of a context distributes the probability mass left
+  // over by its n-grams to the lower order probabilities of the other words.
+  for (int o=1; o<m_order; o++) {
+    std::vector<double> mass(grams[o-1].size(), 0.0);
+    std::vector<double> lower_mass(grams[o-1].size(), 0.0);
+    for (int k=0; k<grams[o].size(); k++) {
+      const Words &words = grams[o][k];
+      int context = find_gram(grams[o-1], &words[0], o);
+      if (context < 0) continue;
+      mass[context] += pow(10, log_probs[o][k]);
+      lower_mass[context] += pow(10, backoff_log_prob(grams, log_probs, back_offs,
+                                                       &words[1], o));
+    }
+    for (int k=0; k<grams[o-1].size(); k++) {
+      double left = 1.0 - mass[k], lower_left = 1.0 - lower_mass[k];
+      if (mass[k] > 0 && left > MINPROB && lower_left > MINPROB)
+        back_offs[o-1][k] = log10(left / lower_left);
+    }
+  }
+
+  TreeGram *lm = new TreeGram;
+  copy_vocab_to(*lm);
+  int num_grams = 0;
+  for (int o=0; o<m_order; o++)
+    num_grams += grams[o].size();
+  lm->reserve_nodes(num_grams);
+  for (int o=0; o<m_order; o++) {
+    for (int k=0; k<grams[o].size(); k++) {
+      gram.assign(grams[o][k].begin(), grams[o][k].end());
+      lm->add_gram(gram, log_probs[o][k], back_offs[o][k], true);
+    }
+  }
+  lm->finalize(true);
+  return lm;
+}
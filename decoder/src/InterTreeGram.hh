@@ -10,9 +10,41 @@
 
 class InterTreeGram : public NGram {
 public:
-  InterTreeGram ( const std::vector< std::string >, const std::vector<float> );
+  /// \brief Reads the ARPA models \a lm_names, to be interpolated with
+  /// \a coeffs.
+  ///
+  /// \param quantization_bits If nonzero, each model is converted to a
+  /// QuantizedTreeGram with codes of this many bits after reading.
+  ///
+  InterTreeGram ( const std::vector< std::string > lm_names,
+                  const std::vector<float> coeffs,
+                  int quantization_bits = 0 );
   ~InterTreeGram ( );
 
+  /// \brief Interpolates the models statically to a single back-off model.
+  ///
+  /// The result contains the union of the n-grams of the models with the
+  /// interpolated probabilities, and back-off weights that normalize the
+  /// distributions. It can be used like any TreeGram, at the cost of
+  /// looking up a single model. The models must not be quantized.
+  ///
+  /// \return The merged model. The caller owns it.
+  ///
+  TreeGram *merge();
+
+  /// \brief Sets the number of interpolated probabilities that are cached.
+  ///
+  /// The cache is direct-mapped, and the size is rounded up to a power of
+  /// two. Zero disables the cache.
+  ///
+  void set_cache_size(int entries);
+
+  /// \brief Returns the interpolated log probability of \a gram.
+  ///
+  /// The probability is stored in the cache, so the object must not be
+  /// shared between threads, even for lookups only. TokenPassSearch calls
+  /// this only outside its parallel passes.
+  ///
   float log_prob(const Gram &gram);
 
   // These need to be implemented for LM lookahead
@@ -35,7 +67,17 @@ public:
   void test_write(std::string fname, int idx);
 
 private:
-  std::vector<TreeGram *> m_models;
+  struct CacheEntry {
+    int size; // 0 if the entry is free
+    float log_prob;
+  };
+
+  float interpolate(const Gram &gram);
+
+  std::vector<NGram *> m_models;
   std::vector<float> m_coeffs;
+
+  std::vector<CacheEntry> m_cache;
+  std::vector<int> m_cache_words; // m_order words for each entry
 };
 #endif
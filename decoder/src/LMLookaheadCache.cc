@@ -0,0 +1,147 @@
+#include <map>
+
+#include "LMLookaheadCache.hh"
+#include "NGram.hh"
+
+LMLookaheadCache::LMLookaheadCache(NGram *ngram, int max_items)
+  : m_ngram(ngram),
+    m_max_items(max_items),
+    m_num_hits(0),
+    m_num_misses(0)
+{
+}
+
+std::shared_ptr<LMLookaheadCache>
+LMLookaheadCache::shared(NGram *ngram, int max_items)
+{
+  static std::mutex registry_mutex;
+  static std::map<NGram *, std::weak_ptr<LMLookaheadCache> > registry;
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  // Forget the caches whose users are gone.
+  std::map<NGram *, std::weak_ptr<LMLookaheadCache> >::iterator it;
+  for (it = registry.begin(); it != registry.end(); ) {
+    if (it->second.expired())
+      registry.erase(it++);
+    else
+      ++it;
+  }
+
+  std::shared_ptr<LMLookaheadCache> cache = registry[ngram].lock();
+  if (cache) {
+    cache->reserve(max_items);
+  }
+  else {
+    cache.reset(new LMLookaheadCache(ngram, max_items));
+    registry[ngram] = cache;
+  }
+  return cache;
+}
+
+LMLookaheadCache::ScoreList
+LMLookaheadCache::get(int w1, int w2)
+{
+  ScoreList scores = find(w1, w2);
+  if (scores)
+    return scores;
+  return compute(w1, w2);
+}
+
+LMLookaheadCache::ScoreList
+LMLookaheadCache::compute(int w1, int w2)
+{
+  // Compute the list without holding the cache lock, so that the other
+  // threads can use the cached lists in the meantime.
+  std::shared_ptr<std::vector<float> > new_scores(new std::vector<float>);
+  {
+    std::lock_guard<std::mutex> lock(m_ngram_mutex);
+    if (w1 < 0)
+      m_ngram->fetch_bigram_list(w2, *new_scores);
+    else
+      m_ngram->fetch_trigram_list(w1, w2, *new_scores);
+  }
+  ScoreList scores = new_scores;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t k = key(w1, w2);
+  ScoreList cached = find_locked(k);
+  if (cached) {
+    // Another thread computed the same list.
+    return cached;
+  }
+  Item item;
+  item.key = k;
+  item.scores = scores;
+  m_items.push_front(item);
+  m_index[k] = m_items.begin();
+  while ((int)m_items.size() > m_max_items) {
+    m_index.erase(m_items.back().key);
+    m_items.pop_back();
+  }
+  return scores;
+}
+
+LMLookaheadCache::ScoreList
+LMLookaheadCache::find(int w1, int w2)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ScoreList scores = find_locked(key(w1, w2));
+  if (scores)
+    m_num_hits++;
+  else
+    m_num_misses++;
+  return scores;
+}
+
+LMLookaheadCache::ScoreList
+LMLookaheadCache::find_locked(uint64_t key)
+{
+  std::unordered_map<uint64_t, ItemList::iterator>::iterator it =
+    m_index.find(key);
+  if (it == m_index.end())
+    return ScoreList();
+
+  // Move to the front of the LRU list.
+  m_items.splice(m_items.begin(), m_items, it->second);
+  return it->second->scores;
+}
+
+void
+LMLookaheadCache::reserve(int max_items)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (max_items > m_max_items)
+    m_max_items = max_items;
+}
+
+void
+LMLookaheadCache::clear()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_items.clear();
+  m_index.clear();
+  m_num_hits = 0;
+  m_num_misses = 0;
+}
+
+int
+LMLookaheadCache::num_items()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_items.size();
+}
+
+long
+LMLookaheadCache::num_hits()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_num_hits;
+}
+
+long
+LMLookaheadCache::num_misses()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_num_misses;
+}
@@ -0,0 +1,100 @@
+#ifndef LMLOOKAHEADCACHE_HH
+#define LMLOOKAHEADCACHE_HH
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+class NGram;
+
+/// \brief Cache of language model lookahead score lists.
+///
+/// A score list contains the log probabilities of every word in the
+/// lookahead LM after a one or two word context. The lists are indexed by
+/// LM word IDs, so the same cache can be used by decoders with different
+/// vocabularies and lexicons. Use shared() to get the cache that all the
+/// decoders of the process use for one LM.
+///
+/// All the public functions are thread-safe. The least recently used lists
+/// are removed when the cache is full. A removed list stays valid as long as
+/// someone holds a ScoreList pointing to it.
+///
+class LMLookaheadCache {
+public:
+  typedef std::shared_ptr<const std::vector<float> > ScoreList;
+
+  /// \brief Creates a cache for \a ngram that holds at most \a max_items
+  /// score lists.
+  ///
+  LMLookaheadCache(NGram *ngram, int max_items);
+
+  /// \brief Returns the cache shared by all users of \a ngram.
+  ///
+  /// The cache is created on the first call and destroyed when the last
+  /// user releases it. The cache is made large enough for \a max_items
+  /// score lists.
+  ///
+  static std::shared_ptr<LMLookaheadCache> shared(NGram *ngram,
+                                                  int max_items);
+
+  /// \brief Returns the scores after the LM words \a w1 \a w2, or after
+  /// \a w2 if \a w1 is negative. Computes the list if it is not cached.
+  ///
+  ScoreList get(int w1, int w2);
+
+  /// \brief Computes the scores after \a w1 \a w2 and adds them to the
+  /// cache. Use after find() has failed.
+  ///
+  ScoreList compute(int w1, int w2);
+
+  /// \brief Returns the cached scores after \a w1 \a w2, or an empty
+  /// pointer if they are not cached.
+  ///
+  ScoreList find(int w1, int w2);
+
+  /// \brief Makes room for at least \a max_items score lists.
+  ///
+  void reserve(int max_items);
+
+  /// \brief Removes all the score lists and resets the counters.
+  ///
+  void clear();
+
+  NGram *ngram() const { return m_ngram; }
+  int num_items();
+  long num_hits();
+  long num_misses();
+
+private:
+  LMLookaheadCache(const LMLookaheadCache &);
+  LMLookaheadCache &operator=(const LMLookaheadCache &);
+
+  struct Item {
+    uint64_t key;
+    ScoreList scores;
+  };
+  typedef std::list<Item> ItemList;
+
+  static uint64_t key(int w1, int w2)
+  {
+    return ((uint64_t)(uint32_t)(w1 + 1) << 32) | (uint32_t)w2;
+  }
+
+  ScoreList find_locked(uint64_t key);
+
+  NGram *m_ngram;
+  int m_max_items;
+
+  std::mutex m_mutex; // Guards the items and the counters
+  std::mutex m_ngram_mutex; // The n-gram model is not thread-safe
+
+  ItemList m_items; // Most recently used first
+  std::unordered_map<uint64_t, ItemList::iterator> m_index;
+  long m_num_hits;
+  long m_num_misses;
+};
+
+#endif /* LMLOOKAHEADCACHE_HH */
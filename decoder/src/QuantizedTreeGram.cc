@@ -0,0 +1,540 @@
+// Compact read-only representation of a TreeGram with quantized
+// probabilities and bit-packed nodes
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "Endian.hh"
+#include "QuantizedTreeGram.hh"
+#include "TreeGram.hh"
+#include "misc/str.hh"
+#include "def.hh"
+
+using namespace std;
+
+static std::string format_str("cis-binlm-quant1\n");
+
+// Number of bits needed to store the values 0 ... max_value.
+static int
+bits_for(uint64_t max_value)
+{
+  int bits = 0;
+  while (bits < 64 && (max_value >> bits) != 0)
+    bits++;
+  return bits;
+}
+
+// Creates a codebook of at most 2^bits values for the given values.
+// If there are few enough distinct values, they are all kept exactly.
+// Otherwise the values are divided to bins of equal counts, and each bin is
+// represented by its mean. Values below MINLOGPROB (e.g. -99 for <s>) are
+// kept exactly, so that they do not pull the means of other bins.
+static void
+make_codebook(std::vector<float> values, int bits, std::vector<float> &codebook)
+{
+  sort(values.begin(), values.end());
+  codebook = values;
+  codebook.erase(unique(codebook.begin(), codebook.end()), codebook.end());
+  size_t max_size = (size_t)1 << bits;
+  if (codebook.size() <= max_size) {
+    if (codebook.empty())
+      codebook.push_back(0);
+    return;
+  }
+
+  codebook.clear();
+  size_t first = 0;
+  while (first < values.size() && values[first] < MINLOGPROB) {
+    if (codebook.empty() || codebook.back() != values[first])
+      codebook.push_back(values[first]);
+    first++;
+  }
+  if (codebook.size() >= max_size)
+    throw std::invalid_argument("QuantizedTreeGram: too few bits");
+
+  size_t bins = max_size - codebook.size();
+  size_t count = values.size() - first;
+  for (size_t b = 0; b < bins; b++) {
+    size_t begin = first + count * b / bins;
+    size_t end = first + count * (b + 1) / bins;
+    if (begin == end)
+      continue;
+    double sum = 0;
+    for (size_t i = begin; i < end; i++)
+      sum += values[i];
+    codebook.push_back(sum / (end - begin));
+  }
+  sort(codebook.begin(), codebook.end());
+  codebook.erase(unique(codebook.begin(), codebook.end()), codebook.end());
+}
+
+// Index of the codebook entry nearest to value.
+static uint32_t
+encode(const std::vector<float> &codebook, float value)
+{
+  std::vector<float>::const_iterator it =
+    lower_bound(codebook.begin(), codebook.end(), value);
+  if (it == codebook.end())
+    return codebook.size() - 1;
+  if (it != codebook.begin() && value - *(it - 1) < *it - value)
+    --it;
+  return it - codebook.begin();
+}
+
+static void
+write_floats(FILE *file, const std::vector<float> &values)
+{
+  std::vector<float> buffer(values);
+  if (Endian::big && !buffer.empty())
+    Endian::convert_buffer(&buffer[0], buffer.size(), sizeof(float));
+  fprintf(file, "%d\n", (int)buffer.size());
+  if (!buffer.empty())
+    fwrite(&buffer[0], buffer.size() * sizeof(float), 1, file);
+}
+
+static bool
+read_floats(FILE *file, std::vector<float> &values)
+{
+  int size;
+  // The newline is read separately, so that the binary data that follows
+  // is not skipped as white space.
+  if (fscanf(file, "%d", &size) != 1 || fgetc(file) != '\n' || size < 1)
+    return false;
+  values.resize(size);
+  if (fread(&values[0], size * sizeof(float), 1, file) != 1)
+    return false;
+  if (Endian::big)
+    Endian::convert_buffer(&values[0], values.size(), sizeof(float));
+  return true;
+}
+
+QuantizedTreeGram::QuantizedTreeGram()
+  : m_num_nodes(0),
+    m_node_bits(0),
+    m_word_bits(0), m_word_offset(0),
+    m_child_bits(0), m_child_offset(0),
+    m_prob_bits(0), m_prob_offset(0),
+    m_back_off_bits(0), m_back_off_offset(0)
+{
+}
+
+void
+QuantizedTreeGram::set_field(int node, int offset, int bits, uint32_t value)
+{
+  uint64_t pos = (uint64_t)node * m_node_bits + offset;
+  unsigned char *p = &m_data[pos >> 3];
+  uint64_t word = 0;
+  for (int i = 0; i < 8; i++)
+    word |= (uint64_t)p[i] << (8 * i);
+  uint64_t mask = (((uint64_t)1 << bits) - 1) << (pos & 7);
+  word = (word & ~mask) | (((uint64_t)value << (pos & 7)) & mask);
+  for (int i = 0; i < 8; i++)
+    p[i] = (word >> (8 * i)) & 0xff;
+}
+
+void
+QuantizedTreeGram::quantize(TreeGram &gram, int bits)
+{
+  if (bits < 1 || bits > 16)
+    throw std::invalid_argument("QuantizedTreeGram::quantize: "
+                                "bits must be 1-16");
+
+  gram.copy_vocab_to(*this);
+  m_type = gram.get_type();
+  m_order = gram.order();
+  m_order_count.resize(m_order);
+  for (int o = 1; o <= m_order; o++)
+    m_order_count[o-1] = gram.gram_count(o);
+  m_num_nodes = gram.num_nodes();
+
+  // The nodes are stored one order after another. The possible sentinel
+  // node at the end is counted to the highest order.
+  std::vector<int> node_order(m_num_nodes, m_order);
+  int node = 0;
+  for (int o = 1; o <= m_order; o++)
+    for (int i = 0; i < m_order_count[o-1] && node < m_num_nodes; i++)
+      node_order[node++] = o;
+
+  std::vector<std::vector<float> > probs(m_order), back_offs(m_order);
+  for (int i = 0; i < m_num_nodes; i++) {
+    probs[node_order[i]-1].push_back(gram.node(i).log_prob);
+    back_offs[node_order[i]-1].push_back(gram.node(i).back_off);
+  }
+  m_prob_codebooks.resize(m_order);
+  m_back_off_codebooks.resize(m_order);
+  size_t max_prob_codes = 1, max_back_off_codes = 1;
+  for (int o = 0; o < m_order; o++) {
+    make_codebook(probs[o], bits, m_prob_codebooks[o]);
+    make_codebook(back_offs[o], bits, m_back_off_codebooks[o]);
+    max_prob_codes = max(max_prob_codes, m_prob_codebooks[o].size());
+    max_back_off_codes = max(max_back_off_codes,
+                             m_back_off_codebooks[o].size());
+  }
+
+  // Word IDs and child indices are stored plus one, so that -1 becomes 0.
+  m_word_bits = bits_for(num_words());
+  m_child_bits = bits_for(m_num_nodes);
+  m_prob_bits = bits_for(max_prob_codes - 1);
+  m_back_off_bits = bits_for(max_back_off_codes - 1);
+  m_word_offset = 0;
+  m_child_offset = m_word_offset + m_word_bits;
+  m_prob_offset = m_child_offset + m_child_bits;
+  m_back_off_offset = m_prob_offset + m_prob_bits;
+  m_node_bits = m_back_off_offset + m_back_off_bits;
+
+  // Eight bytes of padding allow reading any field with one 64-bit load.
+  m_data.assign(((uint64_t)m_num_nodes * m_node_bits + 7) / 8 + 8, 0);
+  for (int i = 0; i < m_num_nodes; i++) {
+    const TreeGram::Node &n = gram.node(i);
+    int o = node_order[i];
+    set_field(i, m_word_offset, m_word_bits, n.word + 1);
+    set_field(i, m_child_offset, m_child_bits, n.child_index + 1);
+    set_field(i, m_prob_offset, m_prob_bits,
+              encode(m_prob_codebooks[o-1], n.log_prob));
+    set_field(i, m_back_off_offset, m_back_off_bits,
+              encode(m_back_off_codebooks[o-1], n.back_off));
+  }
+}
+
+size_t
+QuantizedTreeGram::memory_size() const
+{
+  size_t size = m_data.size();
+  for (int o = 0; o < m_order; o++)
+    size += (m_prob_codebooks[o].size() + m_back_off_codebooks[o].size())
+      * sizeof(float);
+  return size;
+}
+
+void
+QuantizedTreeGram::write(FILE *file, bool binary)
+{
+  assert(binary);
+  fputs(format_str.c_str(), file);
+
+  if (m_type == BACKOFF)
+    fputs("backoff\n", file);
+  else if (m_type == INTERPOLATED)
+    fputs("interpolated\n", file);
+
+  fprintf(file, "%d\n", num_words());
+  for (int i = 0; i < num_words(); i++)
+    fprintf(file, "%s\n", word(i).c_str());
+
+  fprintf(file, "%d %d\n", m_order, m_num_nodes);
+  for (int i = 0; i < m_order; i++)
+    fprintf(file, "%d\n", m_order_count[i]);
+
+  fprintf(file, "%d %d %d %d\n", m_word_bits, m_child_bits, m_prob_bits,
+          m_back_off_bits);
+  for (int o = 0; o < m_order; o++) {
+    write_floats(file, m_prob_codebooks[o]);
+    write_floats(file, m_back_off_codebooks[o]);
+  }
+
+  fprintf(file, "%ld\n", (long)m_data.size());
+  fwrite(&m_data[0], m_data.size(), 1, file);
+
+  if (ferror(file)) {
+    fprintf(stderr, "QuantizedTreeGram::write(): write error: %s\n",
+            strerror(errno));
+    throw runtime_error("QuantizedTreeGram::write");
+  }
+}
+
+void
+QuantizedTreeGram::read(FILE *file, bool binary)
+{
+  assert(binary);
+  read_body(file, "");
+}
+
+// Reads the file when the first bytes of the format string, \a header,
+// have already been read.
+void
+QuantizedTreeGram::read_body(FILE *file, const std::string &header)
+{
+  std::string line;
+  if (!str::read_string(line, format_str.length() - header.length(), file)
+      || header + line != format_str)
+  {
+    fprintf(stderr, "QuantizedTreeGram::read(): invalid file format\n");
+    throw ReadError();
+  }
+
+  str::read_line(line, file, true);
+  if (line == "backoff")
+    m_type = BACKOFF;
+  else if (line == "interpolated")
+    m_type = INTERPOLATED;
+  else {
+    fprintf(stderr, "QuantizedTreeGram::read(): invalid type: %s\n",
+            line.c_str());
+    throw ReadError();
+  }
+
+  int words;
+  if (fscanf(file, "%d\n", &words) != 1 || words < 1) {
+    fprintf(stderr, "QuantizedTreeGram::read(): invalid number of words\n");
+    throw ReadError();
+  }
+  clear_words();
+  for (int i = 0; i < words; i++) {
+    if (!str::read_line(line, file, true)) {
+      fprintf(stderr, "QuantizedTreeGram::read(): "
+              "read error while reading vocabulary\n");
+      throw ReadError();
+    }
+    add_word(line);
+  }
+
+  if (fscanf(file, "%d %d\n", &m_order, &m_num_nodes) != 2
+      || m_order < 1 || m_num_nodes < 1)
+    throw ReadError();
+  m_order_count.resize(m_order);
+  for (int i = 0; i < m_order; i++) {
+    if (fscanf(file, "%d\n", &m_order_count[i]) != 1)
+      throw ReadError();
+  }
+
+  if (fscanf(file, "%d %d %d %d\n", &m_word_bits, &m_child_bits,
+             &m_prob_bits, &m_back_off_bits) != 4
+      || m_word_bits > 32 || m_child_bits > 32
+      || m_prob_bits > 16 || m_back_off_bits > 16)
+    throw ReadError();
+  m_word_offset = 0;
+  m_child_offset = m_word_offset + m_word_bits;
+  m_prob_offset = m_child_offset + m_child_bits;
+  m_back_off_offset = m_prob_offset + m_prob_bits;
+  m_node_bits = m_back_off_offset + m_back_off_bits;
+
+  m_prob_codebooks.resize(m_order);
+  m_back_off_codebooks.resize(m_order);
+  for (int o = 0; o < m_order; o++) {
+    if (!read_floats(file, m_prob_codebooks[o])
+        || !read_floats(file, m_back_off_codebooks[o])
+        || m_prob_codebooks[o].size() > ((size_t)1 << m_prob_bits)
+        || m_back_off_codebooks[o].size() > ((size_t)1 << m_back_off_bits))
+    {
+      fprintf(stderr, "QuantizedTreeGram::read(): invalid codebook\n");
+      throw ReadError();
+    }
+    // Unused codes must not index past the codebook.
+    m_prob_codebooks[o].resize((size_t)1 << m_prob_bits,
+                               m_prob_codebooks[o].back());
+    m_back_off_codebooks[o].resize((size_t)1 << m_back_off_bits,
+                                   m_back_off_codebooks[o].back());
+  }
+
+  long data_size;
+  if (fscanf(file, "%ld", &data_size) != 1 || fgetc(file) != '\n'
+      || data_size != ((long)m_num_nodes * m_node_bits + 7) / 8 + 8)
+    throw ReadError();
+  m_data.resize(data_size);
+  if (fread(&m_data[0], data_size, 1, file) != 1) {
+    fprintf(stderr, "QuantizedTreeGram::read(): "
+            "read error while reading ngrams\n");
+    throw ReadError();
+  }
+}
+
+int
+QuantizedTreeGram::binary_search(int word, int first, int last)
+{
+  while (last - first > 5) { // magic threshold to do linear search
+    int middle = first + (last - first) / 2;
+    int middle_word = node_word(middle);
+    if (middle_word == word)
+      return middle;
+    if (middle_word > word)
+      last = middle;
+    else
+      first = middle + 1;
+  }
+
+  for (; first < last; first++) {
+    if (node_word(first) == word)
+      return first;
+  }
+  return -1;
+}
+
+// Returns unigram if node_index < 0
+int
+QuantizedTreeGram::find_child(int word, int node_index)
+{
+  if (word < 0 || word >= m_words.size()) {
+    fprintf(stderr, "QuantizedTreeGram::find_child(): "
+	    "index %d out of vocabulary size %d\n", word, (int) m_words.size());
+    throw invalid_argument("QuantizedTreeGram::find_child");
+  }
+
+  if (node_index < 0)
+    return word;
+  if (node_index >= m_num_nodes - 1)
+    return -1;
+
+  int first = node_child_index(node_index);
+  int last = node_child_index(node_index + 1); // not included
+  if (first < 0 || last < 0)
+    return -1;
+
+  return binary_search(word, first, last);
+}
+
+// Fetch the node indices of the requested gram to m_fetch_stack as
+// far as found in the tree structure.
+template <typename G>
+void
+QuantizedTreeGram::fetch_gram(const G &gram, int first)
+{
+  assert(first >= 0 && first < gram.size());
+
+  int prev = -1;
+  m_fetch_stack.clear();
+  for (int i = first; i < gram.size(); i++) {
+    int node = find_child(gram[i], prev);
+    if (node < 0)
+      break;
+    m_fetch_stack.push_back(node);
+    prev = node;
+  }
+}
+
+template <typename G>
+float
+QuantizedTreeGram::log_prob_bo_impl(const G &gram)
+{
+  float log_prob = 0.0;
+  int n = 0;
+  while (1) {
+    assert(n < gram.size());
+    fetch_gram(gram, n);
+    assert(m_fetch_stack.size() > 0);
+    int order = m_fetch_stack.size();
+
+    // Full gram found?
+    if (order == gram.size() - n) {
+      log_prob += node_log_prob(m_fetch_stack.back(), order);
+      m_last_order = order;
+      break;
+    }
+
+    // Back-off found?
+    if (order == gram.size() - n - 1)
+      log_prob += node_back_off(m_fetch_stack.back(), order);
+
+    n++;
+  }
+  return log_prob;
+}
+
+template <typename G>
+float
+QuantizedTreeGram::log_prob_i_impl(const G &gram)
+{
+  float prob = 0.0;
+  float bo;
+  m_last_order = 0;
+
+  const int looptill = std::min((int)gram.size(), m_order);
+  for (int n = 1; n <= looptill; n++) {
+    fetch_gram(gram, gram.size() - n);
+    int order = m_fetch_stack.size();
+    if (order < n - 1)
+      continue;
+
+    if (order == n - 1) {
+      bo = pow(10, node_back_off(m_fetch_stack.back(), order));
+      prob *= bo;
+      continue;
+    }
+
+    if (n > 1) {
+      bo = pow(10, node_back_off(m_fetch_stack[order - 2], order - 1));
+      prob = bo * prob;
+    }
+    m_last_order = n;
+    prob += pow(10, node_log_prob(m_fetch_stack.back(), order));
+  }
+  return safelogprob(prob);
+}
+
+// The inline wrappers in the header call these for every key type
+template float QuantizedTreeGram::log_prob_bo_impl(const NGram::Gram &gram);
+template float QuantizedTreeGram::log_prob_i_impl(const NGram::Gram &gram);
+template float QuantizedTreeGram::log_prob_bo_impl(
+  const std::vector<int> &gram);
+template float QuantizedTreeGram::log_prob_i_impl(
+  const std::vector<int> &gram);
+template float QuantizedTreeGram::log_prob_bo_impl(
+  const std::vector<unsigned short> &gram);
+template float QuantizedTreeGram::log_prob_i_impl(
+  const std::vector<unsigned short> &gram);
+
+void
+QuantizedTreeGram::fetch_bigram_list(int prev_word_id,
+                                     std::vector<float> &result_buffer)
+{
+  assert(m_type == BACKOFF);
+
+  float back_off_w = node_back_off(prev_word_id, 1);
+
+  // Fill the unigram probabilities for every word in the LM.
+  result_buffer.resize(m_words.size());
+  for (int i = 0; i < m_words.size(); i++)
+    result_buffer[i] = back_off_w + node_log_prob(i, 1);
+
+  // Fill the bigram probabilities when found.
+  int child_index = node_child_index(prev_word_id);
+  int next_child_index = node_child_index(prev_word_id + 1);
+  if (child_index != -1 && next_child_index > child_index) {
+    for (int i = child_index; i < next_child_index; i++)
+      result_buffer[node_word(i)] = node_log_prob(i, 2);
+  }
+}
+
+void
+QuantizedTreeGram::fetch_trigram_list(int w1, int w2,
+                                      std::vector<float> &result_buffer)
+{
+  assert(m_type == BACKOFF);
+
+  // Check if bigram (w1,w2) exists
+  int bigram_index = find_child(w2, w1);
+  if (bigram_index == -1) {
+    // No bigram (w1,w2), only condition to w2
+    fetch_bigram_list(w2, result_buffer);
+    return;
+  }
+
+  result_buffer.resize(m_words.size());
+
+  // Get backoff weights
+  float bigram_back_off_w = node_back_off(bigram_index, 2);
+  float w2_back_off_w = node_back_off(w2, 1);
+
+  // Fill the unigram probabilities
+  float temp = bigram_back_off_w + w2_back_off_w;
+  for (int i = 0; i < m_words.size(); i++)
+    result_buffer[i] = temp + node_log_prob(i, 1);
+
+  // Fill bigram (w2, next_word_id) probabilities
+  int child_index = node_child_index(w2);
+  int next_child_index = node_child_index(w2 + 1);
+  if (child_index != -1 && next_child_index > child_index) {
+    for (int i = child_index; i < next_child_index; i++)
+      result_buffer[node_word(i)] = bigram_back_off_w + node_log_prob(i, 2);
+  }
+
+  // Fill trigram probabilities
+  child_index = node_child_index(bigram_index);
+  next_child_index = node_child_index(bigram_index + 1);
+  if (child_index != -1 && next_child_index > child_index) {
+    for (int i = child_index; i < next_child_index; i++)
+      result_buffer[node_word(i)] = node_log_prob(i, 3);
+  }
+}
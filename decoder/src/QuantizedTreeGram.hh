@@ -0,0 +1,125 @@
+// Compact read-only representation of a TreeGram with quantized
+// probabilities and bit-packed nodes
+#ifndef QUANTIZEDTREEGRAM_HH
+#define QUANTIZEDTREEGRAM_HH
+
+#include <stdint.h>
+#include "NGram.hh"
+
+class TreeGram;
+
+/// \brief A read-only n-gram model with the same tree structure as
+/// TreeGram, but with smaller nodes.
+///
+/// The log probabilities and back-off weights of each order are replaced
+/// with indices to a codebook of that order. Each node is stored as a bit
+/// field with the word ID, child index and the two codes, using only as
+/// many bits as the model needs. With 8-bit codes a node takes typically
+/// 7-8 bytes instead of 16.
+///
+class QuantizedTreeGram : public NGram {
+public:
+  struct ReadError : public std::exception {
+    virtual const char *what() const throw()
+      { return "QuantizedTreeGram: read error"; }
+  };
+
+  QuantizedTreeGram();
+
+  /// \brief Creates the model from \a gram.
+  ///
+  /// \param bits The number of bits in the codes (1-16).
+  ///
+  void quantize(TreeGram &gram, int bits);
+
+  /// \brief Reads a model written by write().
+  ///
+  /// Use TreeGram::read_binary() to read a binary model of unknown format.
+  ///
+  void read(FILE *file, bool binary=true);
+
+  void write(FILE *file, bool binary=true);
+
+  float log_prob_bo(const Gram &gram) { return log_prob_bo_impl(gram); }
+  float log_prob_i(const Gram &gram) { return log_prob_i_impl(gram); }
+  float log_prob_bo(const std::vector<int> &gram)
+  { return log_prob_bo_impl(gram); }
+  float log_prob_i(const std::vector<int> &gram)
+  { return log_prob_i_impl(gram); }
+  float log_prob_bo(const std::vector<unsigned short> &gram)
+  { return log_prob_bo_impl(gram); }
+  float log_prob_i(const std::vector<unsigned short> &gram)
+  { return log_prob_i_impl(gram); }
+
+  /// \brief Computes bigram probabilities for every word pair
+  /// with context "prev_word_id". See TreeGram::fetch_bigram_list().
+  ///
+  void fetch_bigram_list(int prev_word_id,
+                         std::vector<float> &result_buffer);
+
+  /// \brief Computes trigram probabilities for every word triplet
+  /// with context "w1 w2". See TreeGram::fetch_trigram_list().
+  ///
+  void fetch_trigram_list(int w1, int w2,
+                          std::vector<float> &result_buffer);
+
+  int gram_count(int order) { return m_order_count.at(order-1); }
+  int num_nodes() const { return m_num_nodes; }
+
+  /// \brief Bytes used by the nodes and the codebooks.
+  size_t memory_size() const;
+
+private:
+  friend class TreeGram;
+
+  void read_body(FILE *file, const std::string &header);
+  int find_child(int word, int node_index);
+  int binary_search(int word, int first, int last);
+  template <typename G> void fetch_gram(const G &gram, int first);
+  template <typename G> float log_prob_bo_impl(const G &gram);
+  template <typename G> float log_prob_i_impl(const G &gram);
+
+  inline uint32_t get_field(int node, int offset, int bits) const;
+  void set_field(int node, int offset, int bits, uint32_t value);
+
+  // Fields of the node \a node. The order (1 ... n) selects the codebook.
+  int node_word(int node) const
+  { return (int)get_field(node, m_word_offset, m_word_bits) - 1; }
+  int node_child_index(int node) const
+  { return (int)get_field(node, m_child_offset, m_child_bits) - 1; }
+  float node_log_prob(int node, int order) const
+  { return m_prob_codebooks[order-1][
+      get_field(node, m_prob_offset, m_prob_bits)]; }
+  float node_back_off(int node, int order) const
+  { return m_back_off_codebooks[order-1][
+      get_field(node, m_back_off_offset, m_back_off_bits)]; }
+
+  std::vector<int> m_order_count;	// number of grams in each order
+  int m_num_nodes;
+
+  // Bit widths and offsets of the node fields.
+  int m_node_bits;
+  int m_word_bits, m_word_offset;
+  int m_child_bits, m_child_offset;
+  int m_prob_bits, m_prob_offset;
+  int m_back_off_bits, m_back_off_offset;
+
+  std::vector<std::vector<float> > m_prob_codebooks; // for each order
+  std::vector<std::vector<float> > m_back_off_codebooks;
+  std::vector<unsigned char> m_data;	// packed nodes
+  std::vector<int> m_fetch_stack;	// indices of the gram requested
+};
+
+uint32_t
+QuantizedTreeGram::get_field(int node, int offset, int bits) const
+{
+  uint64_t pos = (uint64_t)node * m_node_bits + offset;
+  const unsigned char *p = &m_data[pos >> 3];
+  // Little-endian load, so that the data does not depend on the host.
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++)
+    value |= (uint64_t)p[i] << (8 * i);
+  return (uint32_t)((value >> (pos & 7)) & (((uint64_t)1 << bits) - 1));
+}
+
+#endif /* QUANTIZEDTREEGRAM_HH */
@@ -1,9 +1,18 @@
 #include <cstddef>  // NULL
 #include <cstdio>
+#include <cstring>
+#include <climits>
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
 #include <iostream>
+#include <utility>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#endif
 
 #include "TPLexPrefixTree.hh"
 
@@ -43,7 +52,9 @@ TPLexPrefixTree::TPLexPrefixTree(std::map<std::string,int> &hmm_map,
                                  std::vector<Hmm> &hmms)
   : m_words(0),
     m_verbose(0),
+    m_frozen(false),
     m_lm_lookahead(0),
+    m_lm_scale(1),
     m_silence_is_word(true),
     m_hmm_map(hmm_map),
     m_hmms(hmms)
@@ -68,10 +79,16 @@ struct delete_node
 
 TPLexPrefixTree::~TPLexPrefixTree()
 {
-  for_each(m_nodes.begin(), m_nodes.end(), delete_node());
+  delete_heap_nodes();
   m_nodes.clear();
 }
 
+void TPLexPrefixTree::delete_heap_nodes()
+{
+  for_each(m_nodes.begin() + m_node_storage.size(), m_nodes.end(),
+           delete_node());
+}
+
 void TPLexPrefixTree::set_lm_lookahead(int lm_lookahead)
 {
   if (m_silence_node != NULL) {
@@ -110,6 +127,7 @@ void TPLexPrefixTree::initialize_lex_tree(void)
 
 void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double prob)
 {
+  thaw();
   double word_log_prob = safe_log(prob);
   if (word_log_prob <= -99)
     return;
@@ -397,6 +415,7 @@ TPLexPrefixTree::expand_lexical_tree(Node *source, Hmm *hmm,
 void TPLexPrefixTree::finish_tree(void)
 {
   assert( m_silence_node != NULL );
+  thaw();
 
   if (m_cross_word_triphones)
   {
@@ -491,6 +510,562 @@ void TPLexPrefixTree::finish_tree(void)
 
   // fprintf(stderr, "WARNING: silence loop not added\n");
   // debug_add_silence_loop();
+
+  freeze();
+}
+
+void TPLexPrefixTree::freeze()
+{
+  const int num_nodes = m_nodes.size();
+
+  // Breadth-first order from the start node, so that the nodes visited
+  // one after another in decoding are close to each other in memory.
+  // Unreachable nodes are kept in the end.
+  std::vector<int> new_id(num_nodes, -1);
+  node_vector order;
+  order.reserve(num_nodes);
+  Node *sources[] = { m_start_node, m_root_node };
+  for (int s = 0; s < 2; s++) {
+    if (new_id[sources[s]->node_id] >= 0)
+      continue;
+    new_id[sources[s]->node_id] = order.size();
+    order.push_back(sources[s]);
+    for (int i = order.size() - 1; i < order.size(); i++) {
+      std::vector<Arc> &arcs = order[i]->arcs;
+      for (int a = 0; a < arcs.size(); a++) {
+        assert( arcs[a].next != NULL );
+        int &id = new_id[arcs[a].next->node_id];
+        if (id < 0) {
+          id = order.size();
+          order.push_back(arcs[a].next);
+        }
+      }
+    }
+  }
+  for (int i = 0; i < num_nodes; i++) {
+    if (new_id[i] < 0) {
+      new_id[i] = order.size();
+      order.push_back(m_nodes[i]);
+    }
+  }
+
+  // Move the nodes into contiguous storage and collect the arcs.
+  std::vector<Node> storage(num_nodes);
+  std::vector<FrozenArc> frozen_arcs;
+  for (int i = 0; i < num_nodes; i++) {
+    Node &node = storage[i];
+    node = std::move(*order[i]);
+    node.node_id = i;
+    node.arc_begin = frozen_arcs.size();
+    for (int a = 0; a < node.arcs.size(); a++) {
+      FrozenArc arc;
+      arc.log_prob = node.arcs[a].log_prob;
+      arc.next = new_id[node.arcs[a].next->node_id];
+      frozen_arcs.push_back(arc);
+    }
+    node.arc_end = frozen_arcs.size();
+    std::vector<Arc>().swap(node.arcs);
+  }
+
+  // Redirect the pointers to the nodes
+  struct Remap {
+    std::vector<Node> &storage;
+    const std::vector<int> &new_id;
+    Node *operator()(Node *node) const
+    { return node == NULL ? NULL : &storage[new_id[node->node_id]]; }
+  } remap = { storage, new_id };
+  m_root_node = remap(m_root_node);
+  m_end_node = remap(m_end_node);
+  m_start_node = remap(m_start_node);
+  m_silence_node = remap(m_silence_node);
+  m_last_silence_node = remap(m_last_silence_node);
+  for (int i = 0; i < m_silence_arcs.size(); i++)
+    m_silence_arcs[i].node = remap(m_silence_arcs[i].node);
+  string_to_nodes_map *maps[] = {
+    &m_fan_out_entry_nodes, &m_fan_out_last_nodes, &m_fan_in_entry_nodes,
+    &m_fan_in_last_nodes, &m_fan_in_connection_nodes };
+  for (int m = 0; m < 5; m++) {
+    for (string_to_nodes_map::iterator it = maps[m]->begin();
+         it != maps[m]->end(); ++it)
+    {
+      for (int i = 0; i < it->second.size(); i++)
+        it->second[i] = remap(it->second[i]);
+    }
+  }
+
+  delete_heap_nodes();
+  m_node_storage.swap(storage);
+  m_frozen_arcs.swap(frozen_arcs);
+  for (int i = 0; i < num_nodes; i++)
+    m_nodes[i] = &m_node_storage[i];
+  m_frozen = true;
+
+  if (m_verbose > 1)
+    fprintf(stderr, "Frozen network: %d nodes, %zd arcs\n", num_nodes,
+            m_frozen_arcs.size());
+}
+
+void TPLexPrefixTree::thaw()
+{
+  if (!m_frozen)
+    return;
+  for (int i = 0; i < m_node_storage.size(); i++) {
+    Node &node = m_node_storage[i];
+    node.arcs.resize(node.arc_end - node.arc_begin);
+    for (int a = node.arc_begin; a < node.arc_end; a++) {
+      Arc &arc = node.arcs[a - node.arc_begin];
+      arc.log_prob = m_frozen_arcs[a].log_prob;
+      arc.next = &m_node_storage[m_frozen_arcs[a].next];
+    }
+    node.arc_begin = 0;
+    node.arc_end = 0;
+  }
+  std::vector<FrozenArc>().swap(m_frozen_arcs);
+  m_frozen = false;
+}
+
+// The binary snapshot format of the frozen network. The arrays are aligned
+// to 8 bytes.
+static const char snapshot_magic[] = "cis-lextree1\n";
+static const int32_t snapshot_byte_order = 0x01020304;
+
+struct SnapshotHeader {
+  char magic[16];
+  int32_t byte_order;
+  uint32_t hmm_checksum;
+  int32_t num_hmms;
+  int32_t words;
+  int32_t root_node;
+  int32_t end_node;
+  int32_t start_node;
+  int32_t silence_node; // -1 if none
+  int32_t last_silence_node; // -1 if none
+  int32_t short_silence_hmm; // -1 if none
+  int32_t short_silence_state;
+  int32_t word_boundary_id;
+  int32_t lm_lookahead;
+  int32_t cross_word_triphones;
+  int32_t silence_is_word;
+  int32_t optional_short_silence;
+  int32_t lm_buf_count;
+  int32_t padding;
+  double lm_scale;
+  int64_t num_nodes;
+  int64_t num_arcs;
+  int64_t num_lookahead_ids;
+  int64_t num_words;
+  int64_t node_offset; // SnapshotNode[num_nodes]
+  int64_t arc_offset; // FrozenArc[num_arcs]
+  int64_t lookahead_offset; // int32_t[num_lookahead_ids]
+  int64_t word_offset_offset; // int64_t[num_words + 1] from word_offset
+  int64_t word_offset; // Null-terminated words
+  int64_t file_size;
+};
+
+struct SnapshotNode {
+  int32_t hmm; // -1 if the node has no state
+  int32_t state;
+  int32_t word_id;
+  int32_t flags;
+  int32_t arc_begin;
+  int32_t arc_end;
+  int64_t lookahead_begin; // possible_word_id_list in the lookahead array
+  int64_t lookahead_end;
+};
+
+static int64_t
+snapshot_align(int64_t offset)
+{
+  return (offset + 7) / 8 * 8;
+}
+
+// Returns true if an aligned array of count elements at offset fits in
+// the file. Checked by division so that corrupted counts cannot overflow.
+static bool
+snapshot_array_fits(int64_t offset, int64_t count, int64_t element_size,
+                    int64_t file_size)
+{
+  return offset >= (int64_t)sizeof(SnapshotHeader) && offset % 8 == 0 &&
+    offset <= file_size && count >= 0 &&
+    count <= (file_size - offset) / element_size;
+}
+
+// Writes the zeros that align the next array. Returns false on error.
+static bool
+write_snapshot_padding(FILE *file, int64_t length)
+{
+  static const char zeros[8] = {0};
+  return length == 0 || fwrite(zeros, length, 1, file) == 1;
+}
+
+static uint32_t
+fnv_hash(uint32_t hash, const void *data, size_t size)
+{
+  const unsigned char *p = (const unsigned char*)data;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  return hash;
+}
+
+// Checksum of the HMM labels, states and transitions, so that a snapshot is
+// not used with different acoustic models.
+static uint32_t
+hmm_checksum(const std::vector<Hmm> &hmms)
+{
+  uint32_t hash = 2166136261u;
+  for (int h = 0; h < hmms.size(); h++) {
+    const Hmm &hmm = hmms[h];
+    hash = fnv_hash(hash, hmm.label.c_str(), hmm.label.size() + 1);
+    int32_t num_states = hmm.states.size();
+    hash = fnv_hash(hash, &num_states, sizeof(num_states));
+    for (int s = 0; s < num_states; s++) {
+      const HmmState &state = hmm.states[s];
+      hash = fnv_hash(hash, &state.model, sizeof(state.model));
+      for (int t = 0; t < state.transitions.size(); t++) {
+        hash = fnv_hash(hash, &state.transitions[t].target, sizeof(int));
+        hash = fnv_hash(hash, &state.transitions[t].log_prob, sizeof(float));
+      }
+    }
+  }
+  return hash;
+}
+
+void TPLexPrefixTree::write_snapshot(const std::string &fname,
+                                     const Vocabulary &vocab) const
+{
+  if (!m_frozen || m_node_storage.empty() ||
+      (m_silence_node != NULL && (m_silence_node->flags & NODE_FINAL)))
+  {
+    fprintf(stderr, "TPLexPrefixTree::write_snapshot(): the network has to be "
+            "built and written before setting the sentence boundary\n");
+    throw SnapshotError();
+  }
+
+  std::map<const HmmState*, std::pair<int,int> > state_index;
+  for (int h = 0; h < m_hmms.size(); h++)
+    for (int s = 0; s < m_hmms[h].states.size(); s++)
+      state_index[&m_hmms[h].states[s]] = std::make_pair(h, s);
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+  header.byte_order = snapshot_byte_order;
+  header.hmm_checksum = hmm_checksum(m_hmms);
+  header.num_hmms = m_hmms.size();
+  header.words = m_words;
+  header.root_node = m_root_node->node_id;
+  header.end_node = m_end_node->node_id;
+  header.start_node = m_start_node->node_id;
+  header.silence_node = m_silence_node ? m_silence_node->node_id : -1;
+  header.last_silence_node =
+    m_last_silence_node ? m_last_silence_node->node_id : -1;
+  header.short_silence_hmm = -1;
+  header.short_silence_state = -1;
+  header.word_boundary_id = m_word_boundary_id;
+  header.lm_lookahead = m_lm_lookahead;
+  header.cross_word_triphones = m_cross_word_triphones;
+  header.silence_is_word = m_silence_is_word;
+  header.optional_short_silence = m_optional_short_silence;
+  header.lm_buf_count = m_lm_buf_count;
+  header.lm_scale = m_lm_scale;
+
+  std::vector<SnapshotNode> nodes(m_node_storage.size());
+  std::vector<int32_t> lookahead_ids;
+  for (int i = 0; i < nodes.size(); i++) {
+    const Node &node = m_node_storage[i];
+    SnapshotNode &out = nodes[i];
+    out.hmm = -1;
+    out.state = -1;
+    if (node.state != NULL) {
+      std::map<const HmmState*, std::pair<int,int> >::const_iterator it =
+        state_index.find(node.state);
+      if (it == state_index.end()) {
+        fprintf(stderr, "TPLexPrefixTree::write_snapshot(): node %d refers "
+                "to an unknown HMM state\n", i);
+        throw SnapshotError();
+      }
+      out.hmm = it->second.first;
+      out.state = it->second.second;
+    }
+    out.word_id = node.word_id;
+    out.flags = node.flags;
+    out.arc_begin = node.arc_begin;
+    out.arc_end = node.arc_end;
+    out.lookahead_begin = lookahead_ids.size();
+    lookahead_ids.insert(lookahead_ids.end(),
+                         node.possible_word_id_list.begin(),
+                         node.possible_word_id_list.end());
+    out.lookahead_end = lookahead_ids.size();
+  }
+  if (m_short_silence_state != NULL) {
+    std::map<const HmmState*, std::pair<int,int> >::const_iterator it =
+      state_index.find(m_short_silence_state);
+    if (it != state_index.end()) {
+      header.short_silence_hmm = it->second.first;
+      header.short_silence_state = it->second.second;
+    }
+  }
+
+  header.num_nodes = nodes.size();
+  header.num_arcs = m_frozen_arcs.size();
+  header.num_lookahead_ids = lookahead_ids.size();
+  header.num_words = vocab.num_words();
+  std::vector<int64_t> word_offsets(header.num_words + 1, 0);
+  for (int i = 0; i < header.num_words; i++)
+    word_offsets[i + 1] = word_offsets[i] + vocab.word(i).size() + 1;
+
+  header.node_offset = snapshot_align(sizeof(header));
+  header.arc_offset = snapshot_align(
+    header.node_offset + header.num_nodes * sizeof(SnapshotNode));
+  header.lookahead_offset = snapshot_align(
+    header.arc_offset + header.num_arcs * sizeof(FrozenArc));
+  header.word_offset_offset = snapshot_align(
+    header.lookahead_offset + header.num_lookahead_ids * sizeof(int32_t));
+  header.word_offset = header.word_offset_offset +
+    word_offsets.size() * sizeof(int64_t);
+  header.file_size = header.word_offset + word_offsets.back();
+
+  FILE *file = fopen(fname.c_str(), "wb");
+  if (file == NULL) {
+    fprintf(stderr, "TPLexPrefixTree::write_snapshot(): could not open %s\n",
+            fname.c_str());
+    throw SnapshotError();
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && write_snapshot_padding(file, header.node_offset - sizeof(header));
+  ok = ok && fwrite(nodes.data(), sizeof(SnapshotNode), nodes.size(), file)
+    == nodes.size();
+  int64_t pos = header.node_offset + header.num_nodes * sizeof(SnapshotNode);
+  ok = ok && write_snapshot_padding(file, header.arc_offset - pos);
+  ok = ok && fwrite(m_frozen_arcs.data(), sizeof(FrozenArc),
+                    m_frozen_arcs.size(), file) == m_frozen_arcs.size();
+  pos = header.arc_offset + header.num_arcs * sizeof(FrozenArc);
+  ok = ok && write_snapshot_padding(file, header.lookahead_offset - pos);
+  ok = ok && fwrite(lookahead_ids.data(), sizeof(int32_t),
+                    lookahead_ids.size(), file) == lookahead_ids.size();
+  pos = header.lookahead_offset + header.num_lookahead_ids * sizeof(int32_t);
+  ok = ok && write_snapshot_padding(file, header.word_offset_offset - pos);
+  ok = ok && fwrite(word_offsets.data(), sizeof(int64_t), word_offsets.size(),
+                    file) == word_offsets.size();
+  for (int i = 0; ok && i < header.num_words; i++)
+    ok = fwrite(vocab.word(i).c_str(), vocab.word(i).size() + 1, 1, file) == 1;
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "TPLexPrefixTree::write_snapshot(): write error in %s\n",
+            fname.c_str());
+    throw SnapshotError();
+  }
+}
+
+void TPLexPrefixTree::read_snapshot(const std::string &fname,
+                                    Vocabulary &vocab)
+{
+  FILE *file = fopen(fname.c_str(), "rb");
+  if (file == NULL) {
+    fprintf(stderr, "TPLexPrefixTree::read_snapshot(): could not open %s\n",
+            fname.c_str());
+    throw SnapshotError();
+  }
+
+  SnapshotHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0)
+  {
+    fclose(file);
+    fprintf(stderr, "TPLexPrefixTree::read_snapshot(): %s is not a lexicon "
+            "snapshot\n", fname.c_str());
+    throw SnapshotError();
+  }
+  if (header.byte_order != snapshot_byte_order) {
+    fclose(file);
+    fprintf(stderr, "TPLexPrefixTree::read_snapshot(): %s was written on a "
+            "machine with different byte order\n", fname.c_str());
+    throw SnapshotError();
+  }
+  if (header.num_hmms != m_hmms.size() ||
+      header.hmm_checksum != hmm_checksum(m_hmms))
+  {
+    fclose(file);
+    fprintf(stderr, "TPLexPrefixTree::read_snapshot(): %s was built with "
+            "different HMMs\n", fname.c_str());
+    throw SnapshotError();
+  }
+
+  // The header is checked against the real size of the file before
+  // anything is allocated or mapped.
+  int64_t real_size = -1;
+#ifndef _MSC_VER
+  struct stat st;
+  int fd = fileno(file);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    real_size = st.st_size;
+#else
+  struct _stat64 st;
+  if (_fstat64(_fileno(file), &st) == 0 && (st.st_mode & _S_IFREG))
+    real_size = st.st_size;
+#endif
+  if (real_size < 0 || header.file_size != real_size
+      || header.num_nodes <= 0 || header.num_nodes > INT_MAX
+      || header.num_arcs > INT_MAX
+      || header.num_words <= 0 || header.num_words > INT_MAX
+      || !snapshot_array_fits(header.node_offset, header.num_nodes,
+                              sizeof(SnapshotNode), real_size)
+      || !snapshot_array_fits(header.arc_offset, header.num_arcs,
+                              sizeof(FrozenArc), real_size)
+      || !snapshot_array_fits(header.lookahead_offset,
+                              header.num_lookahead_ids, sizeof(int32_t),
+                              real_size)
+      || !snapshot_array_fits(header.word_offset_offset,
+                              header.num_words + 1, sizeof(int64_t), real_size)
+      || header.word_offset < (int64_t)sizeof(header)
+      || header.word_offset > real_size)
+  {
+    fclose(file);
+    fprintf(stderr, "TPLexPrefixTree::read_snapshot(): invalid header in %s\n",
+            fname.c_str());
+    throw SnapshotError();
+  }
+
+  // Map the file if possible. Otherwise read it to memory. The nodes are
+  // copied from the file in any case, because they hold the token lists
+  // and the lookahead caches of the search.
+  const char *base = NULL;
+  void *map_data = NULL;
+#ifndef _MSC_VER
+  void *data = mmap(NULL, header.file_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data != MAP_FAILED) {
+    map_data = data;
+    base = (const char*)data;
+  }
+#endif
+  std::vector<char> buffer;
+  if (base == NULL) {
+    buffer.resize(header.file_size);
+    memcpy(&buffer[0], &header, sizeof(header));
+    if (fread(&buffer[sizeof(header)], header.file_size - sizeof(header), 1,
+              file) != 1)
+    {
+      fclose(file);
+      fprintf(stderr, "TPLexPrefixTree::read_snapshot(): unexpected end of "
+              "file in %s\n", fname.c_str());
+      throw SnapshotError();
+    }
+    base = &buffer[0];
+  }
+  fclose(file);
+
+  const SnapshotNode *nodes = (const SnapshotNode*)(base + header.node_offset);
+  const FrozenArc *arcs = (const FrozenArc*)(base + header.arc_offset);
+  const int32_t *lookahead_ids =
+    (const int32_t*)(base + header.lookahead_offset);
+  const int64_t *word_offsets =
+    (const int64_t*)(base + header.word_offset_offset);
+  const char *word_data = base + header.word_offset;
+  const int num_nodes = header.num_nodes;
+
+  // Check the references before modifying the network
+  int32_t node_refs[] = { header.root_node, header.end_node, header.start_node,
+                          header.silence_node, header.last_silence_node };
+  bool ok = (header.short_silence_hmm < 0 ||
+             (header.short_silence_hmm < m_hmms.size() &&
+              header.short_silence_state >= 0 &&
+              header.short_silence_state <
+              m_hmms[header.short_silence_hmm].states.size()));
+  for (int i = 0; ok && i < 5; i++)
+    ok = node_refs[i] < num_nodes && (node_refs[i] >= 0 || i >= 3);
+  ok = ok && header.words >= 0 && header.words <= header.num_words &&
+    header.word_boundary_id >= -1 &&
+    header.word_boundary_id < header.num_words;
+  for (int i = 0; ok && i < num_nodes; i++) {
+    const SnapshotNode &node = nodes[i];
+    ok = (node.hmm < 0 ||
+          (node.hmm < m_hmms.size() && node.state >= 0 &&
+           node.state < m_hmms[node.hmm].states.size())) &&
+      node.arc_begin >= 0 && node.arc_begin <= node.arc_end &&
+      node.arc_end <= header.num_arcs &&
+      node.lookahead_begin >= 0 && node.lookahead_begin <= node.lookahead_end &&
+      node.lookahead_end <= header.num_lookahead_ids &&
+      node.word_id >= -1 && node.word_id < header.words;
+  }
+  for (int64_t i = 0; ok && i < header.num_lookahead_ids; i++)
+    ok = lookahead_ids[i] >= 0 && lookahead_ids[i] < header.words;
+  for (int a = 0; ok && a < header.num_arcs; a++)
+    ok = arcs[a].next >= 0 && arcs[a].next < num_nodes;
+  for (int i = 0; ok && i < header.num_words; i++)
+    ok = word_offsets[i] >= 0 && word_offsets[i + 1] > word_offsets[i] &&
+      word_offsets[i + 1] <= header.file_size - header.word_offset &&
+      word_data[word_offsets[i + 1] - 1] == '\0';
+  if (!ok) {
+#ifndef _MSC_VER
+    if (map_data != NULL)
+      munmap(map_data, header.file_size);
+#endif
+    fprintf(stderr, "TPLexPrefixTree::read_snapshot(): %s is corrupted\n",
+            fname.c_str());
+    throw SnapshotError();
+  }
+
+  if (header.lm_lookahead != m_lm_lookahead) {
+    cerr << "WARNING: TPLexPrefixTree::read_snapshot(): the snapshot was "
+         << "built with LM lookahead " << header.lm_lookahead << "." << endl;
+  }
+  if (header.lm_scale != m_lm_scale) {
+    cerr << "WARNING: TPLexPrefixTree::read_snapshot(): the snapshot was "
+         << "built with LM scale " << header.lm_scale << "." << endl;
+  }
+
+  std::vector<Node> storage(num_nodes);
+  for (int i = 0; i < num_nodes; i++) {
+    const SnapshotNode &in = nodes[i];
+    Node &node = storage[i];
+    node.state = in.hmm < 0 ? NULL : &m_hmms[in.hmm].states[in.state];
+    node.word_id = in.word_id;
+    node.flags = in.flags;
+    node.arc_begin = in.arc_begin;
+    node.arc_end = in.arc_end;
+    node.node_id = i;
+    node.possible_word_id_list.assign(lookahead_ids + in.lookahead_begin,
+                                      lookahead_ids + in.lookahead_end);
+  }
+
+  delete_heap_nodes();
+  free_cross_word_network_connection_points();
+  m_silence_arcs.clear();
+  m_node_storage.swap(storage);
+  m_frozen_arcs.assign(arcs, arcs + header.num_arcs);
+  m_nodes.resize(num_nodes);
+  for (int i = 0; i < num_nodes; i++)
+    m_nodes[i] = &m_node_storage[i];
+  m_root_node = &m_node_storage[header.root_node];
+  m_end_node = &m_node_storage[header.end_node];
+  m_start_node = &m_node_storage[header.start_node];
+  m_silence_node = header.silence_node < 0 ?
+    NULL : &m_node_storage[header.silence_node];
+  m_last_silence_node = header.last_silence_node < 0 ?
+    NULL : &m_node_storage[header.last_silence_node];
+  m_short_silence_state = header.short_silence_hmm < 0 ? NULL :
+    &m_hmms[header.short_silence_hmm].states[header.short_silence_state];
+  m_words = header.words;
+  m_word_boundary_id = header.word_boundary_id;
+  m_lm_lookahead = header.lm_lookahead;
+  m_lm_scale = header.lm_scale;
+  m_cross_word_triphones = header.cross_word_triphones;
+  m_silence_is_word = header.silence_is_word;
+  m_optional_short_silence = header.optional_short_silence;
+  m_lm_buf_count = header.lm_buf_count;
+  m_frozen = true;
+
+  vocab.set_oov(word_data + word_offsets[0]);
+  for (int i = 1; i < header.num_words; i++)
+    vocab.add_word(word_data + word_offsets[i]);
+
+#ifndef _MSC_VER
+  if (map_data != NULL)
+    munmap(map_data, header.file_size);
+#endif
+
+  if (m_verbose > 1)
+    fprintf(stderr, "Read network snapshot: %d nodes, %zd arcs\n", num_nodes,
+            m_frozen_arcs.size());
 }
 
 void TPLexPrefixTree::post_process_lex_branch(Node *node,
@@ -687,6 +1262,8 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
 void TPLexPrefixTree::set_sentence_boundary(int sentence_start_id,
                                             int sentence_end_id)
 {
+  thaw();
+
   // Add nodes containing the sentence start and end word ids
   TPLexPrefixTree::Node * sentence_end_node = new Node(sentence_end_id);
   sentence_end_node->node_id = m_nodes.size();
@@ -711,8 +1288,11 @@ void TPLexPrefixTree::set_sentence_boundary(int sentence_start_id,
 
 void TPLexPrefixTree::initialize_nodes()
 {
-  for_each(m_nodes.begin(), m_nodes.end(), delete_node());
+  delete_heap_nodes();
   m_nodes.clear();
+  m_node_storage.clear();
+  m_frozen_arcs.clear();
+  m_frozen = false;
   m_root_node = new Node(-1);
   m_root_node->node_id = 0;
   m_root_node->flags = NODE_USE_WORD_END_BEAM;
@@ -1243,12 +1823,16 @@ TPLexPrefixTree::add_fan_in_connection_node(Node *node,
 
 float TPLexPrefixTree::get_out_transition_log_prob(Node *node)
 {
-  for (int i = 0; i < node->arcs.size(); i++)
-    if (node->arcs[i].next == node) {
-      // Self transition, compute the out transition
-      return log10(1 - pow(10, node->arcs[i].log_prob));
-    }
-  return 0;
+  float out_log_prob = 0;
+  bool found = false;
+  for_each_arc(node, [&](Node *next, float log_prob) {
+      if (next == node && !found) {
+        // Self transition, compute the out transition
+        out_log_prob = log10(1 - pow(10, log_prob));
+        found = true;
+      }
+    });
+  return out_log_prob;
 }
 
 void TPLexPrefixTree::prune_lookahead_buffers(int min_delta, int max_depth)
@@ -1256,9 +1840,9 @@ void TPLexPrefixTree::prune_lookahead_buffers(int min_delta, int max_depth)
   if (m_verbose > 1)
     printf("LM lookahead buffers before pruning: %d\n", m_lm_buf_count);
   m_lm_buf_count = 0;
-  for (int i = 0; i < m_root_node->arcs.size(); i++)
-    prune_lm_la_buffer(min_delta, max_depth, m_root_node->arcs[i].next,
-                       -1, 0);
+  for_each_arc(m_root_node, [&](Node *next, float) {
+      prune_lm_la_buffer(min_delta, max_depth, next, -1, 0);
+    });
   if (m_verbose > 1)
     printf("LM lookahead buffers after pruning: %d\n", m_lm_buf_count);
 }
@@ -1266,7 +1850,6 @@ void TPLexPrefixTree::prune_lookahead_buffers(int min_delta, int max_depth)
 void TPLexPrefixTree::prune_lm_la_buffer(int delta_thr, int depth_thr,
                                          Node *node, int last_size, int cur_depth)
 {
-  int i;
   int cur_size = last_size;
 
   if (!m_silence_is_word && node == m_silence_node) // Word LM, no word ID
@@ -1296,12 +1879,10 @@ void TPLexPrefixTree::prune_lm_la_buffer(int delta_thr, int depth_thr,
     }
   }
 
-  for (i = 0; i < node->arcs.size(); i++) {
-    if (node->arcs[i].next != node) {
-      prune_lm_la_buffer(delta_thr, depth_thr, node->arcs[i].next,
-                         cur_size, cur_depth);
-    }
-  }
+  for_each_arc(node, [&](Node *next, float) {
+      if (next != node)
+        prune_lm_la_buffer(delta_thr, depth_thr, next, cur_size, cur_depth);
+    });
 }
 
 void TPLexPrefixTree::set_lm_lookahead_cache_sizes(int cache_size)
@@ -1333,14 +1914,13 @@ void TPLexPrefixTree::print_node_info(int node, const Vocabulary &voc)
   printf("flags: %04x\n", m_nodes[node]->flags);
   printf("LM lookahead: %zd possible word(s)\n",
          m_nodes[node]->possible_word_id_list.size());
-  printf("%zd arc(s):\n", m_nodes[node]->arcs.size());
-  for (int i = 0; i < m_nodes[node]->arcs.size(); i++) {
-    printf(" -> %d (%d), transition: %.2f\n",
-           m_nodes[node]->arcs[i].next->node_id,
-           (m_nodes[node]->arcs[i].next->state == NULL ? -1
-            : m_nodes[node]->arcs[i].next->state->model),
-           m_nodes[node]->arcs[i].log_prob);
-  }
+  int num_arcs = 0;
+  for_each_arc(m_nodes[node], [&](Node *, float) { num_arcs++; });
+  printf("%d arc(s):\n", num_arcs);
+  for_each_arc(m_nodes[node], [&](Node *next, float log_prob) {
+      printf(" -> %d (%d), transition: %.2f\n", next->node_id,
+             (next->state == NULL ? -1 : next->state->model), log_prob);
+    });
 }
 
 void TPLexPrefixTree::print_lookahead_info(int node, const Vocabulary &voc)
@@ -1359,6 +1939,7 @@ void TPLexPrefixTree::print_lookahead_info(int node, const Vocabulary &voc)
 
 void TPLexPrefixTree::debug_prune_dead_ends(Node *node)
 {
+  thaw();
   for (int i = 0; i < node->arcs.size(); i++) {
     node->flags |= NODE_DEBUG_PRUNED;
     Node *target = node->arcs[i].next;
@@ -1380,6 +1961,7 @@ void TPLexPrefixTree::debug_prune_dead_ends(Node *node)
 void TPLexPrefixTree::debug_add_silence_loop()
 {
   fprintf(stderr, "DEBUG WARNING: adding hardcoded loop in silence\n");
+  thaw();
   Node *node = m_silence_node;
   Node *prev_node = NULL;
   for (int i = 0; i < 2; i++) {
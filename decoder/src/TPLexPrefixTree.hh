@@ -93,18 +93,30 @@ public:
     {}
   };
 
+  /// \brief An arc in the frozen network (see freeze()). The target node
+  /// is given as an index to the node array.
+  struct FrozenArc {
+    float log_prob;
+    int next;
+  };
+
   class Node {
   public:
-    inline Node() : word_id(-1), node_id(0), state(NULL), token_list(NULL), flags(NODE_NORMAL) { }
-    inline Node(int wid) : word_id(wid), state(NULL), token_list(NULL), flags(NODE_NORMAL) { }
-    inline Node(int wid, HmmState *s) : word_id(wid), state(s), token_list(NULL), flags(NODE_NORMAL) { }
-    int word_id; // -1 for nodes without word identity.
-    int node_id;
+    inline Node() : state(NULL), token_list(NULL), word_id(-1), flags(NODE_NORMAL), arc_begin(0), arc_end(0), node_id(0) { }
+    inline Node(int wid) : state(NULL), token_list(NULL), word_id(wid), flags(NODE_NORMAL), arc_begin(0), arc_end(0) { }
+    inline Node(int wid, HmmState *s) : state(s), token_list(NULL), word_id(wid), flags(NODE_NORMAL), arc_begin(0), arc_end(0) { }
+
+    // The fields accessed for every token in every frame come first, so
+    // that they share a cache line.
     HmmState *state;
     Token *token_list;
-    std::vector<Arc> arcs;
-
+    int word_id; // -1 for nodes without word identity.
     unsigned short flags;
+    int arc_begin; // First and one past last arc in the frozen arc array
+    int arc_end;
+
+    int node_id;
+    std::vector<Arc> arcs;
 
     std::vector<int> possible_word_id_list;
     SimpleHashCache<float> lm_lookahead_buffer;
@@ -124,6 +136,11 @@ public:
       { return "TPLexPrefixTree: no short silence"; }
   };
 
+  struct SnapshotError : public std::exception {
+    virtual const char *what() const throw()
+      { return "TPLexPrefixTree: snapshot error"; }
+  };
+
   TPLexPrefixTree(std::map<std::string,int> &hmm_map, std::vector<Hmm> &hmms);
 
   /// \brief Deletes all the nodes from \ref m_nodes.
@@ -146,6 +163,65 @@ public:
 
   inline int words() const { return m_words; }
 
+  /// \brief Compiles the network into a read-only form for decoding.
+  ///
+  /// The nodes are moved into one contiguous array in breadth-first order
+  /// from the start node, so that the node_id of a node is its index in the
+  /// array, and the arcs of all the nodes are moved into one contiguous
+  /// array of FrozenArc, where each node's arcs are in the range
+  /// [Node::arc_begin, Node::arc_end). Node::arcs is left empty. Node
+  /// pointers obtained before are invalidated, and the token lists must be
+  /// empty.
+  ///
+  /// The node ids are renumbered, so the ids printed by print_node_info()
+  /// and stored in Token::lex_node_id of the word histories are not the
+  /// ids in the order the nodes were built.
+  ///
+  /// Called by finish_tree(). Modifying the network afterwards (e.g.
+  /// set_sentence_boundary()) moves the arcs back to Node::arcs and marks
+  /// the network unfrozen, and freeze() has to be called again before
+  /// decoding.
+  ///
+  void freeze();
+
+  /// \brief Returns true if the network has not been modified after the
+  /// last call to freeze().
+  ///
+  inline bool frozen() const { return m_frozen; }
+
+  /// \brief Returns a node of a frozen network by its node_id.
+  ///
+  inline Node *node(int node_id) { return &m_node_storage[node_id]; }
+
+  /// \brief Returns the first arc leaving a node of a frozen network.
+  ///
+  inline const FrozenArc *arcs_begin(const Node *node) const
+  { return m_frozen_arcs.data() + node->arc_begin; }
+
+  /// \brief Returns one past the last arc leaving a node of a frozen network.
+  ///
+  inline const FrozenArc *arcs_end(const Node *node) const
+  { return m_frozen_arcs.data() + node->arc_end; }
+
+  /// \brief Writes the frozen network and the vocabulary to a binary
+  /// snapshot, which read_snapshot() loads much faster than the lexicon
+  /// can be read and the network built again.
+  ///
+  /// The HMM states are stored as indices to the HMMs, so the snapshot can
+  /// only be used with the same acoustic models. The snapshot has to be
+  /// written before set_sentence_boundary().
+  ///
+  void write_snapshot(const std::string &fname, const Vocabulary &vocab) const;
+
+  /// \brief Replaces the network and \a vocab with a snapshot written by
+  /// write_snapshot().
+  ///
+  /// The file is mapped to memory if possible. The settings the network
+  /// was built with (LM lookahead, LM scale, cross-word triphones etc.) are
+  /// restored from the snapshot.
+  ///
+  void read_snapshot(const std::string &fname, Vocabulary &vocab);
+
   void set_verbose(int verbose) { m_verbose = verbose; }
 
   /// \brief Enables or disables lookahead language model.
@@ -226,6 +302,11 @@ private:
   ///
   void initialize_nodes();
 
+  /// \brief Deletes the nodes that have been allocated one at a time, i.e.
+  /// that are not in \ref m_node_storage.
+  ///
+  void delete_heap_nodes();
+
   /// \brief Creates fan in HMMs
   ///
   /// The construction of the search network starts by creating the fan-in
@@ -332,6 +413,28 @@ private:
 
   float get_out_transition_log_prob(Node *node);
 
+  /// \brief Moves the arcs of a frozen network back to Node::arcs before
+  /// the network is modified.
+  ///
+  void thaw();
+
+  /// \brief Calls f(next, log_prob) for each arc leaving a node, in the
+  /// frozen or the unfrozen network.
+  ///
+  template <typename F>
+  void for_each_arc(Node *node, F f)
+  {
+    if (m_frozen) {
+      for (const FrozenArc *arc = arcs_begin(node); arc != arcs_end(node);
+           ++arc)
+        f(&m_node_storage[arc->next], arc->log_prob);
+    }
+    else {
+      for (int i = 0; i < node->arcs.size(); i++)
+        f(node->arcs[i].next, node->arcs[i].log_prob);
+    }
+  }
+
   void prune_lm_la_buffer(int delta_thr, int depth_thr,
                           Node *node, int last_size, int cur_depth);
 
@@ -344,6 +447,13 @@ private:
   Node *m_last_silence_node;
   node_vector m_nodes;
   int m_verbose;
+
+  // The frozen network. The first m_node_storage.size() nodes of m_nodes
+  // point to m_node_storage, nodes added after freezing are allocated from
+  // the heap.
+  std::vector<Node> m_node_storage;
+  std::vector<FrozenArc> m_frozen_arcs;
+  bool m_frozen;
   int m_lm_lookahead; // 0=None, 1=Only in first subtree nodes,
                       // 2=Full
   double m_lm_scale;
@@ -0,0 +1,75 @@
+#include "ThreadPool.hh"
+
+ThreadPool::ThreadPool(int num_threads)
+  : m_job(NULL),
+    m_generation(0),
+    m_num_running(0),
+    m_stop(false)
+{
+  for (int i = 1; i < num_threads; i++)
+    m_workers.push_back(std::thread(&ThreadPool::worker, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_start.notify_all();
+  for (int i = 0; i < m_workers.size(); i++)
+    m_workers[i].join();
+}
+
+void ThreadPool::run(const Job &job)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_job = &job;
+    m_num_running = m_workers.size();
+    m_error = std::exception_ptr();
+    m_generation++;
+  }
+  m_start.notify_all();
+
+  run_job(0);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [this]() { return m_num_running == 0; });
+  m_job = NULL;
+  if (m_error)
+    std::rethrow_exception(m_error);
+}
+
+void ThreadPool::worker(int thread_index)
+{
+  unsigned int generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_start.wait(lock, [&]() {
+          return m_stop || m_generation != generation; });
+      if (m_stop)
+        return;
+      generation = m_generation;
+    }
+
+    run_job(thread_index);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_num_running == 0)
+      m_done.notify_one();
+  }
+}
+
+void ThreadPool::run_job(int thread_index)
+{
+  try {
+    (*m_job)(thread_index, num_threads());
+  }
+  catch (...) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_error)
+      m_error = std::current_exception();
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef THREADPOOL_HH
+#define THREADPOOL_HH
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// \brief A fixed set of worker threads that run the same job together.
+///
+/// The threads are created once and wait between jobs, so that the pool can
+/// be used for short jobs, e.g. once per frame in the search. run() calls
+/// the job in every thread, including the calling thread as thread 0, and
+/// returns when all of them have finished.
+///
+class ThreadPool {
+public:
+  typedef std::function<void(int thread_index, int num_threads)> Job;
+
+  /// \brief Creates \a num_threads - 1 worker threads.
+  ///
+  ThreadPool(int num_threads);
+
+  /// \brief Stops and joins the worker threads.
+  ///
+  ~ThreadPool();
+
+  /// \brief Number of threads, including the calling thread.
+  ///
+  int num_threads() const { return m_workers.size() + 1; }
+
+  /// \brief Calls job(thread_index, num_threads()) in every thread and
+  /// waits for all of them to finish.
+  ///
+  /// If a job throws an exception, the first one is rethrown in the
+  /// calling thread after all the threads have finished.
+  ///
+  void run(const Job &job);
+
+private:
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  void worker(int thread_index);
+  void run_job(int thread_index);
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_start;
+  std::condition_variable m_done;
+  const Job *m_job;
+  unsigned int m_generation; // Incremented for every job
+  int m_num_running;
+  bool m_stop;
+  std::exception_ptr m_error;
+};
+
+#endif /* THREADPOOL_HH */
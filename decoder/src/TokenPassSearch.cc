@@ -7,6 +7,7 @@
 #include <iostream>
 #include <string>
 #include <cctype>
+#include <climits>
 
 #include "TokenPassSearch.hh"
 
@@ -42,6 +43,9 @@ TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
   m_word_classes(NULL),
 #endif
   m_acoustics(acoustics),
+  m_token_pool(TOKEN_RESERVE_BLOCK),
+  m_word_history_pool(TOKEN_RESERVE_BLOCK),
+  m_state_history_pool(TOKEN_RESERVE_BLOCK),
   m_end_frame(-1),
   m_frame(0),
   m_best_log_prob(0),
@@ -88,7 +92,10 @@ TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
   m_fan_in_log_prob(0),
   m_fan_out_log_prob(0),
   m_fan_out_last_log_prob(0),
-  m_lm_lookahead_initialized(false)
+  m_lm_lookahead_initialized(false),
+  m_thread_pool(NULL),
+  m_lookahead_requests(1),
+  m_batch_lm_scores(false)
 {
 #ifdef ENABLE_MULTIWORD_SUPPORT
   m_split_multiwords = false;
@@ -96,14 +103,11 @@ TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
 }
 
 TokenPassSearch::~TokenPassSearch() {
+  delete m_thread_pool;
   for (std::vector<LMHistory *>::iterator it=m_lmhist_dealloc_table.begin();
        it!=m_lmhist_dealloc_table.end();++it) {
     delete[] *it;
   }
-  for (std::vector<Token *>::iterator it=m_token_dealloc_table.begin();
-       it!=m_token_dealloc_table.end();++it) {
-    delete[] *it;
-  }
 }
 
 void TokenPassSearch::set_word_boundary(const std::string &word)
@@ -156,8 +160,14 @@ void TokenPassSearch::reset_search(int start_frame)
       release_token(m_active_token_list[i]);
   }
   m_active_token_list.clear();
+  m_active_node_list.clear();
+  m_token_pool.reset_peak();
+  m_word_history_pool.reset_peak();
+  m_state_history_pool.reset_peak();
 
   m_lexicon.clear_node_token_lists();
+  if (!m_lexicon.frozen())
+    m_lexicon.freeze();
 
   t = acquire_token();
   t->node = m_lexicon.start_node();
@@ -170,7 +180,7 @@ void TokenPassSearch::reset_search(int start_frame)
   hist::link(t->lm_history);
 
   if (m_generate_word_graph) {
-    t->word_history = new Token::WordHistory(-1, -1, NULL);
+    t->word_history = acquire_word_history(-1, -1, NULL);
     t->word_history->lex_node_id = t->node->node_id;
     hist::link(t->word_history);
 
@@ -225,7 +235,7 @@ void TokenPassSearch::reset_search(int start_frame)
   t->word_count = 0;
 
   if (m_keep_state_segmentation) {
-    t->state_history = new Token::StateHistory(0, 0, NULL);
+    t->state_history = acquire_state_history(0, 0, NULL);
     hist::link(t->state_history);
   }
   else {
@@ -234,21 +244,18 @@ void TokenPassSearch::reset_search(int start_frame)
 
   m_active_token_list.push_back(t);
 
-  if (lm_lookahead_score_list.get_num_items() > 0) {
-    // Delete the LM lookahead cache
-    LMLookaheadScoreList *score_list;
-    while (lm_lookahead_score_list.remove_last_item(&score_list))
-      delete score_list;
-  }
-
   if (!m_lm_lookahead_initialized && (m_lm_lookahead > 0)) {
-    lm_lookahead_score_list.set_max_items(m_max_lookahead_score_list_size);
     m_lexicon.set_lm_lookahead_cache_sizes(m_max_node_lookahead_buffer_size);
     m_lm_lookahead_initialized = true;
   }
 
   if (m_lm_lookahead > 0) {
     assert( m_lookahead_ngram != NULL);
+    // The score lists are kept over utterances and shared with the other
+    // decoders that use the same lookahead model.
+    if (!m_lookahead_cache)
+      m_lookahead_cache = LMLookaheadCache::shared(
+        m_lookahead_ngram, m_max_lookahead_score_list_size);
   }
 
   if (m_lm_score_cache.get_num_items() > 0) {
@@ -565,6 +572,21 @@ void TokenPassSearch::print_lm_history(FILE *file, bool get_best_path)
   fflush(file);
 }
 
+void TokenPassSearch::get_path(HistoryVector &path, bool use_best_token,
+                               LMHistory *limit)
+{
+  const Token & token =
+    use_best_token ? get_best_final_token() : get_first_token();
+
+  path.clear();
+  LMHistory * lm_history = token.lm_history;
+  while (lm_history != NULL && lm_history != limit) {
+    if (lm_history->last().word_id() >= 0)
+      path.push_back(lm_history);
+    lm_history = lm_history->previous;
+  }
+}
+
 float TokenPassSearch::get_am_log_prob(bool get_best_path) const
 {
   const Token & token =
@@ -696,6 +718,9 @@ void TokenPassSearch::propagate_tokens(void)
 {
   int i;
 
+  // The network has been modified after reset_search()
+  assert(m_lexicon.frozen());
+
 #if (defined PRUNING_EXTENSIONS || defined PRUNING_MEASUREMENT || defined FAN_IN_PRUNING || defined EQ_WC_PRUNING || defined EQ_DEPTH_PRUNING)
   for (i = 0; i < MAX_LEX_TREE_DEPTH/2; i++)
   {
@@ -720,6 +745,19 @@ void TokenPassSearch::propagate_tokens(void)
   //m_lexicon.clear_node_token_lists();
   clear_active_node_token_lists();
 
+  // With several threads, the missing lookahead scores are computed
+  // beforehand, so that the tokens can be moved in parallel.
+  if (m_thread_pool != NULL && m_lm_lookahead > 0)
+    prefetch_lm_lookahead_scores();
+  if (m_batch_lm_scores)
+    batch_ngram_scores();
+
+  if (m_thread_pool != NULL && !m_generate_word_graph
+      && !m_keep_state_segmentation) {
+    propagate_tokens_parallel();
+    return;
+  }
+
   for (auto token : m_active_token_list) {
     if (token) {
       propagate_token(token);
@@ -727,15 +765,183 @@ void TokenPassSearch::propagate_tokens(void)
   }
 }
 
+void TokenPassSearch::propagate_tokens_parallel()
+{
+  const int num_tokens = m_active_token_list.size();
+  const int num_threads = m_thread_pool->num_threads();
+  m_propagated_token_end.resize(num_tokens);
+
+  // Each thread moves a contiguous part of the active tokens to the next
+  // nodes, and stores the moved tokens in its own buffer without modifying
+  // the search. If a move would create new histories or compute a score,
+  // the whole token is left to the serial pass. The moves are pruned with
+  // the best score found so far in the same part, which cannot be better
+  // than the best score of the serial search at that point.
+  m_thread_pool->run([&](int thread_index, int num_threads) {
+      std::vector<Token> &moves = m_propagated_tokens[thread_index];
+      moves.clear();
+      float best_log_prob = -1e20;
+      int first = (long)num_tokens * thread_index / num_threads;
+      int last = (long)num_tokens * (thread_index + 1) / num_threads;
+      for (int i = first; i < last; i++) {
+        Token *token = m_active_token_list[i];
+        const int begin = moves.size();
+        m_propagated_token_end[i] = begin;
+        if (token == NULL)
+          continue;
+        if ((token->node->flags & NODE_INSERT_WORD_BOUNDARY)
+            && (m_word_boundary_id > 0)) {
+          m_propagated_token_end[i] = -1;
+          continue;
+        }
+
+        const TPLexPrefixTree::FrozenArc *arc;
+        for (arc = m_lexicon.arcs_begin(token->node);
+             arc != m_lexicon.arcs_end(token->node); ++arc)
+        {
+          Token updated_token;
+          if (!prepare_move(token, m_lexicon.node(arc->next), arc->log_prob,
+                            updated_token)) {
+            moves.resize(begin);
+            m_propagated_token_end[i] = -1;
+            break;
+          }
+          if (updated_token.node == NULL)
+            continue;
+          if (updated_token.total_log_prob > best_log_prob)
+            best_log_prob = updated_token.total_log_prob;
+          else if (updated_token.total_log_prob
+                   < best_log_prob - m_current_glob_beam)
+            continue;
+          moves.push_back(updated_token);
+        }
+        if (m_propagated_token_end[i] >= 0)
+          m_propagated_token_end[i] = moves.size();
+      }
+    });
+
+  // Add the moved tokens to the nodes in the order of the active tokens, so
+  // that the recombination and the beam pruning are identical to the serial
+  // search.
+  for (int t = 0; t < num_threads; t++) {
+    const std::vector<Token> &moves = m_propagated_tokens[t];
+    int first = (long)num_tokens * t / num_threads;
+    int last = (long)num_tokens * (t + 1) / num_threads;
+    int begin = 0;
+    for (int i = first; i < last; i++) {
+      int end = m_propagated_token_end[i];
+      if (end < 0) {
+        propagate_token(m_active_token_list[i]);
+        continue;
+      }
+      for (int m = begin; m < end; m++)
+        add_token_to_node(m_active_token_list[i], moves[m]);
+      begin = end;
+    }
+  }
+}
+
+bool TokenPassSearch::prepare_move(const Token *token,
+                                   TPLexPrefixTree::Node *node,
+                                   float transition_score,
+                                   Token &updated_token)
+{
+  // Nodes without a state are passed through, and the first frame in
+  // silence is stored in the LM history.
+  if (node->state == NULL
+      || ((node->flags & NODE_SILENCE_FIRST)
+          && token->lm_history->word_first_silence_frame == -1))
+    return false;
+
+  // The same computation as in move_token_to_node().
+  updated_token.node = node;
+  updated_token.depth = token->depth;
+  updated_token.am_log_prob = token->am_log_prob
+    + m_transition_scale * transition_score;
+  updated_token.lm_log_prob = token->lm_log_prob;
+  updated_token.word_count = token->word_count;
+  updated_token.fsa_lm_node = token->fsa_lm_node;
+  updated_token.lm_hist_code = token->lm_hist_code;
+  updated_token.lm_history = token->lm_history;
+  updated_token.word_history = token->word_history;
+  updated_token.state_history = token->state_history;
+  updated_token.word_start_frame = token->word_start_frame;
+
+  if (node != token->node) {
+    if (node->flags & NODE_FIRST_STATE_OF_WORD) {
+      assert(updated_token.word_start_frame < 0);
+      updated_token.word_start_frame = m_frame;
+    }
+
+    if (!(node->flags & NODE_AFTER_WORD_ID)) {
+      // Word ends add the word to the LM history.
+      if (node->word_id != -1)
+        return false;
+      if ((node->possible_word_id_list.size() > 0) && (m_lm_lookahead > 0)) {
+        float lookahead_score;
+        if (!find_lm_lookahead_score(token->lm_history, node,
+                                     &lookahead_score))
+          return false;
+        updated_token.cur_lm_log_prob = updated_token.lm_log_prob
+          + lookahead_score;
+      }
+      else {
+        updated_token.cur_lm_log_prob = token->cur_lm_log_prob;
+      }
+    }
+    else
+      updated_token.cur_lm_log_prob = updated_token.lm_log_prob;
+
+    updated_token.dur = 0;
+    updated_token.depth = token->depth + 1;
+    if (token->node->state != NULL) {
+      int temp_dur = token->dur + 1;
+      float duration_log_prob = m_duration_scale
+        * token->node->state->duration.get_log_prob(temp_dur);
+      updated_token.am_log_prob += duration_log_prob;
+    }
+    updated_token.cur_am_log_prob = updated_token.am_log_prob;
+  }
+  else {
+    updated_token.dur = token->dur + 1;
+    if (updated_token.dur > MAX_STATE_DURATION && token->node->state != NULL
+        && token->node->state->duration.is_valid_duration_model()) {
+      updated_token.node = NULL;
+      return true;
+    }
+    updated_token.depth = token->depth;
+    updated_token.cur_am_log_prob = token->cur_am_log_prob
+      + m_transition_scale * transition_score;
+    updated_token.cur_lm_log_prob = token->cur_lm_log_prob;
+  }
+
+  if ((node->flags & NODE_FAN_IN_FIRST)
+      || node == m_lexicon.root()
+      || (node->flags & NODE_SILENCE_FIRST)) {
+    updated_token.depth = 0;
+  }
+
+  float ac_log_prob = m_acoustics->log_prob(node->state->model);
+  updated_token.am_log_prob += ac_log_prob;
+  updated_token.cur_am_log_prob += ac_log_prob;
+  updated_token.total_log_prob =
+    get_token_log_prob(updated_token.cur_am_log_prob,
+                       updated_token.cur_lm_log_prob);
+  return true;
+}
+
 void TokenPassSearch::propagate_token(Token *token)
 {
   TPLexPrefixTree::Node *source_node = token->node;
-  int i;
+  const TPLexPrefixTree::FrozenArc *arcs_begin =
+    m_lexicon.arcs_begin(source_node);
+  const TPLexPrefixTree::FrozenArc *arcs_end =
+    m_lexicon.arcs_end(source_node);
+  const TPLexPrefixTree::FrozenArc *arc;
 
   // Iterate all the arcs leaving the token's node.
-  for (i = 0; i < source_node->arcs.size(); i++) {
-    move_token_to_node(token, source_node->arcs[i].next,
-                       source_node->arcs[i].log_prob);
+  for (arc = arcs_begin; arc != arcs_end; ++arc) {
+    move_token_to_node(token, m_lexicon.node(arc->next), arc->log_prob);
   }
 
   if ((source_node->flags & NODE_INSERT_WORD_BOUNDARY) != 0
@@ -759,10 +965,10 @@ void TokenPassSearch::propagate_token(Token *token)
       token->cur_lm_log_prob = token->lm_log_prob;
 
       // Iterate all the arcs leaving the token's node.
-      for (i = 0; i < source_node->arcs.size(); i++) {
-        if (source_node->arcs[i].next != source_node) // Skip self transitions
-          move_token_to_node(token, source_node->arcs[i].next,
-                             source_node->arcs[i].log_prob);
+      for (arc = arcs_begin; arc != arcs_end; ++arc) {
+        if (arc->next != source_node->node_id) // Skip self transitions
+          move_token_to_node(token, m_lexicon.node(arc->next),
+                             arc->log_prob);
       }
 
       hist::unlink(token->lm_history, &m_lmh_pool);
@@ -942,9 +1148,10 @@ TokenPassSearch::move_token_to_node(Token *token,
 
     if (m_keep_state_segmentation && updated_token.node->state != NULL) {
       updated_token.state_history =
-        new Token::StateHistory(updated_token.node->state->model,
-                                          m_frame, token->state_history);
-      auto_state_history.adopt(updated_token.state_history);
+        acquire_state_history(updated_token.node->state->model,
+                              m_frame, token->state_history);
+      auto_state_history.adopt(updated_token.state_history,
+                               m_state_history_pool.free_list());
     }
 
     // Update duration probability
@@ -965,11 +1172,12 @@ TokenPassSearch::move_token_to_node(Token *token,
         && (updated_token.node->flags & NODE_FIRST_STATE_OF_WORD)) {
       // Add symbol from the LMHistory
       updated_token.word_history = 
-        new Token::WordHistory(old_lm_history_word_id, m_frame,
-                               updated_token.word_history);
+        acquire_word_history(old_lm_history_word_id, m_frame,
+                             updated_token.word_history);
       updated_token.word_history->lex_node_id =
         updated_token.node->node_id;
-      auto_word_history.adopt(updated_token.word_history);
+      auto_word_history.adopt(updated_token.word_history,
+                              m_word_history_pool.free_list());
       updated_token.word_history->cum_am_log_prob = token->am_log_prob
         + m_transition_scale * transition_score + duration_log_prob;
       updated_token.word_history->cum_lm_log_prob = token->lm_log_prob;
@@ -1061,8 +1269,6 @@ TokenPassSearch::move_token_to_node(Token *token,
   else
   {
     // Normal propagation
-    Token *new_token;
-    Token *similar_lm_hist;
     float ac_log_prob = m_acoustics->log_prob(
       updated_token.node->state->model);
 
@@ -1071,66 +1277,102 @@ TokenPassSearch::move_token_to_node(Token *token,
     updated_token.total_log_prob = 
       get_token_log_prob(updated_token.cur_am_log_prob,
                          updated_token.cur_lm_log_prob);
-    
-    // Apply beam pruning
-    if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
-      if (updated_token.total_log_prob
-          < m_best_we_log_prob - m_current_we_beam) {
-        return;
-      }
-    }
+    add_token_to_node(token, updated_token);
+  }
+}
+
+void
+TokenPassSearch::add_token_to_node(Token *token, const Token &updated_token)
+{
+  Token *new_token;
+  Token *similar_lm_hist;
+
+  // Apply beam pruning
+  if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
     if (updated_token.total_log_prob
-        < m_best_log_prob
-        - m_current_glob_beam
+        < m_best_we_log_prob - m_current_we_beam) {
+      return;
+    }
+  }
+  if (updated_token.total_log_prob
+      < m_best_log_prob
+      - m_current_glob_beam
 #ifdef PRUNING_EXTENSIONS
-        || ((updated_token.node->flags&NODE_FAN_IN)?
-            (updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
-            ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-              (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
-               m_eq_wc_beam ||
-               (!(updated_token.node->flags&(NODE_AFTER_WORD_ID)) &&
-                updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam)))))
+      || ((updated_token.node->flags&NODE_FAN_IN)?
+          (updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
+          ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+            (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
+             m_eq_wc_beam ||
+             (!(updated_token.node->flags&(NODE_AFTER_WORD_ID)) &&
+              updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam)))))
 #endif
 #ifdef FAN_IN_PRUNING
-        || ((updated_token.node->flags&NODE_FAN_IN) &&
-            updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
+      || ((updated_token.node->flags&NODE_FAN_IN) &&
+          updated_token.total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
 #endif
 #ifdef EQ_WC_PRUNING
-        || (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-            (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
-             m_eq_wc_beam))
+      || (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+          (updated_token.total_log_prob<m_wc_llh[updated_token.word_count-m_min_word_count]-
+           m_eq_wc_beam))
 #endif
 #ifdef EQ_DEPTH_PRUNING
-        || ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
-             updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam))
+      || ((!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
+           updated_token.total_log_prob<m_depth_llh[updated_token.depth/2]-m_eq_depth_beam))
 #endif
 #ifdef FAN_OUT_PRUNING
-        || ((updated_token.node->flags&NODE_FAN_OUT) &&
-            updated_token.total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
+      || ((updated_token.node->flags&NODE_FAN_OUT) &&
+          updated_token.total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
 #endif
-      ) {
-      return;
-    }
+    ) {
+    return;
+  }
 
 #ifdef STATE_PRUNING
-    if (updated_token.node->flags&(NODE_FAN_OUT|NODE_FAN_IN))
+  if (updated_token.node->flags&(NODE_FAN_OUT|NODE_FAN_IN))
+  {
+    Token *cur_token = updated_token.node->token_list;
+    while (cur_token != NULL)
     {
-      Token *cur_token = updated_token.node->token_list;
-      while (cur_token != NULL)
+      if (updated_token.total_log_prob <
+          cur_token->total_log_prob - m_state_beam)
       {
-        if (updated_token.total_log_prob <
-            cur_token->total_log_prob - m_state_beam)
-        {
-          return;
-        }
-        cur_token = cur_token->next_node_token;
+        return;
       }
+      cur_token = cur_token->next_node_token;
     }
+  }
 #endif
 
-    if (updated_token.node->token_list == NULL) {
-      // No tokens in the node,  create new token
-      m_active_node_list.push_back(updated_token.node); // Mark the node active
+  if (updated_token.node->token_list == NULL) {
+    // No tokens in the node,  create new token
+    m_active_node_list.push_back(updated_token.node); // Mark the node active
+    new_token = acquire_token();
+    new_token->node = updated_token.node;
+    new_token->next_node_token = updated_token.node->token_list;
+    updated_token.node->token_list = new_token;
+    // Add to the list of propagated tokens
+    if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
+      m_word_end_token_list.push_back(new_token);
+    else
+      m_new_token_list.push_back(new_token);
+  }
+  else {
+    // Recombination of search paths that are identical up to
+    // m_similar_lm_hist_span words.
+    if (m_fsa_lm) {
+      similar_lm_hist = find_similar_fsa_token(
+        updated_token.fsa_lm_node,
+        updated_token.node->token_list);
+    }
+    else {
+      similar_lm_hist = find_similar_lm_history(
+        updated_token.lm_history, updated_token.lm_hist_code,
+        updated_token.node->token_list);
+    }
+
+    if (similar_lm_hist == NULL)
+    {
+      // New word history for this node, create new token
       new_token = acquire_token();
       new_token->node = updated_token.node;
       new_token->next_node_token = updated_token.node->token_list;
@@ -1141,156 +1383,130 @@ TokenPassSearch::move_token_to_node(Token *token,
       else
         m_new_token_list.push_back(new_token);
     }
-    else {
-      // Recombination of search paths that are identical up to
-      // m_similar_lm_hist_span words.
-      if (m_fsa_lm) {
-        similar_lm_hist = find_similar_fsa_token(
-          updated_token.fsa_lm_node,
-          updated_token.node->token_list);
-      }
-      else {
-        similar_lm_hist = find_similar_lm_history(
-          updated_token.lm_history, updated_token.lm_hist_code,
-          updated_token.node->token_list);
-      }
-
-      if (similar_lm_hist == NULL)
-      {
-        // New word history for this node, create new token
-        new_token = acquire_token();
-        new_token->node = updated_token.node;
-        new_token->next_node_token = updated_token.node->token_list;
-        updated_token.node->token_list = new_token;
-        // Add to the list of propagated tokens
-        if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
-          m_word_end_token_list.push_back(new_token);
-        else
-          m_new_token_list.push_back(new_token);
+    else
+    {
+      // Found the same word history, pick the best token.
+      if (updated_token.total_log_prob
+          > similar_lm_hist->total_log_prob) {
+        // Replace the previous token
+        new_token = similar_lm_hist;
+        hist::unlink(new_token->lm_history, &m_lmh_pool);
+        hist::unlink(new_token->word_history,
+                     m_word_history_pool.free_list());
+        hist::unlink(new_token->state_history,
+                     m_state_history_pool.free_list());
+
+        //TPLexPrefixTree::PathHistory::unlink(new_token->token_path);
       }
       else
       {
-        // Found the same word history, pick the best token.
-        if (updated_token.total_log_prob
-            > similar_lm_hist->total_log_prob) {
-          // Replace the previous token
-          new_token = similar_lm_hist;
-          hist::unlink(new_token->lm_history, &m_lmh_pool);
-          hist::unlink(new_token->word_history);
-          hist::unlink(new_token->state_history);
-
-          //TPLexPrefixTree::PathHistory::unlink(new_token->token_path);
-        }
-        else
-        {
-          // Discard this token
-          return;
-        }
+        // Discard this token
+        return;
       }
     }
-    if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
-      if (updated_token.total_log_prob > m_best_we_log_prob)
-        m_best_we_log_prob = updated_token.total_log_prob;
-    }
-    if (updated_token.total_log_prob > m_best_log_prob)
-      m_best_log_prob = updated_token.total_log_prob;
+  }
+  if (updated_token.node->flags & NODE_USE_WORD_END_BEAM) {
+    if (updated_token.total_log_prob > m_best_we_log_prob)
+      m_best_we_log_prob = updated_token.total_log_prob;
+  }
+  if (updated_token.total_log_prob > m_best_log_prob)
+    m_best_log_prob = updated_token.total_log_prob;
 
 #if (defined PRUNING_EXTENSIONS || defined PRUNING_MEASUREMENT)
-    if (updated_token.node->flags&NODE_FAN_IN)
-    {
-      if (updated_token.total_log_prob > m_fan_in_log_prob)
-        m_fan_in_log_prob = updated_token.total_log_prob;
-      if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
-        m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
-    }
-    else if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
-    {
-      if (!(updated_token.node->flags&NODE_AFTER_WORD_ID) &&
-          updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
-        m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
-      if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
-        m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
-    }
-    else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
+  if (updated_token.node->flags&NODE_FAN_IN)
+  {
+    if (updated_token.total_log_prob > m_fan_in_log_prob)
+      m_fan_in_log_prob = updated_token.total_log_prob;
+    if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
       m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
+  }
+  else if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
+  {
+    if (!(updated_token.node->flags&NODE_AFTER_WORD_ID) &&
+        updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
+      m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
+    if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
+      m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
+  }
+  else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
+    m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
 #endif
 #ifdef FAN_IN_PRUNING
-    if (updated_token.node->flags&NODE_FAN_IN)
-    {
-      if (updated_token.total_log_prob > m_fan_in_log_prob)
-        m_fan_in_log_prob = updated_token.total_log_prob;
-    }
+  if (updated_token.node->flags&NODE_FAN_IN)
+  {
+    if (updated_token.total_log_prob > m_fan_in_log_prob)
+      m_fan_in_log_prob = updated_token.total_log_prob;
+  }
 #endif
 #ifdef EQ_WC_PRUNING
-    if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
-    {
-      if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
-        m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
-    }
-    else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
-      m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
+  if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT)))
+  {
+    if (updated_token.total_log_prob > m_wc_llh[updated_token.word_count-m_min_word_count])
+      m_wc_llh[updated_token.word_count-m_min_word_count] = updated_token.total_log_prob;
+  }
+  else if (m_wc_llh[updated_token.word_count-m_min_word_count] < -1e19)
+    m_wc_llh[updated_token.word_count-m_min_word_count] = -1e18;
 #endif
 #ifdef EQ_DEPTH_PRUNING
-    if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)))
-    {
-      if (updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
-        m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
-    }
+  if (!(updated_token.node->flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)))
+  {
+    if (updated_token.total_log_prob > m_depth_llh[updated_token.depth/2])
+      m_depth_llh[updated_token.depth/2] = updated_token.total_log_prob;
+  }
 #endif
 
 #if (defined FAN_OUT_PRUNING || defined PRUNING_MEASUREMENT)
-    if (updated_token.node->flags&NODE_FAN_OUT)
-    {
-      if (updated_token.total_log_prob > m_fan_out_log_prob)
-        m_fan_out_log_prob = updated_token.total_log_prob;
-    }
+  if (updated_token.node->flags&NODE_FAN_OUT)
+  {
+    if (updated_token.total_log_prob > m_fan_out_log_prob)
+      m_fan_out_log_prob = updated_token.total_log_prob;
+  }
 #endif
 
-    if (updated_token.total_log_prob < m_worst_log_prob)
-      m_worst_log_prob = updated_token.total_log_prob;
-
-    new_token->lm_history = updated_token.lm_history;
-    if (new_token->lm_history != NULL)
-      hist::link(new_token->lm_history);
-    new_token->lm_hist_code = updated_token.lm_hist_code;
-    new_token->fsa_lm_node = updated_token.fsa_lm_node;
-    new_token->am_log_prob = updated_token.am_log_prob;
-    new_token->cur_am_log_prob = updated_token.cur_am_log_prob;
-    new_token->lm_log_prob = updated_token.lm_log_prob;
-    new_token->cur_lm_log_prob = updated_token.cur_lm_log_prob;
-    new_token->total_log_prob = updated_token.total_log_prob;
-    new_token->dur = updated_token.dur;
-    new_token->word_count = updated_token.word_count;
-    new_token->state_history = updated_token.state_history;
-    new_token->word_history = updated_token.word_history;
-    new_token->word_start_frame = updated_token.word_start_frame;
-    if (updated_token.word_history != NULL)
-      hist::link(new_token->word_history);
-    if (updated_token.state_history != NULL)
-      hist::link(new_token->state_history);
+  if (updated_token.total_log_prob < m_worst_log_prob)
+    m_worst_log_prob = updated_token.total_log_prob;
+
+  new_token->lm_history = updated_token.lm_history;
+  if (new_token->lm_history != NULL)
+    hist::link(new_token->lm_history);
+  new_token->lm_hist_code = updated_token.lm_hist_code;
+  new_token->fsa_lm_node = updated_token.fsa_lm_node;
+  new_token->am_log_prob = updated_token.am_log_prob;
+  new_token->cur_am_log_prob = updated_token.cur_am_log_prob;
+  new_token->lm_log_prob = updated_token.lm_log_prob;
+  new_token->cur_lm_log_prob = updated_token.cur_lm_log_prob;
+  new_token->total_log_prob = updated_token.total_log_prob;
+  new_token->dur = updated_token.dur;
+  new_token->word_count = updated_token.word_count;
+  new_token->state_history = updated_token.state_history;
+  new_token->word_history = updated_token.word_history;
+  new_token->word_start_frame = updated_token.word_start_frame;
+  if (updated_token.word_history != NULL)
+    hist::link(new_token->word_history);
+  if (updated_token.state_history != NULL)
+    hist::link(new_token->state_history);
 
-    if (m_generate_word_graph) {
-      copy_word_graph_info(token, new_token);
-      if ((updated_token.node->flags & NODE_FIRST_STATE_OF_WORD)
-          && updated_token.node != token->node)
-        build_word_graph(new_token);
-    }
+  if (m_generate_word_graph) {
+    copy_word_graph_info(token, new_token);
+    if ((updated_token.node->flags & NODE_FIRST_STATE_OF_WORD)
+        && updated_token.node != token->node)
+      build_word_graph(new_token);
+  }
 
 #ifdef PRUNING_MEASUREMENT
-    for (int i = 0; i < 6; i++)
-      new_token->meas[i] = token->meas[i];
+  for (int i = 0; i < 6; i++)
+    new_token->meas[i] = token->meas[i];
 #endif
 
-    new_token->depth = updated_token.depth;
-    //assert(token->token_path != NULL);
-    /*new_token->token_path = new TPLexPrefixTree::PathHistory(
-      updated_token.total_log_prob,
-      token->token_path->dll + ac_log_prob, updated_token.depth,
-      token->token_path);
-      new_token->token_path->link();*/
-    /*new_token->token_path = token->token_path;
-      new_token->token_path->link();*/
-  }
+  new_token->depth = updated_token.depth;
+  //assert(token->token_path != NULL);
+  /*new_token->token_path = new TPLexPrefixTree::PathHistory(
+    updated_token.total_log_prob,
+    token->token_path->dll + ac_log_prob, updated_token.depth,
+    token->token_path);
+    new_token->token_path->link();*/
+  /*new_token->token_path = token->token_path;
+    new_token->token_path->link();*/
 }
 
 Token*
@@ -1619,6 +1835,7 @@ int TokenPassSearch::set_ngram(NGram *ngram)
 {
   assert(!m_fsa_lm);
   m_ngram = ngram;
+  m_batch_table.clear();
   // Initialize LM lookahead caches again.
   m_lm_lookahead_initialized = false;
   return create_word_repository();
@@ -1635,6 +1852,7 @@ int TokenPassSearch::set_lookahead_ngram(NGram *ngram)
 {
   assert( m_ngram != NULL || m_fsa_lm != NULL);
   m_lookahead_ngram = ngram;
+  m_lookahead_cache.reset();
   return create_word_repository();
 }
 
@@ -1872,14 +2090,176 @@ float TokenPassSearch::compute_ngram_score(LMHistory * history)
   if (m_split_multiwords) {
     return split_and_compute_ngram_score(history);
   }
-  else {
-    create_history_ngram(history, m_ngram->order());
-    return m_ngram->log_prob(m_history_ngram);
-  }
-#else
+#endif
   create_history_ngram(history, m_ngram->order());
+  float score;
+  if (find_batch_ngram_score(&score))
+    return score;
   return m_ngram->log_prob(m_history_ngram);
+}
+
+// Fills the n-grams shorter than the model order in the batch.
+static const int batch_padding = INT_MIN;
+
+static inline unsigned int
+batch_hash(const int *gram, int order)
+{
+  unsigned int code = 0;
+  for (int i = 0; i < order; i++) {
+    code += gram[i];
+    code += (code << 10);
+    code ^= (code >> 6);
+  }
+  code += (code << 3);
+  code ^= (code >> 11);
+  code += (code << 15);
+  return code;
+}
+
+void TokenPassSearch::batch_ngram_scores()
+{
+  m_batch_grams.clear();
+  m_batch_scores.clear();
+  m_batch_table.clear();
+  if (m_fsa_lm || m_ngram == NULL || m_ngram->order() <= 0)
+    return;
+#ifdef ENABLE_MULTIWORD_SUPPORT
+  if (m_split_multiwords)
+    return;
 #endif
+  const int order = m_ngram->order();
+
+  // Collect the n-grams that move_token_to_node() will compute when the
+  // active tokens reach a word end, except the ones in the LM cache. The
+  // context is the same for every word that a token can reach.
+  for (auto token : m_active_token_list) {
+    if (token == NULL)
+      continue;
+    bool have_context = false;
+    const TPLexPrefixTree::FrozenArc *arc;
+    for (arc = m_lexicon.arcs_begin(token->node);
+         arc != m_lexicon.arcs_end(token->node); ++arc)
+    {
+      TPLexPrefixTree::Node *node = m_lexicon.node(arc->next);
+      if (node == token->node
+          || (node->flags & NODE_AFTER_WORD_ID)
+          || node->word_id == -1
+          || node->word_id == m_sentence_start_id
+          || m_word_repository[node->word_id].lm_id() < 0)
+        continue;
+      if (node->word_id == m_word_boundary_id
+          && token->lm_history->last().word_id() == m_word_boundary_id)
+        continue;
+      if (m_use_lm_cache) {
+        // The history the token will have after the word. It is not
+        // linked, so the token's history is not modified.
+        LMHistory word_history(&m_word_repository[node->word_id], NULL);
+        word_history.previous = token->lm_history;
+        LMScoreInfo *info;
+        if (m_lm_score_cache.find(compute_lm_hist_hash_code(&word_history),
+                                  &info)
+            && lm_score_info_matches(info, &word_history))
+          continue;
+      }
+      if (!have_context) {
+        create_history_ngram(token->lm_history, order - 1);
+        m_batch_key.assign(order - 1 - m_history_ngram.size(), batch_padding);
+        m_batch_key.insert(m_batch_key.end(), m_history_ngram.begin(),
+                           m_history_ngram.end());
+        have_context = true;
+      }
+      m_batch_grams.insert(m_batch_grams.end(), m_batch_key.begin(),
+                           m_batch_key.end());
+      m_batch_grams.push_back(m_word_repository[node->word_id].lm_id());
+    }
+  }
+  int num_grams = m_batch_grams.size() / order;
+  if (num_grams == 0)
+    return;
+
+  // Sort by the whole n-gram, so that the queries with the same context
+  // are next to each other, and remove the duplicates.
+  const int *grams = &m_batch_grams[0];
+  m_batch_order.resize(num_grams);
+  for (int i = 0; i < num_grams; i++)
+    m_batch_order[i] = i;
+  sort(m_batch_order.begin(), m_batch_order.end(), [&](int a, int b) {
+      return lexicographical_compare(grams + a * order, grams + (a + 1) * order,
+                                     grams + b * order, grams + (b + 1) * order);
+    });
+  m_batch_order.erase(
+    unique(m_batch_order.begin(), m_batch_order.end(), [&](int a, int b) {
+        return equal(grams + a * order, grams + (a + 1) * order,
+                     grams + b * order);
+      }),
+    m_batch_order.end());
+
+  // Score the n-grams in the sorted order, and keep only the unique ones.
+  int table_size = 1;
+  while (table_size < 2 * (int)m_batch_order.size())
+    table_size *= 2;
+  m_batch_table.assign(table_size, -1);
+  m_batch_scores.resize(m_batch_order.size());
+  for (int i = 0; i < m_batch_order.size(); i++) {
+    const int *gram = &m_batch_grams[m_batch_order[i] * order];
+    m_history_ngram.clear();
+    for (int j = 0; j < order; j++) {
+      if (gram[j] != batch_padding)
+        m_history_ngram.push_back(gram[j]);
+    }
+    m_batch_scores[i] = m_ngram->log_prob(m_history_ngram);
+  }
+  std::vector<int> unique_grams(m_batch_order.size() * order);
+  for (int i = 0; i < m_batch_order.size(); i++) {
+    copy(grams + m_batch_order[i] * order, grams + (m_batch_order[i] + 1) * order,
+         unique_grams.begin() + i * order);
+    unsigned int slot = batch_hash(&unique_grams[i * order], order);
+    while (m_batch_table[slot & (table_size - 1)] >= 0)
+      slot++;
+    m_batch_table[slot & (table_size - 1)] = i;
+  }
+  m_batch_grams.swap(unique_grams);
+}
+
+bool TokenPassSearch::find_batch_ngram_score(float *score)
+{
+  if (m_batch_table.empty())
+    return false;
+  const int order = m_ngram->order();
+  if (m_history_ngram.size() > order)
+    return false;
+  m_batch_key.assign(order - m_history_ngram.size(), batch_padding);
+  m_batch_key.insert(m_batch_key.end(), m_history_ngram.begin(),
+                     m_history_ngram.end());
+  const int mask = m_batch_table.size() - 1;
+  for (unsigned int slot = batch_hash(&m_batch_key[0], order); ; slot++) {
+    int index = m_batch_table[slot & mask];
+    if (index < 0)
+      return false;
+    if (equal(m_batch_key.begin(), m_batch_key.end(),
+              m_batch_grams.begin() + index * order)) {
+      *score = m_batch_scores[index];
+      return true;
+    }
+  }
+}
+
+bool TokenPassSearch::lm_score_info_matches(const LMScoreInfo *info,
+                                            const LMHistory *lm_hist) const
+{
+  // Check this is correct word history
+  const LMHistory *wh = lm_hist;
+  for (int i = 0; i < info->lm_hist.size(); i++) {
+    if (wh->last().word_id() != info->lm_hist[i]) // Also handles 'word_id==-1' case
+      return false;
+    wh = wh->previous;
+  }
+  if (info->lm_hist.size() <= m_ngram->order()) {
+    if (wh->last().word_id() != -1
+        && wh->last().word_id() != m_sentence_end_id)
+      return false;
+  }
+  return true;
 }
 
 float TokenPassSearch::get_ngram_score(LMHistory *lm_hist, int lm_hist_code)
@@ -1893,26 +2273,11 @@ float TokenPassSearch::get_ngram_score(LMHistory *lm_hist, int lm_hist_code)
   int i;
 
   if (m_lm_score_cache.find(lm_hist_code, &info)) {
-    // Check this is correct word history
-    LMHistory *wh = lm_hist;
-    for (int i = 0; i < info->lm_hist.size(); i++) {
-      if (wh->last().word_id() != info->lm_hist[i]) // Also handles 'word_id==-1' case
-      {
-        collision = true;
-        goto get_ngram_score_no_cached;
-      }
-      wh = wh->previous;
-    }
-    if (info->lm_hist.size() <= m_ngram->order()) {
-      if (wh->last().word_id() != -1
-          && wh->last().word_id() != m_sentence_end_id) {
-        collision = true;
-        goto get_ngram_score_no_cached;
-      }
-    }
-    return info->lm_score;
+    if (lm_score_info_matches(info, lm_hist))
+      return info->lm_score;
+    collision = true;
   }
-get_ngram_score_no_cached: if (collision) {
+  if (collision) {
     // In case of collision remove the old item
     if (!m_lm_score_cache.remove_item(lm_hist_code, &old))
       assert( 0);
@@ -1990,35 +2355,207 @@ void TokenPassSearch::update_lm_log_prob(Token & token)
   }
 }
 
-float TokenPassSearch::get_lm_lookahead_score(LMHistory *lm_hist,
-                                              TPLexPrefixTree::Node *node, int depth)
+bool TokenPassSearch::get_lm_lookahead_words(LMHistory *lm_hist,
+                                             int *w1, int *w2) const
 {
   // The last word or its last component.
   LMHistory::ConstReverseIterator iter = lm_hist->rbegin();
-  int w2 = iter->word_id;
-  if (w2 == -1 || w2 == m_sentence_end_id) {
+  *w2 = iter->word_id;
+  if (*w2 == -1 || *w2 == m_sentence_end_id) {
     // This is the beginning of the history or the end of a sentence.
-    return 0;
+    return false;
   }
 
+  *w1 = -1;
   if (m_lm_lookahead == 1) {
-    return get_lm_bigram_lookahead(w2, node, depth);
+    return true;
   }
 
   // The component before the last component of the last word, or the word
   // before the last word.
   ++iter;
   if (iter == lm_hist->rend()) {
-    return 0;
+    return false;
   }
-  int w1 = iter->word_id;
-  if (w1 == -1 || w1 == m_sentence_end_id) {
+  *w1 = iter->word_id;
+  if (*w1 == -1 || *w1 == m_sentence_end_id) {
     // This is the beginning of the history or the end of a sentence.
+    return false;
+  }
+  return true;
+}
+
+float TokenPassSearch::get_lm_lookahead_score(LMHistory *lm_hist,
+                                              TPLexPrefixTree::Node *node, int depth)
+{
+  int w1, w2;
+  if (!get_lm_lookahead_words(lm_hist, &w1, &w2))
     return 0;
+
+  if (m_lm_lookahead == 1) {
+    return get_lm_bigram_lookahead(w2, node, depth);
   }
   return get_lm_trigram_lookahead(w1, w2, node, depth);
 }
 
+bool TokenPassSearch::find_lm_lookahead_score(LMHistory *lm_hist,
+                                              TPLexPrefixTree::Node *node,
+                                              float *score)
+{
+  int w1, w2;
+  if (!get_lm_lookahead_words(lm_hist, &w1, &w2)) {
+    *score = 0;
+    return true;
+  }
+
+  if (m_lm_lookahead == 1)
+    return node->lm_lookahead_buffer.find(w2, score);
+  return node->lm_lookahead_buffer.find(w1 * m_word_repository.size() + w2,
+                                        score);
+}
+
+LMLookaheadCache::ScoreList
+TokenPassSearch::get_lm_lookahead_score_list(int w1, int w2)
+{
+  int lm_w1 = w1 < 0 ? -1 : m_word_repository[w1].lookahead_lm_id();
+  int lm_w2 = m_word_repository[w2].lookahead_lm_id();
+  LMLookaheadCache::ScoreList score_list = m_lookahead_cache->find(lm_w1, lm_w2);
+  if (score_list)
+    return score_list;
+
+#ifdef COUNT_LM_LA_CACHE_MISS
+  lm_la_word_cache_miss++;
+#endif
+  // FIXME! Is it necessary to compute the scores for all the words?
+  if (m_verbose > 2) {
+    if (w1 < 0)
+      printf("Compute lm lookahead scores for \'%s'\n",
+             m_vocabulary.word(w2).c_str());
+    else
+      printf("Compute lm lookahead scores for (%s,%s)\n",
+             m_vocabulary.word(w1).c_str(),
+             m_vocabulary.word(w2).c_str());
+  }
+  return m_lookahead_cache->compute(lm_w1, lm_w2);
+}
+
+float TokenPassSearch::max_lm_lookahead_score(
+  const std::vector<float> &score_list,
+  const TPLexPrefixTree::Node *node) const
+{
+  // Select the maximum LM score of possible word ends. The score list is
+  // indexed by lookahead LM IDs.
+  float score = -1e10;
+  for (int i = 0; i < node->possible_word_id_list.size(); i++) {
+    int lm_id =
+      m_word_repository[node->possible_word_id_list[i]].lookahead_lm_id();
+    if (score_list[lm_id] > score)
+      score = score_list[lm_id];
+  }
+  return score;
+}
+
+void TokenPassSearch::prefetch_lm_lookahead_scores()
+{
+  const int num_tokens = m_active_token_list.size();
+
+  // Find, in parallel, the lookahead scores that are needed when the active
+  // tokens are moved to the next nodes but are missing from the node
+  // caches. Each thread takes a contiguous part of the token list and only
+  // reads the search structures.
+  m_thread_pool->run([&](int thread_index, int num_threads) {
+      std::vector<LMLookaheadRequest> &requests =
+        m_lookahead_requests[thread_index];
+      requests.clear();
+      int first = (long)num_tokens * thread_index / num_threads;
+      int last = (long)num_tokens * (thread_index + 1) / num_threads;
+      for (int i = first; i < last; i++) {
+        Token *token = m_active_token_list[i];
+        if (token == NULL)
+          continue;
+        LMLookaheadRequest request;
+        if (!get_lm_lookahead_words(token->lm_history, &request.w1,
+                                    &request.w2))
+          continue;
+        if (request.w1 < 0)
+          request.index = request.w2;
+        else
+          request.index = request.w1 * m_word_repository.size() + request.w2;
+
+        const TPLexPrefixTree::FrozenArc *arc;
+        for (arc = m_lexicon.arcs_begin(token->node);
+             arc != m_lexicon.arcs_end(token->node); ++arc)
+        {
+          TPLexPrefixTree::Node *node = m_lexicon.node(arc->next);
+          float score;
+          if (node == token->node
+              || (node->flags & NODE_AFTER_WORD_ID)
+              || node->word_id != -1
+              || node->possible_word_id_list.empty()
+              || node->lm_lookahead_buffer.find(request.index, &score))
+            continue;
+          request.node = node;
+          requests.push_back(request);
+        }
+      }
+    });
+
+  // Merge the requests in a fixed order, independent of the thread timing.
+  m_lookahead_merged_requests.clear();
+  for (int t = 0; t < m_lookahead_requests.size(); t++)
+    m_lookahead_merged_requests.insert(m_lookahead_merged_requests.end(),
+                                       m_lookahead_requests[t].begin(),
+                                       m_lookahead_requests[t].end());
+  std::vector<LMLookaheadRequest> &requests = m_lookahead_merged_requests;
+  if (requests.empty())
+    return;
+  sort(requests.begin(), requests.end(),
+       [](const LMLookaheadRequest &a, const LMLookaheadRequest &b) {
+         if (a.node->node_id != b.node->node_id)
+           return a.node->node_id < b.node->node_id;
+         return a.index < b.index;
+       });
+  requests.erase(unique(requests.begin(), requests.end(),
+                        [](const LMLookaheadRequest &a,
+                           const LMLookaheadRequest &b) {
+                          return a.node == b.node && a.index == b.index;
+                        }),
+                 requests.end());
+
+  // The score lists are fetched here once per context, so that the same
+  // list is not computed by several threads at the same time.
+  std::map<int, LMLookaheadCache::ScoreList> score_lists;
+  for (int i = 0; i < requests.size(); i++) {
+    LMLookaheadRequest &request = requests[i];
+    LMLookaheadCache::ScoreList &score_list = score_lists[request.index];
+    if (!score_list)
+      score_list = get_lm_lookahead_score_list(request.w1, request.w2);
+    request.score_list = score_list;
+  }
+
+  m_thread_pool->run([&](int thread_index, int num_threads) {
+      int first = (long)requests.size() * thread_index / num_threads;
+      int last = (long)requests.size() * (thread_index + 1) / num_threads;
+      for (int i = first; i < last; i++)
+        requests[i].score =
+          max_lm_lookahead_score(*requests[i].score_list, requests[i].node);
+    });
+
+  for (int i = 0; i < requests.size(); i++)
+    requests[i].node->lm_lookahead_buffer.insert(requests[i].index,
+                                                 requests[i].score, NULL);
+}
+
+void TokenPassSearch::set_num_threads(int num_threads)
+{
+  delete m_thread_pool;
+  m_thread_pool = NULL;
+  if (num_threads > 1)
+    m_thread_pool = new ThreadPool(num_threads);
+  m_lookahead_requests.resize(std::max(num_threads, 1));
+  m_propagated_tokens.resize(std::max(num_threads, 1));
+}
+
 float TokenPassSearch::get_lm_bigram_lookahead(int prev_word_id,
                                                TPLexPrefixTree::Node *node, int depth)
 {
@@ -2038,42 +2575,12 @@ float TokenPassSearch::get_lm_bigram_lookahead(int prev_word_id,
   // Not found from cache. Compute the LM bigram lookahead score for every
   // word pair starting with prev_word_id (unless the LM scores have been
   // computed already.
-  LMLookaheadScoreList * score_list = NULL;
-  if (!lm_lookahead_score_list.find(prev_word_id, &score_list)) {
-#ifdef COUNT_LM_LA_CACHE_MISS
-    lm_la_word_cache_miss++;
-#endif
-    // FIXME! Is it necessary to compute the scores for all the words?
-    if (m_verbose > 2)
-      printf("Compute lm lookahead scores for \'%s'\n",
-             m_vocabulary.word(prev_word_id).c_str());
-    score_list = new LMLookaheadScoreList;
-    LMLookaheadScoreList * old_score_list = NULL;
-    if (lm_lookahead_score_list.insert(prev_word_id, score_list,
-                                       &old_score_list))
-      delete old_score_list; // Old list was removed
-    score_list->index = prev_word_id;
-    score_list->lm_scores.insert(score_list->lm_scores.end(),
-                                 m_word_repository.size(), 0);
-
-    vector<float> extensions;
-    m_lookahead_ngram->fetch_bigram_list(
-      m_word_repository[prev_word_id].lookahead_lm_id(), extensions);
-
-    // Map lookahead LM IDs to word IDs.
-    for (int i = 0; i < m_word_repository.size(); ++i) {
-      score_list->lm_scores.at(i) =
-        extensions.at(m_word_repository[i].lookahead_lm_id());
-    }
-  }
+  LMLookaheadCache::ScoreList score_list =
+    get_lm_lookahead_score_list(-1, prev_word_id);
 
   // Compute the lookahead score by selecting the maximum LM score of possible
   // word ends.
-  score = -1e10;
-  for (int i = 0; i < node->possible_word_id_list.size(); i++) {
-    if (score_list->lm_scores[node->possible_word_id_list[i]] > score)
-      score = score_list->lm_scores[node->possible_word_id_list[i]];
-  }
+  score = max_lm_lookahead_score(*score_list, node);
 
   // Add the score to the node's buffer
   node->lm_lookahead_buffer.insert(prev_word_id, score, NULL);
@@ -2101,42 +2608,12 @@ float TokenPassSearch::get_lm_trigram_lookahead(int w1, int w2,
   // Not found from cache. Compute the LM trigram lookahead score for every
   // word triplet starting with w1 w2 (unless the LM scores have been computed
   // already).
-  LMLookaheadScoreList * score_list = NULL;
-  if (!lm_lookahead_score_list.find(index, &score_list)) {
-#ifdef COUNT_LM_LA_CACHE_MISS
-    lm_la_word_cache_miss++;
-#endif
-    // FIXME! Is it necessary to compute the scores for all the words?
-    if (m_verbose > 2)
-      printf("Compute lm lookahead scores for (%s,%s)\n",
-             m_vocabulary.word(w1).c_str(),
-             m_vocabulary.word(w2).c_str());
-    score_list = new LMLookaheadScoreList;
-    LMLookaheadScoreList * old_score_list = NULL;
-    if (lm_lookahead_score_list.insert(index, score_list, &old_score_list))
-      delete old_score_list; // Old list was removed
-    score_list->index = index;
-    score_list->lm_scores.insert(score_list->lm_scores.end(),
-                                 m_word_repository.size(), 0);
-
-    vector<float> extensions;
-    m_lookahead_ngram->fetch_trigram_list(
-      m_word_repository[w1].lookahead_lm_id(),
-      m_word_repository[w2].lookahead_lm_id(), extensions);
-
-    // Map lookahead LM IDs to word IDs.
-    for (int i = 0; i < m_word_repository.size(); ++i)
-      score_list->lm_scores.at(i) =
-        extensions.at(m_word_repository[i].lookahead_lm_id());
-  }
+  LMLookaheadCache::ScoreList score_list =
+    get_lm_lookahead_score_list(w1, w2);
 
   // Compute the lookahead score by selecting the maximum LM score of
   // possible word ends.
-  score = -1e10;
-  for (int i = 0; i < node->possible_word_id_list.size(); i++) {
-    if (score_list->lm_scores[node->possible_word_id_list[i]] > score)
-      score = score_list->lm_scores[node->possible_word_id_list[i]];
-  }
+  score = max_lm_lookahead_score(*score_list, node);
 
   // Add the score to the node's buffer
   node->lm_lookahead_buffer.insert(index, score, NULL);
@@ -2147,15 +2624,7 @@ float TokenPassSearch::get_lm_trigram_lookahead(int w1, int w2,
 Token*
 TokenPassSearch::acquire_token(void)
 {
-  if (m_token_pool.size() == 0) {
-    Token *tt =
-      new Token[TOKEN_RESERVE_BLOCK];
-    m_token_dealloc_table.push_back(tt);
-    for (int i = 0; i < TOKEN_RESERVE_BLOCK; i++)
-      m_token_pool.push_back(&tt[i]);
-  }
-  Token *t = m_token_pool.back();
-  m_token_pool.pop_back();
+  Token *t = new (m_token_pool.allocate()) Token();
   t->recent_word_graph_node = -1;
   t->word_history = NULL;
   return t;
@@ -2187,10 +2656,28 @@ void TokenPassSearch::release_token(Token *token)
     word_graph.unlink(token->recent_word_graph_node);
   token->recent_word_graph_node = -1;
   hist::unlink(token->lm_history, &m_lmh_pool);
-  hist::unlink(token->word_history);
-  hist::unlink(token->state_history);
+  hist::unlink(token->word_history, m_word_history_pool.free_list());
+  hist::unlink(token->state_history, m_state_history_pool.free_list());
   //TPLexPrefixTree::PathHistory::unlink(token->token_path);
-  m_token_pool.push_back(token);
+  m_token_pool.release(token);
+}
+
+void TokenPassSearch::print_memory_statistics(FILE *file) const
+{
+  fprintf(file, "Tokens: %zu in use, %zu peak, %zu reserved\n",
+          m_token_pool.num_used(), m_token_pool.peak_used(),
+          m_token_pool.num_reserved());
+  fprintf(file, "Word histories: %zu in use, %zu peak, %zu reserved\n",
+          m_word_history_pool.num_used(), m_word_history_pool.peak_used(),
+          m_word_history_pool.num_reserved());
+  fprintf(file, "State histories: %zu in use, %zu peak, %zu reserved\n",
+          m_state_history_pool.num_used(), m_state_history_pool.peak_used(),
+          m_state_history_pool.num_reserved());
+  if (m_lookahead_cache) {
+    fprintf(file, "LM lookahead score lists: %d cached, %ld hits, %ld misses"
+            " (shared)\n", m_lookahead_cache->num_items(),
+            m_lookahead_cache->num_hits(), m_lookahead_cache->num_misses());
+  }
 }
 
 void TokenPassSearch::release_lmhist(LMHistory *lmhist) {
@@ -2283,7 +2770,7 @@ void TokenPassSearch::update_final_tokens()
     // word. Thus, tokens that are in a final node do not have the current
     // word in their word histories.
     if (m_generate_word_graph && token->node->flags & NODE_FINAL) {
-      token->word_history = new Token::WordHistory(
+      token->word_history = acquire_word_history(
         token->lm_history->last().word_id(), m_frame,
         token->word_history);
       token->word_history->lex_node_id = token->node->node_id;
@@ -2319,7 +2806,7 @@ void TokenPassSearch::update_final_tokens()
           > m_best_final_token->total_log_prob)
         m_best_final_token = token;
 
-      token->word_history = new Token::WordHistory(
+      token->word_history = acquire_word_history(
         token->lm_history->last().word_id(), m_frame,
         token->word_history);
       token->word_history->lex_node_id = token->node->node_id;
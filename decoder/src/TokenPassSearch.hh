@@ -15,6 +15,9 @@
 #include "Acoustics.hh"
 #include "LMHistory.hh"
 #include "IteratorRange.hh"
+#include "BlockPool.hh"
+#include "ThreadPool.hh"
+#include "LMLookaheadCache.hh"
 
 // Visual studio math.h doesn't have log1p function varjokal 17.3.2010
 #ifdef _MSC_VER
@@ -127,6 +130,14 @@ public:
   ///
   std::string state_history_string();
 
+  /// \brief Writes the number of tokens and history structures allocated
+  /// in the memory pools.
+  ///
+  /// Prints the current and peak number of objects in use since the last
+  /// reset_search(), and the number of objects the pools have reserved.
+  ///
+  void print_memory_statistics(FILE *file = stdout) const;
+
   /// \brief Sorts active tokens by the order of descending log probability.
   ///
   /// Sorts active tokens, first final tokens in the order of descending log
@@ -270,6 +281,33 @@ public:
     m_use_lm_cache = value;
   }
 
+  /// \brief Computes the n-gram scores of the word ends in each frame as
+  /// one batch.
+  ///
+  /// Before the tokens are propagated, the n-grams of the words that the
+  /// active tokens reach and that are not in the LM cache are collected,
+  /// sorted by their context so that consecutive queries share the same
+  /// part of the model, and scored once each. The results are identical.
+  /// Disabled by default.
+  ///
+  void set_batch_lm_scores(bool value)
+  {
+    m_batch_lm_scores = value;
+  }
+
+  /// \brief Sets the number of threads used in token propagation.
+  ///
+  /// With more than one thread, the LM lookahead scores needed in each
+  /// frame are computed in parallel first. Then each thread moves a part
+  /// of the active tokens to the next nodes into its own buffer. The moved
+  /// tokens are recombined and pruned in the order of the active tokens, so
+  /// the results are identical to using one thread (the default). Tokens
+  /// whose moves reach a word end or need scores that are not cached are
+  /// propagated serially, and so is the whole search when word graphs or
+  /// state segmentations are generated.
+  ///
+  void set_num_threads(int num_threads);
+
   int frame(void)
   {
     return m_frame;
@@ -319,6 +357,19 @@ public:
   ///
   float get_total_log_prob(bool use_best_token) const;
 
+  /// \brief Collects the LM history of an active token.
+  ///
+  /// Unlike print_lm_history(), does not mark the history as printed, so it
+  /// can be used for partial results while decoding. The pointers are valid
+  /// until the next call to run().
+  ///
+  /// \param path Receives the histories of the words, last word first.
+  /// \param use_best_token If true, uses the best token in NODE_FINAL state,
+  /// otherwise any active token.
+  /// \param limit Stops before this history, or at the beginning if NULL.
+  ///
+  void get_path(HistoryVector &path, bool use_best_token, LMHistory *limit);
+
   /// \brief Finds the globally best token that is in the NODE_FINAL state,
   /// i.e. at the end of a word.
   ///
@@ -434,6 +485,30 @@ private:
                           TPLexPrefixTree::Node *node,
                           float transition_score);
 
+  /// \brief Prunes a moved token, recombines it with the tokens in its
+  /// node, and adds it to the new tokens.
+  ///
+  /// \param token The token that was moved.
+  /// \param updated_token The token after the move, including the acoustic
+  /// score.
+  ///
+  void add_token_to_node(Token *token, const Token &updated_token);
+
+  /// \brief Moves the active tokens in parallel and adds them to the nodes
+  /// in the order of the serial search.
+  ///
+  void propagate_tokens_parallel();
+
+  /// \brief Computes \a updated_token for a move of \a token to \a node
+  /// without modifying the search.
+  ///
+  /// \return False if the move has to be made by move_token_to_node(),
+  /// because it would create histories or compute scores. If the move is
+  /// discarded, updated_token.node is set to NULL.
+  ///
+  bool prepare_move(const Token *token, TPLexPrefixTree::Node *node,
+                    float transition_score, Token &updated_token);
+
   /// \brief Copes new tokens from \ref m_new_token_list to
   /// \ref m_active_token_list.
   ///
@@ -522,6 +597,12 @@ private:
   float get_lm_lookahead_score(LMHistory *lm_hist,
                                 TPLexPrefixTree::Node *node, int depth);
 
+  /// \brief Finds the lookahead score from the cache of \a node without
+  /// computing it. Returns false if the score is not in the cache.
+  ///
+  bool find_lm_lookahead_score(LMHistory *lm_hist,
+                               TPLexPrefixTree::Node *node, float *score);
+
   /// \brief Computes bi-gram probabilities for every word pair starting with
   /// \a prev_word_id, using the lookahead LM, and returns the maximum.
   ///
@@ -543,6 +624,10 @@ private:
 
   Token* acquire_token(void);
   LMHistory* acquire_lmhist(const LMHistory::Word *, LMHistory *);
+  inline Token::WordHistory *acquire_word_history(
+    int word_id, int end_frame, Token::WordHistory *previous);
+  inline Token::StateHistory *acquire_state_history(
+    int hmm_model, int start_time, Token::StateHistory *previous);
   void release_token(Token *token);
   void release_lmhist(LMHistory *);
 
@@ -550,8 +635,7 @@ private:
   //void print_token_path(TPLexPrefixTree::PathHistory *hist);
 
   // Help variables to cope with memory leaks
-  // Vector of pointers to memory blocks for m_token_pool, this is only for freeing up memory at the destructor
-  std::vector<Token *> m_token_dealloc_table;
+  // Vector of pointers to memory blocks for m_lmh_pool, this is only for freeing up memory at the destructor
   std::vector<LMHistory *> m_lmhist_dealloc_table;
 
 public:
@@ -570,18 +654,55 @@ private:
   token_list_type m_active_token_list;
   token_list_type m_new_token_list;
   token_list_type m_word_end_token_list;
-  token_list_type m_token_pool;
+  BlockPool<Token> m_token_pool;
+  BlockPool<Token::WordHistory> m_word_history_pool;
+  BlockPool<Token::StateHistory> m_state_history_pool;
   std::vector<LMHistory*> m_lmh_pool;
 
   std::vector<TPLexPrefixTree::Node*> m_active_node_list;
 
-  class LMLookaheadScoreList
-  {
-  public:
-    int index;
-    std::vector<float> lm_scores;
+  std::shared_ptr<LMLookaheadCache> m_lookahead_cache;
+
+  /// \brief A lookahead score to be computed before token propagation.
+  struct LMLookaheadRequest {
+    TPLexPrefixTree::Node *node;
+    int index; // Key in the caches
+    int w1; // -1 for bigram lookahead
+    int w2;
+    LMLookaheadCache::ScoreList score_list;
+    float score;
   };
-  HashCache<LMLookaheadScoreList*> lm_lookahead_score_list;
+
+  /// \brief Finds the last one or two words of \a lm_hist used for LM
+  /// lookahead. Returns false if the lookahead score is 0.
+  ///
+  bool get_lm_lookahead_words(LMHistory *lm_hist, int *w1, int *w2) const;
+
+  /// \brief Returns the lookahead LM scores of every word after \a w1
+  /// \a w2 (or after \a w2 if \a w1 is negative) from the shared cache.
+  ///
+  LMLookaheadCache::ScoreList get_lm_lookahead_score_list(int w1, int w2);
+
+  /// \brief The maximum score in \a score_list of the words that can end
+  /// after \a node.
+  ///
+  float max_lm_lookahead_score(const std::vector<float> &score_list,
+                               const TPLexPrefixTree::Node *node) const;
+
+  /// \brief Computes in parallel the lookahead scores that the active
+  /// tokens need in the next nodes and adds them to the node caches.
+  ///
+  void prefetch_lm_lookahead_scores();
+
+  /// \brief Computes the n-gram scores that the active tokens need when
+  /// they reach a word end in this frame, and that are not in the LM cache.
+  ///
+  void batch_ngram_scores();
+
+  /// \brief Finds the score of m_history_ngram in the batch of the current
+  /// frame. Returns false if it is not there.
+  ///
+  bool find_batch_ngram_score(float *score);
 
   class LMScoreInfo
   {
@@ -591,6 +712,12 @@ private:
   };
   HashCache<LMScoreInfo*> m_lm_score_cache;
 
+  /// \brief Returns true if \a info was cached for \a lm_hist, and not for
+  /// another history with the same hash code.
+  ///
+  bool lm_score_info_matches(const LMScoreInfo *info,
+                             const LMHistory *lm_hist) const;
+
   int m_end_frame;
   int m_frame; // Current frame
 
@@ -686,6 +813,25 @@ private:
 
   bool m_lm_lookahead_initialized;
 
+  ThreadPool *m_thread_pool; // NULL if only one thread is used
+  std::vector<std::vector<LMLookaheadRequest> > m_lookahead_requests;
+  std::vector<LMLookaheadRequest> m_lookahead_merged_requests;
+
+  // The tokens moved by each thread in propagate_tokens_parallel(), and for
+  // each active token the end of its moves in the buffer of its thread, or
+  // -1 if the token is propagated serially.
+  std::vector<std::vector<Token> > m_propagated_tokens;
+  std::vector<int> m_propagated_token_end;
+
+  // The n-grams scored in batch_ngram_scores(), each m_ngram->order()
+  // LM IDs padded in the front, and a hash table of their indices.
+  bool m_batch_lm_scores;
+  std::vector<int> m_batch_grams;
+  std::vector<float> m_batch_scores;
+  std::vector<int> m_batch_table; // -1 if the slot is free
+  std::vector<int> m_batch_order; // Temporary for sorting
+  std::vector<int> m_batch_key; // Temporary for lookups
+
   int lm_la_cache_count[MAX_LEX_TREE_DEPTH];
   int lm_la_cache_miss[MAX_LEX_TREE_DEPTH];
   int lm_la_word_cache_count;
@@ -700,4 +846,20 @@ public:
 				      const Token & token);
 };
 
+Token::WordHistory *
+TokenPassSearch::acquire_word_history(int word_id, int end_frame,
+                                      Token::WordHistory *previous)
+{
+  return new (m_word_history_pool.allocate())
+    Token::WordHistory(word_id, end_frame, previous);
+}
+
+Token::StateHistory *
+TokenPassSearch::acquire_state_history(int hmm_model, int start_time,
+                                       Token::StateHistory *previous)
+{
+  return new (m_state_history_pool.allocate())
+    Token::StateHistory(hmm_model, start_time, previous);
+}
+
 #endif // TOKENPASSSEARCH_HH
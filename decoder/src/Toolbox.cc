@@ -1,10 +1,12 @@
 #include <cstddef>  // NULL
 #include <algorithm>
 #include <iostream>
+#include <stdexcept>
 #include <assert.h>
 #include <errno.h>
 
 #include "InterTreeGram.hh"
+#include "QuantizedTreeGram.hh"
 #include "Toolbox.hh"
 #include "TreeGramArpaReader.hh"
 #include "io.hh"
@@ -28,7 +30,7 @@ Toolbox::Toolbox(const char * hmm_path, const char * dur_path)
     m_lna_reader(NULL),
     m_one_frame_acoustics(),
     m_fsa_lm(NULL),
-    m_lookahead_ngram(NULL),
+    m_lookahead_ngram(),
 
     m_last_guaranteed_history(NULL)
 {
@@ -45,9 +47,6 @@ Toolbox::~Toolbox()
     delete m_ngrams.back();
     m_ngrams.pop_back();
   }
-  if (m_lookahead_ngram) {
-    delete m_lookahead_ngram;
-  }
 
   if (m_fsa_lm) {
     delete m_fsa_lm;
@@ -151,15 +150,55 @@ Toolbox::lex_read(const char *filename)
   m_lexicon_read = true;
 }
 
+void
+Toolbox::lex_snapshot_write(const char *filename)
+{
+  if (!m_lexicon_read)
+    throw std::logic_error("Toolbox::lex_snapshot_write(): lexicon not read");
+  m_tp_lexicon->write_snapshot(filename, *m_tp_vocabulary);
+}
+
+void
+Toolbox::lex_snapshot_read(const char *filename)
+{
+  if (!m_tp_search) {
+    reinitialize_search();
+  }
+
+  m_tp_lexicon->read_snapshot(filename, *m_tp_vocabulary);
+  if (!m_word_boundary.empty()) {
+    m_tp_search->set_word_boundary(m_word_boundary);
+  }
+  m_lexicon_read = true;
+}
+
 
 void
 Toolbox::interpolated_ngram_read(const std::vector<std::string> lmnames, 
-                                 const std::vector<float> weights) {
+                                 const std::vector<float> weights,
+                                 int quantization_bits, bool merge) {
 
   // Loading binary models doesn't work yet !
-  InterTreeGram *itg = new InterTreeGram(lmnames, weights);
-  m_tp_search->set_ngram(itg);
-  m_ngrams.push_back(itg);
+  NGram *ngram = interpolated_ngram(lmnames, weights, quantization_bits, merge);
+  m_tp_search->set_ngram(ngram);
+  m_ngrams.push_back(ngram);
+}
+
+NGram *
+Toolbox::interpolated_ngram(const std::vector<std::string> &lmnames,
+                            const std::vector<float> &weights,
+                            int quantization_bits, bool merge) {
+  if (!merge)
+    return new InterTreeGram(lmnames, weights, quantization_bits);
+
+  InterTreeGram itg(lmnames, weights);
+  TreeGram *merged = itg.merge();
+  if (quantization_bits == 0)
+    return merged;
+  QuantizedTreeGram *quantized = new QuantizedTreeGram;
+  quantized->quantize(*merged, quantization_bits);
+  delete merged;
+  return quantized;
 }
 
 
@@ -182,8 +221,14 @@ Toolbox::ngram_read(const char *file, const bool binary, bool quiet)
     m_ngrams.clear();
   }
 
-  m_ngrams.push_back(new TreeGram());
-  m_ngrams.back()->read(in.file, binary);
+  if (binary) {
+    // The model may be quantized.
+    m_ngrams.push_back(TreeGram::read_binary(in.file));
+  }
+  else {
+    m_ngrams.push_back(new TreeGram());
+    m_ngrams.back()->read(in.file, binary);
+  }
 
   int num_oolm = 0;
   num_oolm = m_tp_search->set_ngram(m_ngrams.back());
@@ -260,13 +305,16 @@ Toolbox::read_lookahead_ngram(const char *file, const bool binary, bool quiet)
     if (!in.file) {
         throw OpenError();
     }
-    if (m_lookahead_ngram) {
-      delete m_lookahead_ngram;
+    std::shared_ptr<NGram> ngram;
+    if (binary)
+      ngram.reset(TreeGram::read_binary(in.file));
+    else {
+      ngram.reset(new TreeGram());
+      ngram->read(in.file, binary);
     }
-    m_lookahead_ngram = new TreeGram();
-    m_lookahead_ngram->read(in.file, binary);
-    assert(m_lookahead_ngram->get_type()==TreeGram::BACKOFF);
-    num_oolm = m_tp_search->set_lookahead_ngram(m_lookahead_ngram);
+    assert(ngram->get_type()==TreeGram::BACKOFF);
+    num_oolm = m_tp_search->set_lookahead_ngram(ngram.get());
+    m_lookahead_ngram = ngram;
   }
 
   if ((num_oolm > 0) && !quiet) {
@@ -274,13 +322,22 @@ Toolbox::read_lookahead_ngram(const char *file, const bool binary, bool quiet)
   }
 }
 
-void Toolbox::interpolated_lookahead_ngram_read(const std::vector<std::string> lmnames, const std::vector<float> weights) {
-  if (m_lookahead_ngram) {
-    delete m_lookahead_ngram;
-  }
+void Toolbox::interpolated_lookahead_ngram_read(const std::vector<std::string> lmnames, const std::vector<float> weights, int quantization_bits, bool merge) {
   //FIXME: Not checking that the type is BACKOFF
-  m_lookahead_ngram = new InterTreeGram(lmnames, weights);
-  m_tp_search->set_lookahead_ngram(m_lookahead_ngram);;
+  std::shared_ptr<NGram> ngram(
+    interpolated_ngram(lmnames, weights, quantization_bits, merge));
+  m_tp_search->set_lookahead_ngram(ngram.get());
+  m_lookahead_ngram = ngram;
+}
+
+void
+Toolbox::share_lookahead_ngram(Toolbox &other)
+{
+  if (!other.m_lookahead_ngram)
+    throw std::runtime_error(
+      "Toolbox::share_lookahead_ngram: no lookahead model read");
+  m_tp_search->set_lookahead_ngram(other.m_lookahead_ngram.get());
+  m_lookahead_ngram = other.m_lookahead_ngram;
 }
 
 void
@@ -2,6 +2,7 @@
 #define TOOLBOX_HH
 
 #include <deque>
+#include <memory>
 
 #include "io.hh"
 #include "WordGraph.hh"
@@ -41,6 +42,19 @@ public:
   ///
   void lex_read(const char * file);
 
+  /// \brief Writes the search network built by lex_read() and the
+  /// vocabulary to a binary snapshot. Has to be called before
+  /// set_sentence_boundary().
+  ///
+  void lex_snapshot_write(const char * file);
+
+  /// \brief Reads a snapshot written by lex_snapshot_write() instead of a
+  /// dictionary. The snapshot can only be used with the same HMMs, and it
+  /// retains the lexicon settings (LM lookahead, cross-word triphones etc.)
+  /// it was built with.
+  ///
+  void lex_snapshot_read(const char * file);
+
   const std::string & lex_word() const
   { return m_tp_lexicon_reader->word(); }
 
@@ -53,10 +67,20 @@ public:
   // Ngram
 
   /// \brief Reads several n-gram models for interpolation
-  void interpolated_ngram_read(const std::vector<std::string>, const std::vector<float>);
+  ///
+  /// \param quantization_bits If nonzero, the models are quantized to save
+  /// memory (see QuantizedTreeGram).
+  /// \param merge If true, the models are merged to a single back-off model
+  /// after reading (see InterTreeGram::merge()), which is as fast to use as
+  /// a single model.
+  ///
+  void interpolated_ngram_read(const std::vector<std::string>, const std::vector<float>,
+                               int quantization_bits = 0, bool merge = false);
 
   /// \brief Reads an n-gram language model.
   ///
+  /// A binary model may be quantized with arpa2bin --quantize.
+  ///
   /// \param binary If false, the file is expected to be in ARPA file format.
   /// \param quiet If true, doesn't print warnings to stderr.
   /// \return The order of the language model.
@@ -74,7 +98,16 @@ public:
   void read_lookahead_ngram(const char * file, bool binary=true, bool quiet=false);
 
   /// \brief Reads several lookahead n-gram models for interpolation
-  void interpolated_lookahead_ngram_read(const std::vector<std::string>, const std::vector<float>);
+  void interpolated_lookahead_ngram_read(const std::vector<std::string>, const std::vector<float>,
+                                         int quantization_bits = 0, bool merge = false);
+
+  /// \brief Uses the lookahead n-gram model that \a other has read.
+  ///
+  /// The decoders that use the same lookahead model also share the cache of
+  /// lookahead scores, so that each score list is computed and stored only
+  /// once in the process.
+  ///
+  void share_lookahead_ngram(Toolbox &other);
 
   /// \brief Reads a finite-state automaton language model.
   ///
@@ -318,6 +351,16 @@ public:
   void set_use_lm_cache(bool value)
   { m_tp_search->set_use_lm_cache(value); }
 
+  void set_batch_lm_scores(bool value)
+  { m_tp_search->set_batch_lm_scores(value); }
+
+  /// \brief Sets the number of threads used in the search.
+  ///
+  /// The results do not depend on the number of threads. The default is 1.
+  ///
+  void set_num_threads(int num_threads)
+  { m_tp_search->set_num_threads(num_threads); }
+
   // Debug
   void write_word_history(const std::string & file_name)
   {
@@ -331,6 +374,9 @@ public:
   void print_lm_history()
   { m_tp_search->print_lm_history(); }
 
+  void print_memory_statistics()
+  { m_tp_search->print_memory_statistics(); }
+
   void write_state_segmentation(const std::string & file_name)
   {
     io::Stream out(file_name, "w");
@@ -381,7 +427,7 @@ private:
   std::vector<NGram*> m_ngrams;
   fsalm::LM *m_fsa_lm;
   std::deque<int> m_history;
-  NGram *m_lookahead_ngram;
+  std::shared_ptr<NGram> m_lookahead_ngram;
 
   LMHistory *m_last_guaranteed_history;
 
@@ -397,6 +443,12 @@ private:
 
   /// \brief Has to be called after reading acoustic model.
   void reinitialize_search();
+
+  /// \brief Reads the models to be interpolated, either as an
+  /// InterTreeGram or merged to a single model.
+  NGram *interpolated_ngram(const std::vector<std::string> &lmnames,
+                            const std::vector<float> &weights,
+                            int quantization_bits, bool merge);
 };
 
 #endif /* TOOLBOX_HH */
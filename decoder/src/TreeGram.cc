@@ -4,6 +4,8 @@
 #include <cassert>
 #include <cmath>
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
 
 // Use io.h in Visual Studio varjokal 17.3.2010
 #ifdef _MSC_VER
@@ -12,6 +14,8 @@
 typedef int ssize_t;
 #else
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 // BEGIN fwrite-hack
@@ -19,19 +23,77 @@ typedef int ssize_t;
 // END fwrite-hack
 
 #include <memory>
+#include <stdint.h>
 #include "Endian.hh"
 #include "TreeGram.hh"
 #include "misc/str.hh"
 #include "def.hh"
 #include "TreeGramArpaReader.hh"
+#include "QuantizedTreeGram.hh"
 
 using namespace std;
 
 static std::string format_str("cis-binlm2\n");
 
+// The memory-mapped format. The magic string includes the format version
+// and differs from format_str in the first format_str.length() bytes.
+// Version 2 adds the search index, and is written only when there is one.
+static const char mapped_magic[] = "cis-binlm-mmap2\n";
+static const char mapped_magic_v1[] = "cis-binlm-mmap1\n";
+static const int32_t mapped_byte_order = 0x01020304;
+static const int64_t mapped_alignment = 64;
+
+struct MappedHeader {
+  char magic[16];
+  int32_t byte_order;
+  int32_t type;
+  int32_t order;
+  int32_t num_words;
+  int64_t num_nodes;
+  int64_t order_count_offset; // int32_t[order]
+  int64_t word_offset_offset; // int64_t[num_words + 1] from string_offset
+  int64_t string_offset; // Null-terminated words
+  int64_t node_offset; // Node[num_nodes]
+  int64_t file_size;
+  // Version 2
+  int64_t num_search_offsets;
+  int64_t search_offset_offset; // int32_t[num_search_offsets]
+  int64_t num_search_entries;
+  int64_t search_entry_offset; // SearchEntry[num_search_entries]
+};
+
+static const size_t mapped_header_size_v1 =
+  offsetof(MappedHeader, num_search_offsets);
+
+static int64_t
+mapped_align(int64_t offset, int64_t alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+TreeGram::~TreeGram()
+{
+  unmap();
+}
+
+void
+TreeGram::unmap()
+{
+  if (m_nodes.mapped())
+    m_nodes.clear();
+  clear_search_index();
+#ifndef _MSC_VER
+  if (m_map_data != NULL)
+    munmap(m_map_data, m_map_size);
+#endif
+  m_map_data = NULL;
+  m_map_size = 0;
+}
+
 void
 TreeGram::reserve_nodes(int nodes)
 {
+  unmap();
   m_nodes.clear();
   m_nodes.reserve(nodes);
   m_nodes.push_back(Node(0, -99, 0, -1));
@@ -158,6 +220,26 @@ TreeGram::binary_search(int word, int first, int last)
 }
 
 // Returns unigram if node_index < 0
+// Finds the word in entries[1...n] that are in Eytzinger order.
+static inline int
+eytzinger_search(int word, const TreeGram::SearchEntry *entries, int n)
+{
+  int k = 1;
+  while (k <= n) {
+#ifdef __GNUC__
+    __builtin_prefetch(entries + 16 * k);
+#endif
+    k = 2 * k + (entries[k].word < word);
+  }
+  // Undo the steps to the right after the last step to the left.
+  while (k & 1)
+    k >>= 1;
+  k >>= 1;
+  if (k == 0 || entries[k].word != word)
+    return -1;
+  return entries[k].node;
+}
+
 int
 TreeGram::find_child(int word, int node_index)
 {
@@ -181,9 +263,68 @@ TreeGram::find_child(int word, int node_index)
   if (first < 0 || last < 0)
     return -1;
 
+  if (node_index < m_num_search_offsets && m_search_offsets[node_index] >= 0)
+    return eytzinger_search(word, m_search_entries + m_search_offsets[node_index],
+                            last - first);
   return binary_search(word, first, last);
 }
 
+// Fills entries[1...n] in Eytzinger order with the children starting
+// from \a child.
+static void
+eytzinger_fill(TreeGram::SearchEntry *entries, int n, int k,
+               const TreeGram &gram, int &child)
+{
+  if (k > n)
+    return;
+  eytzinger_fill(entries, n, 2 * k, gram, child);
+  entries[k].word = gram.node(child).word;
+  entries[k].node = child;
+  child++;
+  eytzinger_fill(entries, n, 2 * k + 1, gram, child);
+}
+
+void
+TreeGram::build_search_index(int min_children)
+{
+  clear_search_index();
+  int num_unigrams = 0;
+  if (!m_order_count.empty())
+    num_unigrams = std::min(m_order_count[0], (int)m_nodes.size() - 1);
+  m_search_offsets_owned.assign(std::max(num_unigrams, 0), -1);
+  for (int i = 0; i < num_unigrams; i++) {
+    int first = m_nodes[i].child_index;
+    int last = m_nodes[i + 1].child_index;
+    if (first < 0 || last - first < min_children)
+      continue;
+    m_search_offsets_owned[i] = m_search_entries_owned.size();
+    m_search_entries_owned.resize(m_search_entries_owned.size() + last - first + 1);
+    SearchEntry *entries = &m_search_entries_owned[m_search_offsets_owned[i]];
+    entries[0].word = -1;
+    entries[0].node = -1;
+    eytzinger_fill(entries, last - first, 1, *this, first);
+  }
+  if (m_search_entries_owned.empty()) {
+    clear_search_index();
+    return;
+  }
+  m_search_offsets = &m_search_offsets_owned[0];
+  m_search_entries = &m_search_entries_owned[0];
+  m_num_search_offsets = num_unigrams;
+  m_num_search_entries = m_search_entries_owned.size();
+}
+
+void
+TreeGram::clear_search_index()
+{
+  m_search_offsets_owned.clear();
+  m_search_entries_owned.clear();
+  m_search_offsets = NULL;
+  m_search_entries = NULL;
+  m_num_search_offsets = 0;
+  m_num_search_entries = 0;
+}
+
 TreeGram::Iterator
 TreeGram::iterator(const Gram &gram)
 {
@@ -254,6 +395,8 @@ TreeGram::add_gram(const Gram &gram, float log_prob, float back_off, bool add_mi
   }
 
   check_order(gram, add_missing_unigrams);
+  if (m_num_search_offsets > 0)
+    clear_search_index();
 
   // Initialize new order count
   if (gram.size() > m_order_count.size()) {
@@ -398,13 +541,47 @@ TreeGram::read(FILE *file, bool binary)
     return;
   }
 
+  std::string line;
+  if (!str::read_string(line, format_str.length(), file)) {
+    fprintf(stderr, "TreeGram::read(): invalid file format\n");
+    throw ReadError();
+  }
+  read_binary_body(file, line);
+}
+
+NGram *
+TreeGram::read_binary(FILE *file)
+{
+  std::string line;
+  if (!str::read_string(line, format_str.length(), file)) {
+    fprintf(stderr, "TreeGram::read_binary(): invalid file format\n");
+    throw ReadError();
+  }
+  if (line == format_str
+      || line == std::string(mapped_magic, format_str.length()))
+  {
+    std::unique_ptr<TreeGram> gram(new TreeGram());
+    gram->read_binary_body(file, line);
+    return gram.release();
+  }
+  std::unique_ptr<QuantizedTreeGram> gram(new QuantizedTreeGram());
+  gram->read_body(file, line);
+  return gram.release();
+}
+
+// Reads a binary model when the first format_str.length() bytes, \a
+// header, have already been read.
+void
+TreeGram::read_binary_body(FILE *file, const std::string &header)
+{
   std::string line;
   int words;
-  bool ret;
 
-  // Read the header
-  ret = str::read_string(line, format_str.length(), file);
-  if (!ret || line != format_str) {
+  if (header == std::string(mapped_magic, format_str.length())) {
+    read_mapped(file);
+    return;
+  }
+  if (header != format_str) {
     fprintf(stderr, "TreeGram::read(): invalid file format\n");
     throw ReadError();
   }
@@ -469,6 +646,7 @@ TreeGram::read(FILE *file, bool binary)
   }
 
   // Read the nodes
+  unmap();
   m_nodes.clear();
   m_nodes.resize(number_of_nodes);
   size_t block_size = number_of_nodes * sizeof(TreeGram::Node);
@@ -483,6 +661,289 @@ TreeGram::read(FILE *file, bool binary)
     flip_endian();
 }
 
+void
+TreeGram::write_mapped(FILE *file)
+{
+  MappedHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, mapped_magic, sizeof(header.magic));
+  header.byte_order = mapped_byte_order;
+  header.type = m_type;
+  header.order = m_order;
+  header.num_words = num_words();
+  header.num_nodes = m_nodes.size();
+  size_t header_size = mapped_header_size_v1;
+  if (has_search_index()) {
+    header_size = sizeof(header);
+    header.num_search_offsets = m_num_search_offsets;
+    header.num_search_entries = m_num_search_entries;
+  }
+  else
+    memcpy(header.magic, mapped_magic_v1, sizeof(header.magic));
+
+  std::vector<int64_t> word_offsets(num_words() + 1, 0);
+  for (int i = 0; i < num_words(); i++)
+    word_offsets[i + 1] = word_offsets[i] + word(i).length() + 1;
+
+  int64_t offset = header_size;
+  header.order_count_offset = offset;
+  offset += m_order * sizeof(int32_t);
+  offset = mapped_align(offset, sizeof(int64_t));
+  header.word_offset_offset = offset;
+  offset += word_offsets.size() * sizeof(int64_t);
+  header.string_offset = offset;
+  offset += word_offsets.back();
+  offset = mapped_align(offset, mapped_alignment);
+  header.node_offset = offset;
+  offset += m_nodes.size() * sizeof(Node);
+  if (has_search_index()) {
+    header.search_offset_offset = offset;
+    offset += m_num_search_offsets * sizeof(int32_t);
+    offset = mapped_align(offset, mapped_alignment);
+    header.search_entry_offset = offset;
+    offset += m_num_search_entries * sizeof(SearchEntry);
+  }
+  header.file_size = offset;
+
+  // Writes zeros up to the given offset.
+  int64_t written = 0;
+  auto pad_to = [&](int64_t target) {
+    for (; written < target; written++)
+      fputc(0, file);
+  };
+
+  fwrite(&header, header_size, 1, file);
+  written += header_size;
+
+  pad_to(header.order_count_offset);
+  for (int i = 0; i < m_order; i++) {
+    int32_t count = m_order_count[i];
+    fwrite(&count, sizeof(count), 1, file);
+  }
+  written += m_order * sizeof(int32_t);
+
+  pad_to(header.word_offset_offset);
+  fwrite(&word_offsets[0], word_offsets.size() * sizeof(int64_t), 1, file);
+  written += word_offsets.size() * sizeof(int64_t);
+  for (int i = 0; i < num_words(); i++)
+    fwrite(word(i).c_str(), word(i).length() + 1, 1, file);
+  written += word_offsets.back();
+
+  pad_to(header.node_offset);
+  if (!m_nodes.empty())
+    fwrite(&m_nodes[0], m_nodes.size() * sizeof(Node), 1, file);
+  written += m_nodes.size() * sizeof(Node);
+
+  if (has_search_index()) {
+    pad_to(header.search_offset_offset);
+    fwrite(m_search_offsets, m_num_search_offsets * sizeof(int32_t), 1, file);
+    written += m_num_search_offsets * sizeof(int32_t);
+    pad_to(header.search_entry_offset);
+    fwrite(m_search_entries, m_num_search_entries * sizeof(SearchEntry), 1, file);
+  }
+
+  if (ferror(file)) {
+    fprintf(stderr, "TreeGram::write_mapped(): write error: %s\n",
+            strerror(errno));
+    throw runtime_error("TreeGram::write_mapped");
+  }
+}
+
+// Called by read() after the first format_str.length() bytes of the
+// header have been read.
+void
+TreeGram::read_mapped(FILE *file)
+{
+  MappedHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, mapped_magic, format_str.length());
+  size_t header_size = mapped_header_size_v1;
+  size_t header_left = header_size - format_str.length();
+  if (fread((char*)&header + format_str.length(), header_left, 1, file) != 1) {
+    fprintf(stderr, "TreeGram::read(): invalid file format\n");
+    throw ReadError();
+  }
+  if (memcmp(header.magic, mapped_magic, sizeof(header.magic)) == 0) {
+    header_size = sizeof(header);
+    if (fread((char*)&header + mapped_header_size_v1,
+              header_size - mapped_header_size_v1, 1, file) != 1)
+    {
+      fprintf(stderr, "TreeGram::read(): unexpected end of file\n");
+      throw ReadError();
+    }
+  }
+  else if (memcmp(header.magic, mapped_magic_v1, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "TreeGram::read(): invalid file format\n");
+    throw ReadError();
+  }
+  if (header.byte_order != mapped_byte_order) {
+    fprintf(stderr, "TreeGram::read(): "
+            "the model was written on a machine with different byte order\n");
+    throw ReadError();
+  }
+  if (header.type != BACKOFF && header.type != INTERPOLATED) {
+    fprintf(stderr, "TreeGram::read(): invalid type: %d\n", header.type);
+    throw ReadError();
+  }
+  if (header.order < 1 || header.num_words < 1 || header.num_nodes < 1
+      || header.num_nodes > INT32_MAX
+      || header.order_count_offset < (int64_t)header_size
+      || header.order_count_offset + header.order * (int64_t)sizeof(int32_t)
+      > header.file_size
+      || header.word_offset_offset < (int64_t)header_size
+      || header.word_offset_offset % sizeof(int64_t) != 0
+      || header.word_offset_offset
+      + (header.num_words + (int64_t)1) * (int64_t)sizeof(int64_t)
+      > header.file_size
+      || header.string_offset < (int64_t)header_size
+      || header.string_offset > header.file_size
+      || header.node_offset < (int64_t)header_size
+      || header.node_offset % mapped_alignment != 0
+      || header.node_offset + header.num_nodes * (int64_t)sizeof(Node)
+      > header.file_size
+      || header.num_search_offsets < 0
+      || header.num_search_offsets > header.num_nodes - 1
+      || header.num_search_entries < 0
+      || header.num_search_entries > INT32_MAX
+      || (header.num_search_offsets > 0
+          && (header.search_offset_offset < (int64_t)header_size
+              || header.search_offset_offset % sizeof(int32_t) != 0
+              || header.search_entry_offset < (int64_t)header_size
+              || header.search_offset_offset + header.num_search_offsets
+              * (int64_t)sizeof(int32_t) > header.file_size
+              || header.search_entry_offset % sizeof(SearchEntry) != 0
+              || header.search_entry_offset + header.num_search_entries
+              * (int64_t)sizeof(SearchEntry) > header.file_size)))
+  {
+    fprintf(stderr, "TreeGram::read(): invalid header\n");
+    throw ReadError();
+  }
+
+  unmap();
+
+  // Map the file if possible. Otherwise (e.g. a pipe) read it to memory.
+  const char *base = NULL;
+#ifndef _MSC_VER
+  struct stat st;
+  int fd = fileno(file);
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+      && st.st_size >= header.file_size)
+  {
+    void *data = mmap(NULL, header.file_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      if (memcmp(data, &header, header_size) == 0) {
+        m_map_data = data;
+        m_map_size = header.file_size;
+        base = (const char*)data;
+      }
+      else
+        munmap(data, header.file_size);
+    }
+  }
+#endif
+  std::vector<char> buffer;
+  if (base == NULL) {
+    buffer.resize(header.file_size);
+    memcpy(&buffer[0], &header, header_size);
+    if (fread(&buffer[header_size], header.file_size - header_size, 1,
+              file) != 1)
+    {
+      fprintf(stderr, "TreeGram::read(): unexpected end of file\n");
+      throw ReadError();
+    }
+    base = &buffer[0];
+  }
+
+  m_type = (Type)header.type;
+  m_order = header.order;
+
+  int64_t sum = 0;
+  const int32_t *order_counts =
+    (const int32_t*)(base + header.order_count_offset);
+  m_order_count.assign(order_counts, order_counts + m_order);
+  for (int i = 0; i < m_order; i++)
+    sum += m_order_count[i];
+  if (sum != header.num_nodes && sum + 1 != header.num_nodes) {
+    fprintf(stderr, "TreeGram::read(): "
+	    "the sum of order counts %ld does not match number of nodes %ld\n",
+	    (long)sum, (long)header.num_nodes);
+    unmap();
+    throw ReadError();
+  }
+
+  // Check the word table and the search index before using them
+  const int64_t *word_offsets =
+    (const int64_t*)(base + header.word_offset_offset);
+  const char *strings = base + header.string_offset;
+  const int64_t string_size = header.file_size - header.string_offset;
+  bool ok = true;
+  for (int i = 0; ok && i < header.num_words; i++)
+    ok = word_offsets[i] >= 0 && word_offsets[i + 1] > word_offsets[i]
+      && word_offsets[i + 1] <= string_size
+      && strings[word_offsets[i + 1] - 1] == '\0';
+  if (!ok) {
+    fprintf(stderr, "TreeGram::read(): invalid vocabulary\n");
+    unmap();
+    throw ReadError();
+  }
+
+  const Node *file_nodes = (const Node*)(base + header.node_offset);
+  const int32_t *search_offsets =
+    (const int32_t*)(base + header.search_offset_offset);
+  const SearchEntry *search_entries =
+    (const SearchEntry*)(base + header.search_entry_offset);
+  for (int64_t i = 0; ok && i < header.num_search_offsets; i++) {
+    if (search_offsets[i] == -1)
+      continue;
+    int first = file_nodes[i].child_index;
+    int last = file_nodes[i + 1].child_index;
+    ok = search_offsets[i] >= 0 && first >= 0 && last >= first
+      && last <= header.num_nodes
+      && search_offsets[i] + (int64_t)(last - first)
+      < header.num_search_entries;
+  }
+  for (int64_t i = 0; ok && i < header.num_search_entries; i++)
+    ok = search_entries[i].node >= -1
+      && search_entries[i].node < header.num_nodes;
+  if (!ok) {
+    fprintf(stderr, "TreeGram::read(): invalid search index\n");
+    unmap();
+    throw ReadError();
+  }
+
+  clear_words();
+  for (int i = 0; i < header.num_words; i++)
+    add_word(std::string(strings + word_offsets[i]));
+
+  Node *nodes = (Node*)(base + header.node_offset);
+  if (m_map_data != NULL) {
+    m_nodes.map(nodes, header.num_nodes);
+  }
+  else {
+    m_nodes.clear();
+    m_nodes.resize(header.num_nodes);
+    memcpy(&m_nodes[0], nodes, header.num_nodes * sizeof(Node));
+  }
+
+  if (header.num_search_offsets > 0) {
+    if (m_map_data != NULL) {
+      m_search_offsets = search_offsets;
+      m_search_entries = search_entries;
+    }
+    else {
+      m_search_offsets_owned.assign(search_offsets,
+                                    search_offsets + header.num_search_offsets);
+      m_search_entries_owned.assign(search_entries,
+                                    search_entries + header.num_search_entries);
+      m_search_offsets = &m_search_offsets_owned[0];
+      m_search_entries = &m_search_entries_owned[0];
+    }
+    m_num_search_offsets = header.num_search_offsets;
+    m_num_search_entries = header.num_search_entries;
+  }
+}
+
 void 
 TreeGram::flip_endian() 
 {
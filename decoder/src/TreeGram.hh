@@ -3,6 +3,7 @@
 #define TREEGRAM_HH
 
 #include <cstddef>  // NULL
+#include <stdint.h>
 #include "NGram.hh"
 
 class TreeGram : public NGram {
@@ -18,11 +19,56 @@ public:
     int child_index;
   };
 
+  /// \brief Child of a unigram in the search index.
+  struct SearchEntry {
+    int32_t word;
+    int32_t node;
+  };
+
   struct ReadError : public std::exception {
     virtual const char *what() const throw()
       { return "TreeGram: read error"; }
   };
 
+  /// \brief Node storage that is either owned or mapped from a file.
+  ///
+  /// Mapped nodes are copied to the heap before the first operation that
+  /// changes the size. The mapping itself is private, so writing to a node
+  /// in place copies only the page that contains it.
+  ///
+  class NodeVector {
+  public:
+    NodeVector() : m_data(NULL), m_size(0), m_mapped(false) {}
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    bool mapped() const { return m_mapped; }
+    Node &operator[](size_t i) { return m_data[i]; }
+    const Node &operator[](size_t i) const { return m_data[i]; }
+    Node &back() { return m_data[m_size - 1]; }
+    void push_back(const Node &node)
+    { own(); m_owned.push_back(node); update(); }
+    void resize(size_t size) { own(); m_owned.resize(size); update(); }
+    void reserve(size_t size) { own(); m_owned.reserve(size); update(); }
+    void clear() { m_mapped = false; m_owned.clear(); update(); }
+    void map(Node *data, size_t size)
+    { m_owned.clear(); m_data = data; m_size = size; m_mapped = true; }
+  private:
+    void own()
+    {
+      if (m_mapped) {
+        m_owned.assign(m_data, m_data + m_size);
+        m_mapped = false;
+      }
+    }
+    void update()
+    { m_data = m_owned.empty() ? NULL : &m_owned[0]; m_size = m_owned.size(); }
+
+    std::vector<Node> m_owned;
+    Node *m_data;
+    size_t m_size;
+    bool m_mapped;
+  };
+
   class Iterator {
   public:
     Iterator(TreeGram *gram = NULL);
@@ -57,6 +103,11 @@ public:
     std::vector<int> m_index_stack;
   };
 
+  TreeGram() : m_map_data(NULL), m_map_size(0), m_search_offsets(NULL),
+               m_search_entries(NULL), m_num_search_offsets(0),
+               m_num_search_entries(0) {}
+  ~TreeGram();
+
   void reserve_nodes(int nodes); 
 
   /// \brief Adds a new gram to the language model.
@@ -68,6 +119,11 @@ public:
 
   /// \brief Reads a language model file.
   ///
+  /// A binary file may be either in the stream format written by write() or
+  /// in the memory-mapped format written by write_mapped(). The latter is
+  /// detected from the header and mapped to memory directly if \a file is
+  /// a regular file.
+  ///
   /// \param binary If false, the file is expected to be in ARPA file format.
   ///
   void read(FILE *file, bool binary=false);
@@ -75,6 +131,40 @@ public:
   void write(FILE *file, bool binary=false);
   void write_real(FILE *file, bool reflip);
 
+  /// \brief Reads a binary model in any of the binary formats.
+  ///
+  /// \return A QuantizedTreeGram if the model is quantized, otherwise a
+  /// TreeGram. The caller owns the model.
+  ///
+  static NGram *read_binary(FILE *file);
+
+  /// \brief Writes the model in a format that read() can map to memory.
+  ///
+  /// The file contains a fixed header, the counts of each order, the
+  /// vocabulary as a table of string offsets followed by the strings, and
+  /// the nodes aligned to a cache line. Several processes that read the same
+  /// file share the nodes through the page cache. The file is in the byte
+  /// order of the machine that wrote it, and is rejected elsewhere.
+  ///
+  void write_mapped(FILE *file);
+
+  /// \brief True if the nodes are mapped from a file.
+  bool mapped() const { return m_nodes.mapped(); }
+
+  /// \brief Builds a search index for the unigrams with at least \a
+  /// min_children children.
+  ///
+  /// The children of each such unigram are copied in Eytzinger
+  /// (breadth-first) order, so that the first steps of a lookup hit the
+  /// same few cache lines. The nodes themselves and the iteration order do
+  /// not change. The index is stored by write_mapped(), and discarded when
+  /// grams are added.
+  ///
+  void build_search_index(int min_children);
+
+  /// \brief True if the model has a search index.
+  bool has_search_index() const { return m_num_search_offsets > 0; }
+
   float log_prob_bo(const Gram &gram); // Keep this version lean and mean
   float log_prob_bo_cl(const Gram &gram); // Clustered backoff
   float log_prob_i(const Gram &gram); // Interpolated
@@ -130,6 +220,9 @@ public:
 
   int gram_count(int order) { return m_order_count.at(order-1); }
 
+  int num_nodes() const { return m_nodes.size(); }
+  const Node &node(int index) const { return m_nodes[index]; }
+
   /* Don't use this function, unles you really need to*/
   int find_child(int word, int node_index);
 
@@ -161,15 +254,35 @@ public:
   void convert_to_backoff();
 
 private:
+  TreeGram(const TreeGram&);
+  TreeGram &operator=(const TreeGram&);
+
   int binary_search(int word, int first, int last);
+  void clear_search_index();
   void print_gram(FILE *file, const Gram &gram);
   void find_path(const Gram &gram);
   void check_order(const Gram &gram, bool add_missing_unigrams=false);
   void flip_endian();
   void fetch_gram(const Gram &gram, int first);
+  void read_binary_body(FILE *file, const std::string &header);
+  void read_mapped(FILE *file);
+  void unmap();
 
   std::vector<int> m_order_count;	// number of grams in each order
-  std::vector<Node> m_nodes;		// storage for the nodes
+  NodeVector m_nodes;			// storage for the nodes
+  void *m_map_data;			// the mapped file, or NULL
+  size_t m_map_size;
+
+  // Search index of the unigrams. The children of unigram i are in
+  // m_search_entries[m_search_offsets[i] + 1 ...] in Eytzinger order, or
+  // m_search_offsets[i] is -1. Either owned or mapped from the file.
+  std::vector<int32_t> m_search_offsets_owned;
+  std::vector<SearchEntry> m_search_entries_owned;
+  const int32_t *m_search_offsets;
+  const SearchEntry *m_search_entries;
+  int m_num_search_offsets;
+  size_t m_num_search_entries;
+
   std::vector<int> m_fetch_stack;	// indices of the gram requested
   //int m_last_order;			// order of the last hit
 
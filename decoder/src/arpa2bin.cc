@@ -2,14 +2,50 @@
 
 #include "TreeGram.hh"
 #include "TreeGramArpaReader.hh"
+#include "QuantizedTreeGram.hh"
+#include "misc/conf.hh"
 
 int main(int argc, char *argv[]) 
 {
+  conf::Config config;
+  config("usage: arpa2bin [OPTION...] < ARPA > BIN\n")
+    ('h', "help", "", "", "display help")
+    ('m', "mmap", "", "", "write the format that can be mapped to memory")
+    ('q', "quantize=BITS", "arg", "", "quantize probabilities to BITS bits "
+     "(1-16) and pack the nodes")
+    ('e', "eytzinger=MIN", "arg", "", "with --mmap, store the children of the "
+     "unigrams with at least MIN children in a cache-friendly search order")
+    ;
+  config.default_parse(argc, argv);
+  if (config.arguments.size() != 0)
+    config.print_help(stderr, 1);
+  if (config["mmap"].specified && config["quantize"].specified) {
+    fprintf(stderr, "options --mmap and --quantize not allowed together\n");
+    exit(1);
+  }
+  if (config["eytzinger"].specified && !config["mmap"].specified) {
+    fprintf(stderr, "option --eytzinger requires --mmap\n");
+    exit(1);
+  }
+
   TreeGramArpaReader reader;
   TreeGram gram;
 
   fputs("reading arpa from stdin, writing binary to stdout\n", stderr);
 
   reader.read(stdin, &gram);
-  gram.write(stdout, true);
+  if (config["mmap"].specified) {
+    if (config["eytzinger"].specified)
+      gram.build_search_index(config["eytzinger"].get_int());
+    gram.write_mapped(stdout);
+  }
+  else if (config["quantize"].specified) {
+    QuantizedTreeGram quantized;
+    quantized.quantize(gram, config["quantize"].get_int());
+    fprintf(stderr, "quantized %d nodes to %ld bytes\n",
+            gram.num_nodes(), (long)quantized.memory_size());
+    quantized.write(stdout, true);
+  }
+  else
+    gram.write(stdout, true);
 }
@@ -0,0 +1,28 @@
+#include <stdio.h>
+
+#include "Fst.hh"
+#include "misc/conf.hh"
+
+int main(int argc, char *argv[]) 
+{
+  conf::Config config;
+  config("usage: fst2bin [OPTION...] FST BINFST\n")
+    ('h', "help", "", "", "display help")
+    ;
+  config.default_parse(argc, argv);
+  if (config.arguments.size() != 2)
+    config.print_help(stderr, 1);
+
+  try {
+    Fst fst;
+    fst.read(config.arguments[0]);
+    fst.write_binary(config.arguments[1]);
+    fprintf(stderr, "wrote %ld nodes, %ld arcs and %ld symbols\n",
+            (long)fst.nodes.size(), (long)fst.arcs.size(),
+            (long)fst.symbols.size());
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    exit(1);
+  }
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "InterTreeGram.hh"
+#include "TreeGram.hh"
+#include "QuantizedTreeGram.hh"
+#include "misc/conf.hh"
+#include "misc/str.hh"
+
+int main(int argc, char *argv[]) 
+{
+  conf::Config config;
+  config("usage: lminterpolate [OPTION...] ARPA... > BIN\n")
+    ('h', "help", "", "", "display help")
+    ('w', "weights=LIST", "arg must", "", "comma-separated interpolation weights")
+    ('a', "arpa", "", "", "write the model in ARPA format")
+    ('m', "mmap", "", "", "write the format that can be mapped to memory")
+    ('q', "quantize=BITS", "arg", "", "quantize probabilities to BITS bits "
+     "(1-16) and pack the nodes")
+    ;
+  config.default_parse(argc, argv);
+  if (config.arguments.size() < 1)
+    config.print_help(stderr, 1);
+  if ((config["arpa"].specified + config["mmap"].specified +
+       config["quantize"].specified) > 1) {
+    fprintf(stderr, "options --arpa, --mmap and --quantize not allowed together\n");
+    exit(1);
+  }
+
+  std::vector<std::string> fields =
+    str::split(config["weights"].get_str(), ",", false);
+  std::vector<float> weights;
+  for (int i = 0; i < fields.size(); i++)
+    weights.push_back(atof(fields[i].c_str()));
+
+  fputs("reading arpa models, writing the interpolated model to stdout\n", stderr);
+  InterTreeGram inter(config.arguments, weights);
+  TreeGram *gram = inter.merge();
+  fprintf(stderr, "merged model has %d nodes\n", gram->num_nodes());
+
+  if (config["arpa"].specified)
+    gram->write(stdout, false);
+  else if (config["mmap"].specified)
+    gram->write_mapped(stdout);
+  else if (config["quantize"].specified) {
+    QuantizedTreeGram quantized;
+    quantized.quantize(*gram, config["quantize"].get_int());
+    quantized.write(stdout, true);
+  }
+  else
+    gram->write(stdout, true);
+  delete gram;
+}
@@ -0,0 +1,104 @@
+// Compares the perplexity of an n-gram model and its quantized version.
+#include <math.h>
+#include <stdio.h>
+
+#include "TreeGram.hh"
+#include "TreeGramArpaReader.hh"
+#include "QuantizedTreeGram.hh"
+#include "misc/conf.hh"
+#include "misc/io.hh"
+#include "misc/str.hh"
+
+conf::Config config;
+
+// Log10 probability of the next word, skipping words not in the model.
+struct Perplexity {
+  Perplexity() : log_prob(0), words(0) {}
+  void add(NGram &lm, const NGram::Gram &gram)
+  {
+    log_prob += lm.log_prob(gram);
+    words++;
+  }
+  double value() const { return pow(10, -log_prob / words); }
+  double log_prob;
+  long words;
+};
+
+int
+main(int argc, char *argv[])
+{
+  try {
+    config("usage: quantppl [OPTION...] MODEL < TEXT\n"
+           "Computes the perplexity of TEXT with MODEL and with MODEL "
+           "quantized.\n")
+      ('h', "help", "", "", "display help")
+      ('a', "arpa", "", "", "MODEL is in ARPA format")
+      ('b', "bits=BITS", "arg", "8", "bits in the quantized probabilities")
+      ('s', "sentences", "", "", "add <s> and </s> around each line")
+      ;
+    config.default_parse(argc, argv);
+    if (config.arguments.size() != 1)
+      config.print_help(stderr, 1);
+
+    TreeGram gram;
+    {
+      io::Stream in(config.arguments[0], "r");
+      if (config["arpa"].specified) {
+        TreeGramArpaReader reader;
+        reader.read(in.file, &gram);
+      }
+      else
+        gram.read(in.file, true);
+    }
+
+    QuantizedTreeGram quantized;
+    quantized.quantize(gram, config["bits"].get_int());
+
+    Perplexity original, approximate;
+    long oov = 0;
+    bool sentences = config["sentences"].specified;
+    std::string line;
+    while (str::read_line(line, stdin, true)) {
+      std::vector<std::string> words = str::split(line, " \t", true);
+      if (sentences) {
+        words.insert(words.begin(), "<s>");
+        words.push_back("</s>");
+      }
+      NGram::Gram context;
+      for (int i = 0; i < (int)words.size(); i++) {
+        int word = gram.word_index(words[i]);
+        if (word == 0) {
+          // Restart the context after an OOV word.
+          oov++;
+          context.clear();
+          continue;
+        }
+        if ((int)context.size() >= gram.order())
+          context.pop_front();
+        context.push_back(word);
+        if (sentences && i == 0)
+          continue; // <s> is not predicted
+        original.add(gram, context);
+        approximate.add(quantized, context);
+      }
+    }
+
+    if (original.words == 0) {
+      fprintf(stderr, "no words to score\n");
+      exit(1);
+    }
+    printf("words: %ld (%ld OOVs skipped)\n", original.words, oov);
+    printf("nodes: %ld bytes, quantized: %ld bytes (%.2fx)\n",
+           (long)gram.num_nodes() * (long)sizeof(TreeGram::Node),
+           (long)quantized.memory_size(),
+           (double)gram.num_nodes() * sizeof(TreeGram::Node)
+           / quantized.memory_size());
+    printf("perplexity: %.4f, quantized: %.4f (%+.3f%%)\n",
+           original.value(), approximate.value(),
+           100 * (approximate.value() / original.value() - 1));
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "exception: %s\n", e.what());
+    exit(1);
+  }
+}
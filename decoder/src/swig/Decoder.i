@@ -99,11 +99,18 @@ public:
 
   const std::vector<Hmm> &hmms();
   void lex_read(const char *file);
+  void lex_snapshot_write(const char *file);
+  void lex_snapshot_read(const char *file);
   const std::string &lex_word();
   const std::string &lex_phone();
 
+  void interpolated_ngram_read(const std::vector<std::string>, const std::vector<float>, int quantization_bits, bool merge);
+  void interpolated_ngram_read(const std::vector<std::string>, const std::vector<float>, int quantization_bits);
   void interpolated_ngram_read(const std::vector<std::string>, const std::vector<float>);
+  void interpolated_lookahead_ngram_read(const std::vector<std::string>, const std::vector<float>, int quantization_bits, bool merge);
+  void interpolated_lookahead_ngram_read(const std::vector<std::string>, const std::vector<float>, int quantization_bits);
   void interpolated_lookahead_ngram_read(const std::vector<std::string>, const std::vector<float>);
+  void share_lookahead_ngram(Toolbox &other);
 
   int ngram_read(const char *file, const bool binary, const bool quiet);
   int ngram_read(const char *file, const bool binary);
@@ -165,6 +172,8 @@ public:
   void set_generate_word_graph(bool value);
   void set_use_word_pair_approximation(bool value);
   void set_use_lm_cache(bool value);
+  void set_batch_lm_scores(bool value);
+  void set_num_threads(int num_threads);
   void set_require_sentence_end(bool s);
   void set_remove_pronunciation_id(bool remove);
 
@@ -174,6 +183,7 @@ public:
 
   void write_word_history(const std::string &file_name);
   void print_lm_history();
+  void print_memory_statistics();
 
   void print_tp_lex_node(int node);
   void print_tp_lex_lookahead(int node);
@@ -0,0 +1,166 @@
+// Round-trip test of the lexicon network snapshots.
+//
+// Usage: test_lexsnapshot HMMFILE LEXFILE SNAPSHOT [LOOKAHEAD [CROSSWORD]]
+//
+// Builds the network from the lexicon, writes a snapshot, reads it into
+// another network and compares the networks and the vocabularies. Also
+// checks that a truncated snapshot is rejected.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <deque>
+#include <vector>
+
+#include "NowayHmmReader.hh"
+#include "TPNowayLexReader.hh"
+#include "TPLexPrefixTree.hh"
+
+static int errors = 0;
+
+static void
+error(const char *what, int node_id)
+{
+  fprintf(stderr, "mismatch in %s of node %d\n", what, node_id);
+  errors++;
+}
+
+// Walks both networks from the start node and compares the nodes and arcs.
+static void
+compare_networks(TPLexPrefixTree &a, TPLexPrefixTree &b)
+{
+  if (a.start_node()->node_id != b.start_node()->node_id ||
+      a.root()->node_id != b.root()->node_id)
+  {
+    error("start or root", a.start_node()->node_id);
+    return;
+  }
+
+  std::vector<bool> visited;
+  std::deque<int> queue;
+  queue.push_back(a.start_node()->node_id);
+  while (!queue.empty()) {
+    int id = queue.front();
+    queue.pop_front();
+    if (id >= (int)visited.size())
+      visited.resize(id + 1, false);
+    if (visited[id])
+      continue;
+    visited[id] = true;
+
+    TPLexPrefixTree::Node *x = a.node(id);
+    TPLexPrefixTree::Node *y = b.node(id);
+    if (x->node_id != y->node_id)
+      error("node_id", id);
+    if (x->state != y->state)
+      error("state", id);
+    if (x->word_id != y->word_id)
+      error("word_id", id);
+    if (x->flags != y->flags)
+      error("flags", id);
+    if (x->possible_word_id_list != y->possible_word_id_list)
+      error("possible_word_id_list", id);
+    if (!y->arcs.empty())
+      error("arcs (not frozen)", id);
+    if (x->arc_end - x->arc_begin != y->arc_end - y->arc_begin) {
+      error("number of arcs", id);
+      continue;
+    }
+
+    const TPLexPrefixTree::FrozenArc *p = a.arcs_begin(x);
+    const TPLexPrefixTree::FrozenArc *q = b.arcs_begin(y);
+    for (; p != a.arcs_end(x); p++, q++) {
+      if (p->next != q->next || p->log_prob != q->log_prob)
+        error("arc", id);
+      queue.push_back(p->next);
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 4) {
+    fprintf(stderr, "usage: test_lexsnapshot HMMFILE LEXFILE SNAPSHOT "
+            "[LOOKAHEAD [CROSSWORD]]\n");
+    exit(1);
+  }
+  const std::string snapshot = argv[3];
+  const int lm_lookahead = argc > 4 ? atoi(argv[4]) : 0;
+  const bool cross_word = argc > 5 ? atoi(argv[5]) != 0 : false;
+
+  try {
+    NowayHmmReader hmm_reader;
+    std::ifstream hmm_in(argv[1]);
+    if (!hmm_in) {
+      fprintf(stderr, "could not open %s\n", argv[1]);
+      exit(1);
+    }
+    hmm_reader.read(hmm_in);
+    std::map<std::string,int> &hmm_map = hmm_reader.hmm_map();
+    std::vector<Hmm> &hmms = hmm_reader.hmms();
+
+    TPLexPrefixTree built(hmm_map, hmms);
+    built.set_lm_lookahead(lm_lookahead);
+    built.set_cross_word_triphones(cross_word);
+    Vocabulary built_vocab;
+    TPNowayLexReader lex_reader(hmm_map, hmms, built, built_vocab);
+    FILE *lex_file = fopen(argv[2], "r");
+    if (lex_file == NULL) {
+      fprintf(stderr, "could not open %s\n", argv[2]);
+      exit(1);
+    }
+    lex_reader.read(lex_file, "_");
+    fclose(lex_file);
+    built.write_snapshot(snapshot, built_vocab);
+
+    // The settings and the vocabulary come from the snapshot
+    TPLexPrefixTree loaded(hmm_map, hmms);
+    Vocabulary loaded_vocab;
+    loaded_vocab.add_word("overwritten");
+    loaded.read_snapshot(snapshot, loaded_vocab);
+
+    if (!loaded.frozen())
+      error("frozen", 0);
+    if (loaded.words() != built.words())
+      error("words", 0);
+    if (loaded_vocab.num_words() != built_vocab.num_words())
+      error("vocabulary size", 0);
+    else {
+      for (int i = 0; i < built_vocab.num_words(); i++)
+        if (loaded_vocab.word(i) != built_vocab.word(i))
+          error("vocabulary", i);
+    }
+    compare_networks(built, loaded);
+
+    // A truncated snapshot must be rejected before it is mapped
+    std::string truncated = snapshot + ".truncated";
+    {
+      std::ifstream in(snapshot.c_str(), std::ios::binary);
+      std::vector<char> data((std::istreambuf_iterator<char>(in)),
+                             std::istreambuf_iterator<char>());
+      FILE *out = fopen(truncated.c_str(), "wb");
+      fwrite(&data[0], data.size() - 8, 1, out);
+      fclose(out);
+    }
+    try {
+      TPLexPrefixTree rejected(hmm_map, hmms);
+      Vocabulary rejected_vocab;
+      rejected.read_snapshot(truncated, rejected_vocab);
+      error("truncated snapshot accepted", 0);
+    }
+    catch (TPLexPrefixTree::SnapshotError &e) {
+    }
+    remove(truncated.c_str());
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    exit(1);
+  }
+
+  if (errors > 0) {
+    fprintf(stderr, "%d errors\n", errors);
+    exit(1);
+  }
+  printf("test successful\n");
+}
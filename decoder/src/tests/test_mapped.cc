@@ -0,0 +1,130 @@
+// Checks that a TreeGram written by write_mapped() with a search index
+// gives the same probabilities as the model read from the ARPA file.
+//
+// Usage: test_mapped ARPAFILE MAPPEDFILE [MIN_CHILDREN]
+//
+// MAPPEDFILE is overwritten. MIN_CHILDREN is passed to
+// build_search_index() (default 1, i.e. every unigram with children).
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "TreeGram.hh"
+#include "TreeGramArpaReader.hh"
+
+static int errors = 0;
+
+static void
+check_gram(TreeGram &a, TreeGram &b, const TreeGram::Gram &gram)
+{
+  float p = a.log_prob(gram);
+  float q = b.log_prob(gram);
+  if (p != q) {
+    fprintf(stderr, "log_prob differs:");
+    for (int i = 0; i < (int)gram.size(); i++)
+      fprintf(stderr, " %s", a.word(gram[i]).c_str());
+    fprintf(stderr, ": %g %g\n", p, q);
+    errors++;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: test_mapped ARPAFILE MAPPEDFILE "
+            "[MIN_CHILDREN]\n");
+    exit(1);
+  }
+  const int min_children = argc > 3 ? atoi(argv[3]) : 1;
+
+  try {
+    TreeGram arpa;
+    TreeGramArpaReader reader;
+    FILE *file = fopen(argv[1], "r");
+    if (file == NULL) {
+      fprintf(stderr, "could not open %s\n", argv[1]);
+      exit(1);
+    }
+    reader.read(file, &arpa);
+    fclose(file);
+
+    // Write the mapped model with the search index from a copy, so that
+    // the reference lookups do not use the index.
+    bool has_search_index;
+    {
+      TreeGram indexed;
+      file = fopen(argv[1], "r");
+      reader.read(file, &indexed);
+      fclose(file);
+      indexed.build_search_index(min_children);
+      has_search_index = indexed.has_search_index();
+      file = fopen(argv[2], "wb");
+      if (file == NULL) {
+        fprintf(stderr, "could not open %s\n", argv[2]);
+        exit(1);
+      }
+      indexed.write_mapped(file);
+      fclose(file);
+    }
+
+    TreeGram mapped;
+    file = fopen(argv[2], "rb");
+    mapped.read(file, true);
+    fclose(file);
+    if (!mapped.mapped() || mapped.has_search_index() != has_search_index) {
+      fprintf(stderr, "the model was not mapped with the search index\n");
+      errors++;
+    }
+
+    if (mapped.num_words() != arpa.num_words() ||
+        mapped.order() != arpa.order())
+    {
+      fprintf(stderr, "vocabulary size or order differs\n");
+      exit(1);
+    }
+    for (int i = 0; i < arpa.num_words(); i++)
+      if (mapped.word(i) != arpa.word(i)) {
+        fprintf(stderr, "word %d differs\n", i);
+        errors++;
+      }
+
+    // Every gram of the model, in the same order in both
+    TreeGram::Iterator it(&arpa);
+    TreeGram::Iterator mapped_it(&mapped);
+    while (it.next()) {
+      if (!mapped_it.next() || mapped_it.order() != it.order() ||
+          mapped_it.node().word != it.node().word ||
+          mapped_it.node().log_prob != it.node().log_prob ||
+          mapped_it.node().back_off != it.node().back_off)
+      {
+        fprintf(stderr, "the nodes differ\n");
+        exit(1);
+      }
+      TreeGram::Gram gram;
+      for (int i = 1; i <= it.order(); i++)
+        gram.push_back(it.node(i).word);
+      check_gram(arpa, mapped, gram);
+    }
+
+    // Random grams, most of them backing off
+    srand48(1);
+    for (int t = 0; t < 100000; t++) {
+      TreeGram::Gram gram(1 + lrand48() % arpa.order());
+      for (int i = 0; i < (int)gram.size(); i++)
+        gram[i] = lrand48() % arpa.num_words();
+      check_gram(arpa, mapped, gram);
+    }
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    exit(1);
+  }
+
+  if (errors > 0) {
+    fprintf(stderr, "%d errors\n", errors);
+    exit(1);
+  }
+  printf("test successful\n");
+}
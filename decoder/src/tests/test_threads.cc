@@ -0,0 +1,118 @@
+// Checks that the token pass search gives the same result with any number
+// of threads.
+//
+// Usage: test_threads HMMFILE LEXFILE LMFILE LNAFILE THREADS [LOOKAHEAD]
+//
+// Decodes the LNA file once with one thread and once with THREADS
+// threads, and compares the best hypotheses, their log probabilities and
+// the word graphs. The LM is read in ARPA format and also used for the
+// lookahead.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "Toolbox.hh"
+
+struct Result {
+  std::string hypothesis;
+  std::string log_probs;
+  std::string word_graph;
+};
+
+static std::string
+read_file(const std::string &file_name)
+{
+  std::ifstream in(file_name.c_str());
+  std::ostringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+static Result
+decode(char *argv[], int num_threads, int lm_lookahead)
+{
+  Toolbox t(argv[1], NULL);
+  t.set_optional_short_silence(1);
+  t.set_cross_word_triphones(1);
+  t.set_require_sentence_end(1);
+  t.set_silence_is_word(0);
+  t.set_lm_lookahead(lm_lookahead);
+  t.set_lm_scale(10);
+  t.lex_read(argv[2]);
+  t.set_sentence_boundary("<s>", "</s>");
+  t.ngram_read(argv[3], false, true);
+  if (lm_lookahead)
+    t.read_lookahead_ngram("", false, true);
+  t.set_global_beam(250);
+  t.set_word_end_beam(200);
+  t.set_token_limit(3000);
+  t.set_prune_similar(3);
+  t.set_generate_word_graph(1);
+  t.set_num_threads(num_threads);
+
+  t.lna_open(argv[4], 1024);
+  t.reset(0);
+  t.set_end(-1);
+  while (t.run());
+
+  Result result;
+  result.hypothesis = t.best_hypo_string(false, false);
+  char buf[256];
+  sprintf(buf, "total %.4f am %.4f lm %.4f",
+          t.tp_search().get_total_log_prob(false),
+          t.tp_search().get_am_log_prob(false),
+          t.tp_search().get_lm_log_prob(false));
+  result.log_probs = buf;
+
+  std::string word_graph_file = "test_threads.wg";
+  t.write_word_graph(word_graph_file);
+  result.word_graph = read_file(word_graph_file);
+  remove(word_graph_file.c_str());
+  t.lna_close();
+  return result;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 6) {
+    fprintf(stderr, "usage: test_threads HMMFILE LEXFILE LMFILE LNAFILE "
+            "THREADS [LOOKAHEAD]\n");
+    exit(1);
+  }
+  const int num_threads = atoi(argv[5]);
+  const int lm_lookahead = argc > 6 ? atoi(argv[6]) : 1;
+
+  try {
+    Result serial = decode(argv, 1, lm_lookahead);
+    Result parallel = decode(argv, num_threads, lm_lookahead);
+
+    int errors = 0;
+    if (serial.hypothesis != parallel.hypothesis) {
+      fprintf(stderr, "hypotheses differ:\n  1: %s\n  %d: %s\n",
+              serial.hypothesis.c_str(), num_threads,
+              parallel.hypothesis.c_str());
+      errors++;
+    }
+    if (serial.log_probs != parallel.log_probs) {
+      fprintf(stderr, "log probabilities differ:\n  1: %s\n  %d: %s\n",
+              serial.log_probs.c_str(), num_threads,
+              parallel.log_probs.c_str());
+      errors++;
+    }
+    if (serial.word_graph.empty() || serial.word_graph != parallel.word_graph) {
+      fprintf(stderr, "word graphs differ\n");
+      errors++;
+    }
+    if (errors > 0)
+      exit(1);
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    exit(1);
+  }
+  printf("test successful\n");
+}
@@ -14,17 +14,19 @@ Lattice::Node& // private
 Rescore::find_or_create_node(int node_id, Context &context)
 {
   // Check if the context is defined already
-  for (int c = 0; c < (int)m_node_contexts[node_id].size(); c++) {
-    Context &old_context = m_node_contexts[node_id][c];
-    if (old_context == context)
-      return m_rescored_lattice.node(old_context.node_id);
-  }
+  m_lookup_key.node_id = node_id;
+  m_lookup_key.words.assign(context.gram.begin(), context.gram.end());
+  std::unordered_map<ContextKey, int, ContextKeyHash>::const_iterator it =
+    m_context_index.find(m_lookup_key);
+  if (it != m_context_index.end())
+    return m_rescored_lattice.node(it->second);
 
   // Context not found, create a new node and context
   Lattice::Node &node = m_rescored_lattice.new_node();
   Context new_context = context;
   new_context.node_id = node.id;
   m_node_contexts[node_id].push_back(new_context);
+  m_context_index[m_lookup_key] = node.id;
   return node;
 }
 
@@ -71,7 +73,7 @@ Rescore::sort_nodes()
 }
 
 void
-Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
+Rescore::rescore(Lattice *src_lattice, const TreeGram *tree_gram, bool quiet)
 {
   m_src_lattice = src_lattice;
   m_tree_gram = tree_gram;
@@ -93,10 +95,15 @@ Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
     m_rescored_lattice.initial_node_id = node.id;
     m_node_contexts.clear();
     m_node_contexts.resize(src_lattice->num_nodes());
+    m_context_index.clear();
     Context context;
     context.gram.push_back(tree_gram->word_index(m_sentence_start_label));
     context.node_id = node.id;
     m_node_contexts[src_lattice->initial_node_id].push_back(context);
+    ContextKey key;
+    key.node_id = src_lattice->initial_node_id;
+    key.words.assign(context.gram.begin(), context.gram.end());
+    m_context_index[key] = node.id;
   }
 
   // Traverse source lattice in topological order
@@ -125,9 +132,9 @@ Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
 	if (arc.label != m_null_label) {
 	  int word_id = tree_gram->word_index(arc.label);
 	  tgt_context.gram.push_back(word_id);
-	  lm_log_prob = tree_gram->log_prob(tgt_context.gram);
+	  lm_log_prob = tree_gram->log_prob(tgt_context.gram, m_score_state);
 
-	  while (((int)tgt_context.gram.size() > tree_gram->last_history_length())
+	  while (((int)tgt_context.gram.size() > m_score_state.last_history_length)
 	          && (tgt_context.gram.size() > 0))
 	    tgt_context.gram.pop_front();
 	}
@@ -1,10 +1,13 @@
 #ifndef RESCORE_HH
 #define RESCORE_HH
 
+#include <unordered_map>
 #include "TreeGram.hh"
 #include "Lattice.hh"
 
-/** A class for expanding and rescoring lattices. */
+/** A class for expanding and rescoring lattices.  The language model is
+ * only read, so several threads can rescore with the same model, each
+ * with its own Rescore object. */
 class Rescore {
 public:
   /** Context structure for expanding lattices. */
@@ -18,13 +21,32 @@ public:
   Rescore();
 
   /** Expand and rescore the lattice with a language model. */
-  void rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet=false);
+  void rescore(Lattice *src_lattice, const TreeGram *tree_gram,
+               bool quiet=false);
 
   /** Get the rescored lattice. */
   Lattice &rescored_lattice() { return m_rescored_lattice; }
 
 private:
 
+  /** Key of the context index: source lattice node and LM context. */
+  struct ContextKey {
+    int node_id; //!< Node id in the source lattice
+    std::vector<int> words; //!< Words of the context gram
+    bool operator==(const ContextKey &k) const
+    { return node_id == k.node_id && words == k.words; } //!< Compare
+  };
+
+  /** Hash function for the context index. */
+  struct ContextKeyHash {
+    size_t operator()(const ContextKey &k) const {
+      size_t h = (size_t)k.node_id * 2654435761u;
+      for (int i = 0; i < (int)k.words.size(); i++)
+        h = (h ^ (size_t)k.words[i]) * 16777619u + (h >> 13);
+      return h;
+    }
+  };
+
   /** Sort nodes of the source lattice topologically. */
   void sort_nodes();
 
@@ -32,7 +54,8 @@ private:
       lattice if necessary, and return the corresponding node. */
   Lattice::Node &find_or_create_node(int node_id, Context &context);
 
-  TreeGram *m_tree_gram; //!< Language model used in rescoring
+  const TreeGram *m_tree_gram; //!< Language model used in rescoring
+  TreeGram::ScoreState m_score_state; //!< State for computing LM scores
   Lattice *m_src_lattice; //!< The lattice to be rescored
   Lattice m_rescored_lattice; //!< The result lattice of the rescoring
   std::string m_sentence_start_label; //!< Sentence start label in LM
@@ -45,6 +68,12 @@ private:
 
   //!< A vector containing a context vector for each source lattice node.
   std::vector<std::vector<Context> > m_node_contexts;
+
+  //!< Rescored lattice node ids of the contexts of the source nodes.
+  std::unordered_map<ContextKey, int, ContextKeyHash> m_context_index;
+
+  //!< Key used in the context index lookups.
+  ContextKey m_lookup_key;
 };
 
 
@@ -60,6 +60,16 @@ public:
 
   enum Type { BACKOFF=0, INTERPOLATED=1 };
 
+  // The state changed by log_prob().  The model itself is only read,
+  // so several threads can compute probabilities from the same model
+  // if each of them has its own state.
+  struct ScoreState {
+    ScoreState() : last_order(0), last_history_length(0) {}
+    std::vector<int> fetch_stack;	// indices of the gram requested
+    int last_order;			// order of the last hit
+    int last_history_length;		// see last_history_length()
+  };
+
   TreeGram();
   void set_type(Type type) { m_type = type; }
   Type get_type() { return(m_type); }
@@ -80,9 +90,10 @@ public:
   void fetch_trigram_list(int w1, int w2, std::vector<int> &next_word_id,
                           std::vector<float> &result_buffer);
   
-  float log_prob(const Gram &gram);
+  float log_prob(const Gram &gram) { return log_prob(gram, m_state); }
+  float log_prob(const Gram &gram, ScoreState &state) const;
   int order() { return m_order; }
-  int last_order() { return m_last_order; }
+  int last_order() { return m_state.last_order; }
 
   // The history length used in the last log_prob() call, used by
   // Rescore class.  Actually, it is not exactly the history length,
@@ -93,11 +104,11 @@ public:
   // * (a b c d) asked and (a b c d) found: length = 4
   // * (a b c d) asked and backoff (a b c) found: length = 3
   // * (a b c d) asked, (a b c) not found, (b c d) found: length 3
-  int last_history_length() { return m_last_history_length; }
+  int last_history_length() { return m_state.last_history_length; }
   int gram_count(int order) { return m_order_count.at(order-1); }
 
   /* Don't use this function, unles you really need to*/
-  int find_child(int word, int node_index);
+  int find_child(int word, int node_index) const;
 
   // Returns an iterator for given gram.
   Iterator iterator(const Gram &gram);
@@ -107,22 +118,20 @@ public:
 #endif
 
 private:
-  int binary_search(int word, int first, int last);
+  int binary_search(int word, int first, int last) const;
   void print_gram(FILE *file, const Gram &gram);
   void find_path(const Gram &gram);
   void check_order(const Gram &gram);
   void flip_endian();
-  void fetch_gram(const Gram &gram, int first);
+  void fetch_gram(const Gram &gram, int first,
+                  std::vector<int> &fetch_stack) const;
 
   Type m_type;
   int m_order;
   std::vector<int> m_order_count;	// number of grams in each order
   std::vector<float> m_interpolation;	// interpolation weights
   std::vector<Node> m_nodes;		// storage for the nodes
-  std::vector<int> m_fetch_stack;	// indices of the gram requested
-  int m_last_order;			// order of the last hit
-  int m_last_history_length;		// length of the history used in
-					// hit or backoff
+  ScoreState m_state;			// state of log_prob(gram)
 
   // For creating the model
   std::vector<int> m_insert_stack;	// indices of the last gram inserted
@@ -1,5 +1,10 @@
 #include <errno.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <mutex>
+#include <thread>
 #include "TreeGram.hh"
 #include "Lattice.hh"
 #include "Rescore.hh"
@@ -48,6 +53,45 @@ file_exists(std::string file)
   return true;
 }
 
+/** Rescore one lattice and write the result.  With several threads the
+ * progress is reported on one line after the lattice is done. */
+void
+rescore_lattice(const std::string &input_file, const std::string &output_file,
+                const TreeGram &tree_gram, Rescore &rescore,
+                Lattice &src_lattice, bool quiet, bool threaded)
+{
+  static std::mutex output_lock;
+
+  if (!quiet && !threaded)
+    fprintf(stderr, "processing %s...", input_file.c_str());
+  src_lattice.read(io::Stream(input_file, "r").file);
+  rescore.rescore(&src_lattice, &tree_gram, quiet || threaded);
+
+  if (!quiet && !threaded)
+    fprintf(stderr, "writing %s...", output_file.c_str());
+  rescore.rescored_lattice().write(io::Stream(output_file, "w").file);
+  if (!quiet) {
+    if (threaded) {
+      std::lock_guard<std::mutex> lock(output_lock);
+      fprintf(stderr, "processed %s, wrote %s\n", input_file.c_str(),
+              output_file.c_str());
+    }
+    else
+      fprintf(stderr, "\n");
+  }
+
+  if (config["post-process"].specified) {
+    std::string cmd = config["post-process"].get_str() + 
+      " \"" + output_file + "\"";
+    if (!quiet)
+      fprintf(stderr, "running post-processor: %s\n", cmd.c_str());
+    int ret = system(cmd.c_str());
+    if ((ret < 0) && !quiet) {
+      fprintf(stderr, "WARNING: command failed\n");
+    }
+  }
+}
+
 /** The good old main. */
 int
 main(int argc, char *argv[])
@@ -64,6 +108,7 @@ main(int argc, char *argv[])
     ('p', "post-process=FILE", "arg", "", 
      "run a post-processor for each output file")
     ('q', "quiet", "", "", "suppress all output on standard error")
+    ('T', "threads=INT", "arg", "1", "number of lattices rescored in parallel")
     ;
   config.parse(argc, argv);
   if (config["help"].specified) {
@@ -107,13 +152,22 @@ main(int argc, char *argv[])
     input_files = read_file_list(
       io::Stream(config["in-list"].get_str(), "r").file);
 
+  int num_threads = config["threads"].get_int();
+  if (num_threads < 1) {
+    if (!quiet)
+      fprintf(stderr, "ERROR: invalid number of threads\n");
+    exit(1);
+  }
+
   // Create output directory
   if (config["out-dir"].specified)
     mkdir(config["out-dir"].get_c_str(), 0777);
 
-  // Rescore lattices
-  Rescore rescore;
-  Lattice src_lattice;
+  // Find the lattices to rescore
+  std::vector<std::string> job_inputs;
+  std::vector<std::string> job_outputs;
+  std::set<std::string> scheduled_outputs;
+  bool unique_outputs = true;
   for (int i = 0; i < (int)input_files.size(); i++) {
     std::string output_file;
     if (config["out"].specified)
@@ -121,32 +175,53 @@ main(int argc, char *argv[])
     else if (config["out-dir"].specified)
       output_file = 
         config["out-dir"].get_str() + "/" + strip_dir(input_files[i]);
-    if (file_exists(output_file) && !config["force"].specified) {
+    bool scheduled = (scheduled_outputs.count(output_file) > 0);
+    if ((scheduled || file_exists(output_file)) &&
+        !config["force"].specified)
+    {
       if (!quiet)
         fprintf(stderr, "skipped existing file %s\n", output_file.c_str());
       continue;
     }
+    if (scheduled)
+      unique_outputs = false;
+    scheduled_outputs.insert(output_file);
+    job_inputs.push_back(input_files[i]);
+    job_outputs.push_back(output_file);
+  }
 
-    if (!quiet)
-      fprintf(stderr, "processing %s...", input_files[i].c_str());
-    src_lattice.read(io::Stream(input_files[i], "r").file);
-    rescore.rescore(&src_lattice, &tree_gram, quiet);
-
-    if (!quiet)
-      fprintf(stderr, "writing %s...", output_file.c_str());
-    rescore.rescored_lattice().write(io::Stream(output_file, "w").file);
-    if (!quiet)
-      fprintf(stderr, "\n");
-
-    if (config["post-process"].specified) {
-      std::string cmd = config["post-process"].get_str() + 
-        " \"" + output_file + "\"";
-      if (!quiet)
-        fprintf(stderr, "running post-processor: %s\n", cmd.c_str());
-      int ret = system(cmd.c_str());
-      if ((ret < 0) && !quiet) {
-        fprintf(stderr, "WARNING: command failed\n");
-      }
+  // Rescore lattices.  The lattices are independent, so with several
+  // threads each thread takes the next lattice from the list and
+  // rescores it with its own Rescore object and the shared model.
+  // Lattices overwriting the same output file are rescored in order.
+  int num_jobs = job_inputs.size();
+  num_threads = std::min(num_threads, num_jobs);
+  if (!unique_outputs)
+    num_threads = 1;
+  if (num_threads <= 1) {
+    Rescore rescore;
+    Lattice src_lattice;
+    for (int i = 0; i < num_jobs; i++)
+      rescore_lattice(job_inputs[i], job_outputs[i], tree_gram, rescore,
+                      src_lattice, quiet, false);
+  }
+  else {
+    std::atomic<int> next_job(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < num_threads; t++) {
+      workers.push_back(std::thread([&]() {
+            Rescore rescore;
+            Lattice src_lattice;
+            while (true) {
+              int i = next_job++;
+              if (i >= num_jobs)
+                break;
+              rescore_lattice(job_inputs[i], job_outputs[i], tree_gram,
+                              rescore, src_lattice, quiet, true);
+            }
+          }));
     }
+    for (int t = 0; t < num_threads; t++)
+      workers[t].join();
   }
 }
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Checks that lattice_rescore gives the same lattices with any number of
+# threads.
+#
+# Usage: check_threads.sh LATTICE_RESCORE LM LATTICE_LIST [THREADS]
+
+if [ $# -lt 3 ]; then
+    echo "usage: check_threads.sh LATTICE_RESCORE LM LATTICE_LIST [THREADS]" >&2
+    exit 1
+fi
+rescore=$1
+lm=$2
+list=$3
+threads=${4:-4}
+
+tmp=${TMPDIR:-/tmp}/check_threads.$$
+mkdir -p $tmp || exit 1
+
+$rescore -q -l $lm -I $list -O $tmp/serial -T 1 &&
+$rescore -q -l $lm -I $list -O $tmp/parallel -T $threads
+status=$?
+if [ $status -eq 0 ]; then
+    if [ -z "`ls $tmp/serial`" ]; then
+	echo "no lattices were rescored" >&2
+	status=1
+    elif ! diff -r $tmp/serial $tmp/parallel >/dev/null; then
+	echo "the lattices rescored with $threads threads differ" >&2
+	status=1
+    fi
+fi
+
+rm -rf $tmp
+[ $status -eq 0 ] && echo "test successful"
+exit $status